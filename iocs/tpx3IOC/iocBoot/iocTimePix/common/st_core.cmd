@@ -36,5 +36,55 @@ dbLoadRecords("$(ADTIMEPIX)/db/OperatingVoltage.template","P=$(PREFIX),R=cam1:,C
 dbLoadRecords("$(ADTIMEPIX)/db/OperatingVoltage.template","P=$(PREFIX),R=cam1:,C=Pwr4,PORT=$(PORT),ADDR=4,TIMEOUT=1")
 dbLoadRecords("$(ADTIMEPIX)/db/OperatingVoltage.template","P=$(PREFIX),R=cam1:,C=Pwr5,PORT=$(PORT),ADDR=5,TIMEOUT=1")
 
+# ToF gates: global controls at ADDR 0; per-gate read-backs at ADDR = gate index. Gate images on NDArray addr 14..17.
+dbLoadRecords("$(ADTIMEPIX)/db/Gate.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/GateWindow.template","P=$(PREFIX),R=cam1:,G=Gate0:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/GateWindow.template","P=$(PREFIX),R=cam1:,G=Gate1:,PORT=$(PORT),ADDR=1,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/GateWindow.template","P=$(PREFIX),R=cam1:,G=Gate2:,PORT=$(PORT),ADDR=2,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/GateWindow.template","P=$(PREFIX),R=cam1:,G=Gate3:,PORT=$(PORT),ADDR=3,TIMEOUT=1")
+
+# Raw[0] (and with Raw1Decode=On, Raw[1]) tcp:// stream decoded in the IOC: rates and counters; per-channel records at ADDR = channel.
+dbLoadRecords("$(ADTIMEPIX)/db/RawStream.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/RawChannel.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1,C=0")
+dbLoadRecords("$(ADTIMEPIX)/db/RawChannel.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=1,TIMEOUT=1,C=1")
+# Event-mode images from the Raw decode: count / ToT sum / first ToA on NDArray addr 18..20.
+dbLoadRecords("$(ADTIMEPIX)/db/EventImage.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Clustering of Raw hits: centroid list on NDArray addr 21, super-resolution image on addr 22.
+dbLoadRecords("$(ADTIMEPIX)/db/Cluster.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Raw ToF histograms: spectra per group (detector, chip or ROI) at ADDR=group, NDArray addr 23..24.
+dbLoadRecords("$(ADTIMEPIX)/db/RawHistogram.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/RawHistogramGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1,G=0")
+dbLoadRecords("$(ADTIMEPIX)/db/RawHistogramGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=1,TIMEOUT=1,G=1")
+dbLoadRecords("$(ADTIMEPIX)/db/RawHistogramGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=2,TIMEOUT=1,G=2")
+dbLoadRecords("$(ADTIMEPIX)/db/RawHistogramGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=3,TIMEOUT=1,G=3")
+# Virtual STEM: detector images on NDArray addr 25..28, centre of mass X/Y on 29..30; per-detector radii at ADDR = detector.
+dbLoadRecords("$(ADTIMEPIX)/db/VirtualStem.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/VirtualStemDetector.template","P=$(PREFIX),R=cam1:,D=VStem0:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/VirtualStemDetector.template","P=$(PREFIX),R=cam1:,D=VStem1:,PORT=$(PORT),ADDR=1,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/VirtualStemDetector.template","P=$(PREFIX),R=cam1:,D=VStem2:,PORT=$(PORT),ADDR=2,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/VirtualStemDetector.template","P=$(PREFIX),R=cam1:,D=VStem3:,PORT=$(PORT),ADDR=3,TIMEOUT=1")
+# Sparse 4D-STEM event store (.csr/.idx); ROI diffraction sum on NDArray addr 31.
+dbLoadRecords("$(ADTIMEPIX)/db/Stem4d.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Energy calibration: gated images on NDArray addr 32..35, spectra on 36 (axis 37); per-ROI spectrum / window at ADDR = index.
+dbLoadRecords("$(ADTIMEPIX)/db/Energy.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADTIMEPIX)/db/EnergyGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1,G=0")
+dbLoadRecords("$(ADTIMEPIX)/db/EnergyGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=1,TIMEOUT=1,G=1")
+dbLoadRecords("$(ADTIMEPIX)/db/EnergyGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=2,TIMEOUT=1,G=2")
+dbLoadRecords("$(ADTIMEPIX)/db/EnergyGroup.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=3,TIMEOUT=1,G=3")
+# ToA time-walk correction of Raw hits; validation spectra on NDArray addr 38.
+dbLoadRecords("$(ADTIMEPIX)/db/TimeWalk.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Raw hit filter (ROI, ToT window, BPC mask) ahead of the sorter and Raw consumers.
+dbLoadRecords("$(ADTIMEPIX)/db/RawFilter.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Replay of a recorded .tpx3 file through the Raw consumers (mmap + .tidx time index).
+dbLoadRecords("$(ADTIMEPIX)/db/Replay.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Compressed .tpx3z archive of the decoded Raw TCP stream(s).
+dbLoadRecords("$(ADTIMEPIX)/db/RawArchive.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# List-mode hit batches (x, y, ToA ns, ToT) on NDArray addr 39.
+dbLoadRecords("$(ADTIMEPIX)/db/HitList.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Per-chip hit rates, rate alarms and super-pixel occupancy map on NDArray addr 40.
+dbLoadRecords("$(ADTIMEPIX)/db/Occupancy.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+# Spectral stack (thresholds + energy bands) of paired Medipix3 frames on NDArray addr 41 / 42.
+dbLoadRecords("$(ADTIMEPIX)/db/Spectral.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+
 NDStdArraysConfigure("Image1", 3, 0, "$(PORT)", 0)
 dbLoadRecords("$(ADCORE)/db/NDStdArrays.template", "P=$(PREFIX),R=image1:,PORT=Image1,ADDR=0,NDARRAY_PORT=$(PORT),TIMEOUT=1,TYPE=Int16,FTVL=SHORT,NELEMENTS=20000000")
@@ -0,0 +1,43 @@
+/*
+ * Dump CoordMap tables for verify_coordinate_map.py (host build, no EPICS).
+ *
+ * Built by the script together with the EPICS-free part of
+ * tpx3App/src/coord_map.cpp. Each argument is one layout
+ * "num_chips,x_chips,y_chips,pel_width,orientation"; one JSON object per
+ * line is printed with both tables (-1 = unmapped).
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "coord_map.h"
+
+#include <cstdio>
+#include <vector>
+
+static void printTable(const char* name, const std::vector<int32_t>& table) {
+    printf("\"%s\": [", name);
+    for (size_t k = 0; k < table.size(); ++k) printf(k ? ",%d" : "%d", table[k]);
+    printf("]");
+}
+
+int main(int argc, char** argv) {
+    for (int a = 1; a < argc; ++a) {
+        CoordLayout L;
+        if (sscanf(argv[a], "%d,%d,%d,%d,%d", &L.num_chips, &L.x_chips, &L.y_chips, &L.pel_width,
+                   &L.orientation) != 5) {
+            fprintf(stderr, "bad layout: %s\n", argv[a]);
+            return 2;
+        }
+        const CoordMap map(L);
+        printf("{\"layout\": \"%s\", \"width\": %d, \"mapped\": %s, ", argv[a], L.width(),
+               map.mapped() ? "true" : "false");
+        printTable("file_to_image", map.file_to_image());
+        printf(", ");
+        printTable("image_to_file", map.image_to_file());
+        printf("}\n");
+    }
+    return 0;
+}
@@ -1,20 +1,37 @@
 #!/usr/bin/env python3
 """
 Verify coordinate_map_vectors.json against reference implementations of
-pelIndex() and bpc2ImgIndex() from tpx3App/src/mask_io.cpp.
+pelIndex() and bpc2ImgIndex() (CoordMap rules in tpx3App/src/coord_map.cpp).
+
+When a C++ compiler is available ($CXX, c++ or g++), the driver's CoordMap
+tables themselves are also checked: test/coord_map_dump.cpp is built with the
+EPICS-free part of coord_map.cpp, and its file_to_image / image_to_file tables
+are compared with the vectors and, for every chip count and orientation the
+reference rules cover, with those rules at every index.
 
 Does not require EPICS. Run from repo root:
-  python3 test/verify_coordinate_map.py
+  python3 test/verify_coordinate_map.py [--no-cxx]
 """
 
 from __future__ import annotations
 
 import json
+import os
+import shutil
+import subprocess
 import sys
+import tempfile
 from pathlib import Path
 
 REPO_ROOT = Path(__file__).resolve().parents[1]
 VECTORS_PATH = Path(__file__).resolve().parent / "coordinate_map_vectors.json"
+COORD_MAP_SRC = REPO_ROOT / "tpx3App" / "src" / "coord_map.cpp"
+COORD_MAP_DUMP_SRC = Path(__file__).resolve().parent / "coord_map_dump.cpp"
+GLUE_BANNER = "// ADTimePix glue:"
+
+# (num_chips, x_chips, y_chips) of the layouts CoordMap is checked for
+TABLE_MOSAICS = [(1, 1, 1), (4, 2, 2), (8, 4, 2), (8, 2, 4)]
+TABLE_PEL_WIDTH = 4
 
 
 def chip_from_bpc(bpc_index: int, pel_width: int) -> tuple[int, int, int]:
@@ -26,7 +43,7 @@ def chip_from_bpc(bpc_index: int, pel_width: int) -> tuple[int, int, int]:
 
 
 def image_cols(num_chips: int, pel_width: int, x_chips: int) -> int:
-    """Column stride used to decode bpc2ImgIndex linear index (matches mask_io.cpp)."""
+    """Column stride used to decode bpc2ImgIndex linear index (matches coord_map.cpp)."""
     w = pel_width
     if num_chips == 1:
         return w
@@ -268,12 +285,152 @@ def run_case(case: dict) -> list[str]:
     return errors
 
 
+def find_cxx() -> str | None:
+    for cand in (os.environ.get("CXX"), "c++", "g++", "clang++"):
+        if cand and shutil.which(cand):
+            return cand
+    return None
+
+
+def dump_coord_maps(cxx: str, layouts: list[tuple[int, int, int, int, int]]) -> dict:
+    """Build coord_map_dump against coord_map.cpp (without its EPICS glue) and run it."""
+    src = COORD_MAP_SRC.read_text(encoding="utf-8")
+    cut = src.find(GLUE_BANNER)
+    if cut < 0:
+        raise RuntimeError(f"{COORD_MAP_SRC}: glue banner not found")
+    # Drop the banner's leading rule line too, and the driver includes
+    core = src[: src.rfind("\n", 0, src.rfind("\n", 0, cut)) + 1]
+    core = "\n".join(
+        line
+        for line in core.splitlines()
+        if '#include "ADTimePix' not in line and "extern const char* driverName" not in line
+    )
+    with tempfile.TemporaryDirectory() as tmp:
+        core_path = Path(tmp) / "coord_map_core.cpp"
+        exe = Path(tmp) / "coord_map_dump"
+        core_path.write_text(core + "\n", encoding="utf-8")
+        subprocess.run(
+            [cxx, "-std=c++17", "-O1", f"-I{COORD_MAP_SRC.parent}", "-o", str(exe),
+             str(COORD_MAP_DUMP_SRC), str(core_path)],
+            check=True,
+        )
+        args = [",".join(str(v) for v in layout) for layout in layouts]
+        out = subprocess.run([str(exe), *args], check=True, capture_output=True, text=True).stdout
+    maps = {}
+    for line in out.splitlines():
+        m = json.loads(line)
+        maps[tuple(int(v) for v in m["layout"].split(","))] = m
+    return maps
+
+
+def layout_of(case: dict) -> tuple[int, int, int, int, int]:
+    n = case["num_chips"]
+    x = case.get("x_chips", 1 if n == 1 else 2)
+    return n, x, n // x, case["pel_width"], case["orientation"]
+
+
+def check_case_tables(case: dict, m: dict) -> list[str]:
+    """One vector case against the CoordMap tables."""
+    errors: list[str] = []
+    name = case["name"]
+    width = m["width"]
+    f2i = m["file_to_image"]
+    i2f = m["image_to_file"]
+
+    def file_index(i: int, j: int) -> int:
+        return i2f[j * width + i] if 0 <= i < width and 0 <= j * width + i < len(i2f) else -1
+
+    if "bpc_index" in case and "expect_bpc2img" in case:
+        k = case["bpc_index"]
+        exp = case["expect_bpc2img"]
+        got = f2i[k] if 0 <= k < len(f2i) else -1
+        if got != exp["img_linear"] or (got >= 0 and (got % width, got // width) != (exp["i"], exp["j"])):
+            errors.append(f"{name}: CoordMap image_index({k})={got} != {exp['img_linear']}")
+        if "expect_pel_index_at_ij" in case:
+            pk = file_index(exp["i"], exp["j"])
+            if pk != case["expect_pel_index_at_ij"]:
+                errors.append(
+                    f"{name}: CoordMap file_index({exp['i']},{exp['j']})={pk} != {case['expect_pel_index_at_ij']}"
+                )
+    if "expect_pel_index" in case and "i" in case:
+        got = file_index(case["i"], case["j"])
+        if got != case["expect_pel_index"]:
+            errors.append(f"{name}: CoordMap file_index({case['i']},{case['j']})={got} != {case['expect_pel_index']}")
+    if "expect_bpc_index_from_pel" in case:
+        k = file_index(case["i"], case["j"])
+        lin = f2i[k] if 0 <= k < len(f2i) else -1
+        if lin != case["i"] + width * case["j"]:
+            errors.append(f"{name}: CoordMap round trip ({case['i']},{case['j']}) -> {k} -> {lin}")
+    return errors
+
+
+def check_tables_against_rules(layout: tuple[int, int, int, int, int], m: dict) -> tuple[list[str], bool]:
+    """
+    Whole tables against bpc2img_index / pel_index. Returns (errors, covered);
+    layouts the reference rules do not define are only checked for being
+    one-to-one (the two directions need not be inverses, e.g. quad LEFT).
+    """
+    n, x, y, w, orient = layout
+    width = x * w
+    f2i = m["file_to_image"]
+    i2f = m["image_to_file"]
+    errors: list[str] = []
+    ref_f2i = [bpc2img_index(k, w, n, x, orient) for k in range(len(f2i))]
+    ref_i2f = [pel_index(idx % width, idx // width, w, n, x, orient) for idx in range(len(i2f))]
+    covered = any(v >= 0 for v in ref_f2i) or any(v >= 0 for v in ref_i2f)
+    if covered:
+        # Reference values outside the table range are stored as unmapped
+        ref_f2i = [v if 0 <= v < len(i2f) else -1 for v in ref_f2i]
+        ref_i2f = [v if 0 <= v < len(f2i) else -1 for v in ref_i2f]
+        for what, got, ref in (("image_index", f2i, ref_f2i), ("file_index", i2f, ref_i2f)):
+            bad = [k for k in range(len(ref)) if got[k] != ref[k]]
+            if bad:
+                k = bad[0]
+                errors.append(f"layout {layout}: {what} differs at {len(bad)} index(es), first {k}: {got[k]} != {ref[k]}")
+    for what, table in (("image_index", f2i), ("file_index", i2f)):
+        values = [v for v in table if v >= 0]
+        if len(values) != len(set(values)):
+            errors.append(f"layout {layout}: {what} maps two indices to the same target")
+    return errors, covered
+
+
+def check_coord_map(data: dict, cxx: str) -> tuple[list[str], str]:
+    layouts = {layout_of(c) for c in data["cases"] if "expect_chip" not in c}
+    table_layouts = [
+        (n, x, y, TABLE_PEL_WIDTH, orient) for (n, x, y) in TABLE_MOSAICS for orient in range(8)
+    ]
+    maps = dump_coord_maps(cxx, sorted(layouts | set(table_layouts)))
+    errors: list[str] = []
+    for case in data["cases"]:
+        if "expect_chip" not in case:
+            errors.extend(check_case_tables(case, maps[layout_of(case)]))
+    n_covered = 0
+    for layout in table_layouts:
+        errs, covered = check_tables_against_rules(layout, maps[layout])
+        errors.extend(errs)
+        n_covered += covered
+    summary = (
+        f"CoordMap tables: {len(table_layouts)} layouts, {n_covered} compared with the reference rules "
+        "at every index, the rest checked one-to-one"
+    )
+    return errors, summary
+
+
 def main() -> int:
     data = json.loads(VECTORS_PATH.read_text(encoding="utf-8"))
     all_errors: list[str] = []
     for case in data["cases"]:
         all_errors.extend(run_case(case))
 
+    table_summary = "CoordMap tables not checked (--no-cxx)"
+    if "--no-cxx" not in sys.argv[1:]:
+        cxx = find_cxx()
+        if cxx is None:
+            table_summary = "CoordMap tables not checked (no C++ compiler; set CXX)"
+        else:
+            errors, table_summary = check_coord_map(data, cxx)
+            all_errors.extend(errors)
+
     if all_errors:
         print(f"FAIL: {len(all_errors)} error(s):", file=sys.stderr)
         for e in all_errors:
@@ -288,6 +445,7 @@ def main() -> int:
         print(f"; {n_planned} planned case(s) skipped (SpIDR 2×4 — see COORDINATE_MAP.md)")
     else:
         print()
+    print(f"OK: {table_summary}")
     return 0
 
 
@@ -387,6 +387,9 @@ asynStatus ADTimePix::writeOctet(asynUser *pasynUser, const char *value,
 
     if (function == ADTimePixBPCFilePath)  {
         status = this->checkBPCPath();        
+        invalidateRawFilter();
+    } else if (function == ADTimePixBPCFileName || function == ADTimePixRawFilterRois) {
+        invalidateRawFilter();
     } else if (function == ADTimePixDACSFilePath) {
         status = this->checkDACSPath();
     } else if (function == ADTimePixRawBase) {
@@ -405,6 +408,18 @@ asynStatus ADTimePix::writeOctet(asynUser *pasynUser, const char *value,
         status = this->checkPrvHstPath();
     } else if (function == ADTimePixTofTdcReference) {
         status = this->sendMeasurementConfig();
+        invalidateRawHistogram();
+        invalidateTimeWalkValidation();
+    } else if (function == ADTimePixRawHstRois) {
+        invalidateRawHistogram();
+    } else if (function == ADTimePixVStemDetectors) {
+        invalidateStemImager();
+    } else if (function == ADTimePixEnergyCalibDir) {
+        invalidateEnergyImager(true);
+    } else if (function == ADTimePixEnergyGates || function == ADTimePixEnergyRois) {
+        invalidateEnergyImager();
+    } else if (function == ADTimePixGateWindows) {
+        status = this->updateTofGates();
     }
      /* Do callbacks so higher layers see any changes */
     status = (asynStatus)callParamCallbacks(addr, addr);
@@ -531,6 +546,25 @@ asynStatus ADTimePix::writeInt32(asynUser* pasynUser, epicsInt32 value){
     else if(function == ADTimePixStemScanWidth || function == ADTimePixStemScanHeight
             || function == ADTimePixStemRadiusOuter || function == ADTimePixStemRadiusInner) {
         status = sendMeasurementConfig();
+        invalidateStemImager();
+    }
+    else if(function == ADTimePixVStemEnable || function == ADTimePixVStemTrigger ||
+            function == ADTimePixVStemTdcEdge) {
+        invalidateStemImager();
+    }
+    else if(function == ADTimePixStem4dEnable) {
+        if (stemMutex_) {
+            epicsMutexLock(stemMutex_);
+            if (!value) closeStem4d();
+            stem4dOpenFailed_ = false;
+            epicsMutexUnlock(stemMutex_);
+        }
+    }
+    else if(function == ADTimePixStem4dSum) {
+        if (value == 1) {
+            status = sumStem4d();
+            setIntegerParam(ADTimePixStem4dSum, 0);
+        }
     }
     else if(function == ADTimePixWriteBPCFile) { 
         status = uploadBPC();
@@ -650,6 +684,124 @@ asynStatus ADTimePix::writeInt32(asynUser* pasynUser, epicsInt32 value){
         }
     }
 
+    else if(function == ADTimePixGateReset) {
+        if (value == 1) {
+            resetTofGateAccumulation();
+            setIntegerParam(ADTimePixGateReset, 0);
+            callParamCallbacks(ADTimePixGateReset);
+        }
+    }
+
+    else if(function == ADTimePixGateMode) {
+        // Mode 1: Image[0] Mode is rewritten to "tof" on the next ApplyConfig/acquire
+        resetTofGateAccumulation();
+    }
+
+    else if(function == ADTimePixEvtImgEnable || function == ADTimePixEvtImgMode ||
+            function == ADTimePixEvtImgEvents || function == ADTimePixEvtImgTdcEdge) {
+        invalidateEventImageBuilder();
+    }
+
+    else if(function == ADTimePixClusterEnable || function == ADTimePixClusterRadius ||
+            function == ADTimePixClusterMinSize || function == ADTimePixClusterThreads ||
+            function == ADTimePixClusterSubpixel) {
+        invalidateClusterEngine();
+    }
+
+    else if(function == ADTimePixRawHstEnable || function == ADTimePixRawHstBinning ||
+            function == ADTimePixRawHstBins || function == ADTimePixRawHstGrouping ||
+            function == ADTimePixRawHstTotMin || function == ADTimePixRawHstTotMax ||
+            function == ADTimePixRawHstTdc || function == ADTimePixRawHstEdge ||
+            function == ADTimePixRawHstThreads) {
+        invalidateRawHistogram();
+        invalidateTimeWalkValidation();
+    }
+
+    else if(function == ADTimePixRawHstReset) {
+        if (value == 1) {
+            resetRawHistogram();
+            setIntegerParam(ADTimePixRawHstReset, 0);
+            callParamCallbacks(ADTimePixRawHstReset);
+        }
+    }
+
+    else if(function == ADTimePixTimeWalkReload) {
+        if (value == 1) {
+            status = loadTimeWalk();
+            setIntegerParam(ADTimePixTimeWalkReload, 0);
+        }
+    }
+
+    else if(function == ADTimePixRawFilterReset) {
+        if (value == 1) {
+            resetRawFilter();
+            setIntegerParam(ADTimePixRawFilterReset, 0);
+        }
+    }
+
+    else if(function == ADTimePixReplayRun) {
+        if (value == 1) {
+            status = startReplay();
+            if (status != asynSuccess) setIntegerParam(ADTimePixReplayRun, 0);
+        } else {
+            stopReplay();
+        }
+    }
+
+    else if(function == ADTimePixRawFilterEnable || function == ADTimePixRawFilterTotMin ||
+            function == ADTimePixRawFilterTotMax || function == ADTimePixRawFilterMask) {
+        invalidateRawFilter();
+    }
+
+    else if(function == ADTimePixTimeWalkEnable || function == ADTimePixTimeWalkValidate) {
+        invalidateTimeWalkValidation();
+    }
+
+    else if(function == ADTimePixEnergyEnable || function == ADTimePixEnergyBins) {
+        invalidateEnergyImager();
+    }
+
+    else if(function == ADTimePixEnergyReset) {
+        if (value == 1) {
+            resetEnergy();
+            setIntegerParam(ADTimePixEnergyReset, 0);
+            callParamCallbacks(ADTimePixEnergyReset);
+        }
+    }
+
+    else if(function == ADTimePixSpecReset) {
+        if (value == 1) {
+            resetSpectralStacks();
+            setIntegerParam(ADTimePixSpecReset, 0);
+            callParamCallbacks(ADTimePixSpecReset);
+        }
+    }
+
+    else if(function == ADTimePixMaskOpApply || function == ADTimePixMaskStore ||
+            function == ADTimePixMaskRecall || function == ADTimePixMaskDelete) {
+        if (value == 1) {
+            maskCommand(function);
+            setIntegerParam(function, 0);
+            callParamCallbacks();
+        }
+    }
+
+    else if(function == ADTimePixMaskUndo || function == ADTimePixMaskRedo) {
+        if (value == 1) {
+            maskUndoRedo(function == ADTimePixMaskUndo);
+            setIntegerParam(function, 0);
+            callParamCallbacks();
+        }
+    }
+
+    else if(function == ADTimePixClusterReset) {
+        if (value == 1) {
+            resetClusterImage();
+            setIntegerParam(ADTimePixClusterReset, 0);
+            callParamCallbacks(ADTimePixClusterReset);
+        }
+    }
+
     else if(function == ADTimePixPrvHstDataReset) {
         // Reset accumulated histogram data when value is set to 1
         if (value == 1) {
@@ -1050,6 +1202,23 @@ asynStatus ADTimePix::writeFloat64(asynUser* pasynUser, epicsFloat64 value){
     }
     else if(function == ADTimePixStemDwellTime || function == ADTimePixTofMin || function == ADTimePixTofMax) {
         status = sendMeasurementConfig();
+        if (function == ADTimePixStemDwellTime) invalidateStemImager();
+    }
+    else if(function == ADTimePixVStemCenterX || function == ADTimePixVStemCenterY) {
+        invalidateStemImager();
+    }
+    else if(function == ADTimePixEvtImgDurationMs) {
+        invalidateEventImageBuilder();
+    }
+    else if(function == ADTimePixClusterDtNs || function == ADTimePixClusterSpanNs) {
+        invalidateClusterEngine();
+    }
+    else if(function == ADTimePixRawHstMinMs || function == ADTimePixRawHstMaxMs) {
+        invalidateRawHistogram();
+        invalidateTimeWalkValidation();
+    }
+    else if(function == ADTimePixEnergyMinKev || function == ADTimePixEnergyMaxKev) {
+        invalidateEnergyImager();
     }
     else{
         if(function < ADTIMEPIX_FIRST_PARAM){
@@ -1320,10 +1489,15 @@ void ADTimePix::resetPrvHstAccumulation() {
 // ADTimePix Constructor/Destructor
 //----------------------------------------------------------------------------
 
-/* maxAddr=14: asyn addr lists 0..13 — PrvImg thresh0=0, Img thresh0=1, Img sum=2, Img sumN=3,
+/* maxAddr=NDARRAY_MAX_ADDR (43): asyn addr lists 0..42, see the NDARRAY_ADDR_* constants in ADTimePix.h.
+ * PrvImg thresh0=0, Img thresh0=1, Img sum=2, Img sumN=3,
  * PrvHst sumN=4, PrvHst running sum=5, PrvHst frame=6, PrvHst ToF=7, PrvImg thresh1=8,
  * PrvImg T0-T1 band=9 (8088), PrvImg1 integrated thresh0=10 / thresh1=11 / T0-T1 band=12 (8089;
- * clip via PrvImgThreshDiffClip), Img thresh1=13 (MPX3 BothCounters full-rate demux) */
+ * clip via PrvImgThreshDiffClip), Img thresh1=13 (MPX3 BothCounters full-rate demux),
+ * ToF gates 14..17, event images count=18 / ToT=19 / ToA=20, cluster list=21 / image=22,
+ * raw ToF histogram=23 / axis=24, virtual STEM detectors 25..28 / CoM x=29 / CoM y=30,
+ * 4D-STEM sum=31, energy gates 32..35 / spectrum=36 / axis=37, timewalk histogram=38,
+ * hit list=39, chip occupancy=40, PrvImg spectral stack=41, PrvImg1 spectral stack=42 */
 ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers, size_t maxMemory, int priority, int stackSize, int asynFlags)
     : ADDriver(portName, NDARRAY_MAX_ADDR, (int)NUM_TIMEPIX_PARAMS, maxBuffers, maxMemory,
         asynInt32Mask | asynInt64Mask | asynOctetMask | asynFloat64Mask | asynEnumMask | asynInt32ArrayMask | asynInt64ArrayMask | asynFloat64ArrayMask | asynDrvUserMask,
@@ -1682,6 +1856,269 @@ ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers
     createParam(ADTimePixMaskedPelsJsonPathString, asynParamOctet, &ADTimePixMaskedPelsJsonPath);
     createParam(ADTimePixMaskedPelsCountString, asynParamInt32, &ADTimePixMaskedPelsCount);
     createParam(ADTimePixMaskedPelsExportStatusString, asynParamOctet, &ADTimePixMaskedPelsExportStatus);
+    createParam(ADTimePixGateModeString, asynParamInt32, &ADTimePixGateMode);
+    createParam(ADTimePixGateWindowsString, asynParamOctet, &ADTimePixGateWindows);
+    createParam(ADTimePixGateCountString, asynParamInt32, &ADTimePixGateCount);
+    createParam(ADTimePixGateStatusString, asynParamOctet, &ADTimePixGateStatus);
+    createParam(ADTimePixGateFramesString, asynParamInt32, &ADTimePixGateFrames);
+    createParam(ADTimePixGateResetString, asynParamInt32, &ADTimePixGateReset);
+    createParam(ADTimePixGatePublishFramesString, asynParamInt32, &ADTimePixGatePublishFrames);
+    createParam(ADTimePixGateTofUnitNsString, asynParamFloat64, &ADTimePixGateTofUnitNs);
+    createParam(ADTimePixGatePublishPeriodString, asynParamFloat64, &ADTimePixGatePublishPeriod);
+    createParam(ADTimePixGateStartMsString, asynParamFloat64, &ADTimePixGateStartMs);
+    createParam(ADTimePixGateStopMsString, asynParamFloat64, &ADTimePixGateStopMs);
+    createParam(ADTimePixGateTotalCountsString, asynParamInt64, &ADTimePixGateTotalCounts);
+    createParam(ADTimePixRawDecodeString, asynParamInt32, &ADTimePixRawDecode);
+    createParam(ADTimePixRawConnectedString, asynParamInt32, &ADTimePixRawConnected);
+    createParam(ADTimePixRawDecodeStatusString, asynParamOctet, &ADTimePixRawDecodeStatus);
+    createParam(ADTimePixRawHitRateString, asynParamFloat64, &ADTimePixRawHitRate);
+    createParam(ADTimePixRawTdcRateString, asynParamFloat64, &ADTimePixRawTdcRate);
+    createParam(ADTimePixRawPacketRateString, asynParamFloat64, &ADTimePixRawPacketRate);
+    createParam(ADTimePixRawDataRateString, asynParamFloat64, &ADTimePixRawDataRate);
+    createParam(ADTimePixRawHitsString, asynParamInt64, &ADTimePixRawHits);
+    createParam(ADTimePixRawTdcsString, asynParamInt64, &ADTimePixRawTdcs);
+    createParam(ADTimePixRawFramingErrorsString, asynParamInt64, &ADTimePixRawFramingErrors);
+    createParam(ADTimePixRawSortString, asynParamInt32, &ADTimePixRawSort);
+    createParam(ADTimePixRawSortLatencyMsString, asynParamFloat64, &ADTimePixRawSortLatencyMs);
+    createParam(ADTimePixRawSortLateHitsString, asynParamInt64, &ADTimePixRawSortLateHits);
+    createParam(ADTimePixRawSortLateTdcsString, asynParamInt64, &ADTimePixRawSortLateTdcs);
+    createParam(ADTimePixRawSortRolloversString, asynParamInt32, &ADTimePixRawSortRollovers);
+    createParam(ADTimePixRawSortDisorderMsString, asynParamFloat64, &ADTimePixRawSortDisorderMs);
+    createParam(ADTimePixRawSortBufferedString, asynParamInt32, &ADTimePixRawSortBuffered);
+    createParam(ADTimePixRaw1DecodeString, asynParamInt32, &ADTimePixRaw1Decode);
+    createParam(ADTimePixRawChannelsString, asynParamInt32, &ADTimePixRawChannels);
+    createParam(ADTimePixRawChConnectedString, asynParamInt32, &ADTimePixRawChConnected);
+    createParam(ADTimePixRawChHitRateString, asynParamFloat64, &ADTimePixRawChHitRate);
+    createParam(ADTimePixRawChDataRateString, asynParamFloat64, &ADTimePixRawChDataRate);
+    createParam(ADTimePixRawChHitsString, asynParamInt64, &ADTimePixRawChHits);
+    createParam(ADTimePixRawChBacklogString, asynParamInt32, &ADTimePixRawChBacklog);
+    createParam(ADTimePixRawChBacklogHitsString, asynParamInt32, &ADTimePixRawChBacklogHits);
+    createParam(ADTimePixRawChStallsString, asynParamInt64, &ADTimePixRawChStalls);
+    createParam(ADTimePixRawChMergeLagMsString, asynParamFloat64, &ADTimePixRawChMergeLagMs);
+    createParam(ADTimePixEvtImgEnableString, asynParamInt32, &ADTimePixEvtImgEnable);
+    createParam(ADTimePixEvtImgModeString, asynParamInt32, &ADTimePixEvtImgMode);
+    createParam(ADTimePixEvtImgDurationMsString, asynParamFloat64, &ADTimePixEvtImgDurationMs);
+    createParam(ADTimePixEvtImgEventsString, asynParamInt32, &ADTimePixEvtImgEvents);
+    createParam(ADTimePixEvtImgTdcEdgeString, asynParamInt32, &ADTimePixEvtImgTdcEdge);
+    createParam(ADTimePixEvtImgMaxRateString, asynParamFloat64, &ADTimePixEvtImgMaxRate);
+    createParam(ADTimePixEvtImgFramesString, asynParamInt32, &ADTimePixEvtImgFrames);
+    createParam(ADTimePixEvtImgFrameEventsString, asynParamInt32, &ADTimePixEvtImgFrameEvents);
+    createParam(ADTimePixEvtImgDroppedString, asynParamInt64, &ADTimePixEvtImgDropped);
+    createParam(ADTimePixEvtImgSkippedString, asynParamInt64, &ADTimePixEvtImgSkipped);
+    createParam(ADTimePixClusterEnableString, asynParamInt32, &ADTimePixClusterEnable);
+    createParam(ADTimePixClusterRadiusString, asynParamInt32, &ADTimePixClusterRadius);
+    createParam(ADTimePixClusterDtNsString, asynParamFloat64, &ADTimePixClusterDtNs);
+    createParam(ADTimePixClusterSpanNsString, asynParamFloat64, &ADTimePixClusterSpanNs);
+    createParam(ADTimePixClusterMinSizeString, asynParamInt32, &ADTimePixClusterMinSize);
+    createParam(ADTimePixClusterThreadsString, asynParamInt32, &ADTimePixClusterThreads);
+    createParam(ADTimePixClusterSubpixelString, asynParamInt32, &ADTimePixClusterSubpixel);
+    createParam(ADTimePixClusterPublishPeriodString, asynParamFloat64, &ADTimePixClusterPublishPeriod);
+    createParam(ADTimePixClusterResetString, asynParamInt32, &ADTimePixClusterReset);
+    createParam(ADTimePixClusterRateString, asynParamFloat64, &ADTimePixClusterRate);
+    createParam(ADTimePixClusterCountString, asynParamInt64, &ADTimePixClusterCount);
+    createParam(ADTimePixClusterMeanSizeString, asynParamFloat64, &ADTimePixClusterMeanSize);
+    createParam(ADTimePixClusterLateString, asynParamInt64, &ADTimePixClusterLate);
+    createParam(ADTimePixClusterBufferedString, asynParamInt32, &ADTimePixClusterBuffered);
+    createParam(ADTimePixRawHstEnableString, asynParamInt32, &ADTimePixRawHstEnable);
+    createParam(ADTimePixRawHstBinningString, asynParamInt32, &ADTimePixRawHstBinning);
+    createParam(ADTimePixRawHstMinMsString, asynParamFloat64, &ADTimePixRawHstMinMs);
+    createParam(ADTimePixRawHstMaxMsString, asynParamFloat64, &ADTimePixRawHstMaxMs);
+    createParam(ADTimePixRawHstBinsString, asynParamInt32, &ADTimePixRawHstBins);
+    createParam(ADTimePixRawHstGroupingString, asynParamInt32, &ADTimePixRawHstGrouping);
+    createParam(ADTimePixRawHstRoisString, asynParamOctet, &ADTimePixRawHstRois);
+    createParam(ADTimePixRawHstTotMinString, asynParamInt32, &ADTimePixRawHstTotMin);
+    createParam(ADTimePixRawHstTotMaxString, asynParamInt32, &ADTimePixRawHstTotMax);
+    createParam(ADTimePixRawHstTdcString, asynParamInt32, &ADTimePixRawHstTdc);
+    createParam(ADTimePixRawHstEdgeString, asynParamInt32, &ADTimePixRawHstEdge);
+    createParam(ADTimePixRawHstThreadsString, asynParamInt32, &ADTimePixRawHstThreads);
+    createParam(ADTimePixRawHstPublishPeriodString, asynParamFloat64, &ADTimePixRawHstPublishPeriod);
+    createParam(ADTimePixRawHstResetString, asynParamInt32, &ADTimePixRawHstReset);
+    createParam(ADTimePixRawHstStatusString, asynParamOctet, &ADTimePixRawHstStatus);
+    createParam(ADTimePixRawHstGroupsString, asynParamInt32, &ADTimePixRawHstGroups);
+    createParam(ADTimePixRawHstDataString, asynParamInt64Array, &ADTimePixRawHstData);
+    createParam(ADTimePixRawHstTimeMsString, asynParamFloat64Array, &ADTimePixRawHstTimeMs);
+    createParam(ADTimePixRawHstCountsString, asynParamInt64, &ADTimePixRawHstCounts);
+    createParam(ADTimePixRawHstHitsString, asynParamInt64, &ADTimePixRawHstHits);
+    createParam(ADTimePixRawHstNoReferenceString, asynParamInt64, &ADTimePixRawHstNoReference);
+    createParam(ADTimePixRawHstTotRejectedString, asynParamInt64, &ADTimePixRawHstTotRejected);
+    createParam(ADTimePixRawHstOutOfRangeString, asynParamInt64, &ADTimePixRawHstOutOfRange);
+    createParam(ADTimePixRawHstNoRoiString, asynParamInt64, &ADTimePixRawHstNoRoi);
+    createParam(ADTimePixRawHstReferencesString, asynParamInt64, &ADTimePixRawHstReferences);
+    createParam(ADTimePixVStemEnableString, asynParamInt32, &ADTimePixVStemEnable);
+    createParam(ADTimePixVStemTriggerString, asynParamInt32, &ADTimePixVStemTrigger);
+    createParam(ADTimePixVStemTdcEdgeString, asynParamInt32, &ADTimePixVStemTdcEdge);
+    createParam(ADTimePixVStemDetectorsString, asynParamOctet, &ADTimePixVStemDetectors);
+    createParam(ADTimePixVStemCenterXString, asynParamFloat64, &ADTimePixVStemCenterX);
+    createParam(ADTimePixVStemCenterYString, asynParamFloat64, &ADTimePixVStemCenterY);
+    createParam(ADTimePixVStemPublishPeriodString, asynParamFloat64, &ADTimePixVStemPublishPeriod);
+    createParam(ADTimePixVStemStatusString, asynParamOctet, &ADTimePixVStemStatus);
+    createParam(ADTimePixVStemNumDetectorsString, asynParamInt32, &ADTimePixVStemNumDetectors);
+    createParam(ADTimePixVStemInnerString, asynParamFloat64, &ADTimePixVStemInner);
+    createParam(ADTimePixVStemOuterString, asynParamFloat64, &ADTimePixVStemOuter);
+    createParam(ADTimePixVStemFramesString, asynParamInt32, &ADTimePixVStemFrames);
+    createParam(ADTimePixVStemLineString, asynParamInt32, &ADTimePixVStemLine);
+    createParam(ADTimePixVStemPlacedString, asynParamInt64, &ADTimePixVStemPlaced);
+    createParam(ADTimePixVStemNoTriggerString, asynParamInt64, &ADTimePixVStemNoTrigger);
+    createParam(ADTimePixVStemOutsideString, asynParamInt64, &ADTimePixVStemOutside);
+    createParam(ADTimePixStem4dEnableString, asynParamInt32, &ADTimePixStem4dEnable);
+    createParam(ADTimePixStem4dFileString, asynParamOctet, &ADTimePixStem4dFile);
+    createParam(ADTimePixStem4dFileNumberString, asynParamInt32, &ADTimePixStem4dFileNumber);
+    createParam(ADTimePixStem4dFullFileNameString, asynParamOctet, &ADTimePixStem4dFullFileName);
+    createParam(ADTimePixStem4dRoiXString, asynParamInt32, &ADTimePixStem4dRoiX);
+    createParam(ADTimePixStem4dRoiYString, asynParamInt32, &ADTimePixStem4dRoiY);
+    createParam(ADTimePixStem4dRoiWidthString, asynParamInt32, &ADTimePixStem4dRoiWidth);
+    createParam(ADTimePixStem4dRoiHeightString, asynParamInt32, &ADTimePixStem4dRoiHeight);
+    createParam(ADTimePixStem4dFrameString, asynParamInt32, &ADTimePixStem4dFrame);
+    createParam(ADTimePixStem4dSumString, asynParamInt32, &ADTimePixStem4dSum);
+    createParam(ADTimePixStem4dStatusString, asynParamOctet, &ADTimePixStem4dStatus);
+    createParam(ADTimePixStem4dEventsString, asynParamInt64, &ADTimePixStem4dEvents);
+    createParam(ADTimePixStem4dRowsString, asynParamInt64, &ADTimePixStem4dRows);
+    createParam(ADTimePixStem4dUnorderedString, asynParamInt64, &ADTimePixStem4dUnordered);
+    createParam(ADTimePixStem4dMBytesString, asynParamFloat64, &ADTimePixStem4dMBytes);
+    createParam(ADTimePixStem4dSumEventsString, asynParamInt64, &ADTimePixStem4dSumEvents);
+    createParam(ADTimePixEnergyEnableString, asynParamInt32, &ADTimePixEnergyEnable);
+    createParam(ADTimePixEnergyCalibDirString, asynParamOctet, &ADTimePixEnergyCalibDir);
+    createParam(ADTimePixEnergyGatesString, asynParamOctet, &ADTimePixEnergyGates);
+    createParam(ADTimePixEnergyRoisString, asynParamOctet, &ADTimePixEnergyRois);
+    createParam(ADTimePixEnergyMinKevString, asynParamFloat64, &ADTimePixEnergyMinKev);
+    createParam(ADTimePixEnergyMaxKevString, asynParamFloat64, &ADTimePixEnergyMaxKev);
+    createParam(ADTimePixEnergyBinsString, asynParamInt32, &ADTimePixEnergyBins);
+    createParam(ADTimePixEnergyPublishPeriodString, asynParamFloat64, &ADTimePixEnergyPublishPeriod);
+    createParam(ADTimePixEnergyResetString, asynParamInt32, &ADTimePixEnergyReset);
+    createParam(ADTimePixEnergyStatusString, asynParamOctet, &ADTimePixEnergyStatus);
+    createParam(ADTimePixEnergyCalibratedString, asynParamInt32, &ADTimePixEnergyCalibrated);
+    createParam(ADTimePixEnergyNumGatesString, asynParamInt32, &ADTimePixEnergyNumGates);
+    createParam(ADTimePixEnergyGroupsString, asynParamInt32, &ADTimePixEnergyGroups);
+    createParam(ADTimePixEnergySpectrumString, asynParamInt64Array, &ADTimePixEnergySpectrum);
+    createParam(ADTimePixEnergyKevString, asynParamFloat64Array, &ADTimePixEnergyKev);
+    createParam(ADTimePixEnergyCountsString, asynParamInt64, &ADTimePixEnergyCounts);
+    createParam(ADTimePixEnergyGateCountsString, asynParamInt64, &ADTimePixEnergyGateCounts);
+    createParam(ADTimePixEnergyHitsString, asynParamInt64, &ADTimePixEnergyHits);
+    createParam(ADTimePixEnergyUncalibratedString, asynParamInt64, &ADTimePixEnergyUncalibrated);
+    createParam(ADTimePixEnergyOutOfRangeString, asynParamInt64, &ADTimePixEnergyOutOfRange);
+    createParam(ADTimePixTimeWalkEnableString, asynParamInt32, &ADTimePixTimeWalkEnable);
+    createParam(ADTimePixTimeWalkFileString, asynParamOctet, &ADTimePixTimeWalkFile);
+    createParam(ADTimePixTimeWalkPixelFileString, asynParamOctet, &ADTimePixTimeWalkPixelFile);
+    createParam(ADTimePixTimeWalkReloadString, asynParamInt32, &ADTimePixTimeWalkReload);
+    createParam(ADTimePixTimeWalkValidateString, asynParamInt32, &ADTimePixTimeWalkValidate);
+    createParam(ADTimePixTimeWalkStatusString, asynParamOctet, &ADTimePixTimeWalkStatus);
+    createParam(ADTimePixTimeWalkPointsString, asynParamInt32, &ADTimePixTimeWalkPoints);
+    createParam(ADTimePixTimeWalkPixelsString, asynParamInt32, &ADTimePixTimeWalkPixels);
+    createParam(ADTimePixTimeWalkMaxNsString, asynParamFloat64, &ADTimePixTimeWalkMaxNs);
+    createParam(ADTimePixTimeWalkCorrectedString, asynParamInt64, &ADTimePixTimeWalkCorrected);
+    createParam(ADTimePixTimeWalkMeanNsString, asynParamFloat64, &ADTimePixTimeWalkMeanNs);
+    createParam(ADTimePixTimeWalkHistRawString, asynParamInt64Array, &ADTimePixTimeWalkHistRaw);
+    createParam(ADTimePixTimeWalkHistCorrString, asynParamInt64Array, &ADTimePixTimeWalkHistCorr);
+    createParam(ADTimePixTimeWalkTimeMsString, asynParamFloat64Array, &ADTimePixTimeWalkTimeMs);
+    createParam(ADTimePixRawFilterEnableString, asynParamInt32, &ADTimePixRawFilterEnable);
+    createParam(ADTimePixRawFilterRoisString, asynParamOctet, &ADTimePixRawFilterRois);
+    createParam(ADTimePixRawFilterTotMinString, asynParamInt32, &ADTimePixRawFilterTotMin);
+    createParam(ADTimePixRawFilterTotMaxString, asynParamInt32, &ADTimePixRawFilterTotMax);
+    createParam(ADTimePixRawFilterMaskString, asynParamInt32, &ADTimePixRawFilterMask);
+    createParam(ADTimePixRawFilterResetString, asynParamInt32, &ADTimePixRawFilterReset);
+    createParam(ADTimePixRawFilterStatusString, asynParamOctet, &ADTimePixRawFilterStatus);
+    createParam(ADTimePixRawFilterMaskedPixelsString, asynParamInt32, &ADTimePixRawFilterMaskedPixels);
+    createParam(ADTimePixRawFilterHitsString, asynParamInt64, &ADTimePixRawFilterHits);
+    createParam(ADTimePixRawFilterPassedString, asynParamInt64, &ADTimePixRawFilterPassed);
+    createParam(ADTimePixRawFilterOutsideRoiString, asynParamInt64, &ADTimePixRawFilterOutsideRoi);
+    createParam(ADTimePixRawFilterTotRejectedString, asynParamInt64, &ADTimePixRawFilterTotRejected);
+    createParam(ADTimePixRawFilterMaskedString, asynParamInt64, &ADTimePixRawFilterMasked);
+    createParam(ADTimePixReplayFileString, asynParamOctet, &ADTimePixReplayFile);
+    createParam(ADTimePixReplayStartMsString, asynParamFloat64, &ADTimePixReplayStartMs);
+    createParam(ADTimePixReplayStopMsString, asynParamFloat64, &ADTimePixReplayStopMs);
+    createParam(ADTimePixReplayThreadsString, asynParamInt32, &ADTimePixReplayThreads);
+    createParam(ADTimePixReplayRunString, asynParamInt32, &ADTimePixReplayRun);
+    createParam(ADTimePixReplayStatusString, asynParamOctet, &ADTimePixReplayStatus);
+    createParam(ADTimePixReplayProgressString, asynParamFloat64, &ADTimePixReplayProgress);
+    createParam(ADTimePixReplayDurationMsString, asynParamFloat64, &ADTimePixReplayDurationMs);
+    createParam(ADTimePixReplayBlocksString, asynParamInt32, &ADTimePixReplayBlocks);
+    createParam(ADTimePixReplayHitsString, asynParamInt64, &ADTimePixReplayHits);
+    createParam(ADTimePixReplayTdcsString, asynParamInt64, &ADTimePixReplayTdcs);
+    createParam(ADTimePixReplayRateString, asynParamFloat64, &ADTimePixReplayRate);
+    createParam(ADTimePixRawArchiveEnableString, asynParamInt32, &ADTimePixRawArchiveEnable);
+    createParam(ADTimePixRawArchivePathString, asynParamOctet, &ADTimePixRawArchivePath);
+    createParam(ADTimePixRawArchivePrefixString, asynParamOctet, &ADTimePixRawArchivePrefix);
+    createParam(ADTimePixRawArchiveLevelString, asynParamInt32, &ADTimePixRawArchiveLevel);
+    createParam(ADTimePixRawArchiveThreadsString, asynParamInt32, &ADTimePixRawArchiveThreads);
+    createParam(ADTimePixRawArchiveRotateMBString, asynParamFloat64, &ADTimePixRawArchiveRotateMB);
+    createParam(ADTimePixRawArchiveRotateSecString, asynParamFloat64, &ADTimePixRawArchiveRotateSec);
+    createParam(ADTimePixRawArchiveDirectString, asynParamInt32, &ADTimePixRawArchiveDirect);
+    createParam(ADTimePixRawArchiveStatusString, asynParamOctet, &ADTimePixRawArchiveStatus);
+    createParam(ADTimePixRawArchiveFileString, asynParamOctet, &ADTimePixRawArchiveFile);
+    createParam(ADTimePixRawArchiveFilesString, asynParamInt32, &ADTimePixRawArchiveFiles);
+    createParam(ADTimePixRawArchiveInMBString, asynParamFloat64, &ADTimePixRawArchiveInMB);
+    createParam(ADTimePixRawArchiveOutMBString, asynParamFloat64, &ADTimePixRawArchiveOutMB);
+    createParam(ADTimePixRawArchiveRatioString, asynParamFloat64, &ADTimePixRawArchiveRatio);
+    createParam(ADTimePixRawArchiveRateString, asynParamFloat64, &ADTimePixRawArchiveRate);
+    createParam(ADTimePixRawArchiveStallsString, asynParamInt64, &ADTimePixRawArchiveStalls);
+    createParam(ADTimePixRawArchiveDroppedMBString, asynParamFloat64, &ADTimePixRawArchiveDroppedMB);
+    createParam(ADTimePixHitListEnableString, asynParamInt32, &ADTimePixHitListEnable);
+    createParam(ADTimePixHitListEventsString, asynParamInt32, &ADTimePixHitListEvents);
+    createParam(ADTimePixHitListDurationMsString, asynParamFloat64, &ADTimePixHitListDurationMs);
+    createParam(ADTimePixHitListBatchesString, asynParamInt32, &ADTimePixHitListBatches);
+    createParam(ADTimePixHitListHitsString, asynParamInt64, &ADTimePixHitListHits);
+    createParam(ADTimePixHitListUnmappedString, asynParamInt64, &ADTimePixHitListUnmapped);
+    createParam(ADTimePixHitListDroppedString, asynParamInt64, &ADTimePixHitListDropped);
+    createParam(ADTimePixOccEnableString, asynParamInt32, &ADTimePixOccEnable);
+    createParam(ADTimePixOccCellSizeString, asynParamInt32, &ADTimePixOccCellSize);
+    createParam(ADTimePixOccRateHzString, asynParamFloat64, &ADTimePixOccRateHz);
+    createParam(ADTimePixOccChipRateHighString, asynParamFloat64, &ADTimePixOccChipRateHigh);
+    createParam(ADTimePixOccCellRateHighString, asynParamFloat64, &ADTimePixOccCellRateHigh);
+    createParam(ADTimePixOccChipRateString, asynParamFloat64Array, &ADTimePixOccChipRate);
+    createParam(ADTimePixOccAlarmString, asynParamInt32, &ADTimePixOccAlarm);
+    createParam(ADTimePixOccChipAlarmString, asynParamInt32, &ADTimePixOccChipAlarm);
+    createParam(ADTimePixOccHotCellsString, asynParamInt32, &ADTimePixOccHotCells);
+    createParam(ADTimePixOccMaxChipString, asynParamInt32, &ADTimePixOccMaxChip);
+    createParam(ADTimePixOccMaxChipRateString, asynParamFloat64, &ADTimePixOccMaxChipRate);
+    createParam(ADTimePixOccMaxCellRateString, asynParamFloat64, &ADTimePixOccMaxCellRate);
+    createParam(ADTimePixOccUpdatesString, asynParamInt32, &ADTimePixOccUpdates);
+    createParam(ADTimePixRawBatchAdaptString, asynParamInt32, &ADTimePixRawBatchAdapt);
+    createParam(ADTimePixRawBatchLatencyMsString, asynParamFloat64, &ADTimePixRawBatchLatencyMs);
+    createParam(ADTimePixRawBatchMaxHitsString, asynParamInt32, &ADTimePixRawBatchMaxHits);
+    createParam(ADTimePixRawBatchTargetString, asynParamInt32, &ADTimePixRawBatchTarget);
+    createParam(ADTimePixRawBatchHitRateString, asynParamFloat64, &ADTimePixRawBatchHitRate);
+    createParam(ADTimePixRawBatchRateString, asynParamFloat64, &ADTimePixRawBatchRate);
+    createParam(ADTimePixRawBatchMeanHitsString, asynParamFloat64, &ADTimePixRawBatchMeanHits);
+    createParam(ADTimePixRawBatchesString, asynParamInt64, &ADTimePixRawBatches);
+    createParam(ADTimePixRawBatchBySizeString, asynParamInt64, &ADTimePixRawBatchBySize);
+    createParam(ADTimePixRawBatchByAgeString, asynParamInt64, &ADTimePixRawBatchByAge);
+    createParam(ADTimePixRawBatchMaxWaitMsString, asynParamFloat64, &ADTimePixRawBatchMaxWaitMs);
+    createParam(ADTimePixRawBatchSizeHistString, asynParamInt32Array, &ADTimePixRawBatchSizeHist);
+    createParam(ADTimePixPrvPairModeString, asynParamInt32, &ADTimePixPrvPairMode);
+    createParam(ADTimePixPrvPairThresholdsString, asynParamInt32, &ADTimePixPrvPairThresholds);
+    createParam(ADTimePixPrvPairTimeoutMsString, asynParamFloat64, &ADTimePixPrvPairTimeoutMs);
+    createParam(ADTimePixPrvPairKeyString, asynParamInt32, &ADTimePixPrvPairKey);
+    createParam(ADTimePixPrvPairSetSizeString, asynParamInt32, &ADTimePixPrvPairSetSize);
+    createParam(ADTimePixPrvPairPendingString, asynParamInt32, &ADTimePixPrvPairPending);
+    createParam(ADTimePixPrvPairSetsString, asynParamInt64, &ADTimePixPrvPairSets);
+    createParam(ADTimePixPrvPairOrphansString, asynParamInt64, &ADTimePixPrvPairOrphans);
+    createParam(ADTimePixPrvPairDuplicatesString, asynParamInt64, &ADTimePixPrvPairDuplicates);
+    createParam(ADTimePixSpecEnableString, asynParamInt32, &ADTimePixSpecEnable);
+    createParam(ADTimePixSpecFramesString, asynParamInt32, &ADTimePixSpecFrames);
+    createParam(ADTimePixSpecBandsString, asynParamInt32, &ADTimePixSpecBands);
+    createParam(ADTimePixSpecResetString, asynParamInt32, &ADTimePixSpecReset);
+    createParam(ADTimePixSpecPlanesString, asynParamInt32, &ADTimePixSpecPlanes);
+    createParam(ADTimePixSpecFramesRbvString, asynParamInt32, &ADTimePixSpecFramesRbv);
+    createParam(ADTimePixSpecStacksString, asynParamInt32, &ADTimePixSpecStacks);
+    createParam(ADTimePixMaskNameString, asynParamOctet, &ADTimePixMaskName);
+    createParam(ADTimePixMaskOpString, asynParamInt32, &ADTimePixMaskOp);
+    createParam(ADTimePixMaskOpSizeString, asynParamInt32, &ADTimePixMaskOpSize);
+    createParam(ADTimePixMaskOpApplyString, asynParamInt32, &ADTimePixMaskOpApply);
+    createParam(ADTimePixMaskStoreString, asynParamInt32, &ADTimePixMaskStore);
+    createParam(ADTimePixMaskRecallString, asynParamInt32, &ADTimePixMaskRecall);
+    createParam(ADTimePixMaskDeleteString, asynParamInt32, &ADTimePixMaskDelete);
+    createParam(ADTimePixMaskCountString, asynParamInt32, &ADTimePixMaskCount);
+    createParam(ADTimePixMaskStackString, asynParamInt32, &ADTimePixMaskStack);
+    createParam(ADTimePixMaskNamesString, asynParamOctet, &ADTimePixMaskNames);
+    createParam(ADTimePixMaskStatusString, asynParamOctet, &ADTimePixMaskStatus);
+    createParam(ADTimePixMaskOutputString, asynParamInt32, &ADTimePixMaskOutput);
+    createParam(ADTimePixMaskOutputPixelsString, asynParamInt32, &ADTimePixMaskOutputPixels);
+    createParam(ADTimePixMaskUndoString, asynParamInt32, &ADTimePixMaskUndo);
+    createParam(ADTimePixMaskRedoString, asynParamInt32, &ADTimePixMaskRedo);
+    createParam(ADTimePixMaskUndoDepthString, asynParamInt32, &ADTimePixMaskUndoDepth);
+    createParam(ADTimePixMaskRedoDepthString, asynParamInt32, &ADTimePixMaskRedoDepth);
+    createParam(ADTimePixMaskCommitPelsString, asynParamInt32, &ADTimePixMaskCommitPels);
+    createParam(ADTimePixMaskCommitStatusString, asynParamOctet, &ADTimePixMaskCommitStatus);
 
     //sets driver version
     char versionString[25];
@@ -1710,10 +2147,6 @@ ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers
     prvImgAcquisitionRate_ = 0.0;
     prvImgLastRateUpdateTime_ = 0.0;
     prvImgFirstFrameReceived_ = false;
-    prvImgT1ReadyForDiff_ = false;
-    prvImgT0OrphanForDiff_ = false;
-    prvImgLastSeenFrameForPair_ = -1;
-    prvImgLastDiffT0Frame_ = -1;
     prvImgJsonHeadersRemaining_ = 0;
 
     // Initialize TCP streaming for PrvImg1 channel (integrated preview)
@@ -1735,10 +2168,6 @@ ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers
     prvImg1AcquisitionRate_ = 0.0;
     prvImg1LastRateUpdateTime_ = 0.0;
     prvImg1FirstFrameReceived_ = false;
-    prvImg1T1ReadyForDiff_ = false;
-    prvImg1T0OrphanForDiff_ = false;
-    prvImg1LastSeenFrameForPair_ = -1;
-    prvImg1LastDiffT0Frame_ = -1;
     prvImg1JsonHeadersRemaining_ = 0;
     
     // Initialize TCP streaming for Img channel
@@ -1760,6 +2189,111 @@ ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers
         ERR("Failed to create PixelConfig diff mutex");
     }
     pixelConfigDiff_.assign(262144, 0);
+    gateMutex_ = epicsMutexMustCreate();
+    if (!gateMutex_) {
+        ERR("Failed to create ToF gate mutex");
+    }
+    tofGates_.clear();
+    gatedImages_.reset();
+    gateNoReference_ = 0;
+    gateUnmapped_ = 0;
+    gateLastPublishTime_ = 0.0;
+    gateRangeWarned_ = false;
+
+    // Initialize Raw TCP decode
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        rawChannels_[c].owner = this;
+        rawChannels_[c].index = c;
+        rawChannels_[c].spaceEvent = epicsEventMustCreate(epicsEventEmpty);
+    }
+    rawNumChannels_ = 0;
+    rawDataEvent_ = epicsEventMustCreate(epicsEventEmpty);
+    rawRunning_ = false;
+    rawWorkerThreadId_ = nullptr;
+    rawMutex_ = epicsMutexMustCreate();
+    if (!rawMutex_) {
+        ERR("Failed to create Raw decode mutex");
+    }
+    rawImageWidth_ = 0;
+    rawImageHeight_ = 0;
+    replayRunning_ = false;
+    rawTeardown_ = false;
+    replayThreadId_ = nullptr;
+    rawArchiveLastIn_ = 0;
+    rawBatchLastBatches_ = 0;
+    rawBatchLastHits_ = 0;
+    evtImgMutex_ = epicsMutexMustCreate();
+    if (!evtImgMutex_) {
+        ERR("Failed to create event image mutex");
+    }
+    evtImgBuilder_.reset();
+    evtImgConfigDirty_ = true;
+    evtImgLastPublishTime_ = 0.0;
+    evtImgSkipped_ = 0;
+    clusterMutex_ = epicsMutexMustCreate();
+    if (!clusterMutex_) {
+        ERR("Failed to create cluster mutex");
+    }
+    clusterEngine_.reset();
+    clusterSubpixel_ = 1;
+    clusterConfigDirty_ = true;
+    clusterLastPublishTime_ = 0.0;
+    clusterLastPublishCount_ = 0;
+    rawHstMutex_ = epicsMutexMustCreate();
+    if (!rawHstMutex_) {
+        ERR("Failed to create Raw histogram mutex");
+    }
+    rawHst_.reset();
+    rawHstConfigDirty_ = true;
+    rawHstLastPublishTime_ = 0.0;
+    stemMutex_ = epicsMutexMustCreate();
+    if (!stemMutex_) {
+        ERR("Failed to create virtual STEM mutex");
+    }
+    stemImager_.reset();
+    stemConfigDirty_ = true;
+    stemLastPublishTime_ = 0.0;
+    stem4dOpenFailed_ = false;
+    energyMutex_ = epicsMutexMustCreate();
+    if (!energyMutex_) {
+        ERR("Failed to create energy calibration mutex");
+    }
+    energyCalib_.reset();
+    energyImager_.reset();
+    energyConfigDirty_ = true;
+    energyLastPublishTime_ = 0.0;
+    timeWalkMutex_ = epicsMutexMustCreate();
+    if (!timeWalkMutex_) {
+        ERR("Failed to create time-walk mutex");
+    }
+    timeWalk_.reset();
+    timeWalkConfigDirty_ = true;
+    timeWalkLastPublishTime_ = 0.0;
+    rawFilterMutex_ = epicsMutexMustCreate();
+    if (!rawFilterMutex_) {
+        ERR("Failed to create raw filter mutex");
+    }
+    rawFilter_.reset();
+    rawFilterConfigDirty_ = true;
+    hitListMutex_ = epicsMutexMustCreate();
+    if (!hitListMutex_) {
+        ERR("Failed to create hit list mutex");
+    }
+    hitListOpen_ = false;
+    hitListCapacity_ = 0;
+    hitListCount_ = 0;
+    hitListWidth_ = 1;
+    hitListStart_ = 0;
+    hitListEnd_ = 0;
+    hitListBatches_ = 0;
+    hitListHits_ = 0;
+    hitListUnmapped_ = 0;
+    hitListDropped_ = 0;
+    occupancyCellsX_ = 0;
+    occupancyCellsY_ = 0;
+    occupancyCellSize_ = 16;
+    occupancyLastPublish_ = 0.0;
+    occupancyUpdates_ = 0;
     prvHstNetworkClient_.reset();
     prvHstHost_ = "";
     prvHstPort_ = 0;
@@ -1851,6 +2385,249 @@ ADTimePix::ADTimePix(const char* portName, const char* serverURL, int maxBuffers
     setIntegerParam(ADTimePixProcessedImgOutputType, 0);  // 0=Sum (NDInt64), 1=Average (NDInt32)
     setIntegerParam(ADTimePixWriteProcessedHst, 0);
     setIntegerParam(ADTimePixProcessedHstOutputType, 0);
+    setIntegerParam(ADTimePixGateMode, TOF_GATE_MODE_OFF);
+    setStringParam(ADTimePixGateWindows, "");
+    setIntegerParam(ADTimePixGateCount, 0);
+    setStringParam(ADTimePixGateStatus, "No gates");
+    setIntegerParam(ADTimePixGateFrames, 0);
+    setIntegerParam(ADTimePixGateReset, 0);
+    setIntegerParam(ADTimePixGatePublishFrames, 1);
+    setDoubleParam(ADTimePixGateTofUnitNs, TOF_GATE_FRAME_UNIT_NS);
+    setDoubleParam(ADTimePixGatePublishPeriod, 1.0);
+    for (int g = 0; g < TOF_GATE_MAX; ++g) {
+        setDoubleParam(g, ADTimePixGateStartMs, 0.0);
+        setDoubleParam(g, ADTimePixGateStopMs, 0.0);
+        setInteger64Param(g, ADTimePixGateTotalCounts, 0);
+    }
+    setIntegerParam(ADTimePixRawDecode, 0);
+    setIntegerParam(ADTimePixRawConnected, 0);
+    setStringParam(ADTimePixRawDecodeStatus, "Idle");
+    setIntegerParam(ADTimePixRawSort, 1);
+    setDoubleParam(ADTimePixRawSortLatencyMs, 1.0);
+    setIntegerParam(ADTimePixRaw1Decode, 0);
+    setIntegerParam(ADTimePixRawChannels, 0);
+    resetRawDecodeStats();
+    setIntegerParam(ADTimePixEvtImgEnable, 0);
+    setIntegerParam(ADTimePixEvtImgMode, EVENT_WINDOW_DURATION);
+    setDoubleParam(ADTimePixEvtImgDurationMs, 10.0);
+    setIntegerParam(ADTimePixEvtImgEvents, 100000);
+    setIntegerParam(ADTimePixEvtImgTdcEdge, TPX3_TDC1_RISE);
+    setDoubleParam(ADTimePixEvtImgMaxRate, 10.0);
+    setIntegerParam(ADTimePixEvtImgFrames, 0);
+    setIntegerParam(ADTimePixEvtImgFrameEvents, 0);
+    setInteger64Param(ADTimePixEvtImgDropped, 0);
+    setInteger64Param(ADTimePixEvtImgSkipped, 0);
+    setIntegerParam(ADTimePixClusterEnable, 0);
+    setIntegerParam(ADTimePixClusterRadius, 1);
+    setDoubleParam(ADTimePixClusterDtNs, 100.0);
+    setDoubleParam(ADTimePixClusterSpanNs, 1000.0);
+    setIntegerParam(ADTimePixClusterMinSize, 1);
+    setIntegerParam(ADTimePixClusterThreads, 1);
+    setIntegerParam(ADTimePixClusterSubpixel, 4);
+    setDoubleParam(ADTimePixClusterPublishPeriod, 1.0);
+    setIntegerParam(ADTimePixClusterReset, 0);
+    setDoubleParam(ADTimePixClusterRate, 0.0);
+    setInteger64Param(ADTimePixClusterCount, 0);
+    setDoubleParam(ADTimePixClusterMeanSize, 0.0);
+    setInteger64Param(ADTimePixClusterLate, 0);
+    setIntegerParam(ADTimePixClusterBuffered, 0);
+    setIntegerParam(ADTimePixRawHstEnable, 0);
+    setIntegerParam(ADTimePixRawHstBinning, 0);
+    setDoubleParam(ADTimePixRawHstMinMs, 0.0);
+    setDoubleParam(ADTimePixRawHstMaxMs, 20.0);
+    setIntegerParam(ADTimePixRawHstBins, 2000);
+    setIntegerParam(ADTimePixRawHstGrouping, TOF_HIST_GROUP_DETECTOR);
+    setStringParam(ADTimePixRawHstRois, "");
+    setIntegerParam(ADTimePixRawHstTotMin, 0);
+    setIntegerParam(ADTimePixRawHstTotMax, 0);
+    setIntegerParam(ADTimePixRawHstTdc, 0);
+    setIntegerParam(ADTimePixRawHstEdge, 0);
+    setIntegerParam(ADTimePixRawHstThreads, 1);
+    setDoubleParam(ADTimePixRawHstPublishPeriod, 1.0);
+    setIntegerParam(ADTimePixRawHstReset, 0);
+    setStringParam(ADTimePixRawHstStatus, "Idle");
+    setIntegerParam(ADTimePixRawHstGroups, 0);
+    for (int g = 0; g < TOF_HIST_MAX_GROUPS; ++g) {
+        setInteger64Param(g, ADTimePixRawHstCounts, 0);
+    }
+    setInteger64Param(ADTimePixRawHstHits, 0);
+    setInteger64Param(ADTimePixRawHstNoReference, 0);
+    setInteger64Param(ADTimePixRawHstTotRejected, 0);
+    setInteger64Param(ADTimePixRawHstOutOfRange, 0);
+    setInteger64Param(ADTimePixRawHstNoRoi, 0);
+    setInteger64Param(ADTimePixRawHstReferences, 0);
+    setIntegerParam(ADTimePixVStemEnable, 0);
+    setIntegerParam(ADTimePixVStemTrigger, STEM_TRIGGER_FRAME);
+    setIntegerParam(ADTimePixVStemTdcEdge, TPX3_TDC1_RISE);
+    setStringParam(ADTimePixVStemDetectors, "");
+    setDoubleParam(ADTimePixVStemCenterX, -1.0);
+    setDoubleParam(ADTimePixVStemCenterY, -1.0);
+    setDoubleParam(ADTimePixVStemPublishPeriod, 1.0);
+    setStringParam(ADTimePixVStemStatus, "Idle");
+    setIntegerParam(ADTimePixVStemNumDetectors, 0);
+    for (int d = 0; d < STEM_MAX_DETECTORS; ++d) {
+        setDoubleParam(d, ADTimePixVStemInner, 0.0);
+        setDoubleParam(d, ADTimePixVStemOuter, 0.0);
+    }
+    setIntegerParam(ADTimePixVStemFrames, 0);
+    setIntegerParam(ADTimePixVStemLine, -1);
+    setInteger64Param(ADTimePixVStemPlaced, 0);
+    setInteger64Param(ADTimePixVStemNoTrigger, 0);
+    setInteger64Param(ADTimePixVStemOutside, 0);
+    setIntegerParam(ADTimePixStem4dEnable, 0);
+    setStringParam(ADTimePixStem4dFile, "");
+    setIntegerParam(ADTimePixStem4dFileNumber, 0);
+    setStringParam(ADTimePixStem4dFullFileName, "");
+    setIntegerParam(ADTimePixStem4dRoiX, 0);
+    setIntegerParam(ADTimePixStem4dRoiY, 0);
+    setIntegerParam(ADTimePixStem4dRoiWidth, 1);
+    setIntegerParam(ADTimePixStem4dRoiHeight, 1);
+    setIntegerParam(ADTimePixStem4dFrame, -1);
+    setIntegerParam(ADTimePixStem4dSum, 0);
+    setStringParam(ADTimePixStem4dStatus, "Idle");
+    setInteger64Param(ADTimePixStem4dEvents, 0);
+    setInteger64Param(ADTimePixStem4dRows, 0);
+    setInteger64Param(ADTimePixStem4dUnordered, 0);
+    setDoubleParam(ADTimePixStem4dMBytes, 0.0);
+    setInteger64Param(ADTimePixStem4dSumEvents, 0);
+    setIntegerParam(ADTimePixEnergyEnable, 0);
+    setStringParam(ADTimePixEnergyCalibDir, "");
+    setStringParam(ADTimePixEnergyGates, "");
+    setStringParam(ADTimePixEnergyRois, "");
+    setDoubleParam(ADTimePixEnergyMinKev, 0.0);
+    setDoubleParam(ADTimePixEnergyMaxKev, 100.0);
+    setIntegerParam(ADTimePixEnergyBins, 1000);
+    setDoubleParam(ADTimePixEnergyPublishPeriod, 1.0);
+    setIntegerParam(ADTimePixEnergyReset, 0);
+    setStringParam(ADTimePixEnergyStatus, "Idle");
+    setIntegerParam(ADTimePixEnergyCalibrated, 0);
+    setIntegerParam(ADTimePixEnergyNumGates, 0);
+    setIntegerParam(ADTimePixEnergyGroups, 0);
+    for (int g = 0; g < TOF_HIST_MAX_GROUPS; ++g) {
+        setInteger64Param(g, ADTimePixEnergyCounts, 0);
+        setInteger64Param(g, ADTimePixEnergyGateCounts, 0);
+    }
+    setInteger64Param(ADTimePixEnergyHits, 0);
+    setInteger64Param(ADTimePixEnergyUncalibrated, 0);
+    setInteger64Param(ADTimePixEnergyOutOfRange, 0);
+    setIntegerParam(ADTimePixTimeWalkEnable, 0);
+    setStringParam(ADTimePixTimeWalkFile, "");
+    setStringParam(ADTimePixTimeWalkPixelFile, "");
+    setIntegerParam(ADTimePixTimeWalkReload, 0);
+    setIntegerParam(ADTimePixTimeWalkValidate, 0);
+    setStringParam(ADTimePixTimeWalkStatus, "Not loaded");
+    setIntegerParam(ADTimePixTimeWalkPoints, 0);
+    setIntegerParam(ADTimePixTimeWalkPixels, 0);
+    setDoubleParam(ADTimePixTimeWalkMaxNs, 0.0);
+    setInteger64Param(ADTimePixTimeWalkCorrected, 0);
+    setDoubleParam(ADTimePixTimeWalkMeanNs, 0.0);
+    setIntegerParam(ADTimePixRawFilterEnable, 0);
+    setStringParam(ADTimePixRawFilterRois, "");
+    setIntegerParam(ADTimePixRawFilterTotMin, 0);
+    setIntegerParam(ADTimePixRawFilterTotMax, 0);
+    setIntegerParam(ADTimePixRawFilterMask, 0);
+    setIntegerParam(ADTimePixRawFilterReset, 0);
+    setStringParam(ADTimePixRawFilterStatus, "Idle");
+    setIntegerParam(ADTimePixRawFilterMaskedPixels, 0);
+    setInteger64Param(ADTimePixRawFilterHits, 0);
+    setInteger64Param(ADTimePixRawFilterPassed, 0);
+    setInteger64Param(ADTimePixRawFilterOutsideRoi, 0);
+    setInteger64Param(ADTimePixRawFilterTotRejected, 0);
+    setInteger64Param(ADTimePixRawFilterMasked, 0);
+    setStringParam(ADTimePixReplayFile, "");
+    setDoubleParam(ADTimePixReplayStartMs, 0.0);
+    setDoubleParam(ADTimePixReplayStopMs, 0.0);
+    setIntegerParam(ADTimePixReplayThreads, 4);
+    setIntegerParam(ADTimePixReplayRun, 0);
+    setStringParam(ADTimePixReplayStatus, "Idle");
+    setDoubleParam(ADTimePixReplayProgress, 0.0);
+    setDoubleParam(ADTimePixReplayDurationMs, 0.0);
+    setIntegerParam(ADTimePixReplayBlocks, 0);
+    setInteger64Param(ADTimePixReplayHits, 0);
+    setInteger64Param(ADTimePixReplayTdcs, 0);
+    setDoubleParam(ADTimePixReplayRate, 0.0);
+    setIntegerParam(ADTimePixRawArchiveEnable, 0);
+    setStringParam(ADTimePixRawArchivePath, "");
+    setStringParam(ADTimePixRawArchivePrefix, "raw");
+    setIntegerParam(ADTimePixRawArchiveLevel, 1);
+    setIntegerParam(ADTimePixRawArchiveThreads, 2);
+    setDoubleParam(ADTimePixRawArchiveRotateMB, 0.0);
+    setDoubleParam(ADTimePixRawArchiveRotateSec, 0.0);
+    setIntegerParam(ADTimePixRawArchiveDirect, 1);
+    setStringParam(ADTimePixRawArchiveStatus, "Off");
+    setStringParam(ADTimePixRawArchiveFile, "");
+    setIntegerParam(ADTimePixRawArchiveFiles, 0);
+    setDoubleParam(ADTimePixRawArchiveInMB, 0.0);
+    setDoubleParam(ADTimePixRawArchiveOutMB, 0.0);
+    setDoubleParam(ADTimePixRawArchiveRatio, 0.0);
+    setDoubleParam(ADTimePixRawArchiveRate, 0.0);
+    setInteger64Param(ADTimePixRawArchiveStalls, 0);
+    setDoubleParam(ADTimePixRawArchiveDroppedMB, 0.0);
+    setIntegerParam(ADTimePixHitListEnable, 0);
+    setIntegerParam(ADTimePixHitListEvents, 65536);
+    setDoubleParam(ADTimePixHitListDurationMs, 100.0);
+    setIntegerParam(ADTimePixHitListBatches, 0);
+    setInteger64Param(ADTimePixHitListHits, 0);
+    setInteger64Param(ADTimePixHitListUnmapped, 0);
+    setInteger64Param(ADTimePixHitListDropped, 0);
+    setIntegerParam(ADTimePixOccEnable, 0);
+    setIntegerParam(ADTimePixOccCellSize, 16);
+    setDoubleParam(ADTimePixOccRateHz, 2.0);
+    setDoubleParam(ADTimePixOccChipRateHigh, 0.0);
+    setDoubleParam(ADTimePixOccCellRateHigh, 0.0);
+    setIntegerParam(ADTimePixOccAlarm, 0);
+    setIntegerParam(ADTimePixOccChipAlarm, 0);
+    setIntegerParam(ADTimePixOccHotCells, 0);
+    setIntegerParam(ADTimePixOccMaxChip, 0);
+    setDoubleParam(ADTimePixOccMaxChipRate, 0.0);
+    setDoubleParam(ADTimePixOccMaxCellRate, 0.0);
+    setIntegerParam(ADTimePixOccUpdates, 0);
+    setIntegerParam(ADTimePixRawBatchAdapt, 1);
+    setDoubleParam(ADTimePixRawBatchLatencyMs, 20.0);
+    setIntegerParam(ADTimePixRawBatchMaxHits, 1 << 22);
+    setIntegerParam(ADTimePixRawBatchTarget, 0);
+    setDoubleParam(ADTimePixRawBatchHitRate, 0.0);
+    setDoubleParam(ADTimePixRawBatchRate, 0.0);
+    setDoubleParam(ADTimePixRawBatchMeanHits, 0.0);
+    setInteger64Param(ADTimePixRawBatches, 0);
+    setInteger64Param(ADTimePixRawBatchBySize, 0);
+    setInteger64Param(ADTimePixRawBatchByAge, 0);
+    setDoubleParam(ADTimePixRawBatchMaxWaitMs, 0.0);
+    setIntegerParam(ADTimePixPrvPairMode, 0);
+    setIntegerParam(ADTimePixPrvPairThresholds, 0);
+    setDoubleParam(ADTimePixPrvPairTimeoutMs, 1000.0);
+    setIntegerParam(ADTimePixPrvPairKey, 0);
+    setIntegerParam(ADTimePixPrvPairSetSize, 2);
+    setIntegerParam(ADTimePixPrvPairPending, 0);
+    setInteger64Param(ADTimePixPrvPairSets, 0);
+    setInteger64Param(ADTimePixPrvPairOrphans, 0);
+    setInteger64Param(ADTimePixPrvPairDuplicates, 0);
+    setIntegerParam(ADTimePixSpecEnable, 0);
+    setIntegerParam(ADTimePixSpecFrames, 1);
+    setIntegerParam(ADTimePixSpecBands, 1);
+    setIntegerParam(ADTimePixSpecReset, 0);
+    setIntegerParam(ADTimePixSpecPlanes, 0);
+    setIntegerParam(ADTimePixSpecFramesRbv, 0);
+    setIntegerParam(ADTimePixSpecStacks, 0);
+    setStringParam(ADTimePixMaskName, "");
+    setIntegerParam(ADTimePixMaskOp, MaskOpUnion);
+    setIntegerParam(ADTimePixMaskOpSize, 1);
+    setIntegerParam(ADTimePixMaskOpApply, 0);
+    setIntegerParam(ADTimePixMaskStore, 0);
+    setIntegerParam(ADTimePixMaskRecall, 0);
+    setIntegerParam(ADTimePixMaskDelete, 0);
+    setIntegerParam(ADTimePixMaskCount, 0);
+    setIntegerParam(ADTimePixMaskStack, 0);
+    setStringParam(ADTimePixMaskNames, "");
+    setStringParam(ADTimePixMaskStatus, "");
+    setIntegerParam(ADTimePixMaskOutput, MaskOutputOff);
+    setIntegerParam(ADTimePixMaskOutputPixels, 0);
+    setIntegerParam(ADTimePixMaskUndo, 0);
+    setIntegerParam(ADTimePixMaskRedo, 0);
+    setIntegerParam(ADTimePixMaskUndoDepth, 0);
+    setIntegerParam(ADTimePixMaskRedoDepth, 0);
+    setIntegerParam(ADTimePixMaskCommitPels, 0);
+    setStringParam(ADTimePixMaskCommitStatus, "");
     // Initialize NumImages to 0 (unlimited) for continuous mode
     // This prevents INVALID status from very large default values
     setIntegerParam(ADNumImages, 0);
@@ -2073,6 +2850,10 @@ void ADTimePix::shutdownPortDriver() {
     }
     imgDisconnect();
 
+    // Stop Raw TCP decode and file replay
+    stopRawDecode();
+    stopReplay();
+
     // Stop PrvHst TCP streaming
     if (prvHstMutex_) {
         epicsMutexLock(prvHstMutex_);
@@ -2183,6 +2964,78 @@ ADTimePix::~ADTimePix(){
         pixelConfigDiffMutex_ = NULL;
     }
 
+    // Join the raw threads without flushing the consumers: their NDArray and
+    // param callbacks must not run while the driver is being destroyed.
+    if (rawMutex_) {
+        epicsMutexLock(rawMutex_);
+        rawTeardown_ = true;
+        epicsMutexUnlock(rawMutex_);
+    }
+    stopRawDecode();
+    stopReplay();
+    if (rawMutex_) {
+        epicsMutexDestroy(rawMutex_);
+        rawMutex_ = NULL;
+    }
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        if (rawChannels_[c].spaceEvent) {
+            epicsEventDestroy(rawChannels_[c].spaceEvent);
+            rawChannels_[c].spaceEvent = NULL;
+        }
+    }
+    if (rawDataEvent_) {
+        epicsEventDestroy(rawDataEvent_);
+        rawDataEvent_ = NULL;
+    }
+    if (gateMutex_) {
+        gatedImages_.reset();
+        epicsMutexDestroy(gateMutex_);
+        gateMutex_ = NULL;
+    }
+    if (evtImgMutex_) {
+        evtImgBuilder_.reset();
+        epicsMutexDestroy(evtImgMutex_);
+        evtImgMutex_ = NULL;
+    }
+    if (clusterMutex_) {
+        clusterEngine_.reset();
+        epicsMutexDestroy(clusterMutex_);
+        clusterMutex_ = NULL;
+    }
+    if (rawHstMutex_) {
+        rawHst_.reset();
+        epicsMutexDestroy(rawHstMutex_);
+        rawHstMutex_ = NULL;
+    }
+    if (stemMutex_) {
+        stemImager_.reset();
+        stem4dStore_.reset();
+        epicsMutexDestroy(stemMutex_);
+        stemMutex_ = NULL;
+    }
+    if (energyMutex_) {
+        energyImager_.reset();
+        energyCalib_.reset();
+        epicsMutexDestroy(energyMutex_);
+        energyMutex_ = NULL;
+    }
+    if (timeWalkMutex_) {
+        timeWalkHistRaw_.reset();
+        timeWalkHistCorr_.reset();
+        timeWalk_.reset();
+        epicsMutexDestroy(timeWalkMutex_);
+        timeWalkMutex_ = NULL;
+    }
+    if (rawFilterMutex_) {
+        rawFilter_.reset();
+        epicsMutexDestroy(rawFilterMutex_);
+        rawFilterMutex_ = NULL;
+    }
+    if (hitListMutex_) {
+        epicsMutexDestroy(hitListMutex_);
+        hitListMutex_ = NULL;
+    }
+
     // Do not call disconnect(this->pasynUserSelf) here. It can trigger asyn disconnect
     // handling (e.g. callbacks) that may touch driver state or param lists after we have
     // already torn down our resources, leading to SIGSEGV on IOC exit. The port is torn
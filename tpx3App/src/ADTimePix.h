@@ -38,8 +38,29 @@
 #include <memory>
 #include <vector>
 #include <deque>
+#include <mutex>
 #include "img_accumulation.h"
 #include "histogram_io.h"
+#include "tof_gate.h"
+#include "tpx3_raw.h"
+#include "event_image.h"
+#include "cluster.h"
+#include "tof_histogram.h"
+#include "hit_sorter.h"
+#include "stem_image.h"
+#include "stem4d.h"
+#include "energy_calib.h"
+#include "timewalk.h"
+#include "raw_filter.h"
+#include "raw_archive.h"
+#include "chip_occupancy.h"
+#include "raw_batcher.h"
+#include "threshold_pair.h"
+#include "spectral_stack.h"
+#include "coord_map.h"
+#include "bpc_cache.h"
+#include "bpc_journal.h"
+#include "masked_pels_json.h"
 #include "network_client.h"
 #include "detector_family.h"
 
@@ -288,6 +309,289 @@
 #define ADTimePixMaskedPelsJsonPathString        "TPX3_MASKED_PELS_JSON_RBV"     // (asynOctet,   r)      Full path to last _masked_pels.json (RefreshPixelConfig)
 #define ADTimePixMaskedPelsCountString           "TPX3_MASKED_PELS_COUNT_RBV"   // (asynInt32,   r)      Count of BPC pels with bit0 set in export
 #define ADTimePixMaskedPelsExportStatusString   "TPX3_MASKED_PELS_EXPORT_STATUS_RBV" // (asynOctet,   r)  OK / skipped / I/O error message
+    // ToF-gated imaging (per-gate images on NDArray addresses 14..17)
+#define ADTimePixGateModeString                 "TPX3_GATE_MODE"               // (asynInt32,   r/w)    0=Off, 1=Serval Image[0] tof mode, 2=Raw events
+#define ADTimePixGateWindowsString              "TPX3_GATE_WINDOWS"            // (asynOctet,   r/w)    Gate list "start:stop,..." in ms (max 4)
+#define ADTimePixGateCountString                "TPX3_GATE_COUNT_RBV"          // (asynInt32,   r)      Number of valid gates
+#define ADTimePixGateStatusString               "TPX3_GATE_STATUS_RBV"         // (asynOctet,   r)      OK / parse error message
+#define ADTimePixGateFramesString               "TPX3_GATE_FRAMES_RBV"         // (asynInt32,   r)      Frames accumulated into gate images
+#define ADTimePixGateResetString                "TPX3_GATE_RESET"              // (asynInt32,   w)      Write 1: zero gate images
+#define ADTimePixGatePublishFramesString        "TPX3_GATE_PUBLISH_FRAMES"     // (asynInt32,   r/w)    Publish gate NDArrays every N frames, mode 1
+#define ADTimePixGateTofUnitNsString            "TPX3_GATE_TOF_UNIT_NS"        // (asynFloat64, r/w)    Serval tof pixel unit (ns), mode 1
+#define ADTimePixGatePublishPeriodString        "TPX3_GATE_PUBLISH_PERIOD"     // (asynFloat64, r/w)    Publish period (s), mode 2
+#define ADTimePixGateStartMsString              "TPX3_GATE_START_MS_RBV"       // (asynFloat64, r)      addr g: gate start (ms)
+#define ADTimePixGateStopMsString               "TPX3_GATE_STOP_MS_RBV"        // (asynFloat64, r)      addr g: gate stop (ms)
+#define ADTimePixGateTotalCountsString          "TPX3_GATE_TOTAL_COUNTS_RBV"   // (asynInt64,   r)      addr g: counts inside gate
+    // Raw (.tpx3) TCP stream decoding (Raw[0] tcp://, optionally merged with Raw[1])
+#define ADTimePixRawDecodeString                "TPX3_RAW_DECODE"              // (asynInt32,   r/w)    1: decode Raw[0] tcp:// stream in the IOC
+#define ADTimePixRawConnectedString             "TPX3_RAW_CONNECTED_RBV"       // (asynInt32,   r)      Raw TCP connected
+#define ADTimePixRawDecodeStatusString          "TPX3_RAW_DECODE_STATUS_RBV"   // (asynOctet,   r)      Raw decode status message
+#define ADTimePixRawHitRateString               "TPX3_RAW_HIT_RATE_RBV"        // (asynFloat64, r)      Decoded pixel hits/s
+#define ADTimePixRawTdcRateString               "TPX3_RAW_TDC_RATE_RBV"        // (asynFloat64, r)      Decoded TDC events/s
+#define ADTimePixRawPacketRateString            "TPX3_RAW_PACKET_RATE_RBV"     // (asynFloat64, r)      Packets/s (all types)
+#define ADTimePixRawDataRateString              "TPX3_RAW_DATA_RATE_RBV"       // (asynFloat64, r)      Raw stream MB/s
+#define ADTimePixRawHitsString                  "TPX3_RAW_HITS_RBV"            // (asynInt64,   r)      Pixel hits this acquisition
+#define ADTimePixRawTdcsString                  "TPX3_RAW_TDCS_RBV"            // (asynInt64,   r)      TDC events this acquisition
+#define ADTimePixRawFramingErrorsString         "TPX3_RAW_FRAMING_ERRORS_RBV"  // (asynInt64,   r)      Chunk header resyncs
+#define ADTimePixRawSortString                  "TPX3_RAW_SORT"                // (asynInt32,   r/w)    1: time-order hits across chips before processing
+#define ADTimePixRawSortLatencyMsString         "TPX3_RAW_SORT_LATENCY_MS"     // (asynFloat64, r/w)    Reorder window (ms of detector time)
+#define ADTimePixRawSortLateHitsString          "TPX3_RAW_SORT_LATE_HITS_RBV"  // (asynInt64,   r)      Hits dropped behind the reorder window
+#define ADTimePixRawSortLateTdcsString          "TPX3_RAW_SORT_LATE_TDCS_RBV"  // (asynInt64,   r)      TDC events dropped behind the reorder window
+#define ADTimePixRawSortRolloversString         "TPX3_RAW_SORT_ROLLOVERS_RBV"  // (asynInt32,   r)      Pixel ToA wraps (~26.8 s) crossed
+#define ADTimePixRawSortDisorderMsString        "TPX3_RAW_SORT_DISORDER_MS_RBV" // (asynFloat64, r)     Largest lateness seen (ms)
+#define ADTimePixRawSortBufferedString          "TPX3_RAW_SORT_BUFFERED_RBV"   // (asynInt32,   r)      Hits held in the reorder window
+#define ADTimePixRaw1DecodeString               "TPX3_RAW1_DECODE"             // (asynInt32,   r/w)    1: also decode Raw[1] tcp:// and merge by time
+#define ADTimePixRawChannelsString              "TPX3_RAW_CHANNELS_RBV"        // (asynInt32,   r)      Raw channels being decoded (1 or 2)
+#define ADTimePixRawChConnectedString           "TPX3_RAW_CH_CONNECTED_RBV"    // (asynInt32,   r)      addr c: Raw[c] TCP connected
+#define ADTimePixRawChHitRateString             "TPX3_RAW_CH_HIT_RATE_RBV"     // (asynFloat64, r)      addr c: decoded hits/s
+#define ADTimePixRawChDataRateString            "TPX3_RAW_CH_DATA_RATE_RBV"    // (asynFloat64, r)      addr c: MB/s received
+#define ADTimePixRawChHitsString                "TPX3_RAW_CH_HITS_RBV"         // (asynInt64,   r)      addr c: hits decoded this acquisition
+#define ADTimePixRawChBacklogString             "TPX3_RAW_CH_BACKLOG_RBV"      // (asynInt32,   r)      addr c: decoded batches waiting for the merge
+#define ADTimePixRawChBacklogHitsString         "TPX3_RAW_CH_BACKLOG_HITS_RBV" // (asynInt32,   r)      addr c: hits in those batches
+#define ADTimePixRawChStallsString              "TPX3_RAW_CH_STALLS_RBV"       // (asynInt64,   r)      addr c: reader waits on a full merge queue
+#define ADTimePixRawChMergeLagMsString          "TPX3_RAW_CH_MERGE_LAG_MS_RBV" // (asynFloat64, r)      addr c: detector time behind the newest channel (ms)
+    // Event-mode images from the Raw decode (NDArray addresses 18..20)
+#define ADTimePixEvtImgEnableString             "TPX3_EVTIMG_ENABLE"           // (asynInt32,   r/w)    1: build count/ToT/ToA images from decoded hits
+#define ADTimePixEvtImgModeString               "TPX3_EVTIMG_MODE"             // (asynInt32,   r/w)    Window: 0=Duration, 1=TDC edge to edge, 2=N events
+#define ADTimePixEvtImgDurationMsString         "TPX3_EVTIMG_DURATION_MS"      // (asynFloat64, r/w)    Window length (ms) in Duration mode
+#define ADTimePixEvtImgEventsString             "TPX3_EVTIMG_EVENTS"           // (asynInt32,   r/w)    Hits per window in N events mode
+#define ADTimePixEvtImgTdcEdgeString            "TPX3_EVTIMG_TDC_EDGE"         // (asynInt32,   r/w)    0=TDC1 rise, 1=TDC1 fall, 2=TDC2 rise, 3=TDC2 fall
+#define ADTimePixEvtImgMaxRateString            "TPX3_EVTIMG_MAX_RATE"         // (asynFloat64, r/w)    Max published windows/s (0 = all)
+#define ADTimePixEvtImgFramesString             "TPX3_EVTIMG_FRAMES_RBV"       // (asynInt32,   r)      Windows completed this acquisition
+#define ADTimePixEvtImgFrameEventsString        "TPX3_EVTIMG_FRAME_EVENTS_RBV" // (asynInt32,   r)      Hits in last published window
+#define ADTimePixEvtImgDroppedString            "TPX3_EVTIMG_DROPPED_RBV"      // (asynInt64,   r)      Hits without image pixel or before first TDC edge
+#define ADTimePixEvtImgSkippedString            "TPX3_EVTIMG_SKIPPED_RBV"      // (asynInt64,   r)      Windows not published (max rate)
+    // Space-time clustering of Raw hits (cluster list addr 21, super-resolution image addr 22)
+#define ADTimePixClusterEnableString            "TPX3_CLUSTER_ENABLE"          // (asynInt32,   r/w)    1: cluster and centroid decoded hits
+#define ADTimePixClusterRadiusString            "TPX3_CLUSTER_RADIUS"          // (asynInt32,   r/w)    Neighbourhood radius in pixels (1 = 8-connected)
+#define ADTimePixClusterDtNsString              "TPX3_CLUSTER_DT_NS"           // (asynFloat64, r/w)    Max ToA gap between connected hits (ns)
+#define ADTimePixClusterSpanNsString            "TPX3_CLUSTER_SPAN_NS"         // (asynFloat64, r/w)    Max cluster duration / slab overlap (ns)
+#define ADTimePixClusterMinSizeString           "TPX3_CLUSTER_MIN_SIZE"        // (asynInt32,   r/w)    Minimum hits per published cluster
+#define ADTimePixClusterThreadsString           "TPX3_CLUSTER_THREADS"         // (asynInt32,   r/w)    Worker threads (time slabs), 1..16
+#define ADTimePixClusterSubpixelString          "TPX3_CLUSTER_SUBPIXEL"        // (asynInt32,   r/w)    Super-resolution bins per pixel and axis, 1..16
+#define ADTimePixClusterPublishPeriodString     "TPX3_CLUSTER_PUBLISH_PERIOD"  // (asynFloat64, r/w)    Seconds between cluster list / image publishes
+#define ADTimePixClusterResetString             "TPX3_CLUSTER_RESET"           // (asynInt32,   w)      Write 1: zero super-resolution image
+#define ADTimePixClusterRateString              "TPX3_CLUSTER_RATE_RBV"        // (asynFloat64, r)      Clusters/s
+#define ADTimePixClusterCountString             "TPX3_CLUSTER_COUNT_RBV"       // (asynInt64,   r)      Clusters this acquisition
+#define ADTimePixClusterMeanSizeString          "TPX3_CLUSTER_MEAN_SIZE_RBV"   // (asynFloat64, r)      Mean hits per cluster
+#define ADTimePixClusterLateString              "TPX3_CLUSTER_LATE_RBV"        // (asynInt64,   r)      Hits older than the emitted time range (dropped)
+#define ADTimePixClusterBufferedString          "TPX3_CLUSTER_BUFFERED_RBV"    // (asynInt32,   r)      Hits held for the next pass
+    // TDC-referenced ToF histograms from Raw hits (spectra at addr = group; NDArrays addr 23..24)
+#define ADTimePixRawHstEnableString             "TPX3_RAWHST_ENABLE"           // (asynInt32,   r/w)    1: histogram ToF of decoded hits
+#define ADTimePixRawHstBinningString            "TPX3_RAWHST_BINNING"          // (asynInt32,   r/w)    0=Linear, 1=Log
+#define ADTimePixRawHstMinMsString              "TPX3_RAWHST_MIN_MS"           // (asynFloat64, r/w)    First bin edge (ms)
+#define ADTimePixRawHstMaxMsString              "TPX3_RAWHST_MAX_MS"           // (asynFloat64, r/w)    Last bin edge (ms)
+#define ADTimePixRawHstBinsString               "TPX3_RAWHST_BINS"             // (asynInt32,   r/w)    Number of bins (max 100000)
+#define ADTimePixRawHstGroupingString           "TPX3_RAWHST_GROUPING"         // (asynInt32,   r/w)    0=Detector, 1=Per chip, 2=Per ROI
+#define ADTimePixRawHstRoisString               "TPX3_RAWHST_ROIS"             // (asynOctet,   r/w)    ROI list "x,y,w,h;..." (max 8)
+#define ADTimePixRawHstTotMinString             "TPX3_RAWHST_TOT_MIN"          // (asynInt32,   r/w)    Min ToT (25 ns units)
+#define ADTimePixRawHstTotMaxString             "TPX3_RAWHST_TOT_MAX"          // (asynInt32,   r/w)    Max ToT (25 ns units), 0 = no limit
+#define ADTimePixRawHstTdcString                "TPX3_RAWHST_TDC"              // (asynInt32,   r/w)    Reference channel 0=TDC1, 1=TDC2
+#define ADTimePixRawHstEdgeString               "TPX3_RAWHST_EDGE"             // (asynInt32,   r/w)    0=From TofTdcReference (P/N), 1=Rising, 2=Falling, 3=Both
+#define ADTimePixRawHstThreadsString            "TPX3_RAWHST_THREADS"          // (asynInt32,   r/w)    Threads with private histograms, 1..16
+#define ADTimePixRawHstPublishPeriodString      "TPX3_RAWHST_PUBLISH_PERIOD"   // (asynFloat64, r/w)    Seconds between publishes
+#define ADTimePixRawHstResetString              "TPX3_RAWHST_RESET"            // (asynInt32,   w)      Write 1: zero histograms
+#define ADTimePixRawHstStatusString             "TPX3_RAWHST_STATUS_RBV"       // (asynOctet,   r)      OK / configuration error
+#define ADTimePixRawHstGroupsString             "TPX3_RAWHST_GROUPS_RBV"       // (asynInt32,   r)      Number of histograms
+#define ADTimePixRawHstDataString               "TPX3_RAWHST_DATA"             // (asynInt64Array, r)   addr g: spectrum of group g
+#define ADTimePixRawHstTimeMsString             "TPX3_RAWHST_TIME_MS"          // (asynFloat64Array, r) Bin centres (ms)
+#define ADTimePixRawHstCountsString             "TPX3_RAWHST_COUNTS_RBV"       // (asynInt64,   r)      addr g: counts in group g
+#define ADTimePixRawHstHitsString               "TPX3_RAWHST_HITS_RBV"         // (asynInt64,   r)      Hits seen
+#define ADTimePixRawHstNoReferenceString        "TPX3_RAWHST_NO_REFERENCE_RBV" // (asynInt64,   r)      Hits before the first reference edge
+#define ADTimePixRawHstTotRejectedString        "TPX3_RAWHST_TOT_REJECTED_RBV" // (asynInt64,   r)      Hits outside the ToT window
+#define ADTimePixRawHstOutOfRangeString         "TPX3_RAWHST_OUT_OF_RANGE_RBV" // (asynInt64,   r)      Hits with ToF outside [Min, Max)
+#define ADTimePixRawHstNoRoiString              "TPX3_RAWHST_NO_ROI_RBV"       // (asynInt64,   r)      Per-ROI grouping: hits in no ROI or unmapped
+#define ADTimePixRawHstReferencesString         "TPX3_RAWHST_REFERENCES_RBV"   // (asynInt64,   r)      Reference edges seen
+    // Event-based virtual STEM from Raw hits (Stem.Scan geometry; NDArrays addr 25..30)
+#define ADTimePixVStemEnableString              "TPX3_VSTEM_ENABLE"            // (asynInt32,   r/w)    1: build virtual STEM images from decoded hits
+#define ADTimePixVStemTriggerString             "TPX3_VSTEM_TRIGGER"           // (asynInt32,   r/w)    0=Frame TDC, 1=Line TDC, 2=Free running
+#define ADTimePixVStemTdcEdgeString             "TPX3_VSTEM_TDC_EDGE"          // (asynInt32,   r/w)    Trigger edge: 0=TDC1 rise, 1=TDC1 fall, 2=TDC2 rise, 3=TDC2 fall
+#define ADTimePixVStemDetectorsString           "TPX3_VSTEM_DETECTORS"         // (asynOctet,   r/w)    "inner:outer,..." px; empty = Stem.VirtualDetector BF/ADF
+#define ADTimePixVStemCenterXString             "TPX3_VSTEM_CENTER_X"          // (asynFloat64, r/w)    Pattern centre X (px), < 0 = detector centre
+#define ADTimePixVStemCenterYString             "TPX3_VSTEM_CENTER_Y"          // (asynFloat64, r/w)    Pattern centre Y (px), < 0 = detector centre
+#define ADTimePixVStemPublishPeriodString       "TPX3_VSTEM_PUBLISH_PERIOD"    // (asynFloat64, r/w)    Live partial-frame publish period (s), 0 = full frames only
+#define ADTimePixVStemStatusString              "TPX3_VSTEM_STATUS_RBV"        // (asynOctet,   r)      OK / configuration error
+#define ADTimePixVStemNumDetectorsString        "TPX3_VSTEM_NUM_DETECTORS_RBV" // (asynInt32,   r)      Virtual detectors in use
+#define ADTimePixVStemInnerString               "TPX3_VSTEM_INNER_RBV"         // (asynFloat64, r)      addr d: inner radius (px)
+#define ADTimePixVStemOuterString               "TPX3_VSTEM_OUTER_RBV"         // (asynFloat64, r)      addr d: outer radius (px)
+#define ADTimePixVStemFramesString              "TPX3_VSTEM_FRAMES_RBV"        // (asynInt32,   r)      Completed scan frames
+#define ADTimePixVStemLineString                "TPX3_VSTEM_LINE_RBV"          // (asynInt32,   r)      Scan line being filled, -1 idle
+#define ADTimePixVStemPlacedString              "TPX3_VSTEM_PLACED_RBV"        // (asynInt64,   r)      Hits assigned to a scan position
+#define ADTimePixVStemNoTriggerString           "TPX3_VSTEM_NO_TRIGGER_RBV"    // (asynInt64,   r)      Hits before the first trigger
+#define ADTimePixVStemOutsideString             "TPX3_VSTEM_OUTSIDE_RBV"       // (asynInt64,   r)      Hits in flyback / after frame end
+    // Sparse 4D-STEM event store (CSR by probe position; ROI sum on NDArray addr 31)
+#define ADTimePixStem4dEnableString             "TPX3_STEM4D_ENABLE"           // (asynInt32,   r/w)    1: write placed hits to <FILE>_NNNN.csr/.idx
+#define ADTimePixStem4dFileString               "TPX3_STEM4D_FILE"             // (asynOctet,   r/w)    File base path (without number / extension)
+#define ADTimePixStem4dFileNumberString         "TPX3_STEM4D_FILE_NUMBER"      // (asynInt32,   r/w)    Next file number (auto increment)
+#define ADTimePixStem4dFullFileNameString       "TPX3_STEM4D_FULL_FILE_NAME_RBV" // (asynOctet, r)      Base of the file pair being written / last written
+#define ADTimePixStem4dRoiXString               "TPX3_STEM4D_ROI_X"            // (asynInt32,   r/w)    Scan ROI start X (positions)
+#define ADTimePixStem4dRoiYString               "TPX3_STEM4D_ROI_Y"            // (asynInt32,   r/w)    Scan ROI start Y
+#define ADTimePixStem4dRoiWidthString           "TPX3_STEM4D_ROI_WIDTH"        // (asynInt32,   r/w)    Scan ROI width
+#define ADTimePixStem4dRoiHeightString          "TPX3_STEM4D_ROI_HEIGHT"       // (asynInt32,   r/w)    Scan ROI height
+#define ADTimePixStem4dFrameString              "TPX3_STEM4D_FRAME"            // (asynInt32,   r/w)    Scan frame to sum, -1 = all
+#define ADTimePixStem4dSumString                "TPX3_STEM4D_SUM"              // (asynInt32,   w)      1: publish the ROI diffraction sum
+#define ADTimePixStem4dStatusString             "TPX3_STEM4D_STATUS_RBV"       // (asynOctet,   r)      Writing / Closed / error
+#define ADTimePixStem4dEventsString             "TPX3_STEM4D_EVENTS_RBV"       // (asynInt64,   r)      Events stored
+#define ADTimePixStem4dRowsString               "TPX3_STEM4D_ROWS_RBV"         // (asynInt64,   r)      Probe positions closed
+#define ADTimePixStem4dUnorderedString          "TPX3_STEM4D_UNORDERED_RBV"    // (asynInt64,   r)      Hits behind the current position (dropped)
+#define ADTimePixStem4dMBytesString             "TPX3_STEM4D_MBYTES_RBV"       // (asynFloat64, r)      Store size (MiB)
+#define ADTimePixStem4dSumEventsString          "TPX3_STEM4D_SUM_EVENTS_RBV"   // (asynInt64,   r)      Events in the last ROI sum
+    // Per-pixel ToT -> energy calibration of Raw hits (gated images addr 32..35, spectra addr 36..37)
+#define ADTimePixEnergyEnableString             "TPX3_ENERGY_ENABLE"           // (asynInt32,   r/w)    1: convert decoded hits to keV
+#define ADTimePixEnergyCalibDirString           "TPX3_ENERGY_CALIB_DIR"        // (asynOctet,   r/w)    Directory with caliba/b/c/t.txt (BPC order)
+#define ADTimePixEnergyGatesString              "TPX3_ENERGY_GATES"            // (asynOctet,   r/w)    Energy windows "low:high,..." keV (max 4)
+#define ADTimePixEnergyRoisString               "TPX3_ENERGY_ROIS"             // (asynOctet,   r/w)    Spectrum ROIs "x,y,w,h;..." (max 8), empty = detector
+#define ADTimePixEnergyMinKevString             "TPX3_ENERGY_MIN_KEV"          // (asynFloat64, r/w)    Spectrum first bin edge (keV)
+#define ADTimePixEnergyMaxKevString             "TPX3_ENERGY_MAX_KEV"          // (asynFloat64, r/w)    Spectrum last bin edge (keV)
+#define ADTimePixEnergyBinsString               "TPX3_ENERGY_BINS"             // (asynInt32,   r/w)    Spectrum bins (max 100000)
+#define ADTimePixEnergyPublishPeriodString      "TPX3_ENERGY_PUBLISH_PERIOD"   // (asynFloat64, r/w)    Seconds between publishes
+#define ADTimePixEnergyResetString              "TPX3_ENERGY_RESET"            // (asynInt32,   w)      Write 1: zero images and spectra
+#define ADTimePixEnergyStatusString             "TPX3_ENERGY_STATUS_RBV"       // (asynOctet,   r)      OK / calibration or configuration error
+#define ADTimePixEnergyCalibratedString         "TPX3_ENERGY_CALIBRATED_RBV"   // (asynInt32,   r)      Image pixels with a calibration
+#define ADTimePixEnergyNumGatesString           "TPX3_ENERGY_NUM_GATES_RBV"    // (asynInt32,   r)      Energy windows in use
+#define ADTimePixEnergyGroupsString             "TPX3_ENERGY_GROUPS_RBV"       // (asynInt32,   r)      Number of spectra
+#define ADTimePixEnergySpectrumString           "TPX3_ENERGY_SPECTRUM"         // (asynInt64Array, r)   addr g: spectrum of ROI g
+#define ADTimePixEnergyKevString                "TPX3_ENERGY_KEV"              // (asynFloat64Array, r) Bin centres (keV)
+#define ADTimePixEnergyCountsString             "TPX3_ENERGY_COUNTS_RBV"       // (asynInt64,   r)      addr g: counts in spectrum g
+#define ADTimePixEnergyGateCountsString         "TPX3_ENERGY_GATE_COUNTS_RBV"  // (asynInt64,   r)      addr g: hits in energy window g
+#define ADTimePixEnergyHitsString               "TPX3_ENERGY_HITS_RBV"         // (asynInt64,   r)      Hits converted
+#define ADTimePixEnergyUncalibratedString       "TPX3_ENERGY_UNCALIBRATED_RBV" // (asynInt64,   r)      Hits on pixels without calibration
+#define ADTimePixEnergyOutOfRangeString         "TPX3_ENERGY_OUT_OF_RANGE_RBV" // (asynInt64,   r)      Hits outside [Min, Max) keV
+    // ToA time-walk correction of Raw hits (validation spectra on NDArray addr 38)
+#define ADTimePixTimeWalkEnableString           "TPX3_TIMEWALK_ENABLE"         // (asynInt32,   r/w)    1: correct ToA before sorting / consumers
+#define ADTimePixTimeWalkFileString             "TPX3_TIMEWALK_FILE"           // (asynOctet,   r/w)    ToT LUT file, "tot delay_ns" per line
+#define ADTimePixTimeWalkPixelFileString        "TPX3_TIMEWALK_PIXEL_FILE"     // (asynOctet,   r/w)    Optional per-pixel offsets (ns, BPC order)
+#define ADTimePixTimeWalkReloadString           "TPX3_TIMEWALK_RELOAD"         // (asynInt32,   w)      Write 1: load the files
+#define ADTimePixTimeWalkValidateString         "TPX3_TIMEWALK_VALIDATE"       // (asynInt32,   r/w)    1: uncorrected vs corrected ToF spectra
+#define ADTimePixTimeWalkStatusString           "TPX3_TIMEWALK_STATUS_RBV"     // (asynOctet,   r)      Loaded / error
+#define ADTimePixTimeWalkPointsString           "TPX3_TIMEWALK_POINTS_RBV"     // (asynInt32,   r)      ToT LUT points read
+#define ADTimePixTimeWalkPixelsString           "TPX3_TIMEWALK_PIXELS_RBV"     // (asynInt32,   r)      Pixel offsets read (0 = none)
+#define ADTimePixTimeWalkMaxNsString            "TPX3_TIMEWALK_MAX_NS_RBV"     // (asynFloat64, r)      Largest ToT delay (ns)
+#define ADTimePixTimeWalkCorrectedString        "TPX3_TIMEWALK_CORRECTED_RBV"  // (asynInt64,   r)      Hits corrected
+#define ADTimePixTimeWalkMeanNsString           "TPX3_TIMEWALK_MEAN_NS_RBV"    // (asynFloat64, r)      Mean correction (ns)
+#define ADTimePixTimeWalkHistRawString          "TPX3_TIMEWALK_HIST_RAW"       // (asynInt64Array, r)   Uncorrected ToF spectrum
+#define ADTimePixTimeWalkHistCorrString         "TPX3_TIMEWALK_HIST_CORR"      // (asynInt64Array, r)   Corrected ToF spectrum
+#define ADTimePixTimeWalkTimeMsString           "TPX3_TIMEWALK_TIME_MS"        // (asynFloat64Array, r) Bin centres (ms)
+    // Raw hit filter stage (ROI, ToT window, BPC mask) ahead of the sorter and consumers
+#define ADTimePixRawFilterEnableString          "TPX3_RAW_FILTER_ENABLE"       // (asynInt32,   r/w)    1: drop rejected hits after decode
+#define ADTimePixRawFilterRoisString            "TPX3_RAW_FILTER_ROIS"         // (asynOctet,   r/w)    "x,y,w,h;..." image pixels; empty = whole detector
+#define ADTimePixRawFilterTotMinString          "TPX3_RAW_FILTER_TOT_MIN"      // (asynInt32,   r/w)    Lowest ToT kept (25 ns units)
+#define ADTimePixRawFilterTotMaxString          "TPX3_RAW_FILTER_TOT_MAX"      // (asynInt32,   r/w)    Highest ToT kept; 0 = no limit
+#define ADTimePixRawFilterMaskString            "TPX3_RAW_FILTER_MASK"         // (asynInt32,   r/w)    1: drop hits on BPC-masked pixels
+#define ADTimePixRawFilterResetString           "TPX3_RAW_FILTER_RESET"        // (asynInt32,   w)      Write 1: zero counters
+#define ADTimePixRawFilterStatusString          "TPX3_RAW_FILTER_STATUS_RBV"   // (asynOctet,   r)      OK / configuration error
+#define ADTimePixRawFilterMaskedPixelsString    "TPX3_RAW_FILTER_MASKED_PIXELS_RBV" // (asynInt32, r)   Image pixels masked by the BPC file
+#define ADTimePixRawFilterHitsString            "TPX3_RAW_FILTER_HITS_RBV"     // (asynInt64,   r)      Hits seen by the filter
+#define ADTimePixRawFilterPassedString          "TPX3_RAW_FILTER_PASSED_RBV"   // (asynInt64,   r)      Hits passed on
+#define ADTimePixRawFilterOutsideRoiString      "TPX3_RAW_FILTER_OUTSIDE_ROI_RBV" // (asynInt64, r)     Rejected: outside every ROI
+#define ADTimePixRawFilterTotRejectedString     "TPX3_RAW_FILTER_TOT_REJECTED_RBV" // (asynInt64, r)    Rejected: ToT outside window
+#define ADTimePixRawFilterMaskedString          "TPX3_RAW_FILTER_MASKED_RBV"   // (asynInt64,   r)      Rejected: masked pixel
+    // Replay of a recorded .tpx3 file through the Raw consumers (mmap + <file>.tidx time index)
+#define ADTimePixReplayFileString               "TPX3_REPLAY_FILE"             // (asynOctet,   r/w)    Full path of the .tpx3 file
+#define ADTimePixReplayStartMsString            "TPX3_REPLAY_START_MS"         // (asynFloat64, r/w)    Start, ms after the first time in the file
+#define ADTimePixReplayStopMsString             "TPX3_REPLAY_STOP_MS"          // (asynFloat64, r/w)    Stop (ms); 0 = end of file
+#define ADTimePixReplayThreadsString            "TPX3_REPLAY_THREADS"          // (asynInt32,   r/w)    Decode threads, 1..64
+#define ADTimePixReplayRunString                "TPX3_REPLAY_RUN"              // (asynInt32,   r/w)    1: start replay, 0: abort
+#define ADTimePixReplayStatusString             "TPX3_REPLAY_STATUS_RBV"       // (asynOctet,   r)      Idle / progress / error message
+#define ADTimePixReplayProgressString           "TPX3_REPLAY_PROGRESS_RBV"     // (asynFloat64, r)      Blocks of the range done (%)
+#define ADTimePixReplayDurationMsString         "TPX3_REPLAY_DURATION_MS_RBV"  // (asynFloat64, r)      Time span of the file (ms)
+#define ADTimePixReplayBlocksString             "TPX3_REPLAY_BLOCKS_RBV"       // (asynInt32,   r)      Index blocks in the file
+#define ADTimePixReplayHitsString               "TPX3_REPLAY_HITS_RBV"         // (asynInt64,   r)      Hits decoded in the range
+#define ADTimePixReplayTdcsString               "TPX3_REPLAY_TDCS_RBV"         // (asynInt64,   r)      TDC events decoded in the range
+#define ADTimePixReplayRateString               "TPX3_REPLAY_RATE_RBV"         // (asynFloat64, r)      File MB/s replayed
+    // Compressed archive of the decoded Raw TCP stream(s) (<Path>/<Prefix>_<time>_ch<c>_<seq>.tpx3z)
+#define ADTimePixRawArchiveEnableString         "TPX3_RAW_ARCHIVE_ENABLE"      // (asynInt32,   r/w)    1: archive Raw bytes while decoding
+#define ADTimePixRawArchivePathString           "TPX3_RAW_ARCHIVE_PATH"        // (asynOctet,   r/w)    Archive directory
+#define ADTimePixRawArchivePrefixString         "TPX3_RAW_ARCHIVE_PREFIX"      // (asynOctet,   r/w)    File name prefix
+#define ADTimePixRawArchiveLevelString          "TPX3_RAW_ARCHIVE_LEVEL"       // (asynInt32,   r/w)    zlib level 0..9 (0 = store)
+#define ADTimePixRawArchiveThreadsString        "TPX3_RAW_ARCHIVE_THREADS"     // (asynInt32,   r/w)    Compression threads per channel, 1..16
+#define ADTimePixRawArchiveRotateMBString       "TPX3_RAW_ARCHIVE_ROTATE_MB"   // (asynFloat64, r/w)    New file after this size (MB); 0 = never
+#define ADTimePixRawArchiveRotateSecString      "TPX3_RAW_ARCHIVE_ROTATE_SEC"  // (asynFloat64, r/w)    New file after this time (s); 0 = never
+#define ADTimePixRawArchiveDirectString         "TPX3_RAW_ARCHIVE_DIRECT"      // (asynInt32,   r/w)    1: O_DIRECT writes where supported
+#define ADTimePixRawArchiveStatusString         "TPX3_RAW_ARCHIVE_STATUS_RBV"  // (asynOctet,   r)      Off / Archiving / error
+#define ADTimePixRawArchiveFileString           "TPX3_RAW_ARCHIVE_FILE_RBV"    // (asynOctet,   r)      Current Raw[0] archive file
+#define ADTimePixRawArchiveFilesString          "TPX3_RAW_ARCHIVE_FILES_RBV"   // (asynInt32,   r)      Files written this acquisition
+#define ADTimePixRawArchiveInMBString           "TPX3_RAW_ARCHIVE_IN_MB_RBV"   // (asynFloat64, r)      Raw stream MB archived
+#define ADTimePixRawArchiveOutMBString          "TPX3_RAW_ARCHIVE_OUT_MB_RBV"  // (asynFloat64, r)      MB written to disk
+#define ADTimePixRawArchiveRatioString          "TPX3_RAW_ARCHIVE_RATIO_RBV"   // (asynFloat64, r)      Compression ratio (in / out)
+#define ADTimePixRawArchiveRateString           "TPX3_RAW_ARCHIVE_RATE_RBV"    // (asynFloat64, r)      Raw MB/s archived
+#define ADTimePixRawArchiveStallsString         "TPX3_RAW_ARCHIVE_STALLS_RBV"  // (asynInt64,   r)      Reader waits on compression / disk
+#define ADTimePixRawArchiveDroppedMBString      "TPX3_RAW_ARCHIVE_DROPPED_MB_RBV" // (asynFloat64, r)   Raw MB lost after a file error
+    // List-mode NDArrays of decoded Raw hits (NDFloat64 {4, N}: x, y, ToA ns, ToT on addr 39)
+#define ADTimePixHitListEnableString            "TPX3_HITLIST_ENABLE"          // (asynInt32,   r/w)    1: publish hit batches
+#define ADTimePixHitListEventsString            "TPX3_HITLIST_EVENTS"          // (asynInt32,   r/w)    Hits per batch (max 4194304)
+#define ADTimePixHitListDurationMsString        "TPX3_HITLIST_DURATION_MS"     // (asynFloat64, r/w)    Close a batch after this span of ToA (ms); 0 = count only
+#define ADTimePixHitListBatchesString           "TPX3_HITLIST_BATCHES_RBV"     // (asynInt32,   r)      Batches published
+#define ADTimePixHitListHitsString              "TPX3_HITLIST_HITS_RBV"        // (asynInt64,   r)      Hits published
+#define ADTimePixHitListUnmappedString          "TPX3_HITLIST_UNMAPPED_RBV"    // (asynInt64,   r)      Hits skipped: no image position
+#define ADTimePixHitListDroppedString           "TPX3_HITLIST_DROPPED_RBV"     // (asynInt64,   r)      Hits lost: NDArray pool exhausted
+    // Per-chip hit rates and super-pixel occupancy map from the Raw stream (NDFloat32 map on addr 40)
+#define ADTimePixOccEnableString                "TPX3_OCC_ENABLE"              // (asynInt32,   r/w)    1: count hits per chip and super-pixel
+#define ADTimePixOccCellSizeString              "TPX3_OCC_CELL_SIZE"           // (asynInt32,   r/w)    Super-pixel side (px), power of two 1..256; applied at start
+#define ADTimePixOccRateHzString                "TPX3_OCC_RATE_HZ"             // (asynFloat64, r/w)    Map / rate updates per second (0.1..10)
+#define ADTimePixOccChipRateHighString          "TPX3_OCC_CHIP_RATE_HIGH"      // (asynFloat64, r/w)    Chip alarm threshold (hits/s); 0 = off
+#define ADTimePixOccCellRateHighString          "TPX3_OCC_CELL_RATE_HIGH"      // (asynFloat64, r/w)    Super-pixel alarm threshold (hits/s per pixel); 0 = off
+#define ADTimePixOccChipRateString              "TPX3_OCC_CHIP_RATE"           // (asynFloat64Array, r) Hit rate per chip (hits/s)
+#define ADTimePixOccAlarmString                 "TPX3_OCC_ALARM_RBV"           // (asynInt32,   r)      1: a chip or super-pixel is over its threshold
+#define ADTimePixOccChipAlarmString             "TPX3_OCC_CHIP_ALARM_RBV"      // (asynInt32,   r)      Chips over TPX3_OCC_CHIP_RATE_HIGH, bit per chip (0..30)
+#define ADTimePixOccHotCellsString              "TPX3_OCC_HOT_CELLS_RBV"       // (asynInt32,   r)      Super-pixels over TPX3_OCC_CELL_RATE_HIGH
+#define ADTimePixOccMaxChipString               "TPX3_OCC_MAX_CHIP_RBV"        // (asynInt32,   r)      Busiest chip
+#define ADTimePixOccMaxChipRateString           "TPX3_OCC_MAX_CHIP_RATE_RBV"   // (asynFloat64, r)      Its hit rate (hits/s)
+#define ADTimePixOccMaxCellRateString           "TPX3_OCC_MAX_CELL_RATE_RBV"   // (asynFloat64, r)      Highest super-pixel rate (hits/s per pixel)
+#define ADTimePixOccUpdatesString               "TPX3_OCC_UPDATES_RBV"         // (asynInt32,   r)      Maps published since start
+    // Adaptive batching of decoded hits between the Raw merge and the consumers
+#define ADTimePixRawBatchAdaptString            "TPX3_RAW_BATCH_ADAPT"         // (asynInt32,   r/w)    1: size batches for the latency target, 0: pass decoded batches on
+#define ADTimePixRawBatchLatencyMsString        "TPX3_RAW_BATCH_LATENCY_MS"    // (asynFloat64, r/w)    Longest a hit waits for its batch (ms)
+#define ADTimePixRawBatchMaxHitsString          "TPX3_RAW_BATCH_MAX_HITS"      // (asynInt32,   r/w)    Largest batch (hits)
+#define ADTimePixRawBatchTargetString           "TPX3_RAW_BATCH_TARGET_RBV"    // (asynInt32,   r)      Current target size (hits)
+#define ADTimePixRawBatchHitRateString          "TPX3_RAW_BATCH_HIT_RATE_RBV"  // (asynFloat64, r)      Smoothed hit rate behind the target (hits/s)
+#define ADTimePixRawBatchRateString             "TPX3_RAW_BATCH_RATE_RBV"      // (asynFloat64, r)      Batches dispatched per second
+#define ADTimePixRawBatchMeanHitsString         "TPX3_RAW_BATCH_MEAN_HITS_RBV" // (asynFloat64, r)      Mean hits per batch, last second
+#define ADTimePixRawBatchesString               "TPX3_RAW_BATCHES_RBV"         // (asynInt64,   r)      Batches dispatched
+#define ADTimePixRawBatchBySizeString           "TPX3_RAW_BATCH_BY_SIZE_RBV"   // (asynInt64,   r)      ... because the target size was reached
+#define ADTimePixRawBatchByAgeString            "TPX3_RAW_BATCH_BY_AGE_RBV"    // (asynInt64,   r)      ... because the latency target was reached
+#define ADTimePixRawBatchMaxWaitMsString        "TPX3_RAW_BATCH_MAX_WAIT_MS_RBV" // (asynFloat64, r)    Longest a batch was held (ms)
+#define ADTimePixRawBatchSizeHistString         "TPX3_RAW_BATCH_SIZE_HIST"     // (asynInt32Array, r)   Batches per log2 size bin [2^k, 2^(k+1)) hits
+    // Medipix3 threshold frame pairing for the preview band-pass
+#define ADTimePixPrvPairModeString              "TPX3_PRV_PAIR_MODE"           // (asynInt32,   r/w)    Preview threshold pairing key: 0 auto, 1 frameNumber, 2 frameNumber+thresholdID
+#define ADTimePixPrvPairThresholdsString        "TPX3_PRV_PAIR_THRESHOLDS"     // (asynInt32,   r/w)    Thresholds per set (0: highest thresholdID seen, at least 2)
+#define ADTimePixPrvPairTimeoutMsString         "TPX3_PRV_PAIR_TIMEOUT_MS"     // (asynFloat64, r/w)    Drop an incomplete set after (ms)
+#define ADTimePixPrvPairKeyString               "TPX3_PRV_PAIR_KEY_RBV"        // (asynInt32,   r)      Pairing key in use (0 while still learning)
+#define ADTimePixPrvPairSetSizeString           "TPX3_PRV_PAIR_SET_SIZE_RBV"   // (asynInt32,   r)      Thresholds per set in use
+#define ADTimePixPrvPairPendingString           "TPX3_PRV_PAIR_PENDING_RBV"    // (asynInt32,   r)      Frames waiting for their set
+#define ADTimePixPrvPairSetsString              "TPX3_PRV_PAIR_SETS_RBV"       // (asynInt64,   r)      Complete sets (band-pass images)
+#define ADTimePixPrvPairOrphansString           "TPX3_PRV_PAIR_ORPHANS_RBV"    // (asynInt64,   r)      Frames dropped without a complete set
+#define ADTimePixPrvPairDuplicatesString        "TPX3_PRV_PAIR_DUPLICATES_RBV" // (asynInt64,   r)      Threshold frames repeated within a set
+    // Spectral stack (thresholds + energy bands) from paired Medipix3 frames
+#define ADTimePixSpecEnableString               "TPX3_SPEC_ENABLE"             // (asynInt32,   r/w)    1: sum complete threshold sets into a spectral stack
+#define ADTimePixSpecFramesString               "TPX3_SPEC_FRAMES"             // (asynInt32,   r/w)    Threshold sets summed per published stack
+#define ADTimePixSpecBandsString                "TPX3_SPEC_BANDS"              // (asynInt32,   r/w)    1: append band planes Tk - Tk+1 after the thresholds
+#define ADTimePixSpecResetString                "TPX3_SPEC_RESET"              // (asynInt32,   w)      Write 1: restart the sums
+#define ADTimePixSpecPlanesString               "TPX3_SPEC_PLANES_RBV"         // (asynInt32,   r)      Planes per stack (thresholds + bands)
+#define ADTimePixSpecFramesRbvString            "TPX3_SPEC_FRAMES_RBV"         // (asynInt32,   r)      Sets in the current sum
+#define ADTimePixSpecStacksString               "TPX3_SPEC_STACKS_RBV"         // (asynInt32,   r)      Stacks published since acquisition start
+    // Bit-packed working mask, named mask stack and mask algebra
+#define ADTimePixMaskNameString                 "TPX3_MASK_NAME"               // (asynOctet,   r/w)    Named mask for store / recall / delete and binary ops
+#define ADTimePixMaskOpString                   "TPX3_MASK_OP"                 // (asynInt32,   r/w)    0 union, 1 intersect, 2 subtract, 3 invert, 4 dilate, 5 erode, 6 from BPC
+#define ADTimePixMaskOpSizeString               "TPX3_MASK_OP_SIZE"            // (asynInt32,   r/w)    Dilate / erode steps (3x3)
+#define ADTimePixMaskOpApplyString              "TPX3_MASK_OP_APPLY"           // (asynInt32,   w)      Write 1: apply TPX3_MASK_OP to the working mask
+#define ADTimePixMaskStoreString                "TPX3_MASK_STORE"              // (asynInt32,   w)      Write 1: store the working mask as TPX3_MASK_NAME
+#define ADTimePixMaskRecallString               "TPX3_MASK_RECALL"             // (asynInt32,   w)      Write 1: working mask = TPX3_MASK_NAME
+#define ADTimePixMaskDeleteString               "TPX3_MASK_DELETE"             // (asynInt32,   w)      Write 1: drop TPX3_MASK_NAME from the stack
+#define ADTimePixMaskCountString                "TPX3_MASK_COUNT_RBV"          // (asynInt32,   r)      Pixels set in the working mask
+#define ADTimePixMaskStackString                "TPX3_MASK_STACK_RBV"          // (asynInt32,   r)      Named masks stored
+#define ADTimePixMaskNamesString                "TPX3_MASK_NAMES_RBV"          // (asynOctet,   r)      Stored mask names, comma separated
+#define ADTimePixMaskStatusString               "TPX3_MASK_STATUS_RBV"         // (asynOctet,   r)      Result of the last mask command
+    // Masking of outgoing PrvImg / Img frames with the BPC mask
+#define ADTimePixMaskOutputString               "TPX3_MASK_OUTPUT"             // (asynInt32,   r/w)    PrvImg / Img masked pixels: 0 off, 1 zero, 2 flag (type max)
+#define ADTimePixMaskOutputPixelsString         "TPX3_MASK_OUTPUT_PIXELS_RBV"  // (asynInt32,   r)      Pixels masked in the last frame
+    // Atomic mask commits with an undo / redo journal
+#define ADTimePixMaskUndoString                 "TPX3_MASK_UNDO"               // (asynInt32,   w)      Write 1: restore the mask file before the last commit and upload it
+#define ADTimePixMaskRedoString                 "TPX3_MASK_REDO"               // (asynInt32,   w)      Write 1: re-apply the last undone commit and upload it
+#define ADTimePixMaskUndoDepthString            "TPX3_MASK_UNDO_RBV"           // (asynInt32,   r)      Commits that can be undone
+#define ADTimePixMaskRedoDepthString            "TPX3_MASK_REDO_RBV"           // (asynInt32,   r)      Commits that can be redone
+#define ADTimePixMaskCommitPelsString           "TPX3_MASK_COMMIT_PELS_RBV"    // (asynInt32,   r)      BPC bytes changed by the last commit / undo / redo
+#define ADTimePixMaskCommitStatusString         "TPX3_MASK_COMMIT_STATUS_RBV"  // (asynOctet,   r)      Result of the last commit / undo / redo
     // Server, Preview, ImageChannels[1]
 #define ADTimePixPrvImg1BaseString            "TPX3_PRV_IMG1BASE"          // (asynOctet,         w)      Preview ImageChannels Preview files Base
 #define ADTimePixPrvImg1FilePatString         "TPX3_PRV_IMG1PAT"            // (asynOctet,        w)      Preview ImageChannels FilePattern 
@@ -421,11 +725,14 @@ class ADTimePix : public ADDriver{
         virtual asynStatus readInt64Array(asynUser *pasynUser, epicsInt64 *value, size_t nElements, size_t *nIn);
         // Note: readFloat64Array not needed - using doCallbacksFloat64Array() to push data directly (like histogram IOC)
 
-        asynStatus maskReset(epicsInt32 *buf, int OnOff);
-        asynStatus maskRectangle(epicsInt32 *buf, int nX,int nXsize, int nY, int nYsize, int OnOff);
-        asynStatus maskCircle(epicsInt32 *buf, int nX,int nY, int nRadius, int OnOff);
-        asynStatus readBPCfile(char **buf, int *bufSize);
+        asynStatus maskReset(int OnOff);
+        asynStatus maskRectangle(int nX,int nXsize, int nY, int nYsize, int OnOff);
+        asynStatus maskCircle(int nX,int nY, int nRadius, int OnOff);
         asynStatus writeBPCfile(char **buf, int *bufSize);
+        asynStatus uploadBPCAs(const std::string& dir, const std::string& name);
+        asynStatus commitBPC(const std::string& dir, const std::string& name,
+                             const std::vector<char>& bytes, const std::vector<char>& fallbackBase);
+        void maskUndoRedo(bool undo);
         asynStatus mask2DtoBPC(int *buf, char *bufBPC);
 
         void timePixCallback();
@@ -773,6 +1080,269 @@ class ADTimePix : public ADDriver{
         int ADTimePixMaskedPelsJsonPath;
         int ADTimePixMaskedPelsCount;
         int ADTimePixMaskedPelsExportStatus;
+        int ADTimePixGateMode;
+        int ADTimePixGateWindows;
+        int ADTimePixGateCount;
+        int ADTimePixGateStatus;
+        int ADTimePixGateFrames;
+        int ADTimePixGateReset;
+        int ADTimePixGatePublishFrames;
+        int ADTimePixGateTofUnitNs;
+        int ADTimePixGatePublishPeriod;
+        int ADTimePixGateStartMs;
+        int ADTimePixGateStopMs;
+        int ADTimePixGateTotalCounts;
+        int ADTimePixRawDecode;
+        int ADTimePixRawConnected;
+        int ADTimePixRawDecodeStatus;
+        int ADTimePixRawHitRate;
+        int ADTimePixRawTdcRate;
+        int ADTimePixRawPacketRate;
+        int ADTimePixRawDataRate;
+        int ADTimePixRawHits;
+        int ADTimePixRawTdcs;
+        int ADTimePixRawFramingErrors;
+        int ADTimePixRawSort;
+        int ADTimePixRawSortLatencyMs;
+        int ADTimePixRawSortLateHits;
+        int ADTimePixRawSortLateTdcs;
+        int ADTimePixRawSortRollovers;
+        int ADTimePixRawSortDisorderMs;
+        int ADTimePixRawSortBuffered;
+        int ADTimePixRaw1Decode;
+        int ADTimePixRawChannels;
+        int ADTimePixRawChConnected;
+        int ADTimePixRawChHitRate;
+        int ADTimePixRawChDataRate;
+        int ADTimePixRawChHits;
+        int ADTimePixRawChBacklog;
+        int ADTimePixRawChBacklogHits;
+        int ADTimePixRawChStalls;
+        int ADTimePixRawChMergeLagMs;
+        int ADTimePixEvtImgEnable;
+        int ADTimePixEvtImgMode;
+        int ADTimePixEvtImgDurationMs;
+        int ADTimePixEvtImgEvents;
+        int ADTimePixEvtImgTdcEdge;
+        int ADTimePixEvtImgMaxRate;
+        int ADTimePixEvtImgFrames;
+        int ADTimePixEvtImgFrameEvents;
+        int ADTimePixEvtImgDropped;
+        int ADTimePixEvtImgSkipped;
+        int ADTimePixClusterEnable;
+        int ADTimePixClusterRadius;
+        int ADTimePixClusterDtNs;
+        int ADTimePixClusterSpanNs;
+        int ADTimePixClusterMinSize;
+        int ADTimePixClusterThreads;
+        int ADTimePixClusterSubpixel;
+        int ADTimePixClusterPublishPeriod;
+        int ADTimePixClusterReset;
+        int ADTimePixClusterRate;
+        int ADTimePixClusterCount;
+        int ADTimePixClusterMeanSize;
+        int ADTimePixClusterLate;
+        int ADTimePixClusterBuffered;
+        int ADTimePixRawHstEnable;
+        int ADTimePixRawHstBinning;
+        int ADTimePixRawHstMinMs;
+        int ADTimePixRawHstMaxMs;
+        int ADTimePixRawHstBins;
+        int ADTimePixRawHstGrouping;
+        int ADTimePixRawHstRois;
+        int ADTimePixRawHstTotMin;
+        int ADTimePixRawHstTotMax;
+        int ADTimePixRawHstTdc;
+        int ADTimePixRawHstEdge;
+        int ADTimePixRawHstThreads;
+        int ADTimePixRawHstPublishPeriod;
+        int ADTimePixRawHstReset;
+        int ADTimePixRawHstStatus;
+        int ADTimePixRawHstGroups;
+        int ADTimePixRawHstData;
+        int ADTimePixRawHstTimeMs;
+        int ADTimePixRawHstCounts;
+        int ADTimePixRawHstHits;
+        int ADTimePixRawHstNoReference;
+        int ADTimePixRawHstTotRejected;
+        int ADTimePixRawHstOutOfRange;
+        int ADTimePixRawHstNoRoi;
+        int ADTimePixRawHstReferences;
+        int ADTimePixVStemEnable;
+        int ADTimePixVStemTrigger;
+        int ADTimePixVStemTdcEdge;
+        int ADTimePixVStemDetectors;
+        int ADTimePixVStemCenterX;
+        int ADTimePixVStemCenterY;
+        int ADTimePixVStemPublishPeriod;
+        int ADTimePixVStemStatus;
+        int ADTimePixVStemNumDetectors;
+        int ADTimePixVStemInner;
+        int ADTimePixVStemOuter;
+        int ADTimePixVStemFrames;
+        int ADTimePixVStemLine;
+        int ADTimePixVStemPlaced;
+        int ADTimePixVStemNoTrigger;
+        int ADTimePixVStemOutside;
+        int ADTimePixStem4dEnable;
+        int ADTimePixStem4dFile;
+        int ADTimePixStem4dFileNumber;
+        int ADTimePixStem4dFullFileName;
+        int ADTimePixStem4dRoiX;
+        int ADTimePixStem4dRoiY;
+        int ADTimePixStem4dRoiWidth;
+        int ADTimePixStem4dRoiHeight;
+        int ADTimePixStem4dFrame;
+        int ADTimePixStem4dSum;
+        int ADTimePixStem4dStatus;
+        int ADTimePixStem4dEvents;
+        int ADTimePixStem4dRows;
+        int ADTimePixStem4dUnordered;
+        int ADTimePixStem4dMBytes;
+        int ADTimePixStem4dSumEvents;
+        int ADTimePixEnergyEnable;
+        int ADTimePixEnergyCalibDir;
+        int ADTimePixEnergyGates;
+        int ADTimePixEnergyRois;
+        int ADTimePixEnergyMinKev;
+        int ADTimePixEnergyMaxKev;
+        int ADTimePixEnergyBins;
+        int ADTimePixEnergyPublishPeriod;
+        int ADTimePixEnergyReset;
+        int ADTimePixEnergyStatus;
+        int ADTimePixEnergyCalibrated;
+        int ADTimePixEnergyNumGates;
+        int ADTimePixEnergyGroups;
+        int ADTimePixEnergySpectrum;
+        int ADTimePixEnergyKev;
+        int ADTimePixEnergyCounts;
+        int ADTimePixEnergyGateCounts;
+        int ADTimePixEnergyHits;
+        int ADTimePixEnergyUncalibrated;
+        int ADTimePixEnergyOutOfRange;
+        int ADTimePixTimeWalkEnable;
+        int ADTimePixTimeWalkFile;
+        int ADTimePixTimeWalkPixelFile;
+        int ADTimePixTimeWalkReload;
+        int ADTimePixTimeWalkValidate;
+        int ADTimePixTimeWalkStatus;
+        int ADTimePixTimeWalkPoints;
+        int ADTimePixTimeWalkPixels;
+        int ADTimePixTimeWalkMaxNs;
+        int ADTimePixTimeWalkCorrected;
+        int ADTimePixTimeWalkMeanNs;
+        int ADTimePixTimeWalkHistRaw;
+        int ADTimePixTimeWalkHistCorr;
+        int ADTimePixTimeWalkTimeMs;
+        int ADTimePixRawFilterEnable;
+        int ADTimePixRawFilterRois;
+        int ADTimePixRawFilterTotMin;
+        int ADTimePixRawFilterTotMax;
+        int ADTimePixRawFilterMask;
+        int ADTimePixRawFilterReset;
+        int ADTimePixRawFilterStatus;
+        int ADTimePixRawFilterMaskedPixels;
+        int ADTimePixRawFilterHits;
+        int ADTimePixRawFilterPassed;
+        int ADTimePixRawFilterOutsideRoi;
+        int ADTimePixRawFilterTotRejected;
+        int ADTimePixRawFilterMasked;
+        int ADTimePixReplayFile;
+        int ADTimePixReplayStartMs;
+        int ADTimePixReplayStopMs;
+        int ADTimePixReplayThreads;
+        int ADTimePixReplayRun;
+        int ADTimePixReplayStatus;
+        int ADTimePixReplayProgress;
+        int ADTimePixReplayDurationMs;
+        int ADTimePixReplayBlocks;
+        int ADTimePixReplayHits;
+        int ADTimePixReplayTdcs;
+        int ADTimePixReplayRate;
+        int ADTimePixRawArchiveEnable;
+        int ADTimePixRawArchivePath;
+        int ADTimePixRawArchivePrefix;
+        int ADTimePixRawArchiveLevel;
+        int ADTimePixRawArchiveThreads;
+        int ADTimePixRawArchiveRotateMB;
+        int ADTimePixRawArchiveRotateSec;
+        int ADTimePixRawArchiveDirect;
+        int ADTimePixRawArchiveStatus;
+        int ADTimePixRawArchiveFile;
+        int ADTimePixRawArchiveFiles;
+        int ADTimePixRawArchiveInMB;
+        int ADTimePixRawArchiveOutMB;
+        int ADTimePixRawArchiveRatio;
+        int ADTimePixRawArchiveRate;
+        int ADTimePixRawArchiveStalls;
+        int ADTimePixRawArchiveDroppedMB;
+        int ADTimePixHitListEnable;
+        int ADTimePixHitListEvents;
+        int ADTimePixHitListDurationMs;
+        int ADTimePixHitListBatches;
+        int ADTimePixHitListHits;
+        int ADTimePixHitListUnmapped;
+        int ADTimePixHitListDropped;
+        int ADTimePixOccEnable;
+        int ADTimePixOccCellSize;
+        int ADTimePixOccRateHz;
+        int ADTimePixOccChipRateHigh;
+        int ADTimePixOccCellRateHigh;
+        int ADTimePixOccChipRate;
+        int ADTimePixOccAlarm;
+        int ADTimePixOccChipAlarm;
+        int ADTimePixOccHotCells;
+        int ADTimePixOccMaxChip;
+        int ADTimePixOccMaxChipRate;
+        int ADTimePixOccMaxCellRate;
+        int ADTimePixOccUpdates;
+        int ADTimePixRawBatchAdapt;
+        int ADTimePixRawBatchLatencyMs;
+        int ADTimePixRawBatchMaxHits;
+        int ADTimePixRawBatchTarget;
+        int ADTimePixRawBatchHitRate;
+        int ADTimePixRawBatchRate;
+        int ADTimePixRawBatchMeanHits;
+        int ADTimePixRawBatches;
+        int ADTimePixRawBatchBySize;
+        int ADTimePixRawBatchByAge;
+        int ADTimePixRawBatchMaxWaitMs;
+        int ADTimePixRawBatchSizeHist;
+        int ADTimePixPrvPairMode;
+        int ADTimePixPrvPairThresholds;
+        int ADTimePixPrvPairTimeoutMs;
+        int ADTimePixPrvPairKey;
+        int ADTimePixPrvPairSetSize;
+        int ADTimePixPrvPairPending;
+        int ADTimePixPrvPairSets;
+        int ADTimePixPrvPairOrphans;
+        int ADTimePixPrvPairDuplicates;
+        int ADTimePixSpecEnable;
+        int ADTimePixSpecFrames;
+        int ADTimePixSpecBands;
+        int ADTimePixSpecReset;
+        int ADTimePixSpecPlanes;
+        int ADTimePixSpecFramesRbv;
+        int ADTimePixSpecStacks;
+        int ADTimePixMaskName;
+        int ADTimePixMaskOp;
+        int ADTimePixMaskOpSize;
+        int ADTimePixMaskOpApply;
+        int ADTimePixMaskStore;
+        int ADTimePixMaskRecall;
+        int ADTimePixMaskDelete;
+        int ADTimePixMaskCount;
+        int ADTimePixMaskStack;
+        int ADTimePixMaskNames;
+        int ADTimePixMaskStatus;
+        int ADTimePixMaskOutput;
+        int ADTimePixMaskOutputPixels;
+        int ADTimePixMaskUndo;
+        int ADTimePixMaskRedo;
+        int ADTimePixMaskUndoDepth;
+        int ADTimePixMaskRedoDepth;
+        int ADTimePixMaskCommitPels;
+        int ADTimePixMaskCommitStatus;
 
         asynStatus getMeasurementConfig();
         asynStatus sendMeasurementConfig();
@@ -792,6 +1362,44 @@ class ADTimePix : public ADDriver{
         void pushProcessedImgToPlugins();
         /** Push PrvHst spectra (running sum, sum-of-N, frame, ToF axis) as NDArrays to addresses 4–7 for file plugins. */
         void pushProcessedHstToPlugins();
+        /** ToF gates (tof_gate.cpp): parse TPX3_GATE_WINDOWS, accumulate Img tof frames or raw hits, publish addrs 14..17. */
+        asynStatus updateTofGates();
+        void resetTofGateAccumulation();
+        void processTofGateFrame(const void* pixels, bool is_uint32, int width, int height);
+        void processTofGateBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void resetTofGateReferences();
+        void publishTofGateImages();
+        /** Raw (.tpx3) TCP decode (raw_stream.cpp). */
+        void startRawDecode();
+        void stopRawDecode();
+        /** Event-mode images (event_image.cpp): fed from processRawBatch, published on addrs 18..20. */
+        void invalidateEventImageBuilder();
+        void flushEventImage();
+        /** Clustering (cluster.cpp): fed from processRawBatch, published on addrs 21..22. */
+        void invalidateClusterEngine();
+        void resetClusterImage();
+        void flushClusters();
+        /** Raw ToF histograms (tof_histogram.cpp): fed from processRawBatch, addrs 23..24. */
+        void invalidateRawHistogram();
+        void resetRawHistogram();
+        void flushRawHistogram();
+        /** Virtual STEM (stem_image.cpp): fed from processRawBatch, addrs 25..30. */
+        void invalidateStemImager();
+        void flushStem();
+        /** Energy calibration (energy_calib.cpp): fed from processRawBatch, addrs 32..37. */
+        void invalidateEnergyImager(bool reloadCalibration = false);
+        void resetEnergy();
+        void flushEnergy();
+        /** Time-walk correction (timewalk.cpp): applied before the sorter, validation spectra on addr 38. */
+        asynStatus loadTimeWalk();
+        void invalidateTimeWalkValidation();
+        void flushTimeWalk();
+        /** Raw hit filter (raw_filter.cpp): compacts decoded batches before the sorter. */
+        void invalidateRawFilter();
+        void resetRawFilter();
+        /** .tpx3 file replay (raw_replay.cpp): decodes a recorded file into processRawBatch. */
+        asynStatus startReplay();
+        void stopReplay();
 
         /** Serval Layout.DetectorOrientation names (index 0..7). Used by readEnum and GET /detector. */
         static int detOrientationCount();
@@ -804,7 +1412,7 @@ class ADTimePix : public ADDriver{
         static const char* triggerModeServalName(int index);
         static int triggerModeIndexFromServal(const std::string& name, int def = 0);
 
-        #define ADTIMEPIX_LAST_PARAM ADTimePixMaskedPelsExportStatus  // Last parameter in the list
+        #define ADTIMEPIX_LAST_PARAM ADTimePixMaskCommitStatus  // Last parameter in the list
 
     private:
 
@@ -815,6 +1423,26 @@ class ADTimePix : public ADDriver{
         /** |SERVAL PixelConfig − on-disk BPC| per detector index (same layout as BPC waveform). */
         epicsMutexId pixelConfigDiffMutex_;
         std::vector<epicsInt32> pixelConfigDiff_;
+        /** Image <-> BPC index tables for the current layout (coord_map.cpp). */
+        std::mutex coordMapMutex_;
+        std::shared_ptr<const CoordMap> coordMap_;
+        /** BPC file contents shared by waveforms, PixelConfig and the Raw filter (bpc_cache.cpp). */
+        BpcCache bpcCache_;
+        /** Mask edited by the TPX3_MASK_* PVs, and the named masks (mask_engine.cpp). Port thread. */
+        BitMask maskWork_;
+        MaskStack maskStack_;
+        /** Changed bytes of recent mask commits for TPX3_MASK_UNDO / REDO (bpc_journal.cpp). */
+        BpcJournal maskJournal_;
+        /** Mask file and bytes of the last successful commit upload; any other upload clears it. */
+        std::string maskUploadedPath_;
+        uint64_t maskUploadedHash_ = 0;
+        /** Hash of the last masked-pels JSON written, to skip unchanged rewrites (masked_pels_json.cpp). */
+        MaskedPelsExport maskedPelsExport_;
+        /** BPC image mask applied to outgoing frames, re-checked once per second (mask_engine.cpp). */
+        std::mutex outputMaskMutex_;
+        std::shared_ptr<const BitMask> outputMask_;
+        double outputMaskCheckedAt_ = 0.0;
+        bool outputMaskSizeWarned_ = false;
 
         std::string serverURL;
         /** Extra asyn flags passed at construction (e.g. ASYN_DESTRUCTIBLE). When set, asyn performs teardown on IOC exit. */
@@ -848,10 +1476,13 @@ class ADTimePix : public ADDriver{
         std::deque<double> prvImgRateSamples_;
         double prvImgLastRateUpdateTime_;
         bool prvImgFirstFrameReceived_;
-        bool prvImgT1ReadyForDiff_;
-        bool prvImgT0OrphanForDiff_;
-        int prvImgLastSeenFrameForPair_;
-        int prvImgLastDiffT0Frame_;
+        /** Threshold pairing queue releases the NDArray references it drops. */
+        struct NDArrayRelease {
+            void operator()(NDArray* p) const { if (p) p->release(); }
+        };
+        typedef ThresholdPairQueue<NDArray*, NDArrayRelease> PreviewPairQueue;
+        /** T0/T1 (.. Tn) frames of one trigger, completed into a band-pass set. */
+        PreviewPairQueue prvImgPairs_;
         static constexpr size_t PRVIMG_MAX_RATE_SAMPLES = 10;
         /** Remaining jsonimage headers to log this acquire (from TPX3_PRVIMG_LOG_HEADERS). */
         int prvImgJsonHeadersRemaining_;
@@ -871,8 +1502,40 @@ class ADTimePix : public ADDriver{
         static constexpr int NDARRAY_ADDR_IMG_THRESHOLD0 = 1;
         /** NDArray address for full-rate Image[] threshold 1 (MPX3 BothCounters demux). */
         static constexpr int NDARRAY_ADDR_IMG_THRESHOLD1 = 13;
+        /** First NDArray address for ToF-gated images (gate g -> addr 14+g, TOF_GATE_MAX gates). */
+        static constexpr int NDARRAY_ADDR_GATE0 = 14;
+        /** NDArray addresses for event-mode images (Raw decode): hit count, summed ToT, first ToA. */
+        static constexpr int NDARRAY_ADDR_EVTIMG_COUNT = NDARRAY_ADDR_GATE0 + TOF_GATE_MAX;
+        static constexpr int NDARRAY_ADDR_EVTIMG_TOT = NDARRAY_ADDR_EVTIMG_COUNT + 1;
+        static constexpr int NDARRAY_ADDR_EVTIMG_TOA = NDARRAY_ADDR_EVTIMG_COUNT + 2;
+        /** NDArray address for the centroided cluster list (NDFloat64 {5, N}). */
+        static constexpr int NDARRAY_ADDR_CLUSTER_LIST = NDARRAY_ADDR_EVTIMG_TOA + 1;
+        /** NDArray address for the super-resolution centroid image. */
+        static constexpr int NDARRAY_ADDR_CLUSTER_IMAGE = NDARRAY_ADDR_CLUSTER_LIST + 1;
+        /** NDArray addresses for Raw ToF histograms (NDInt64 {bins, groups}) and their ms axis. */
+        static constexpr int NDARRAY_ADDR_RAWHST = NDARRAY_ADDR_CLUSTER_IMAGE + 1;
+        static constexpr int NDARRAY_ADDR_RAWHST_AXIS = NDARRAY_ADDR_RAWHST + 1;
+        /** NDArray addresses for virtual STEM detector images (addr + d) and centre of mass X/Y. */
+        static constexpr int NDARRAY_ADDR_VSTEM0 = NDARRAY_ADDR_RAWHST_AXIS + 1;
+        static constexpr int NDARRAY_ADDR_VSTEM_COM_X = NDARRAY_ADDR_VSTEM0 + STEM_MAX_DETECTORS;
+        static constexpr int NDARRAY_ADDR_VSTEM_COM_Y = NDARRAY_ADDR_VSTEM_COM_X + 1;
+        /** NDArray address for the 4D-STEM ROI diffraction sum (NDUInt32 {det_w, det_h}). */
+        static constexpr int NDARRAY_ADDR_STEM4D_SUM = NDARRAY_ADDR_VSTEM_COM_Y + 1;
+        /** NDArray addresses for energy-gated images (addr + g), energy spectra {bins, groups} and their keV axis. */
+        static constexpr int NDARRAY_ADDR_ENERGY_GATE0 = NDARRAY_ADDR_STEM4D_SUM + 1;
+        static constexpr int NDARRAY_ADDR_ENERGY_SPECTRUM = NDARRAY_ADDR_ENERGY_GATE0 + ENERGY_MAX_GATES;
+        static constexpr int NDARRAY_ADDR_ENERGY_AXIS = NDARRAY_ADDR_ENERGY_SPECTRUM + 1;
+        /** NDArray address for time-walk validation spectra (NDInt64 {bins, 2}: uncorrected, corrected). */
+        static constexpr int NDARRAY_ADDR_TIMEWALK_HIST = NDARRAY_ADDR_ENERGY_AXIS + 1;
+        /** NDArray address for list-mode hit batches (NDFloat64 {4, N}). */
+        static constexpr int NDARRAY_ADDR_HIT_LIST = NDARRAY_ADDR_TIMEWALK_HIST + 1;
+        /** NDArray address for the super-pixel occupancy map (NDFloat32, mean hits/s per pixel). */
+        static constexpr int NDARRAY_ADDR_OCCUPANCY = NDARRAY_ADDR_HIT_LIST + 1;
+        /** NDArray addresses for the spectral stacks (NDInt32 {x, y, thresholds + bands}) of PrvImg / PrvImg1. */
+        static constexpr int NDARRAY_ADDR_PRVIMG_SPECTRAL = NDARRAY_ADDR_OCCUPANCY + 1;
+        static constexpr int NDARRAY_ADDR_PRVIMG1_SPECTRAL = NDARRAY_ADDR_PRVIMG_SPECTRAL + 1;
         /** Number of NDArray callback addresses (0..NDARRAY_MAX_ADDR-1). */
-        static constexpr int NDARRAY_MAX_ADDR = 14;
+        static constexpr int NDARRAY_MAX_ADDR = NDARRAY_ADDR_PRVIMG1_SPECTRAL + 1;
 
         // TCP streaming for PrvImg1 channel (integrated preview)
         std::unique_ptr<NetworkClient> prvImg1NetworkClient_;
@@ -891,10 +1554,15 @@ class ADTimePix : public ADDriver{
         std::deque<double> prvImg1RateSamples_;
         double prvImg1LastRateUpdateTime_;
         bool prvImg1FirstFrameReceived_;
-        bool prvImg1T1ReadyForDiff_;
-        bool prvImg1T0OrphanForDiff_;
-        int prvImg1LastSeenFrameForPair_;
-        int prvImg1LastDiffT0Frame_;
+        PreviewPairQueue prvImg1Pairs_;
+        /** Spectral stack being summed from complete threshold sets (spectral_stack.cpp). */
+        struct SpectralAccum {
+            SpectralStack stack;
+            NDArray* pArray = nullptr;     // sum in progress, published when full
+            int stacks = 0;                // published since acquisition start
+        };
+        SpectralAccum prvImgSpectral_;
+        SpectralAccum prvImg1Spectral_;
         int prvImg1JsonHeadersRemaining_;
 
         // TCP streaming for Img channel
@@ -993,6 +1661,139 @@ class ADTimePix : public ADDriver{
         std::vector<uint64_t> prvHstSumArray64WorkBuffer_; // Working buffer for sum calculation
         std::vector<epicsFloat64> prvHstTimeMsBuffer_;    // For histogram time axis (milliseconds)
 
+        // ToF-gated imaging
+        epicsMutexId gateMutex_;
+        std::vector<TofGate> tofGates_;
+        std::unique_ptr<GatedImageStack> gatedImages_;
+        TofReferenceEdges gateRefs_;          // mode 2 reference edges (worker thread)
+        uint64_t gateNoReference_;
+        uint64_t gateUnmapped_;
+        double gateLastPublishTime_;
+        bool gateRangeWarned_;                // 16-bit frame range warning given for these gates
+
+        // Raw (.tpx3) TCP decode: one reader thread per Raw[c] channel, merged on rawWorker
+        static constexpr int RAW_MAX_CHANNELS = 2;
+        struct RawChannelBatch {
+            Tpx3HitBatch hits;
+            Tpx3TdcBatch tdcs;
+            bool restart = false;               // first batch after a (re)connect
+        };
+        struct RawChannel {
+            ADTimePix* owner = nullptr;
+            int index = 0;
+            std::string host;
+            int port = 0;
+            std::unique_ptr<NetworkClient> networkClient;
+            epicsThreadId threadId = nullptr;
+            epicsEventId spaceEvent = nullptr;  // merge thread took a batch
+            std::unique_ptr<RawArchiver> archiver;  // set while decoding with TPX3_RAW_ARCHIVE_ENABLE=1
+            ChipOccupancy occupancy;            // reader's hit counts (a replay uses channel 0)
+            // Guarded by rawMutex_
+            bool active = false;                // reader thread running
+            bool connected = false;
+            std::deque<RawChannelBatch> queue;  // decoded, waiting for the merge
+            std::vector<RawChannelBatch> spare; // merged batches returned for reuse
+            size_t queuedHits = 0;
+            uint64_t stalls = 0;
+            Tpx3DecoderStats stats;             // reader's decoder counters
+        };
+        RawChannel rawChannels_[RAW_MAX_CHANNELS];
+        int rawNumChannels_;
+        epicsEventId rawDataEvent_;             // a reader queued a batch or exited
+        bool rawRunning_;
+        epicsThreadId rawWorkerThreadId_ = nullptr;
+        epicsMutexId rawMutex_;
+        std::vector<uint32_t> rawPixelLut_;   // BPC index -> image index (bpc2ImgIndex)
+        bool replayRunning_;                  // guarded by rawMutex_; excludes the live decode
+        bool rawTeardown_;                    // guarded by rawMutex_; set by ~ADTimePix: stop without publishing
+        uint64_t rawArchiveLastIn_;           // worker thread: archive rate
+        uint64_t rawBatchLastBatches_;        // worker thread: batch rate
+        uint64_t rawBatchLastHits_;
+        epicsThreadId replayThreadId_ = nullptr;
+        int rawImageWidth_;
+        int rawImageHeight_;
+
+        // Event-mode images (Raw decode worker thread)
+        epicsMutexId evtImgMutex_;
+        std::unique_ptr<EventImageBuilder> evtImgBuilder_;
+        bool evtImgConfigDirty_;
+        double evtImgLastPublishTime_;
+        uint64_t evtImgSkipped_;
+
+        // Space-time clustering (Raw decode worker thread)
+        epicsMutexId clusterMutex_;
+        std::unique_ptr<ClusterEngine> clusterEngine_;
+        Tpx3ClusterBatch clusterOut_;              // clusters since the last publish
+        std::vector<uint32_t> clusterSuperRes_;    // (w * subpixel) x (h * subpixel)
+        int clusterSubpixel_;
+        bool clusterConfigDirty_;
+        double clusterLastPublishTime_;
+        uint64_t clusterLastPublishCount_;
+
+        // Raw ToF histograms (Raw decode worker thread)
+        epicsMutexId rawHstMutex_;
+        std::unique_ptr<TofHistogrammer> rawHst_;
+        std::vector<epicsInt64> rawHstPublishBuffer_;
+        bool rawHstConfigDirty_;
+        double rawHstLastPublishTime_;
+
+        // Virtual STEM (Raw decode worker thread)
+        epicsMutexId stemMutex_;
+        std::unique_ptr<StemImager> stemImager_;
+        bool stemConfigDirty_;
+        double stemLastPublishTime_;
+        /** 4D-STEM store (stem4d.cpp); guarded by stemMutex_. */
+        std::unique_ptr<Stem4dStore> stem4dStore_;
+        std::vector<uint64_t> stem4dRows_;
+        bool stem4dOpenFailed_;               // no reopen until rebuildStemImager() or Stem4dEnable
+
+        // Energy calibration (Raw decode worker thread)
+        epicsMutexId energyMutex_;
+        std::unique_ptr<EnergyCalibration> energyCalib_;
+        std::unique_ptr<EnergyImager> energyImager_;
+        std::vector<float> energyKev_;
+        std::vector<epicsInt64> energyPublishBuffer_;
+        bool energyConfigDirty_;
+        double energyLastPublishTime_;
+
+        // Time-walk correction (Raw decode worker thread; tables loaded on the port thread)
+        epicsMutexId timeWalkMutex_;
+        std::unique_ptr<TimeWalkCorrector> timeWalk_;
+        std::unique_ptr<TofHistogrammer> timeWalkHistRaw_;
+        std::unique_ptr<TofHistogrammer> timeWalkHistCorr_;
+        Tpx3HitBatch timeWalkRawBatch_;
+        std::vector<epicsInt64> timeWalkPublishBuffer_;
+        bool timeWalkConfigDirty_;
+        double timeWalkLastPublishTime_;
+
+        // Raw hit filter (Raw decode worker thread)
+        epicsMutexId rawFilterMutex_;
+        std::unique_ptr<RawHitFilter> rawFilter_;
+        bool rawFilterConfigDirty_;
+
+        // List-mode hit batches (Raw decode worker thread)
+        epicsMutexId hitListMutex_;
+        bool hitListOpen_;
+        std::vector<epicsFloat64> hitListRows_; // open batch, HIT_LIST_COLUMNS values per hit
+        size_t hitListCapacity_;
+        size_t hitListCount_;
+        uint32_t hitListWidth_;
+        uint64_t hitListStart_;                // ToA of the first hit (ticks)
+        uint64_t hitListEnd_;
+        uint64_t hitListBatches_;
+        uint64_t hitListHits_;
+        uint64_t hitListUnmapped_;
+        uint64_t hitListDropped_;
+
+        // Per-chip occupancy (Raw readers count, worker / replay thread publishes)
+        OccupancyCounts occupancyCounts_;
+        std::vector<double> occupancyChipRate_;
+        size_t occupancyCellsX_;
+        size_t occupancyCellsY_;
+        int occupancyCellSize_;
+        double occupancyLastPublish_;
+        uint64_t occupancyUpdates_;
+
         // Connection poll (CONNECT/DISCONNECT)
         epicsThreadId connectionPollThreadId_ = nullptr;
         epicsEventId connectionPollEvent_;
@@ -1094,9 +1895,14 @@ class ADTimePix : public ADDriver{
         bool parseTcpPath(const std::string& filePath, std::string& host, int& port);
         bool processPreviewJsonimageLine(const PreviewJsonimageStream& stream,
                                          char* line_buffer, char* newline_pos, size_t total_read);
-        void emitPreviewThresholdDiff(int addrT0, int addrT1, int addrDiff,
-                                      int frame_number, const char* logTag,
-                                      int& lastDiffT0Frame);
+        void pairPreviewThresholdFrame(const PreviewJsonimageStream& stream, NDArray* pImage,
+                                       int threshold_id, int frame_number);
+        void publishPreviewPairStats(const PreviewPairQueue& pairQueue);
+        void resetSpectralStacks();
+        void addSpectralSet(SpectralAccum& acc, int addr, const std::vector<NDArray*>& set,
+                            int key, const char* logTag);
+        void emitPreviewThresholdDiff(NDArray* pT0, NDArray* pT1, int addrDiff,
+                                      int key, const char* logTag);
         void releasePreviewBandArrays();
         void runPreviewTcpWorker(epicsMutexId mutex, bool& running, bool& connected,
                                  std::string& host, int& port,
@@ -1105,6 +1911,7 @@ class ADTimePix : public ADDriver{
                                  void (ADTimePix::*connectFn)(),
                                  void (ADTimePix::*disconnectFn)(),
                                  bool (ADTimePix::*processLineFn)(char*, char*, size_t),
+                                 PreviewPairQueue& pairQueue,
                                  const char* logTag);
         
         // TCP streaming methods for Img channel
@@ -1129,6 +1936,60 @@ class ADTimePix : public ADDriver{
         static void prvHstWorkerThreadC(void *pPvt);
         void prvHstConnect();
         void prvHstDisconnect();
+
+        // Raw TCP decode worker
+        void rawWorkerThread();
+        static void rawWorkerThreadC(void *pPvt);
+        void rawReaderThread(RawChannel& channel);
+        static void rawReaderThreadC(void *pPvt);
+        void rawConnect(RawChannel& channel);
+        void rawDisconnect(RawChannel& channel);
+        void buildRawPixelLut();
+        void resetRawDecodeStats();
+        void updateRawSortStats(const Tpx3HitSorter& sorter);
+        void processRawBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void prepareRawConsumers();
+        void flushRawConsumers();
+        void startRawArchive(int numChannels);
+        void stopRawArchive();
+        void updateRawArchiveStats(double dt);
+        static void replayThreadC(void* pPvt);
+        void replayThread();
+        void rebuildEventImageBuilder();
+        void processEventImageBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void publishEventImageFrame(const EventImageFrame& frame);
+        void rebuildClusterEngine();
+        void processClusterBatch(const Tpx3HitBatch& hits);
+        void publishClusters(double now);
+        void rebuildRawHistogram();
+        void processRawHistogramBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void publishRawHistogram();
+        void rebuildStemImager();
+        void processStemBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void publishStemFrame(const StemFrame& frame);
+        void openStem4d(const StemConfig& cfg);
+        void closeStem4d();
+        void updateStem4dStats();
+        asynStatus sumStem4d();
+        void rebuildEnergyImager();
+        void processEnergyBatch(const Tpx3HitBatch& hits);
+        void publishEnergy();
+        void applyTimeWalk(Tpx3HitBatch& hits);
+        void rebuildTimeWalkValidation();
+        void processTimeWalkBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+        void publishTimeWalk();
+        void rebuildRawFilter();
+        void filterRawHits(Tpx3HitBatch& hits);
+        void beginHitList(uint64_t startTicks);
+        void publishHitList();
+        void processHitListBatch(const Tpx3HitBatch& hits);
+        void resetHitList();
+        void flushHitList();
+        void resetOccupancy();
+        void countOccupancy(int channel, const Tpx3HitBatch& hits);
+        void updateOccupancy(bool final);
+        void configureRawBatcher(RawBatcher& batcher);
+        void updateRawBatchStats(const RawBatcher& batcher, double dt);
         
         // Helper functions for fileWriter optimization
         asynStatus getParameterSafely(int param, int& value);
@@ -1159,7 +2020,15 @@ class ADTimePix : public ADDriver{
         asynStatus findChip(int x, int y, int *xChip, int *yChip, int *width);
         int pelIndex(int x, int y);
         int bpc2ImgIndex(int bpcIndexIn, int chipPelWidthIn);
-        /** Write <BPCFilePath><stem>_masked_pels.json from in-memory BPC (bit0 = masked). Called from refreshPixelConfig when BPC is loaded. */
+        std::shared_ptr<const CoordMap> coordMap();
+        std::shared_ptr<const BpcSnapshot> bpcFile();
+        std::shared_ptr<const BitMask> bpcImageMask();
+        BitMask& workMask();
+        void exportWorkMask(epicsInt32* value, size_t nElements, bool keepOtherBits);
+        void maskCommand(int function);
+        std::shared_ptr<const BitMask> outputMask(size_t width, size_t height);
+        void byteSwapFrame(const char* payload, void* pData, size_t width, size_t height, bool is_uint32);
+        /** Write <BPCFilePath><stem>_masked_pels.json from in-memory BPC (bit0 = masked), unless unchanged. Called from refreshPixelConfig when BPC is loaded. */
         void exportMaskedPelsJsonFromBpcBuffer(const char* bpcBuf, int bpcSize);
 };
 
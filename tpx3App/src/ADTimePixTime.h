@@ -0,0 +1,25 @@
+/*
+ * ADTimePix3 - wall-clock helper
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef ADTIMEPIX3_TIME_H
+#define ADTIMEPIX3_TIME_H
+
+#include <epicsTime.h>
+
+/**
+ * Current EPICS time in seconds past the EPICS epoch, for publish periods,
+ * rate windows and timeouts (NDArray timestamps keep using epicsTS).
+ */
+inline double nowSeconds() {
+    epicsTimeStamp ts;
+    epicsTimeGetCurrent(&ts);
+    return ts.secPastEpoch + ts.nsec / 1e9;
+}
+
+#endif // ADTIMEPIX3_TIME_H
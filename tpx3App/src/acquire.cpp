@@ -464,17 +464,12 @@ asynStatus ADTimePix::acquireStart(){
         getIntegerParam(ADTimePixPrvImgLogHeaders, &logHeaders);
         prvImgJsonHeadersRemaining_ = (logHeaders > 0) ? logHeaders : 0;
         prvImgFirstFrameReceived_ = false;
-        prvImgT1ReadyForDiff_ = false;
-        prvImgT0OrphanForDiff_ = false;
-        prvImgLastSeenFrameForPair_ = -1;
-        prvImgLastDiffT0Frame_ = -1;
+        prvImgPairs_.reset();
         prvImg1JsonHeadersRemaining_ = (logHeaders > 0) ? logHeaders : 0;
         prvImg1FirstFrameReceived_ = false;
-        prvImg1T1ReadyForDiff_ = false;
-        prvImg1T0OrphanForDiff_ = false;
-        prvImg1LastSeenFrameForPair_ = -1;
-        prvImg1LastDiffT0Frame_ = -1;
+        prvImg1Pairs_.reset();
         releasePreviewBandArrays();
+        resetSpectralStacks();
     }
 
     // Path PV may have changed (port rotation or Phoebus WriteData); refresh before connect.
@@ -562,6 +557,9 @@ asynStatus ADTimePix::acquireStart(){
         }
     }
     
+    // Decode the Raw[0] tcp:// stream in the IOC when TPX3_RAW_DECODE=1
+    startRawDecode();
+
     // Start PrvHst TCP streaming if enabled, path is TCP, format is jsonhisto, and accumulation is enabled
     // If accumulation is disabled, don't connect to TCP port so other clients can connect
     // Skip PrvHst setup if mutex is not initialized (defensive check to prevent segfault)
@@ -927,10 +925,7 @@ asynStatus ADTimePix::acquireStop(){
         epicsMutexLock(prvImgMutex_);
         prvImgRunning_ = false;
         prvImgFirstFrameReceived_ = false;
-        prvImgT1ReadyForDiff_ = false;
-        prvImgT0OrphanForDiff_ = false;
-        prvImgLastSeenFrameForPair_ = -1;
-        prvImgLastDiffT0Frame_ = -1;
+        prvImgPairs_.reset();
         prvImgAcquisitionRate_ = 0.0;
         prvImgRateSamples_.clear();
         setDoubleParam(ADTimePixPrvImgAcqRate, 0.0);
@@ -941,10 +936,7 @@ asynStatus ADTimePix::acquireStop(){
         epicsMutexLock(prvImg1Mutex_);
         prvImg1Running_ = false;
         prvImg1FirstFrameReceived_ = false;
-        prvImg1T1ReadyForDiff_ = false;
-        prvImg1T0OrphanForDiff_ = false;
-        prvImg1LastSeenFrameForPair_ = -1;
-        prvImg1LastDiffT0Frame_ = -1;
+        prvImg1Pairs_.reset();
         prvImg1AcquisitionRate_ = 0.0;
         prvImg1RateSamples_.clear();
         epicsMutexUnlock(prvImg1Mutex_);
@@ -985,6 +977,13 @@ asynStatus ADTimePix::acquireStop(){
         epicsThreadMustJoin(imgWorkerThreadId_);
         imgWorkerThreadId_ = NULL;
     }
+    // Join the Raw decode readers / worker and flush their consumers
+    stopRawDecode();
+
+    // Flush gate images accumulated since the last TPX3_GATE_PUBLISH_FRAMES boundary
+    int gateMode = TOF_GATE_MODE_OFF;
+    getIntegerParam(ADTimePixGateMode, &gateMode);
+    if (gateMode != TOF_GATE_MODE_OFF) publishTofGateImages();
 
     if (prvHstWorkerThreadId_ != NULL && prvHstWorkerThreadId_ != epicsThreadGetIdSelf()) {
         epicsThreadId prvHstThreadId = prvHstWorkerThreadId_;
@@ -0,0 +1,143 @@
+/*
+ * ADTimePix3 - In-memory BPC file cache with change detection
+ *
+ * The BPC and MaskBPC waveforms, PixelConfig refresh, the masked-pels JSON and
+ * the Raw hit filter used to fopen/malloc/fread the BPC file and recount its
+ * masked pixels on every access. They now share one cached copy: each access
+ * costs a stat() of TPX3_BPC_FILE_PATH + TPX3_BPC_FILE_NAME, and the file is
+ * read again only when the name, size or modification time changed (or after
+ * the driver wrote a mask itself). TPX3_BPC_PEL_N is updated on those reloads
+ * only.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "bpc_cache.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <cstdio>
+#include <sys/stat.h>
+
+extern const char* driverName;
+
+namespace {
+
+/** Size and modification time of a regular file; false when missing or not a file. */
+bool statBpc(const std::string& path, int64_t* size, int64_t* mtimeNs) {
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+        return false;
+    }
+    *size = static_cast<int64_t>(st.st_size);
+#if defined(__linux__)
+    *mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+    *mtimeNs = static_cast<int64_t>(st.st_mtime) * 1000000000LL;
+#endif
+    return true;
+}
+
+}  // namespace
+
+std::shared_ptr<const BpcSnapshot> BpcCache::get(const std::string& path, bool* changed) {
+    if (changed) *changed = false;
+    int64_t size = 0, mtimeNs = 0;
+    const bool exists = statBpc(path, &size, &mtimeNs);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (valid_ && path == path_) {
+        if (!exists && !snapshot_) return nullptr;
+        if (exists && snapshot_ && snapshot_->size == size && snapshot_->mtime_ns == mtimeNs) {
+            return snapshot_;
+        }
+    }
+
+    const bool had = snapshot_ != nullptr;
+    path_ = path;
+    valid_ = true;
+    snapshot_.reset();
+    if (exists) {
+        auto snap = std::make_shared<BpcSnapshot>();
+        snap->path = path;
+        snap->size = size;
+        snap->mtime_ns = mtimeNs;
+        snap->bytes.resize(static_cast<size_t>(size));
+        FILE* f = fopen(path.c_str(), "rb");
+        size_t nRead = 0;
+        if (f) {
+            nRead = fread(snap->bytes.data(), 1, snap->bytes.size(), f);
+            fclose(f);
+        }
+        if (f && nRead == snap->bytes.size()) {
+            int masked = 0;
+            for (char b : snap->bytes) masked += b & 1;
+            snap->masked = masked;
+            snap->generation = ++generation_;
+            snapshot_ = snap;
+        } else {
+            // Being rewritten or unreadable: retry on the next get()
+            valid_ = false;
+        }
+    }
+    if (changed) *changed = snapshot_ != nullptr || had;
+    return snapshot_;
+}
+
+void BpcCache::invalidate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    valid_ = false;
+}
+
+std::shared_ptr<const BitMask> BpcCache::image_mask(
+    const std::shared_ptr<const BpcSnapshot>& bpc, const std::shared_ptr<const CoordMap>& map)
+{
+    if (!bpc || !map || !map->mapped()) return nullptr;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (imageMask_ && imageMaskGeneration_ == bpc->generation && imageMaskLayout_ == map->layout()) {
+        return imageMask_;
+    }
+    auto mask = std::make_shared<BitMask>();
+    mask->from_bpc(bpc->bytes.data(), bpc->bytes.size(), *map);
+    imageMask_ = mask;
+    imageMaskGeneration_ = bpc->generation;
+    imageMaskLayout_ = map->layout();
+    return imageMask_;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: TPX3_BPC_FILE_PATH/NAME -> cached BpcSnapshot
+// -----------------------------------------------------------------------
+
+/**
+ * Current BPC file, nullptr when it cannot be read. Safe from any thread;
+ * TPX3_BPC_PEL_N is refreshed when the file was (re)loaded or disappeared.
+ */
+std::shared_ptr<const BpcSnapshot> ADTimePix::bpcFile() {
+    std::string filePath, fileName;
+    getStringParam(ADTimePixBPCFilePath, filePath);
+    getStringParam(ADTimePixBPCFileName, fileName);
+    const std::string fullFileName = filePath + fileName;
+
+    bool changed = false;
+    std::shared_ptr<const BpcSnapshot> bpc = bpcCache_.get(fullFileName, &changed);
+    if (changed) {
+        setIntegerParam(ADTimePixBPCn, bpc ? bpc->masked : 0);
+        if (bpc) {
+            LOG_ARGS("ReadBPC: file=\"%s\" bytes read=%zu bytes with mask bit0 set=%d (used for BPCn)",
+                     fullFileName.c_str(), bpc->bytes.size(), bpc->masked);
+        } else {
+            WARN_ARGS("ReadBPC: cannot read \"%s\"", fullFileName.c_str());
+        }
+        callParamCallbacks();
+    }
+    return bpc;
+}
+
+/** Bit-packed image-coordinate mask of the current BPC file and layout. */
+std::shared_ptr<const BitMask> ADTimePix::bpcImageMask() {
+    return bpcCache_.image_mask(bpcFile(), coordMap());
+}
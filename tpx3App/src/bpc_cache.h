@@ -0,0 +1,70 @@
+/*
+ * ADTimePix3 - In-memory BPC file cache with change detection
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BPC_CACHE_H
+#define BPC_CACHE_H
+
+#include "mask_engine.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/** @brief One loaded BPC file (immutable; shared by all readers). */
+struct BpcSnapshot {
+    std::string path;
+    std::vector<char> bytes;           // file contents, one pixel config byte per pel
+    int masked = 0;                    // bytes with bit0 (mask) set -> TPX3_BPC_PEL_N
+    int64_t mtime_ns = 0;
+    int64_t size = 0;
+    uint64_t generation = 0;           // increases with every load
+
+    bool is_masked(int k) const {
+        return k >= 0 && static_cast<size_t>(k) < bytes.size() && (bytes[static_cast<size_t>(k)] & 1);
+    }
+};
+
+/**
+ * @brief BPC file contents kept in memory between waveform reads
+ *
+ * get() stats the file and returns the cached snapshot while path, size and
+ * modification time are unchanged; otherwise it reads the file once and
+ * publishes a new snapshot. Readers hold the shared_ptr for the length of a
+ * loop, so a reload never pulls bytes out from under them. image_mask()
+ * derives the bit-packed mask in image coordinates from a snapshot and a
+ * CoordMap and keeps it until either changes.
+ */
+class BpcCache {
+public:
+    /**
+     * Snapshot of path, nullptr when it is not a readable regular file.
+     * changed (optional) is set when this call loaded, or lost, the file.
+     */
+    std::shared_ptr<const BpcSnapshot> get(const std::string& path, bool* changed = nullptr);
+    /** Force the next get() to read the file (after writing it ourselves). */
+    void invalidate();
+
+    std::shared_ptr<const BitMask> image_mask(const std::shared_ptr<const BpcSnapshot>& bpc,
+                                              const std::shared_ptr<const CoordMap>& map);
+
+private:
+    std::mutex mutex_;
+    std::string path_;                 // path of the last get(), also when it failed
+    bool valid_ = false;
+    std::shared_ptr<const BpcSnapshot> snapshot_;
+    uint64_t generation_ = 0;
+
+    std::shared_ptr<const BitMask> imageMask_;
+    uint64_t imageMaskGeneration_ = 0;
+    CoordLayout imageMaskLayout_;
+};
+
+#endif // BPC_CACHE_H
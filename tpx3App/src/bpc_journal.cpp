@@ -0,0 +1,250 @@
+/*
+ * ADTimePix3 - Atomic BPC file commits with an undo / redo journal
+ *
+ * TPX3_MASK_WRITE used to fwrite the whole mask .bpc in place and push it to
+ * SERVAL, losing the previous mask. A mask commit now diffs the new bytes
+ * against the current mask file (or, before the first commit, the BPC file
+ * the mask was built from), skips the write and the upload when nothing
+ * changed, and otherwise writes a temp file, renames it over the mask file
+ * and records the changed bytes. TPX3_MASK_UNDO / TPX3_MASK_REDO patch the
+ * file back and forth from that journal and upload it again.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "bpc_journal.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern const char* driverName;
+
+BpcCommit BpcJournal::diff(const char* before, const char* after, size_t size) {
+    BpcCommit c;
+    c.size = size;
+    for (size_t k = 0; k < size; ++k) {
+        if (before[k] != after[k]) {
+            c.index.push_back(static_cast<uint32_t>(k));
+            c.before.push_back(before[k]);
+            c.after.push_back(after[k]);
+        }
+    }
+    return c;
+}
+
+bool BpcJournal::apply(std::vector<char>& bytes, const BpcCommit& commit, bool undo) {
+    if (bytes.size() != commit.size) return false;
+    const std::vector<char>& expect = undo ? commit.after : commit.before;
+    const std::vector<char>& target = undo ? commit.before : commit.after;
+    for (size_t i = 0; i < commit.index.size(); ++i) {
+        if (bytes[commit.index[i]] != expect[i]) return false;
+    }
+    for (size_t i = 0; i < commit.index.size(); ++i) bytes[commit.index[i]] = target[i];
+    return true;
+}
+
+void BpcJournal::record(BpcCommit commit) {
+    redo_.clear();
+    undo_.push_back(std::move(commit));
+    while (undo_.size() > MAX_COMMITS) undo_.pop_front();
+}
+
+void BpcJournal::undone() {
+    if (undo_.empty()) return;
+    redo_.push_back(std::move(undo_.back()));
+    undo_.pop_back();
+}
+
+void BpcJournal::redone() {
+    if (redo_.empty()) return;
+    undo_.push_back(std::move(redo_.back()));
+    redo_.pop_back();
+}
+
+void BpcJournal::clear() {
+    undo_.clear();
+    redo_.clear();
+}
+
+uint64_t bpcBytesHash(const char* data, size_t size) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t k = 0; k < size; ++k) {
+        h ^= static_cast<unsigned char>(data[k]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+bool readFileBytes(const std::string& path, std::vector<char>& out) {
+    out.clear();
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    bool ok = fseek(f, 0, SEEK_END) == 0;
+    const long size = ok ? ftell(f) : -1;
+    ok = ok && size >= 0 && fseek(f, 0, SEEK_SET) == 0;
+    if (ok) {
+        out.resize(static_cast<size_t>(size));
+        ok = fread(out.data(), 1, out.size(), f) == out.size();
+    }
+    fclose(f);
+    if (!ok) out.clear();
+    return ok;
+}
+
+bool writeFileAtomic(const std::string& path, const char* data, size_t size, std::string& err) {
+    const std::string tmp = path + ".tmp";
+    const int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        err = "open " + tmp + ": " + strerror(errno);
+        return false;
+    }
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            err = "write " + tmp + ": " + strerror(errno);
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    // close() even when fsync() failed, so the descriptor is never leaked
+    const bool synced = fsync(fd) == 0;
+    const int syncErrno = errno;
+    const bool closed = close(fd) == 0;
+    if (!synced || !closed) {
+        err = (synced ? "close " : "sync ") + tmp + ": " + strerror(synced ? errno : syncErrno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        err = "rename " + tmp + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: mask commits, undo / redo, journal PVs
+// -----------------------------------------------------------------------
+
+/**
+ * Write bytes as dir + name and upload it, unless the file already holds
+ * them and they are what the last successful upload sent (a file that is
+ * current but was never uploaded gets the upload only). The journal records
+ * the difference to the file's previous contents, or to fallbackBase (the BPC
+ * file the mask was built from) when the file is new or had another size.
+ * Port thread.
+ */
+asynStatus ADTimePix::commitBPC(const std::string& dir, const std::string& name,
+                                const std::vector<char>& bytes, const std::vector<char>& fallbackBase)
+{
+    const std::string fullFileName = dir + name;
+    std::vector<char> current;
+    const bool exists = readFileBytes(fullFileName, current);
+    const std::vector<char>& base = (exists && current.size() == bytes.size()) ? current : fallbackBase;
+    BpcCommit commit;
+    if (base.size() == bytes.size()) {
+        commit = BpcJournal::diff(base.data(), bytes.data(), bytes.size());
+    }
+    commit.dir = dir;
+    commit.name = name;
+    commit.size = bytes.size();
+
+    char msg[160];
+    const uint64_t hash = bpcBytesHash(bytes.data(), bytes.size());
+    const bool uploaded = maskUploadedPath_ == fullFileName && maskUploadedHash_ == hash;
+    if (exists && current == bytes && uploaded) {
+        epicsSnprintf(msg, sizeof(msg), "Unchanged: %s not rewritten or uploaded", name.c_str());
+        LOG_ARGS("Mask commit: \"%s\" unchanged, skipping write and upload", fullFileName.c_str());
+        setIntegerParam(ADTimePixMaskCommitPels, 0);
+        setStringParam(ADTimePixMaskCommitStatus, msg);
+        return asynSuccess;
+    }
+
+    // A file that is already current only needs the upload retried
+    std::string err;
+    if (!(exists && current == bytes) && !writeFileAtomic(fullFileName, bytes.data(), bytes.size(), err)) {
+        ERR_ARGS("Mask commit: %s", err.c_str());
+        setStringParam(ADTimePixMaskCommitStatus, err.c_str());
+        return asynError;
+    }
+    bpcCache_.invalidate();
+    const size_t changed = commit.index.size();
+    if (!commit.empty()) {
+        maskJournal_.record(std::move(commit));
+    }
+
+    // Write mask file to TimePix3 chip
+    const asynStatus status = uploadBPCAs(dir, name);
+    if (status == asynSuccess) {
+        maskUploadedPath_ = fullFileName;
+        maskUploadedHash_ = hash;
+    }
+    epicsSnprintf(msg, sizeof(msg), "%s: %zu pels changed%s", name.c_str(), changed,
+                  status == asynSuccess ? ", uploaded" : ", upload FAILED");
+    LOG_ARGS("Mask commit: \"%s\" %zu bytes changed, upload %s", fullFileName.c_str(), changed,
+             status == asynSuccess ? "OK" : "failed");
+    setIntegerParam(ADTimePixMaskCommitPels, static_cast<int>(changed));
+    setStringParam(ADTimePixMaskCommitStatus, msg);
+    setIntegerParam(ADTimePixMaskUndoDepth, static_cast<int>(maskJournal_.undo_depth()));
+    setIntegerParam(ADTimePixMaskRedoDepth, static_cast<int>(maskJournal_.redo_depth()));
+    return status;
+}
+
+/** TPX3_MASK_UNDO / TPX3_MASK_REDO: patch the committed mask file and upload it again. */
+void ADTimePix::maskUndoRedo(bool undo) {
+    const BpcCommit* commit = undo ? maskJournal_.next_undo() : maskJournal_.next_redo();
+    const char* what = undo ? "Undo" : "Redo";
+    char msg[160];
+    if (!commit) {
+        epicsSnprintf(msg, sizeof(msg), "%s: nothing to %s", what, undo ? "undo" : "redo");
+        setStringParam(ADTimePixMaskCommitStatus, msg);
+        return;
+    }
+
+    const std::string fullFileName = commit->dir + commit->name;
+    std::vector<char> bytes;
+    if (!readFileBytes(fullFileName, bytes) || !BpcJournal::apply(bytes, *commit, undo)) {
+        // The file no longer matches the journal: drop it rather than patch a foreign mask
+        WARN_ARGS("Mask %s: \"%s\" changed outside the journal, history cleared", what, fullFileName.c_str());
+        epicsSnprintf(msg, sizeof(msg), "%s: %s changed on disk, history cleared", what, commit->name.c_str());
+        maskJournal_.clear();
+    } else {
+        std::string err;
+        if (!writeFileAtomic(fullFileName, bytes.data(), bytes.size(), err)) {
+            ERR_ARGS("Mask %s: %s", what, err.c_str());
+            epicsSnprintf(msg, sizeof(msg), "%s: %s", what, err.c_str());
+        } else {
+            bpcCache_.invalidate();
+            invalidateRawFilter();
+            const size_t changed = commit->index.size();
+            const asynStatus status = uploadBPCAs(commit->dir, commit->name);
+            if (status == asynSuccess) {
+                maskUploadedPath_ = fullFileName;
+                maskUploadedHash_ = bpcBytesHash(bytes.data(), bytes.size());
+            }
+            if (undo) maskJournal_.undone();
+            else maskJournal_.redone();
+            epicsSnprintf(msg, sizeof(msg), "%s: %zu pels%s", what, changed,
+                          status == asynSuccess ? ", uploaded" : ", upload FAILED");
+            LOG_ARGS("Mask %s: \"%s\" %zu bytes, upload %s", what, fullFileName.c_str(), changed,
+                     status == asynSuccess ? "OK" : "failed");
+            setIntegerParam(ADTimePixMaskCommitPels, static_cast<int>(changed));
+        }
+    }
+    setStringParam(ADTimePixMaskCommitStatus, msg);
+    setIntegerParam(ADTimePixMaskUndoDepth, static_cast<int>(maskJournal_.undo_depth()));
+    setIntegerParam(ADTimePixMaskRedoDepth, static_cast<int>(maskJournal_.redo_depth()));
+}
@@ -0,0 +1,80 @@
+/*
+ * ADTimePix3 - Atomic BPC file commits with an undo / redo journal
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BPC_JOURNAL_H
+#define BPC_JOURNAL_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief One mask commit: the BPC bytes it changed, before and after. */
+struct BpcCommit {
+    std::string dir;                   // BPC_FILE_PATH at commit time
+    std::string name;                  // mask file name in dir
+    size_t size = 0;                   // file size the offsets refer to
+    std::vector<uint32_t> index;       // changed byte offsets, ascending
+    std::vector<char> before;
+    std::vector<char> after;
+
+    bool empty() const { return index.empty(); }
+};
+
+/**
+ * @brief Bounded undo / redo history of mask commits
+ *
+ * A commit stores only the bytes that differ (offset + old + new value, six
+ * bytes per changed pixel), so undoing a mask edit on an 8-chip BPC is a
+ * patch of a few hundred bytes instead of a copy of the 512 KiB file.
+ */
+class BpcJournal {
+public:
+    static constexpr size_t MAX_COMMITS = 64;
+
+    /** Bytes that differ between before and after (both size bytes). */
+    static BpcCommit diff(const char* before, const char* after, size_t size);
+    /**
+     * Patch bytes to the commit's before (undo) or after (redo) state. False,
+     * with bytes unchanged, when bytes is not in the state the commit expects
+     * (file rewritten outside the journal).
+     */
+    static bool apply(std::vector<char>& bytes, const BpcCommit& commit, bool undo);
+
+    /** Add a commit; drops the redo history and the oldest commit past MAX_COMMITS. */
+    void record(BpcCommit commit);
+    const BpcCommit* next_undo() const { return undo_.empty() ? nullptr : &undo_.back(); }
+    const BpcCommit* next_redo() const { return redo_.empty() ? nullptr : &redo_.back(); }
+    /** Move next_undo() to the redo history (after it was applied), and back. */
+    void undone();
+    void redone();
+    void clear();
+
+    size_t undo_depth() const { return undo_.size(); }
+    size_t redo_depth() const { return redo_.size(); }
+
+private:
+    std::deque<BpcCommit> undo_;
+    std::deque<BpcCommit> redo_;
+};
+
+/** FNV-1a hash of a mask file's bytes (identifies what was last uploaded). */
+uint64_t bpcBytesHash(const char* data, size_t size);
+
+/** Whole file into out; false when it cannot be read. */
+bool readFileBytes(const std::string& path, std::vector<char>& out);
+/**
+ * Write data to path through "<path>.tmp" + fsync + rename, so readers
+ * (SERVAL loading the file) see either the old or the new file, never a
+ * partial one. err is set on failure.
+ */
+bool writeFileAtomic(const std::string& path, const char* data, size_t size, std::string& err);
+
+#endif // BPC_JOURNAL_H
@@ -0,0 +1,272 @@
+/*
+ * ADTimePix3 - Per-chip hit rates and coarse occupancy map of the Raw stream
+ *
+ * With TPX3_OCC_ENABLE=1 each Raw reader (and a file replay) counts every
+ * decoded hit per chip and per TPX3_OCC_CELL_SIZE super-pixel before the hit
+ * filter, so saturating chips and hot regions show up even when their hits are
+ * later dropped. The Raw worker publishes, TPX3_OCC_RATE_HZ times a second, the
+ * per-chip hit rates as a waveform and the mean per-pixel rate of each
+ * super-pixel as an NDFloat32 image on NDArray address 40, and raises
+ * TPX3_OCC_ALARM_RBV when a chip exceeds TPX3_OCC_CHIP_RATE_HIGH or a
+ * super-pixel exceeds TPX3_OCC_CELL_RATE_HIGH. Unlike TPX3_PEL_RATE, which is
+ * one detector-wide number from /measurement, these come straight from the
+ * data. Cell size and layout are taken at acquisition start.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "chip_occupancy.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+
+#include <epicsTime.h>
+
+#include <algorithm>
+
+extern const char* driverName;
+
+namespace {
+
+constexpr int CHIP_PEL_WIDTH = 256;
+constexpr int CHIP_PEL_BITS = 8;
+constexpr uint32_t OCC_CELL_NONE = UINT32_MAX;
+/** Chips reported in TPX3_OCC_CHIP_ALARM_RBV (one bit each). */
+constexpr int OCC_ALARM_MASK_CHIPS = 31;
+
+}  // namespace
+
+void OccupancyCounts::clear() {
+    std::fill(chip_hits.begin(), chip_hits.end(), 0);
+    std::fill(cell_hits.begin(), cell_hits.end(), 0);
+    other_hits = 0;
+}
+
+int ChipOccupancy::cell_size_for(int cell_size) {
+    int size = 1;
+    while (size * 2 <= std::min(cell_size, CHIP_PEL_WIDTH)) size *= 2;
+    return size;
+}
+
+void ChipOccupancy::configure(const std::vector<uint32_t>& pixel_lut, int num_chips, size_t image_width,
+                              size_t image_height, int cell_size) {
+    const int size = cell_size_for(cell_size);
+    int shift = 0;
+    while ((1 << shift) < size) ++shift;
+    const int chipCellBits = CHIP_PEL_BITS - shift;
+    const size_t chipCells = size_t(1) << (2 * chipCellBits);
+    const size_t cellsX = image_width >> shift;
+    const size_t cellsY = image_height >> shift;
+    num_chips = std::max(num_chips, 0);
+
+    std::vector<uint32_t> lut(static_cast<size_t>(num_chips) * chipCells, OCC_CELL_NONE);
+    const size_t chipPels = static_cast<size_t>(CHIP_PEL_WIDTH) * CHIP_PEL_WIDTH;
+    if (cellsX > 0 && pixel_lut.size() >= static_cast<size_t>(num_chips) * chipPels) {
+        for (int chip = 0; chip < num_chips; ++chip) {
+            for (size_t cell = 0; cell < chipCells; ++cell) {
+                // Centre pel of the chip-local super-pixel; any pel of it lands in the same image cell
+                const size_t cy = cell >> chipCellBits;
+                const size_t cx = cell & ((size_t(1) << chipCellBits) - 1);
+                const size_t py = (cy << shift) + size / 2;
+                const size_t px = (cx << shift) + size / 2;
+                const uint32_t pixel = pixel_lut[chip * chipPels + (py << CHIP_PEL_BITS) + px];
+                if (pixel == TPX3_PIXEL_NONE) continue;
+                const size_t row = (pixel / image_width) >> shift;
+                const size_t col = (pixel % image_width) >> shift;
+                if (row < cellsY && col < cellsX) lut[chip * chipCells + cell] = static_cast<uint32_t>(row * cellsX + col);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_chips_ = num_chips;
+    cell_shift_ = shift;
+    chip_cell_bits_ = chipCellBits;
+    cell_lut_.swap(lut);
+    counts_.chip_hits.assign(static_cast<size_t>(num_chips), 0);
+    counts_.cell_hits.assign(cellsX * cellsY, 0);
+    counts_.other_hits = 0;
+}
+
+void ChipOccupancy::add(const Tpx3HitBatch& hits) {
+    const size_t n = hits.size();
+    if (n == 0) return;
+    const uint8_t* chip = hits.chip.data();
+    const uint8_t* x = hits.x.data();
+    const uint8_t* y = hits.y.data();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const int shift = cell_shift_;
+    const int bits = chip_cell_bits_;
+    const uint32_t* lut = cell_lut_.data();
+    uint64_t* chipHits = counts_.chip_hits.data();
+    uint64_t* cellHits = counts_.cell_hits.data();
+    for (size_t i = 0; i < n; ++i) {
+        const int c = chip[i];
+        if (c >= num_chips_) {
+            ++counts_.other_hits;
+            continue;
+        }
+        ++chipHits[c];
+        const uint32_t local = (static_cast<uint32_t>(c) << (2 * bits)) | ((y[i] >> shift) << bits) | (x[i] >> shift);
+        const uint32_t cell = lut[local];
+        if (cell != OCC_CELL_NONE) ++cellHits[cell];
+    }
+}
+
+void ChipOccupancy::drain(OccupancyCounts& totals) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (totals.chip_hits.size() < counts_.chip_hits.size()) totals.chip_hits.resize(counts_.chip_hits.size(), 0);
+    if (totals.cell_hits.size() < counts_.cell_hits.size()) totals.cell_hits.resize(counts_.cell_hits.size(), 0);
+    for (size_t c = 0; c < counts_.chip_hits.size(); ++c) totals.chip_hits[c] += counts_.chip_hits[c];
+    for (size_t k = 0; k < counts_.cell_hits.size(); ++k) totals.cell_hits[k] += counts_.cell_hits[k];
+    totals.other_hits += counts_.other_hits;
+    counts_.clear();
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: Raw readers -> ChipOccupancy -> rate waveform, map, alarms
+// -----------------------------------------------------------------------
+
+/** Size the counters for the detector layout (prepareRawConsumers, port thread). */
+void ADTimePix::resetOccupancy() {
+    int cellSize = 16, numChips = 0;
+    getIntegerParam(ADTimePixOccCellSize, &cellSize);
+    getIntegerParam(ADTimePixNumberOfChips, &numChips);
+    cellSize = ChipOccupancy::cell_size_for(cellSize);
+
+    std::vector<uint32_t> pixelLut;
+    epicsMutexLock(rawMutex_);
+    pixelLut = rawPixelLut_;
+    const size_t width = static_cast<size_t>(std::max(rawImageWidth_, 0));
+    const size_t height = static_cast<size_t>(std::max(rawImageHeight_, 0));
+    epicsMutexUnlock(rawMutex_);
+
+    numChips = std::min(std::max(numChips, 0), 255);
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        rawChannels_[c].occupancy.configure(pixelLut, numChips, width, height, cellSize);
+    }
+    occupancyCounts_.chip_hits.assign(static_cast<size_t>(numChips), 0);
+    occupancyCounts_.cell_hits.assign((width / cellSize) * (height / cellSize), 0);
+    occupancyCounts_.other_hits = 0;
+    occupancyCellSize_ = cellSize;
+    occupancyCellsX_ = width / cellSize;
+    occupancyCellsY_ = height / cellSize;
+    occupancyChipRate_.assign(static_cast<size_t>(numChips), 0.0);
+    occupancyLastPublish_ = nowSeconds();
+    occupancyUpdates_ = 0;
+
+    setIntegerParam(ADTimePixOccCellSize, cellSize);
+    setIntegerParam(ADTimePixOccAlarm, 0);
+    setIntegerParam(ADTimePixOccChipAlarm, 0);
+    setIntegerParam(ADTimePixOccHotCells, 0);
+    setIntegerParam(ADTimePixOccMaxChip, 0);
+    setDoubleParam(ADTimePixOccMaxChipRate, 0.0);
+    setDoubleParam(ADTimePixOccMaxCellRate, 0.0);
+    setIntegerParam(ADTimePixOccUpdates, 0);
+    if (!occupancyChipRate_.empty()) {
+        doCallbacksFloat64Array(occupancyChipRate_.data(), occupancyChipRate_.size(), ADTimePixOccChipRate, 0);
+    }
+}
+
+/** Reader / replay thread: count a decoded batch before the hit filter. */
+void ADTimePix::countOccupancy(int channel, const Tpx3HitBatch& hits) {
+    int enable = 0;
+    getIntegerParam(ADTimePixOccEnable, &enable);
+    if (enable && channel >= 0 && channel < RAW_MAX_CHANNELS) rawChannels_[channel].occupancy.add(hits);
+}
+
+/**
+ * Worker / replay thread: once per 1/TPX3_OCC_RATE_HZ, turn the counts into
+ * rates, publish them and update the alarms. final (end of stream) zeroes the
+ * rates and clears the alarms.
+ */
+void ADTimePix::updateOccupancy(bool final) {
+    int enable = 0;
+    double rateHz = 2.0;
+    getIntegerParam(ADTimePixOccEnable, &enable);
+    getDoubleParam(ADTimePixOccRateHz, &rateHz);
+    const double now = nowSeconds();
+    const double dt = now - occupancyLastPublish_;
+    if (!final && (!enable || dt < 1.0 / std::min(std::max(rateHz, 0.1), 10.0))) return;
+    occupancyLastPublish_ = now;
+
+    occupancyCounts_.clear();
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) rawChannels_[c].occupancy.drain(occupancyCounts_);
+    const double scale = (final || dt <= 0.0) ? 0.0 : 1.0 / dt;
+
+    double chipHigh = 0.0, cellHigh = 0.0;
+    getDoubleParam(ADTimePixOccChipRateHigh, &chipHigh);
+    getDoubleParam(ADTimePixOccCellRateHigh, &cellHigh);
+
+    // Per-chip rates and alarm bits
+    int chipAlarm = 0, maxChip = 0;
+    double maxChipRate = 0.0;
+    occupancyChipRate_.resize(occupancyCounts_.chip_hits.size());
+    for (size_t c = 0; c < occupancyCounts_.chip_hits.size(); ++c) {
+        const double rate = occupancyCounts_.chip_hits[c] * scale;
+        occupancyChipRate_[c] = rate;
+        if (rate > maxChipRate) {
+            maxChipRate = rate;
+            maxChip = static_cast<int>(c);
+        }
+        if (chipHigh > 0.0 && rate >= chipHigh && c < static_cast<size_t>(OCC_ALARM_MASK_CHIPS)) {
+            chipAlarm |= 1 << c;
+        }
+    }
+
+    // Super-pixel map: mean hits/s per pixel
+    const size_t cells = occupancyCellsX_ * occupancyCellsY_;
+    const double pixelScale = scale / (static_cast<double>(occupancyCellSize_) * occupancyCellSize_);
+    int hotCells = 0;
+    double maxCellRate = 0.0;
+    for (size_t k = 0; k < cells && k < occupancyCounts_.cell_hits.size(); ++k) {
+        const double rate = occupancyCounts_.cell_hits[k] * pixelScale;
+        maxCellRate = std::max(maxCellRate, rate);
+        if (cellHigh > 0.0 && rate >= cellHigh) ++hotCells;
+    }
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!final && arrayCallbacks && cells > 0 && pNDArrayPool) {
+        size_t dims[2] = { occupancyCellsX_, occupancyCellsY_ };
+        NDArray* pArr = pNDArrayPool->alloc(2, dims, NDFloat32, 0, NULL);
+        if (pArr && pArr->pData) {
+            float* out = static_cast<float*>(pArr->pData);
+            for (size_t k = 0; k < cells; ++k) out[k] = static_cast<float>(occupancyCounts_.cell_hits[k] * pixelScale);
+            epicsInt32 cellSize = occupancyCellSize_;
+            epicsFloat64 interval = dt;
+            epicsFloat64 maxRate = maxCellRate;
+            pArr->uniqueId = static_cast<int>(occupancyUpdates_ + 1);
+            epicsTimeGetCurrent(&pArr->epicsTS);
+            pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+            if (pArr->pAttributeList) {
+                getAttributes(pArr->pAttributeList);
+                pArr->pAttributeList->add("OccCellSize", "Super-pixel side (px)", NDAttrInt32, &cellSize);
+                pArr->pAttributeList->add("OccInterval", "Counting interval (s)", NDAttrFloat64, &interval);
+                pArr->pAttributeList->add("OccMaxRate", "Highest super-pixel rate (hits/s/px)", NDAttrFloat64, &maxRate);
+            }
+            doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_OCCUPANCY);
+            pArr->release();
+        } else {
+            if (pArr) pArr->release();
+            ERR("Failed to allocate occupancy NDArray");
+        }
+    }
+    if (!final) ++occupancyUpdates_;
+
+    if (!occupancyChipRate_.empty()) {
+        doCallbacksFloat64Array(occupancyChipRate_.data(), occupancyChipRate_.size(), ADTimePixOccChipRate, 0);
+    }
+    setIntegerParam(ADTimePixOccAlarm, (chipAlarm || hotCells) ? 1 : 0);
+    setIntegerParam(ADTimePixOccChipAlarm, chipAlarm);
+    setIntegerParam(ADTimePixOccHotCells, hotCells);
+    setIntegerParam(ADTimePixOccMaxChip, maxChip);
+    setDoubleParam(ADTimePixOccMaxChipRate, maxChipRate);
+    setDoubleParam(ADTimePixOccMaxCellRate, maxCellRate);
+    setIntegerParam(ADTimePixOccUpdates, static_cast<int>(occupancyUpdates_));
+    callParamCallbacks();
+}
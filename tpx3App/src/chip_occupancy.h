@@ -0,0 +1,65 @@
+/*
+ * ADTimePix3 - Per-chip hit rates and coarse occupancy map of the Raw stream
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef CHIP_OCCUPANCY_H
+#define CHIP_OCCUPANCY_H
+
+#include "tpx3_raw.h"
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Counts taken out of one or more ChipOccupancy instances. */
+struct OccupancyCounts {
+    std::vector<uint64_t> chip_hits;   // per chip
+    std::vector<uint64_t> cell_hits;   // super-pixels, row-major in image orientation
+    uint64_t other_hits = 0;           // chip index beyond the configured chips
+
+    void clear();
+};
+
+/**
+ * @brief Hit counters per chip and per super-pixel, fed straight from the decoder
+ *
+ * configure() folds the BPC -> image pixel table into a (chip, chip-local
+ * super-pixel) -> image super-pixel table, so a hit costs two increments and
+ * one lookup on shifts of its chip-local x/y; chip rotations in the detector
+ * layout map aligned super-pixels onto aligned super-pixels, so the table is
+ * exact for any power-of-two cell size up to 256. add() and drain() may run
+ * on different threads.
+ */
+class ChipOccupancy {
+public:
+    /**
+     * @param pixel_lut BPC index -> image index (bpc2ImgIndex); empty = chip rates only
+     * @param cell_size super-pixel side in pixels; rounded down to a power of two in [1, 256]
+     */
+    void configure(const std::vector<uint32_t>& pixel_lut, int num_chips, size_t image_width,
+                   size_t image_height, int cell_size);
+
+    /** Count a decoded batch. */
+    void add(const Tpx3HitBatch& hits);
+    /** Add the counts since the last drain to totals (sized on first use) and zero them. */
+    void drain(OccupancyCounts& totals);
+
+    /** Effective super-pixel side after rounding. */
+    static int cell_size_for(int cell_size);
+
+private:
+    std::mutex mutex_;
+    int num_chips_ = 0;
+    int cell_shift_ = 4;
+    int chip_cell_bits_ = 4;                 // log2(super-pixels per chip side)
+    std::vector<uint32_t> cell_lut_;         // (chip, cy, cx) -> image super-pixel
+    OccupancyCounts counts_;
+};
+
+#endif // CHIP_OCCUPANCY_H
@@ -0,0 +1,434 @@
+/*
+ * ADTimePix3 - Streaming space-time clustering and centroiding of raw hits
+ *
+ * Fed from the Raw TCP decoder (TPX3_RAW_DECODE=1) when TPX3_CLUSTER_ENABLE=1.
+ * Centroided clusters are published as an NDFloat64 list (addr 21, one row of
+ * x, y, ToA ns, ToT, size per cluster) and accumulated into a super-resolution
+ * centroid image (addr 22, TPX3_CLUSTER_SUBPIXEL bins per pixel and axis).
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "cluster.h"
+#include "tof_gate.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+extern const char* driverName;
+
+namespace {
+
+/** Below this many hits per slab the thread start costs more than it saves. */
+constexpr size_t CLUSTER_MIN_SLAB_HITS = 16384;
+/** Number of columns in the published cluster list (x, y, toa_ns, tot, size). */
+constexpr size_t CLUSTER_LIST_COLUMNS = 5;
+/** Publish the cluster list early once it holds this many rows (40 MB). */
+constexpr size_t CLUSTER_LIST_MAX_ROWS = size_t(1) << 20;
+
+inline uint32_t findRoot(uint32_t* parent, uint32_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];  // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+}  // namespace
+
+// Tpx3ClusterBatch
+void Tpx3ClusterBatch::clear() {
+    x.clear();
+    y.clear();
+    toa.clear();
+    tot.clear();
+    size.clear();
+}
+
+void Tpx3ClusterBatch::append(const Tpx3ClusterBatch& src) {
+    x.insert(x.end(), src.x.begin(), src.x.end());
+    y.insert(y.end(), src.y.begin(), src.y.end());
+    toa.insert(toa.end(), src.toa.begin(), src.toa.end());
+    tot.insert(tot.end(), src.tot.begin(), src.tot.end());
+    size.insert(size.end(), src.size.begin(), src.size.end());
+}
+
+// ClusterEngine class implementation
+ClusterEngine::ClusterEngine(size_t width, size_t height, const ClusterParams& params)
+    : width_(width), height_(height), params_(params) {
+    params_.radius = std::max(params_.radius, 0);
+    params_.min_size = std::max<uint32_t>(params_.min_size, 1);
+    params_.threads = std::min(std::max(params_.threads, 1), CLUSTER_MAX_THREADS);
+    params_.span_ticks = std::max(params_.span_ticks, params_.dt_ticks);
+}
+
+size_t ClusterEngine::lower_index(uint64_t toa) const {
+    return static_cast<size_t>(std::lower_bound(pending_.begin(), pending_.end(), toa,
+                                                [](const Hit& h, uint64_t t) { return h.toa < t; }) -
+                               pending_.begin());
+}
+
+void ClusterEngine::add(const Tpx3HitBatch& hits, Tpx3ClusterBatch& out) {
+    const size_t npix = width_ * height_;
+    incoming_.clear();
+    incoming_.reserve(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const uint32_t pix = hits.pixel[i];
+        if (pix >= npix) {
+            ++stats_.unmapped;
+        } else if (started_ && hits.toa[i] < emitted_until_) {
+            ++stats_.late;
+        } else {
+            incoming_.push_back(Hit{ hits.toa[i], pix, hits.tot[i] });
+        }
+    }
+    if (incoming_.empty()) return;
+    stats_.hits += incoming_.size();
+
+    // Batches are time ordered per chip only: sort the new hits, then merge
+    // into the already sorted buffer
+    auto byToa = [](const Hit& a, const Hit& b) { return a.toa < b.toa; };
+    std::sort(incoming_.begin(), incoming_.end(), byToa);
+    const size_t m = pending_.size();
+    pending_.insert(pending_.end(), incoming_.begin(), incoming_.end());
+    std::inplace_merge(pending_.begin(), pending_.begin() + m, pending_.end(), byToa);
+
+    if (!started_) {
+        started_ = true;
+        emitted_until_ = pending_.front().toa;
+    }
+    const uint64_t newest = pending_.back().toa;
+    if (newest < params_.span_ticks) return;
+    const uint64_t emit_until = newest - params_.span_ticks;
+    if (emit_until > emitted_until_) process(emit_until, out);
+}
+
+void ClusterEngine::flush(Tpx3ClusterBatch& out) {
+    if (!pending_.empty()) process(pending_.back().toa + 1, out);
+    pending_.clear();
+}
+
+void ClusterEngine::reset() {
+    pending_.clear();
+    incoming_.clear();
+    started_ = false;
+    emitted_until_ = 0;
+    stats_ = ClusterStats();
+}
+
+void ClusterEngine::process(uint64_t emit_until, Tpx3ClusterBatch& out) {
+    const uint64_t span = params_.span_ticks;
+    const size_t a = lower_index(emitted_until_);
+    const size_t b = lower_index(emit_until);
+
+    if (b > a) {
+        const size_t nSlabs = std::max<size_t>(1, std::min<size_t>(params_.threads, (b - a) / CLUSTER_MIN_SLAB_HITS));
+        if (slabs_.size() < nSlabs) slabs_.resize(nSlabs);
+
+        std::vector<uint64_t> bounds(nSlabs + 1);
+        bounds[0] = emitted_until_;
+        for (size_t k = 1; k < nSlabs; ++k) bounds[k] = pending_[a + (b - a) * k / nSlabs].toa;
+        bounds[nSlabs] = emit_until;
+
+        auto runSlab = [&](size_t k) {
+            const uint64_t lo = bounds[k];
+            const uint64_t hi = bounds[k + 1];
+            const size_t begin = lower_index(lo > span ? lo - span : 0);
+            const size_t end = lower_index(hi + span + 1);
+            cluster_slab(slabs_[k], begin, end, lo, hi);
+        };
+        std::vector<std::thread> workers;
+        workers.reserve(nSlabs - 1);
+        for (size_t k = 1; k < nSlabs; ++k) workers.emplace_back(runSlab, k);
+        runSlab(0);
+        for (auto& t : workers) t.join();
+
+        for (size_t k = 0; k < nSlabs; ++k) {
+            Slab& s = slabs_[k];
+            out.append(s.out);
+            stats_.clusters += s.out.count();
+            stats_.small += s.small;
+            stats_.clustered_hits += s.clustered_hits;
+        }
+    }
+
+    emitted_until_ = emit_until;
+    const size_t keep = lower_index(emit_until > span ? emit_until - span : 0);
+    pending_.erase(pending_.begin(), pending_.begin() + keep);
+}
+
+void ClusterEngine::cluster_slab(Slab& slab, size_t begin, size_t end, uint64_t own_lo, uint64_t own_hi) {
+    const size_t len = end - begin;
+    const Hit* hit = pending_.data() + begin;
+    const int W = static_cast<int>(width_);
+    const int H = static_cast<int>(height_);
+    const int r = params_.radius;
+    const uint64_t dt = params_.dt_ticks;
+
+    slab.out.clear();
+    slab.small = 0;
+    slab.clustered_hits = 0;
+    if (slab.last.size() != width_ * height_ || ++slab.pass == 0) {
+        slab.last.assign(width_ * height_, PixelLast{ 0, 0, 0 });
+        slab.pass = 1;
+    }
+    slab.parent.resize(len);
+    uint32_t* parent = slab.parent.data();
+    PixelLast* last = slab.last.data();
+    const uint32_t pass = slab.pass;
+
+    // Connectivity: link each hit to the latest hit of every neighbour pixel
+    // within dt. The per-pixel table is never cleared; entries from an older
+    // pass are ignored by their pass number.
+    for (size_t i = 0; i < len; ++i) {
+        const uint32_t p = hit[i].pixel;
+        const uint64_t t = hit[i].toa;
+        const int x = static_cast<int>(p % width_);
+        const int y = static_cast<int>(p / width_);
+        parent[i] = static_cast<uint32_t>(i);
+        for (int yy = std::max(0, y - r); yy <= std::min(H - 1, y + r); ++yy) {
+            const PixelLast* row = last + static_cast<size_t>(yy) * W;
+            for (int xx = std::max(0, x - r); xx <= std::min(W - 1, x + r); ++xx) {
+                const PixelLast& e = row[xx];
+                if (e.pass != pass || t - e.toa > dt) continue;
+                const uint32_t rj = findRoot(parent, e.index);
+                const uint32_t ri = findRoot(parent, static_cast<uint32_t>(i));
+                // Root is the earliest hit, so root ToA is the cluster's first ToA
+                if (rj < ri) parent[ri] = rj;
+                else if (ri < rj) parent[rj] = ri;
+            }
+        }
+        last[p] = PixelLast{ t, pass, static_cast<uint32_t>(i) };
+    }
+
+    slab.sum_x.assign(len, 0.0);
+    slab.sum_y.assign(len, 0.0);
+    slab.sum_w.assign(len, 0.0);
+    slab.sum_tot.assign(len, 0);
+    slab.n.assign(len, 0);
+    for (size_t i = 0; i < len; ++i) {
+        const uint32_t root = findRoot(parent, static_cast<uint32_t>(i));
+        const double w = std::max<uint16_t>(hit[i].tot, 1);  // ToT 0 still counts as a hit
+        slab.sum_x[root] += w * static_cast<double>(hit[i].pixel % width_);
+        slab.sum_y[root] += w * static_cast<double>(hit[i].pixel / width_);
+        slab.sum_w[root] += w;
+        slab.sum_tot[root] += hit[i].tot;
+        ++slab.n[root];
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        if (parent[i] != i) continue;
+        const uint64_t t = hit[i].toa;
+        if (t < own_lo || t >= own_hi) continue;
+        const uint32_t n = slab.n[i];
+        if (n < params_.min_size) {
+            ++slab.small;
+            continue;
+        }
+        slab.out.x.push_back(static_cast<float>(slab.sum_x[i] / slab.sum_w[i]));
+        slab.out.y.push_back(static_cast<float>(slab.sum_y[i] / slab.sum_w[i]));
+        slab.out.toa.push_back(t);
+        slab.out.tot.push_back(slab.sum_tot[i]);
+        slab.out.size.push_back(static_cast<uint16_t>(std::min<uint32_t>(n, 0xFFFF)));
+        slab.clustered_hits += n;
+    }
+}
+
+void accumulateSuperRes(const Tpx3ClusterBatch& clusters, size_t first, size_t width, size_t height,
+                        int factor, uint32_t* image) {
+    const int f = std::min(std::max(factor, 1), CLUSTER_MAX_SUBPIXEL);
+    const long w = static_cast<long>(width) * f;
+    const long h = static_cast<long>(height) * f;
+    for (size_t i = first; i < clusters.count(); ++i) {
+        const long bx = static_cast<long>(std::floor((clusters.x[i] + 0.5f) * f));
+        const long by = static_cast<long>(std::floor((clusters.y[i] + 0.5f) * f));
+        if (bx < 0 || by < 0 || bx >= w || by >= h) continue;
+        ++image[by * w + bx];
+    }
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: raw batches -> ClusterEngine -> NDArray addrs 21..22
+// -----------------------------------------------------------------------
+
+/** Mark the engine for rebuild from TPX3_CLUSTER_* (applied on the Raw worker thread). */
+void ADTimePix::invalidateClusterEngine() {
+    if (!clusterMutex_) return;
+    epicsMutexLock(clusterMutex_);
+    clusterConfigDirty_ = true;
+    epicsMutexUnlock(clusterMutex_);
+}
+
+/** Caller holds clusterMutex_. Drops buffered hits and the super-resolution image. */
+void ADTimePix::rebuildClusterEngine() {
+    int radius = 1, minSize = 1, threads = 1, subpixel = 1;
+    double dtNs = 100.0, spanNs = 1000.0;
+    getIntegerParam(ADTimePixClusterRadius, &radius);
+    getIntegerParam(ADTimePixClusterMinSize, &minSize);
+    getIntegerParam(ADTimePixClusterThreads, &threads);
+    getIntegerParam(ADTimePixClusterSubpixel, &subpixel);
+    getDoubleParam(ADTimePixClusterDtNs, &dtNs);
+    getDoubleParam(ADTimePixClusterSpanNs, &spanNs);
+
+    epicsMutexLock(rawMutex_);
+    const int width = rawImageWidth_;
+    const int height = rawImageHeight_;
+    epicsMutexUnlock(rawMutex_);
+
+    ClusterParams params;
+    params.radius = std::min(std::max(radius, 0), 8);
+    params.dt_ticks = tofMsToTicks(dtNs * 1e-6);
+    params.span_ticks = tofMsToTicks(spanNs * 1e-6);
+    params.min_size = static_cast<uint32_t>(std::max(minSize, 1));
+    params.threads = threads;
+
+    clusterEngine_.reset();
+    clusterOut_.clear();
+    clusterSubpixel_ = std::min(std::max(subpixel, 1), CLUSTER_MAX_SUBPIXEL);
+    clusterSuperRes_.clear();
+    if (width > 0 && height > 0) {
+        clusterEngine_.reset(new ClusterEngine(width, height, params));
+        clusterSuperRes_.assign(static_cast<size_t>(width) * clusterSubpixel_ * height * clusterSubpixel_, 0);
+    }
+    clusterConfigDirty_ = false;
+    clusterLastPublishTime_ = 0.0;
+    clusterLastPublishCount_ = 0;
+}
+
+/**
+ * Publish the cluster list since the last publish (NDFloat64, dims {5, N}: x,
+ * y, ToA ns, ToT, size per row) and the super-resolution image (NDUInt32).
+ * Caller holds clusterMutex_.
+ */
+void ADTimePix::publishClusters(double now) {
+    const ClusterStats& st = clusterEngine_->stats();
+    const double dt = now - clusterLastPublishTime_;
+    if (clusterLastPublishTime_ > 0.0 && dt > 0.0) {
+        setDoubleParam(ADTimePixClusterRate, (st.clusters - clusterLastPublishCount_) / dt);
+    }
+    clusterLastPublishTime_ = now;
+    clusterLastPublishCount_ = st.clusters;
+    setInteger64Param(ADTimePixClusterCount, static_cast<epicsInt64>(st.clusters));
+    setDoubleParam(ADTimePixClusterMeanSize, st.clusters ? static_cast<double>(st.clustered_hits) / st.clusters : 0.0);
+    setInteger64Param(ADTimePixClusterLate, static_cast<epicsInt64>(st.late));
+    setIntegerParam(ADTimePixClusterBuffered, static_cast<int>(clusterEngine_->get_buffered_hits()));
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) {
+        clusterOut_.clear();
+        return;
+    }
+
+    epicsInt64 totalClusters = static_cast<epicsInt64>(st.clusters);
+    const size_t n = clusterOut_.count();
+    if (n > 0) {
+        size_t dims[2] = { CLUSTER_LIST_COLUMNS, n };
+        NDArray* pArr = pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL);
+        if (!pArr || !pArr->pData) {
+            if (pArr) pArr->release();
+            ERR("Failed to allocate cluster list NDArray");
+        } else {
+            double* row = static_cast<double*>(pArr->pData);
+            const double nsPerTick = TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+            for (size_t i = 0; i < n; ++i, row += CLUSTER_LIST_COLUMNS) {
+                row[0] = clusterOut_.x[i];
+                row[1] = clusterOut_.y[i];
+                row[2] = clusterOut_.toa[i] * nsPerTick;
+                row[3] = clusterOut_.tot[i];
+                row[4] = clusterOut_.size[i];
+            }
+            epicsInt32 rows = static_cast<epicsInt32>(n);
+            pArr->uniqueId = static_cast<int>(totalClusters);
+            epicsTimeGetCurrent(&pArr->epicsTS);
+            pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+            if (pArr->pAttributeList) {
+                getAttributes(pArr->pAttributeList);
+                pArr->pAttributeList->add("Columns", "Column names", NDAttrString, const_cast<char*>("x,y,toa_ns,tot,size"));
+                pArr->pAttributeList->add("Clusters", "Clusters in this list", NDAttrInt32, &rows);
+                pArr->pAttributeList->add("TotalClusters", "Clusters since start", NDAttrInt64, &totalClusters);
+            }
+            doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_CLUSTER_LIST);
+            pArr->release();
+        }
+    }
+    clusterOut_.clear();
+
+    const size_t f = static_cast<size_t>(clusterSubpixel_);
+    size_t imgDims[2] = { clusterEngine_->get_width() * f, clusterEngine_->get_height() * f };
+    NDArray* pImg = pNDArrayPool->alloc(2, imgDims, NDUInt32, 0, NULL);
+    if (!pImg || !pImg->pData) {
+        if (pImg) pImg->release();
+        ERR("Failed to allocate super-resolution NDArray");
+        return;
+    }
+    std::memcpy(pImg->pData, clusterSuperRes_.data(), clusterSuperRes_.size() * sizeof(uint32_t));
+    epicsInt32 subpixel = clusterSubpixel_;
+    pImg->uniqueId = static_cast<int>(totalClusters);
+    epicsTimeGetCurrent(&pImg->epicsTS);
+    pImg->timeStamp = pImg->epicsTS.secPastEpoch + pImg->epicsTS.nsec / 1.e9;
+    if (pImg->pAttributeList) {
+        getAttributes(pImg->pAttributeList);
+        pImg->pAttributeList->add("Subpixel", "Super-resolution bins per pixel", NDAttrInt32, &subpixel);
+        pImg->pAttributeList->add("TotalClusters", "Clusters since start", NDAttrInt64, &totalClusters);
+    }
+    doCallbacksGenericPointer(pImg, NDArrayData, NDARRAY_ADDR_CLUSTER_IMAGE);
+    pImg->release();
+}
+
+/** Raw worker hook: cluster one decoded batch. */
+void ADTimePix::processClusterBatch(const Tpx3HitBatch& hits) {
+    int enable = 0;
+    getIntegerParam(ADTimePixClusterEnable, &enable);
+    if (!enable) return;
+
+    epicsMutexLock(clusterMutex_);
+    if (clusterConfigDirty_ || !clusterEngine_) rebuildClusterEngine();
+    if (clusterEngine_) {
+        const size_t before = clusterOut_.count();
+        clusterEngine_->add(hits, clusterOut_);
+        accumulateSuperRes(clusterOut_, before, clusterEngine_->get_width(), clusterEngine_->get_height(),
+                           clusterSubpixel_, clusterSuperRes_.data());
+        double period = 1.0;
+        getDoubleParam(ADTimePixClusterPublishPeriod, &period);
+        const double now = nowSeconds();
+        if (clusterLastPublishTime_ == 0.0) clusterLastPublishTime_ = now;
+        if (now - clusterLastPublishTime_ >= std::max(period, 0.05) ||
+            clusterOut_.count() >= CLUSTER_LIST_MAX_ROWS) {
+            publishClusters(now);
+        }
+    }
+    epicsMutexUnlock(clusterMutex_);
+}
+
+/** TPX3_CLUSTER_RESET: zero the super-resolution image. */
+void ADTimePix::resetClusterImage() {
+    if (!clusterMutex_) return;
+    epicsMutexLock(clusterMutex_);
+    std::fill(clusterSuperRes_.begin(), clusterSuperRes_.end(), 0u);
+    epicsMutexUnlock(clusterMutex_);
+}
+
+/** Cluster the buffered tail and publish at end of acquisition. */
+void ADTimePix::flushClusters() {
+    if (!clusterMutex_) return;
+    epicsMutexLock(clusterMutex_);
+    if (clusterEngine_) {
+        const size_t before = clusterOut_.count();
+        clusterEngine_->flush(clusterOut_);
+        accumulateSuperRes(clusterOut_, before, clusterEngine_->get_width(), clusterEngine_->get_height(),
+                           clusterSubpixel_, clusterSuperRes_.data());
+        publishClusters(nowSeconds());
+        clusterEngine_.reset();  // next acquisition starts a fresh time base
+    }
+    epicsMutexUnlock(clusterMutex_);
+    callParamCallbacks();
+}
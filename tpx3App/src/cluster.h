@@ -0,0 +1,149 @@
+/*
+ * ADTimePix3 - Streaming space-time clustering and centroiding of raw hits
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "tpx3_raw.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** Maximum worker threads (time slabs) per clustering pass. */
+constexpr int CLUSTER_MAX_THREADS = 16;
+/** Maximum super-resolution factor (image is factor^2 larger than the detector). */
+constexpr int CLUSTER_MAX_SUBPIXEL = 16;
+
+/**
+ * @brief Clustering parameters; times in TDC ticks
+ *
+ * Two hits belong to the same cluster when their pixels are within radius
+ * (Chebyshev distance, 1 = 8-neighbourhood) and their ToA differ by at most
+ * dt_ticks; clusters are the transitive closure. span_ticks bounds the length
+ * of a cluster and is the overlap between time slabs: longer chains are
+ * truncated at the slab edge.
+ */
+struct ClusterParams {
+    int radius = 1;
+    uint64_t dt_ticks = 0;
+    uint64_t span_ticks = 0;
+    uint32_t min_size = 1;
+    int threads = 1;
+};
+
+/**
+ * @brief Centroided clusters as parallel arrays, ordered by first ToA
+ *
+ * x/y are the ToT-weighted centroid in image pixel units (pixel centre at the
+ * integer), toa the first hit in TDC ticks, tot the summed ToT (25 ns units).
+ */
+struct Tpx3ClusterBatch {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<uint64_t> toa;
+    std::vector<uint32_t> tot;
+    std::vector<uint16_t> size;
+
+    size_t count() const { return toa.size(); }
+    bool empty() const { return toa.empty(); }
+    void clear();
+    void append(const Tpx3ClusterBatch& src);
+};
+
+/** @brief Running clustering counters (monotonic until reset()). */
+struct ClusterStats {
+    uint64_t hits = 0;        // hits accepted into the time-sorted buffer
+    uint64_t unmapped = 0;    // hits without an image pixel
+    uint64_t late = 0;        // hits older than the already emitted time range
+    uint64_t clusters = 0;    // clusters emitted (>= min_size)
+    uint64_t small = 0;       // clusters below min_size
+    uint64_t clustered_hits = 0;
+};
+
+/**
+ * @brief Streaming cluster engine over decoded hit batches
+ *
+ * Hits are merged into a buffer kept sorted by ToA. Each add() emits every
+ * cluster whose first hit is older than (newest ToA - span); hits within span
+ * of that boundary are kept as context for the next pass. The emitted range is
+ * split into time slabs of similar hit count, each clustered on its own thread
+ * over [slab start - span, slab end + span); a slab only emits clusters whose
+ * first ToA lies inside it, so clusters crossing a slab edge are emitted once.
+ * Connectivity uses union-find with a per-pixel "last hit" table.
+ */
+class ClusterEngine {
+public:
+    ClusterEngine(size_t width, size_t height, const ClusterParams& params);
+
+    /** Add a decoded batch; completed clusters are appended to out. */
+    void add(const Tpx3HitBatch& hits, Tpx3ClusterBatch& out);
+
+    /** Cluster everything still buffered (end of acquisition). */
+    void flush(Tpx3ClusterBatch& out);
+
+    /** Drop buffered hits and counters. */
+    void reset();
+
+    size_t get_width() const { return width_; }
+    size_t get_height() const { return height_; }
+    const ClusterParams& get_params() const { return params_; }
+    const ClusterStats& stats() const { return stats_; }
+    size_t get_buffered_hits() const { return pending_.size(); }
+
+private:
+    struct Hit {
+        uint64_t toa;
+        uint32_t pixel;
+        uint16_t tot;
+    };
+    struct PixelLast {
+        uint64_t toa;
+        uint32_t pass;     // valid only when equal to Slab::pass
+        uint32_t index;
+    };
+    struct Slab {
+        std::vector<PixelLast> last;    // pixel -> latest hit in this pass
+        uint32_t pass = 0;
+        std::vector<uint32_t> parent;   // union-find over hits of the slab range
+        std::vector<double> sum_x;
+        std::vector<double> sum_y;
+        std::vector<double> sum_w;      // ToT weights (ToT 0 weighs 1)
+        std::vector<uint32_t> sum_tot;
+        std::vector<uint32_t> n;
+        Tpx3ClusterBatch out;
+        uint64_t small = 0;
+        uint64_t clustered_hits = 0;
+    };
+
+    void process(uint64_t emit_until, Tpx3ClusterBatch& out);
+    void cluster_slab(Slab& slab, size_t begin, size_t end, uint64_t own_lo, uint64_t own_hi);
+    size_t lower_index(uint64_t toa) const;
+
+    size_t width_;
+    size_t height_;
+    ClusterParams params_;
+    std::vector<Hit> pending_;
+    std::vector<Hit> incoming_;
+    std::vector<Slab> slabs_;
+    bool started_ = false;
+    uint64_t emitted_until_ = 0;   // clusters with first ToA below this were emitted
+    ClusterStats stats_;
+};
+
+/**
+ * @brief Add cluster centroids [first, count) to a super-resolution count image
+ *
+ * Image is (width * factor) x (height * factor); centroid (x, y) falls into bin
+ * floor((x + 0.5) * factor). Centroids outside the image are ignored.
+ */
+void accumulateSuperRes(const Tpx3ClusterBatch& clusters, size_t first, size_t width, size_t height,
+                        int factor, uint32_t* image);
+
+#endif // CLUSTER_H
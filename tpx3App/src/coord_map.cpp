@@ -0,0 +1,460 @@
+/*
+ * ADTimePix3 - Precomputed image <-> BPC file index tables
+ *
+ * pelIndex() and bpc2ImgIndex() used to read TPX3_DET_ORIENTATION and
+ * TPX3_NUMBER_OF_CHIPS and walk the orientation/chip branches for every
+ * pixel. The same rules now fill two tables once per layout (chip count,
+ * mosaic, pixel width, orientation); mask read/write, PixelConfigDiff, the
+ * masked-pels JSON and the Raw pixel LUT index the tables instead. The tables
+ * are rebuilt when the layout read from the parameters differs from the one
+ * they were built for, so an orientation or detector change takes effect on
+ * the next lookup.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "coord_map.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+extern const char* driverName;
+
+CoordMap::CoordMap(const CoordLayout& layout) : layout_(layout) {
+    const int w = layout_.pel_width;
+    if (w <= 0 || layout_.num_chips <= 0 || layout_.x_chips <= 0 || layout_.y_chips <= 0) return;
+    const int width = layout_.width();
+    const int height = layout_.height();
+    const int imgCount = width * height;
+    const int fileCount = layout_.num_chips * w * w;
+
+    image_to_file_.assign(static_cast<size_t>(imgCount), -1);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            const int k = rule_file_index(layout_, i, j);
+            if (k >= 0 && k < fileCount) {
+                image_to_file_[static_cast<size_t>(j) * width + i] = k;
+                mapped_ = true;
+            }
+        }
+    }
+    file_to_image_.assign(static_cast<size_t>(fileCount), -1);
+    for (int k = 0; k < fileCount; ++k) {
+        const int idx = rule_image_index(layout_, k);
+        if (idx >= 0 && idx < imgCount) {
+            file_to_image_[static_cast<size_t>(k)] = idx;
+            mapped_ = true;
+        }
+    }
+}
+
+/* bpc vector index into AD image index;  x/y (i,j) are image coordinates
+* i,j coordinates of the AD image with pixel starting from top left in image mask PV
+* k - index of pixel in bpc file; returns index of pixel in AD image
+*/
+int CoordMap::rule_image_index(const CoordLayout& L, int k) {
+    int i=0, j=0;
+    int imgIndex=0;
+    const int detOrientation = L.orientation;
+    const int numChips = L.num_chips;
+    const int chipPelWidth = L.pel_width;
+    const int bpcIndex = k;
+    const int chipPelCount = (chipPelWidth) * (chipPelWidth);
+    /* 0-based chip from linear BPC index: [0,chipPelCount) -> 0, etc. Do not use (bpcIndex+1)/chipPelCount;
+     * that maps the last pel of each chip (e.g. 65535) to the next chip and bpcIndex 262143 -> chip 4,
+     * falsely tripping "detector larger than 2x2" and misplacing boundary pixels. */
+    const int chip = (chipPelCount > 0) ? (bpcIndex / chipPelCount) : 0;
+
+    if (numChips == 1) { // single chip TimePix3
+        if (detOrientation == 0) {  // UP detector orientation
+            i = bpcIndex % chipPelWidth;
+            j = chipPelWidth - 1 - bpcIndex / chipPelWidth;
+        } else if (detOrientation == 1) {  // RIGHT
+            i = bpcIndex / chipPelWidth;
+            j = bpcIndex % chipPelWidth;
+        } else if (detOrientation == 2) {  // DOWN
+            i = chipPelWidth - 1 - bpcIndex % chipPelWidth;
+            j = bpcIndex / chipPelWidth;
+        } else if (detOrientation == 3) {  // LEFT
+            i = chipPelWidth - 1 - bpcIndex / chipPelWidth;
+            j = chipPelWidth - 1 - bpcIndex % chipPelWidth;
+        } else if (detOrientation == 4) {  // UP MIRRORED
+            i = chipPelWidth - 1 - bpcIndex % chipPelWidth;
+            j = chipPelWidth - 1 - bpcIndex / chipPelWidth;
+        } else if (detOrientation == 5) {  // RIGHT MIRRORED
+            i = chipPelWidth - 1 - bpcIndex / chipPelWidth;
+            j = bpcIndex % chipPelWidth;
+        } else if (detOrientation == 6) {  // DOWN MIRRORED
+            i = bpcIndex % chipPelWidth;
+            j = bpcIndex / chipPelWidth;
+        } else if (detOrientation == 7) {  // LEFT MIRRORED
+            i = bpcIndex / chipPelWidth;
+            j = chipPelWidth - 1 - bpcIndex % chipPelWidth;
+        } else {
+            return -1;
+        }
+        imgIndex = i + chipPelWidth*j;
+    } else if (numChips == 4) {  // quad chip 2x2 TimePix3
+        if (detOrientation == 0) {  // UP detector orientation
+            if (chip == 0) { // tile (1,1), chip 0
+                i = chipPelWidth + bpcIndex % chipPelWidth;
+                j = 2*chipPelWidth - 1 - bpcIndex / chipPelWidth;
+            } else if (chip == 1) { // tile (1,0), chip 1
+                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
+                j = (bpcIndex - chipPelCount) / chipPelWidth;
+            } else if (chip == 2) { // tile (0,0), chip 2
+                i = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
+                j = (bpcIndex - 2*chipPelCount) / chipPelWidth;
+            } else if (chip == 3) { // tile (0,1), chip 3
+                i = (bpcIndex - 3*chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 3) {  // LEFT detector orientation
+            if (chip == 3) { // tile (1,1), chip 3
+                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
+            } else if (chip == 0) { // tile (1,0), chip 0
+                i = 2*chipPelWidth - 1 - bpcIndex / chipPelWidth;
+                j = bpcIndex % chipPelWidth;
+            } else if (chip == 1) { // tile (0,0), chip 1
+                i = (bpcIndex - chipPelCount) / chipPelWidth;
+                j = (bpcIndex - chipPelCount) % chipPelWidth;
+            } else if (chip == 2) { // tile (0,1), chip 2
+                i = (bpcIndex - 2*chipPelCount) / chipPelWidth;
+                j = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 1) {  // RIGHT detector orientation
+            if (chip == 1) { // tile (1,1), chip 1
+                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
+            } else if (chip == 2) { // tile (1,0), chip 2
+                i = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
+                j = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
+            } else if (chip == 3) { // tile (0,0), chip 3
+                i = (bpcIndex - 3*chipPelCount) / chipPelWidth;
+                j = (bpcIndex - 3*chipPelCount) % chipPelWidth;
+            } else if (chip == 0) { // tile (0,1), chip 0
+                i = (bpcIndex) / chipPelWidth;
+                j = chipPelWidth + (bpcIndex) % chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 2) {  // DOWN detector orientation
+            if (chip == 2) { // tile (1,1), chip 2
+                i = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
+            } else if (chip == 3) { // tile (1,0), chip 3
+                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
+                j = (bpcIndex - 3*chipPelCount) / chipPelWidth;
+            } else if (chip == 0) { // tile (0,0), chip 0
+                i = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
+                j = (bpcIndex) / chipPelWidth;
+            } else if (chip == 1) { // tile (0,1), chip 1
+                i = (bpcIndex - chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 4) {  // UP MIRRORED detector orientation
+            if (chip == 3) { // tile (1,1), chip 3
+                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
+            } else if (chip == 2) { // tile (1,0), chip 2
+                i = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
+                j = (bpcIndex - 2*chipPelCount) / chipPelWidth;
+            } else if (chip == 1) { // tile (0,0), chip 1
+                i = (bpcIndex - chipPelCount) % chipPelWidth;
+                j = (bpcIndex - chipPelCount) / chipPelWidth;
+            } else if (chip == 0) { // tile (0,1), chip 0
+                i = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex) / chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 5) {  // RIGHT MIRRORED detector orientation
+            if (chip == 0) { // tile (1,1), chip 0
+                i = 2*chipPelWidth - 1 - (bpcIndex) / chipPelWidth;
+                j = chipPelWidth + (bpcIndex) % chipPelWidth;
+            } else if (chip == 3) { // tile (1,0), chip 3
+                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
+                j = (bpcIndex - 3*chipPelCount) % chipPelWidth;
+            } else if (chip == 2) { // tile (0,0), chip 2
+                i = (bpcIndex - 2*chipPelCount) / chipPelWidth;
+                j = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
+            } else if (chip == 1) { // tile (0,1), chip 1
+                i = (bpcIndex - chipPelCount) / chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 6) {  // DOWN MIRRORED detector orientation
+            if (chip == 1) { // tile (1,1), chip 1
+                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
+            } else if (chip == 0) { // tile (1,0), chip 0
+                i = chipPelWidth + (bpcIndex) % chipPelWidth;
+                j = (bpcIndex) / chipPelWidth;
+            } else if (chip == 3) { // tile (0,0), chip 3
+                i = (bpcIndex - 3*chipPelCount) % chipPelWidth;
+                j = (bpcIndex - 3*chipPelCount) / chipPelWidth;
+            } else if (chip == 2) { // tile (0,1), chip 2
+                i = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 7) {  // LEFT MIRRORED detector orientation
+            if (chip == 2) { // tile (1,1), chip 2
+                i = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
+                j = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
+            } else if (chip == 1) { // tile (1,0), chip 1
+                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
+                j = (bpcIndex - chipPelCount) % chipPelWidth;
+            } else if (chip == 0) { // tile (0,0), chip 0
+                i = (bpcIndex) / chipPelWidth;
+                j = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
+            } else if (chip == 3) { // tile (0,1), chip 3
+                i = (bpcIndex - 3*chipPelCount) / chipPelWidth;
+                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
+            } else {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+        imgIndex = i + 2*chipPelWidth*j;
+    } else if (numChips == 8) {
+        /* 2×4 (or 4×2) mosaic: uniform grid, BPC chip order chip = Y_CHIP * xChips + X_CHIP,
+         * intra-chip mapping matches single-chip UP (same convention as one tile of the 2×2 case).
+         * Only DetectorOrientation UP (0); other orientations need per-layout tables like 2×2. */
+        if (detOrientation != 0) {
+            return -1;
+        }
+        const int xChips = L.x_chips, yChips = L.y_chips, w = L.pel_width;
+        if (xChips * yChips != 8 || chipPelCount <= 0 || chip < 0 || chip > 7) {
+            return -1;
+        }
+        int local = bpcIndex - chip * chipPelCount;
+        int lx = local % w;
+        int ly = local / w;
+        int X_CHIP = chip % xChips;
+        int Y_CHIP = chip / xChips;
+        i = X_CHIP * w + lx;
+        j = Y_CHIP * w + (w - 1 - ly);
+        imgIndex = i + (xChips * w) * j;
+    } else {
+        return -1;
+    }
+
+    return imgIndex;
+}
+
+/*
+* Index of mask vector
+* i,j coordinates of the pixel starting from top left in image mask PV
+*/
+int CoordMap::rule_file_index(const CoordLayout& L, int i, int j) {
+    int index=0, ii=0, jj=0;
+    const int detOrientation = L.orientation;
+    const int numChips = L.num_chips;
+    const int PelWidth = L.pel_width;
+    if (PelWidth <= 0) return -1;
+    const int X_CHIP = i / PelWidth;
+    const int Y_CHIP = j / PelWidth;
+
+    // One-chip TimePix3 detector
+    if (numChips == 1) {
+        if (detOrientation == 0) {  // UP detector orientation
+            index = i + ((PelWidth - 1) - j)*PelWidth;
+        } else if (detOrientation == 1) {  // RIGHT
+            index = j + i*PelWidth;
+        } else if (detOrientation == 2) {  // DOWN
+            index = ((PelWidth - 1) - i) + j*PelWidth;
+        } else if (detOrientation == 3) {  // LEFT
+            index =  ((PelWidth - 1) - j) +  ((PelWidth - 1) - i)*PelWidth;
+        } else if (detOrientation == 4) {  // UP MIRRORED
+            index =  ((PelWidth - 1) - i) +  ((PelWidth - 1) - j)*PelWidth;
+        } else if (detOrientation == 5) {  // RIGHT MIRRORED
+            index = j + ((PelWidth - 1) - i)*PelWidth;
+        } else if (detOrientation == 6) {  // DOWN MIRRORED
+            index = i + j*PelWidth;
+        } else if (detOrientation == 7) {  // LEFT MIRRORED
+            index = ((PelWidth - 1) - j) + i*PelWidth;
+        } else {
+            return -1;
+        }
+
+    } else if (numChips == 4) {
+        // Four chip 2x2 TimePix3 detector orientations
+        ii = i - PelWidth;
+        jj = j - PelWidth;
+
+        if (detOrientation == 0) {  // UP detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 0
+                index = ii - (jj - (PelWidth - 1))*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 1
+                index = PelWidth*PelWidth + ((PelWidth - 1) - ii) + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 2
+                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - i) + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 3
+                index = 3*PelWidth*PelWidth + i - (jj - (PelWidth - 1))*PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 3) {  // LEFT detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 3
+                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - jj) + ((PelWidth - 1) - ii)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 0
+                index = ((PelWidth - 1) - j) +  ((PelWidth - 1) - ii) * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 1
+                index = PelWidth*PelWidth + j + i * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 2
+                index = 2*PelWidth*PelWidth + jj + i * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 1) {  // RIGHT detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 1
+                index = PelWidth*PelWidth + ((PelWidth - 1) - jj) + ((PelWidth - 1) - ii)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 2
+                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - j) +  ((PelWidth - 1) - ii) * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 3
+                index = 3*PelWidth*PelWidth + j + i * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 0
+                index = jj +  i * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 2) {  // DOWN detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 2
+                index = 2*PelWidth*PelWidth + ii + ((PelWidth - 1) - jj)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 3
+                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - ii) +  j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 0
+                index =  ((PelWidth - 1) - i) + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 1
+                index = PelWidth*PelWidth + i +  ((PelWidth - 1) - jj) * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 4) {  // UP MIRRORED detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 3
+                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - ii) + ((PelWidth - 1) - jj)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 2
+                index = 2*PelWidth*PelWidth + ii + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 1
+                index =  PelWidth*PelWidth + i + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 0
+                index = ((PelWidth - 1) - i) + ((PelWidth - 1) - jj) * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 5) {  // RIGHT MIRRORED detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 0
+                index = jj + ((PelWidth - 1) - ii)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 3
+                index = 3*PelWidth*PelWidth + j + ((PelWidth - 1) - ii) * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 2
+                index =  2*PelWidth*PelWidth + ((PelWidth - 1) - j) + i * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 1
+                index = PelWidth*PelWidth + ((PelWidth - 1) - jj) + i * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 6) {  // DOWN MIRRORED detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 1
+                index = PelWidth*PelWidth + ((PelWidth - 1) - ii) + ((PelWidth - 1) - jj)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 0
+                index = ii + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 3
+                index =  3*PelWidth*PelWidth + i + j * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 2
+                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - i) + ((PelWidth - 1) - jj) * PelWidth;
+            } else {
+                return -1;
+            }
+        } else if (detOrientation == 7) {  // LEFT MIRRORED detector orientation
+            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 2
+                index = 2*PelWidth*PelWidth + jj + ((PelWidth - 1) - ii)*PelWidth;
+            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 1
+                index = PelWidth*PelWidth + j + ((PelWidth - 1) - ii) * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 0
+                index =  ((PelWidth - 1) - j) + i * PelWidth;
+            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 3
+                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - jj) + i * PelWidth;
+            } else {
+                return -1;
+            }
+
+        } else {
+            return -1;
+        }
+    } else if (numChips == 8) {
+        if (detOrientation != 0) {
+            return -1;
+        } else {
+            const int xChips = L.x_chips, yChips = L.y_chips, Pel = L.pel_width;
+            if (xChips * yChips != 8 || Pel <= 0 || X_CHIP >= xChips || Y_CHIP >= yChips) {
+                return -1;
+            } else {
+                int lx = i - X_CHIP * Pel;
+                int ly = j - Y_CHIP * Pel;
+                int chipIdx = Y_CHIP * xChips + X_CHIP;
+                index = chipIdx * Pel * Pel + lx + ((Pel - 1) - ly) * Pel;
+            }
+        }
+    } else {
+        return -1;
+    }
+
+    return index;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: layout from the parameters -> cached CoordMap
+// -----------------------------------------------------------------------
+
+/**
+ * Tables for the current layout, rebuilt when TPX3_DET_ORIENTATION or the
+ * chip layout changed since the last call. Callers keep the pointer for the
+ * duration of a loop; a concurrent rebuild does not invalidate it.
+ */
+std::shared_ptr<const CoordMap> ADTimePix::coordMap() {
+    CoordLayout layout;
+    int rows = 0, cols = 0;
+    rowsCols(&rows, &cols, &layout.x_chips, &layout.y_chips, &layout.pel_width);
+    getIntegerParam(ADTimePixNumberOfChips, &layout.num_chips);
+    getIntegerParam(ADTimePixDetectorOrientation, &layout.orientation);
+
+    std::lock_guard<std::mutex> lock(coordMapMutex_);
+    if (!coordMap_ || coordMap_->layout() != layout) {
+        coordMap_ = std::make_shared<const CoordMap>(layout);
+        if (coordMap_->mapped()) {
+            FLOW_ARGS("Coordinate map: %d chips (%dx%d, %d px), orientation %d",
+                      layout.num_chips, layout.x_chips, layout.y_chips, layout.pel_width, layout.orientation);
+        } else if (layout.num_chips > 0) {
+            WARN_ARGS("Coordinate map: no mapping for %d chips (%dx%d, %d px), orientation %d "
+                      "(supported: 1 or 4 chips, any orientation; 8 chips UP)",
+                      layout.num_chips, layout.x_chips, layout.y_chips, layout.pel_width, layout.orientation);
+        }
+    }
+    return coordMap_;
+}
+
+/* Image (i, j) -> BPC file index (single lookup; loops should use coordMap() directly). */
+int ADTimePix::pelIndex(int i, int j) {
+    return coordMap()->file_index(i, j);
+}
+
+/* BPC file index -> AD image index (single lookup). chipPelWidthIn must match the layout. */
+int ADTimePix::bpc2ImgIndex(int bpcIndexIn, int chipPelWidthIn) {
+    std::shared_ptr<const CoordMap> map = coordMap();
+    if (chipPelWidthIn != map->layout().pel_width) return -1;
+    return map->image_index(bpcIndexIn);
+}
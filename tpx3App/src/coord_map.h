@@ -0,0 +1,79 @@
+/*
+ * ADTimePix3 - Precomputed image <-> BPC file index tables
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef COORD_MAP_H
+#define COORD_MAP_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Chip mosaic and orientation the tables are built for (see COORDINATE_MAP.md). */
+struct CoordLayout {
+    int num_chips = 0;
+    int x_chips = 0;                   // TPX3_ROWLEN
+    int y_chips = 0;
+    int pel_width = 0;                 // pixels per chip edge
+    int orientation = 0;               // TPX3_DET_ORIENTATION
+
+    int width() const { return x_chips * pel_width; }
+    int height() const { return y_chips * pel_width; }
+    bool operator==(const CoordLayout& o) const {
+        return num_chips == o.num_chips && x_chips == o.x_chips && y_chips == o.y_chips &&
+               pel_width == o.pel_width && orientation == o.orientation;
+    }
+    bool operator!=(const CoordLayout& o) const { return !(*this == o); }
+};
+
+/**
+ * @brief Image <-> BPC file index tables for one layout
+ *
+ * file_index(i, j) is the former per-pixel pelIndex() (mask write/read,
+ * PixelConfigDiff) and image_index(k) the former bpc2ImgIndex() (masked-pels
+ * JSON, Raw pixel LUT). The two are kept as separate tables because they are
+ * not inverses for every quad orientation (e.g. LEFT). Both are built once per
+ * layout; unmapped entries are -1. The rules are the ones checked by
+ * test/verify_coordinate_map.py.
+ */
+class CoordMap {
+public:
+    explicit CoordMap(const CoordLayout& layout);
+
+    const CoordLayout& layout() const { return layout_; }
+    /** false when the layout has no mapping (unsupported chip count / orientation). */
+    bool mapped() const { return mapped_; }
+
+    /** Image (i, j) (top-left origin) -> BPC file index, -1 when unmapped. */
+    int file_index(int i, int j) const {
+        if (i < 0 || j < 0 || i >= layout_.width() || j >= layout_.height()) return -1;
+        return image_to_file_[static_cast<size_t>(j) * layout_.width() + i];
+    }
+    /** BPC file index -> linear image index i + width * j, -1 when unmapped. */
+    int image_index(int k) const {
+        if (k < 0 || static_cast<size_t>(k) >= file_to_image_.size()) return -1;
+        return file_to_image_[static_cast<size_t>(k)];
+    }
+
+    /** Row-major (j * width + i) image -> file index table. */
+    const std::vector<int32_t>& image_to_file() const { return image_to_file_; }
+    /** File index -> linear image index table (num_chips * pel_width^2 entries). */
+    const std::vector<int32_t>& file_to_image() const { return file_to_image_; }
+
+    /** The mapping rules themselves (per pixel; used to fill the tables). */
+    static int rule_file_index(const CoordLayout& layout, int i, int j);
+    static int rule_image_index(const CoordLayout& layout, int k);
+
+private:
+    CoordLayout layout_;
+    bool mapped_ = false;
+    std::vector<int32_t> image_to_file_;
+    std::vector<int32_t> file_to_image_;
+};
+
+#endif // COORD_MAP_H
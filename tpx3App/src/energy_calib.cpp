@@ -0,0 +1,484 @@
+/*
+ * ADTimePix3 - Per-pixel ToT to energy calibration of decoded raw hits
+ *
+ * Fed from the Raw TCP decoder (TPX3_RAW_DECODE=1) when TPX3_ENERGY_ENABLE=1.
+ * Calibration tables are loaded from TPX3_ENERGY_CALIB_DIR on the first batch
+ * after a change of directory or detector layout. Energy-gated count images go
+ * to NDArray addrs 32..35, energy spectra (one per ROI, or the whole detector)
+ * to TPX3_ENERGY_SPECTRUM (addr = group) and as an NDInt64 {bins, groups}
+ * array on addr 36, keV axis on addr 37.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "energy_calib.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+extern const char* driverName;
+
+namespace {
+
+/** Coefficient file names inside TPX3_ENERGY_CALIB_DIR, in a, b, c, t order. */
+const char* const ENERGY_CALIB_FILES[4] = { "caliba.txt", "calibb.txt", "calibc.txt", "calibt.txt" };
+
+/** Read exactly count whitespace-separated numbers from path. */
+bool readCalibTable(const std::string& path, size_t count, std::vector<float>& values, std::string& err) {
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in) {
+        err = "Cannot open " + path;
+        return false;
+    }
+    std::stringstream ss;
+    ss << in.rdbuf();
+    const std::string text = ss.str();
+
+    values.clear();
+    values.reserve(count);
+    const char* p = text.c_str();
+    char* end = nullptr;
+    while (true) {
+        const double v = std::strtod(p, &end);
+        if (end == p) break;
+        values.push_back(static_cast<float>(v));
+        p = end;
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') ++p;
+    if (*p != '\0') {
+        err = path + ": not a number near byte " + std::to_string(p - text.c_str());
+        return false;
+    }
+    if (values.size() != count) {
+        err = path + ": " + std::to_string(values.size()) + " values, expected " + std::to_string(count);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+bool parseEnergyGates(const std::string& spec, std::vector<EnergyGate>& gates, std::string& err) {
+    gates.clear();
+    err.clear();
+    std::string s;
+    s.reserve(spec.size());
+    for (char c : spec) {
+        if (c != ' ' && c != '\t') s += c;
+    }
+    size_t start = 0;
+    while (start < s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(start, end - start);
+        start = end + 1;
+        if (item.empty()) continue;
+        EnergyGate gate;
+        char* colon = nullptr;
+        gate.low = std::strtod(item.c_str(), &colon);
+        if (colon == item.c_str() || *colon != ':') {
+            err = "Bad energy window '" + item + "' (low:high keV)";
+            gates.clear();
+            return false;
+        }
+        char* tail = nullptr;
+        gate.high = std::strtod(colon + 1, &tail);
+        if (tail == colon + 1 || *tail != '\0') {
+            err = "Bad energy window '" + item + "' (low:high keV)";
+            gates.clear();
+            return false;
+        }
+        if (!(gate.low >= 0.0) || !(gate.high > gate.low)) {
+            err = "Energy window '" + item + "' needs high > low >= 0";
+            gates.clear();
+            return false;
+        }
+        if (static_cast<int>(gates.size()) >= ENERGY_MAX_GATES) {
+            err = "Too many energy windows (max " + std::to_string(ENERGY_MAX_GATES) + ")";
+            gates.clear();
+            return false;
+        }
+        gates.push_back(gate);
+    }
+    return true;
+}
+
+bool EnergyCalibration::load(const std::string& dir, const std::vector<uint32_t>& pixel_lut,
+                             size_t image_pixels, std::string& err) {
+    std::vector<float> coef[4];
+    for (int k = 0; k < 4; ++k) {
+        std::string path = dir;
+        if (!path.empty() && path.back() != '/') path += '/';
+        path += ENERGY_CALIB_FILES[k];
+        if (!readCalibTable(path, pixel_lut.size(), coef[k], err)) return false;
+    }
+
+    // Slot image_pixels stays uncalibrated; unmapped hits are redirected there
+    coef_.assign(image_pixels + 1, Coef{ 0.0f, 0.0f, 0.0f, 0.0f });
+    calibrated_ = 0;
+    for (size_t k = 0; k < pixel_lut.size(); ++k) {
+        const uint32_t img = pixel_lut[k];
+        if (img >= image_pixels) continue;
+        const float a = coef[0][k];
+        const float b = coef[1][k];
+        const float c = coef[2][k];
+        const float t = coef[3][k];
+        if (!(a > 0.0f) || !std::isfinite(b) || !std::isfinite(c) || !std::isfinite(t)) continue;
+        coef_[img] = Coef{ b, a * t, 4.0f * a * c, 0.5f / a };
+        ++calibrated_;
+    }
+    dir_ = dir;
+    pixels_ = image_pixels;
+    return true;
+}
+
+void EnergyCalibration::convert(const Tpx3HitBatch& hits, std::vector<float>& kev) {
+    const size_t n = hits.size();
+    kev.resize(n);
+    if (coef_.empty()) {
+        std::fill(kev.begin(), kev.end(), -1.0f);
+        return;
+    }
+    index_.resize(n);
+    gb_.resize(n);
+    gat_.resize(n);
+    gac4_.resize(n);
+    ginv_.resize(n);
+
+    // Gather: coefficients of each hit's pixel into contiguous arrays
+    const uint32_t* pixel = hits.pixel.data();
+    const uint32_t none = static_cast<uint32_t>(pixels_);
+    for (size_t i = 0; i < n; ++i) {
+        index_[i] = pixel[i] < none ? pixel[i] : none;
+    }
+    const Coef* coef = coef_.data();
+    for (size_t i = 0; i < n; ++i) {
+        const Coef& c = coef[index_[i]];
+        gb_[i] = c.b;
+        gat_[i] = c.at;
+        gac4_[i] = c.ac4;
+        ginv_[i] = c.inv_2a;
+    }
+
+    // Evaluate: straight-line arithmetic over the batch
+    const uint16_t* tot = hits.tot.data();
+    const float* gb = gb_.data();
+    const float* gat = gat_.data();
+    const float* gac4 = gac4_.data();
+    const float* ginv = ginv_.data();
+    float* out = kev.data();
+    for (size_t i = 0; i < n; ++i) {
+        const float u = static_cast<float>(tot[i]) - gb[i];
+        const float d = u - gat[i];
+        const float disc = std::max(d * d + gac4[i], 0.0f);
+        const float e = (u + gat[i] + std::sqrt(disc)) * ginv[i];
+        out[i] = ginv[i] > 0.0f ? e : -1.0f;
+    }
+}
+
+EnergyImager::EnergyImager(const EnergyImageConfig& config) : config_(config) {
+    config_.bins = std::min(std::max(config_.bins, 1), ENERGY_MAX_BINS);
+    if (static_cast<int>(config_.gates.size()) > ENERGY_MAX_GATES) config_.gates.resize(ENERGY_MAX_GATES);
+    pixels_ = config_.image_width * config_.image_height;
+    groups_ = config_.rois.empty() ? 1 : static_cast<int>(config_.rois.size());
+    bin_scale_ = config_.max_kev > config_.min_kev ? config_.bins / (config_.max_kev - config_.min_kev) : 0.0;
+    images_.assign(config_.gates.size() * pixels_, 0);
+    gate_counts_.assign(config_.gates.size(), 0);
+    spectra_.assign(static_cast<size_t>(groups_) * config_.bins, 0);
+}
+
+void EnergyImager::reset() {
+    std::fill(images_.begin(), images_.end(), 0u);
+    std::fill(gate_counts_.begin(), gate_counts_.end(), 0u);
+    std::fill(spectra_.begin(), spectra_.end(), 0u);
+    stats_ = EnergyImageStats();
+}
+
+void EnergyImager::add(const Tpx3HitBatch& hits, const std::vector<float>& kev) {
+    const size_t n = std::min(hits.size(), kev.size());
+    const size_t ngates = config_.gates.size();
+    const bool byRoi = !config_.rois.empty();
+    const size_t width = config_.image_width;
+    const int bins = config_.bins;
+    stats_.hits += n;
+
+    for (size_t i = 0; i < n; ++i) {
+        const float e = kev[i];
+        const uint32_t pixel = hits.pixel[i];
+        if (e < 0.0f || pixel >= pixels_) {
+            ++stats_.uncalibrated;
+            continue;
+        }
+        for (size_t g = 0; g < ngates; ++g) {
+            if (e >= config_.gates[g].low && e < config_.gates[g].high) {
+                ++images_[g * pixels_ + pixel];
+                ++gate_counts_[g];
+            }
+        }
+
+        const double pos = (e - config_.min_kev) * bin_scale_;
+        if (!(pos >= 0.0) || pos >= bins) {
+            ++stats_.out_of_range;
+            continue;
+        }
+        const int bin = static_cast<int>(pos);
+        if (!byRoi) {
+            ++spectra_[bin];
+            continue;
+        }
+        const int x = static_cast<int>(pixel % width);
+        const int y = static_cast<int>(pixel / width);
+        for (int r = 0; r < groups_; ++r) {
+            const TofRoi& roi = config_.rois[r];
+            if (x >= roi.x && x < roi.x + roi.width && y >= roi.y && y < roi.y + roi.height) {
+                ++spectra_[static_cast<size_t>(r) * bins + bin];
+            }
+        }
+    }
+}
+
+std::vector<double> EnergyImager::bin_centers_kev() const {
+    std::vector<double> axis(config_.bins);
+    const double width = (config_.max_kev - config_.min_kev) / config_.bins;
+    for (int b = 0; b < config_.bins; ++b) axis[b] = config_.min_kev + (b + 0.5) * width;
+    return axis;
+}
+
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: raw batches -> EnergyCalibration -> EnergyImager -> addrs 32..37
+// -----------------------------------------------------------------------
+
+/**
+ * Mark the energy imager for rebuild from TPX3_ENERGY_* (applied on the Raw
+ * worker thread); reloadCalibration also drops the loaded tables.
+ */
+void ADTimePix::invalidateEnergyImager(bool reloadCalibration) {
+    if (!energyMutex_) return;
+    epicsMutexLock(energyMutex_);
+    energyConfigDirty_ = true;
+    if (reloadCalibration) energyCalib_.reset();
+    epicsMutexUnlock(energyMutex_);
+}
+
+/** Caller holds energyMutex_. Invalid settings leave no imager and a status message. */
+void ADTimePix::rebuildEnergyImager() {
+    int bins = 1000;
+    double minKev = 0.0, maxKev = 100.0;
+    std::string calibDir, gateSpec, roiSpec;
+    getIntegerParam(ADTimePixEnergyBins, &bins);
+    getDoubleParam(ADTimePixEnergyMinKev, &minKev);
+    getDoubleParam(ADTimePixEnergyMaxKev, &maxKev);
+    getStringParam(ADTimePixEnergyCalibDir, calibDir);
+    getStringParam(ADTimePixEnergyGates, gateSpec);
+    getStringParam(ADTimePixEnergyRois, roiSpec);
+
+    energyImager_.reset();
+    energyConfigDirty_ = false;
+    energyLastPublishTime_ = 0.0;
+
+    epicsMutexLock(rawMutex_);
+    const int width = rawImageWidth_;
+    const int height = rawImageHeight_;
+    std::vector<uint32_t> lut = rawPixelLut_;
+    epicsMutexUnlock(rawMutex_);
+
+    EnergyImageConfig cfg;
+    cfg.image_width = static_cast<size_t>(std::max(width, 0));
+    cfg.image_height = static_cast<size_t>(std::max(height, 0));
+    cfg.min_kev = minKev;
+    cfg.max_kev = maxKev;
+    cfg.bins = std::min(std::max(bins, 1), ENERGY_MAX_BINS);
+    const size_t pixels = cfg.image_width * cfg.image_height;
+
+    if (lut.empty() || pixels == 0) {
+        setStringParam(ADTimePixEnergyStatus, "No detector pixel map");
+        return;
+    }
+    if (calibDir.empty()) {
+        setStringParam(ADTimePixEnergyStatus, "No calibration directory");
+        return;
+    }
+    if (!energyCalib_ || energyCalib_->get_dir() != calibDir || energyCalib_->get_pixels() != pixels) {
+        std::unique_ptr<EnergyCalibration> calib(new EnergyCalibration());
+        std::string err;
+        if (!calib->load(calibDir, lut, pixels, err)) {
+            energyCalib_.reset();
+            setIntegerParam(ADTimePixEnergyCalibrated, 0);
+            setStringParam(ADTimePixEnergyStatus, err.c_str());
+            ERR_ARGS("Energy calibration: %s", err.c_str());
+            return;
+        }
+        energyCalib_ = std::move(calib);
+        LOG_ARGS("Energy calibration loaded from %s (%zu of %zu pixels)",
+                 calibDir.c_str(), energyCalib_->get_calibrated(), pixels);
+    }
+    setIntegerParam(ADTimePixEnergyCalibrated, static_cast<int>(energyCalib_->get_calibrated()));
+
+    std::string err;
+    if (!parseEnergyGates(gateSpec, cfg.gates, err) || !parseTofRois(roiSpec, cfg.rois, err)) {
+        setStringParam(ADTimePixEnergyStatus, err.c_str());
+        return;
+    }
+    if (!(maxKev > minKev)) {
+        setStringParam(ADTimePixEnergyStatus, "Need Min < Max keV");
+        return;
+    }
+
+    energyImager_.reset(new EnergyImager(cfg));
+    setIntegerParam(ADTimePixEnergyNumGates, energyImager_->get_gates());
+    setIntegerParam(ADTimePixEnergyGroups, energyImager_->get_groups());
+    char msg[80];
+    epicsSnprintf(msg, sizeof(msg), "OK: %d windows, %d x %d bins",
+                  energyImager_->get_gates(), energyImager_->get_groups(), energyImager_->get_bins());
+    setStringParam(ADTimePixEnergyStatus, msg);
+
+    std::vector<double> axis = energyImager_->bin_centers_kev();
+    doCallbacksFloat64Array(axis.data(), axis.size(), ADTimePixEnergyKev, 0);
+}
+
+/** Push spectra, counters and NDArrays (gated images, spectra, axis). Caller holds energyMutex_. */
+void ADTimePix::publishEnergy() {
+    const int groups = energyImager_->get_groups();
+    const int bins = energyImager_->get_bins();
+    const std::vector<uint64_t>& spectra = energyImager_->spectra();
+    const EnergyImageStats& st = energyImager_->stats();
+
+    energyPublishBuffer_.resize(spectra.size());
+    for (size_t i = 0; i < spectra.size(); ++i) energyPublishBuffer_[i] = static_cast<epicsInt64>(spectra[i]);
+    for (int g = 0; g < groups; ++g) {
+        const epicsInt64* spectrum = energyPublishBuffer_.data() + static_cast<size_t>(g) * bins;
+        epicsInt64 sum = 0;
+        for (int b = 0; b < bins; ++b) sum += spectrum[b];
+        setInteger64Param(g, ADTimePixEnergyCounts, sum);
+        doCallbacksInt64Array(const_cast<epicsInt64*>(spectrum), bins, ADTimePixEnergySpectrum, g);
+    }
+    const int gates = energyImager_->get_gates();
+    for (int g = 0; g < gates; ++g) {
+        setInteger64Param(g, ADTimePixEnergyGateCounts, static_cast<epicsInt64>(energyImager_->gate_counts(g)));
+    }
+    setInteger64Param(ADTimePixEnergyHits, static_cast<epicsInt64>(st.hits));
+    setInteger64Param(ADTimePixEnergyUncalibrated, static_cast<epicsInt64>(st.uncalibrated));
+    setInteger64Param(ADTimePixEnergyOutOfRange, static_cast<epicsInt64>(st.out_of_range));
+    // Every per-address param is set before any address is posted
+    for (int g = 0; g < std::max(groups, gates); ++g) callParamCallbacks(g);
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return;
+
+    const EnergyImageConfig& cfg = energyImager_->config();
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    size_t imgDims[2] = { cfg.image_width, cfg.image_height };
+    const size_t pixels = cfg.image_width * cfg.image_height;
+    for (int g = 0; g < gates; ++g) {
+        NDArray* pImg = pNDArrayPool->alloc(2, imgDims, NDUInt32, 0, NULL);
+        if (!pImg || !pImg->pData) {
+            if (pImg) pImg->release();
+            ERR("Failed to allocate energy gate NDArray");
+            return;
+        }
+        std::memcpy(pImg->pData, energyImager_->image(g), pixels * sizeof(uint32_t));
+        double low = cfg.gates[g].low;
+        double high = cfg.gates[g].high;
+        pImg->epicsTS = now;
+        pImg->timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+        if (pImg->pAttributeList) {
+            getAttributes(pImg->pAttributeList);
+            pImg->pAttributeList->add("EnergyLowKeV", "Energy window low edge (keV)", NDAttrFloat64, &low);
+            pImg->pAttributeList->add("EnergyHighKeV", "Energy window high edge (keV)", NDAttrFloat64, &high);
+        }
+        doCallbacksGenericPointer(pImg, NDArrayData, NDARRAY_ADDR_ENERGY_GATE0 + g);
+        pImg->release();
+    }
+
+    double minKev = cfg.min_kev;
+    double maxKev = cfg.max_kev;
+    size_t dims[2] = { static_cast<size_t>(bins), static_cast<size_t>(groups) };
+    NDArray* pArr = pNDArrayPool->alloc(2, dims, NDInt64, 0, NULL);
+    if (!pArr || !pArr->pData) {
+        if (pArr) pArr->release();
+        ERR("Failed to allocate energy spectrum NDArray");
+        return;
+    }
+    std::memcpy(pArr->pData, energyPublishBuffer_.data(), energyPublishBuffer_.size() * sizeof(epicsInt64));
+    pArr->epicsTS = now;
+    pArr->timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+    if (pArr->pAttributeList) {
+        getAttributes(pArr->pAttributeList);
+        pArr->pAttributeList->add("EnergyMinKeV", "First bin edge (keV)", NDAttrFloat64, &minKev);
+        pArr->pAttributeList->add("EnergyMaxKeV", "Last bin edge (keV)", NDAttrFloat64, &maxKev);
+    }
+    doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_ENERGY_SPECTRUM);
+    pArr->release();
+
+    std::vector<double> axis = energyImager_->bin_centers_kev();
+    size_t axisDims[1] = { axis.size() };
+    NDArray* pAxis = pNDArrayPool->alloc(1, axisDims, NDFloat64, 0, NULL);
+    if (!pAxis || !pAxis->pData) {
+        if (pAxis) pAxis->release();
+        ERR("Failed to allocate energy axis NDArray");
+        return;
+    }
+    std::memcpy(pAxis->pData, axis.data(), axis.size() * sizeof(double));
+    pAxis->epicsTS = now;
+    pAxis->timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+    doCallbacksGenericPointer(pAxis, NDArrayData, NDARRAY_ADDR_ENERGY_AXIS);
+    pAxis->release();
+}
+
+/** Raw worker hook: convert one decoded batch to keV and accumulate it. */
+void ADTimePix::processEnergyBatch(const Tpx3HitBatch& hits) {
+    int enable = 0;
+    getIntegerParam(ADTimePixEnergyEnable, &enable);
+    if (!enable || hits.empty()) return;
+
+    epicsMutexLock(energyMutex_);
+    if (energyConfigDirty_) rebuildEnergyImager();
+    if (energyImager_ && energyCalib_) {
+        energyCalib_->convert(hits, energyKev_);
+        energyImager_->add(hits, energyKev_);
+        double period = 1.0;
+        getDoubleParam(ADTimePixEnergyPublishPeriod, &period);
+        const double now = nowSeconds();
+        if (now - energyLastPublishTime_ >= std::max(period, 0.05)) {
+            energyLastPublishTime_ = now;
+            publishEnergy();
+            callParamCallbacks();
+        }
+    }
+    epicsMutexUnlock(energyMutex_);
+}
+
+/** TPX3_ENERGY_RESET: zero gated images, spectra and counters. */
+void ADTimePix::resetEnergy() {
+    if (!energyMutex_) return;
+    epicsMutexLock(energyMutex_);
+    if (energyImager_) {
+        energyImager_->reset();
+        publishEnergy();
+    }
+    epicsMutexUnlock(energyMutex_);
+}
+
+/** Final publish at end of acquisition; publishEnergy() posts every group and gate address. */
+void ADTimePix::flushEnergy() {
+    if (!energyMutex_) return;
+    epicsMutexLock(energyMutex_);
+    if (energyImager_) publishEnergy();
+    epicsMutexUnlock(energyMutex_);
+    callParamCallbacks();
+}
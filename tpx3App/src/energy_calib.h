@@ -0,0 +1,152 @@
+/*
+ * ADTimePix3 - Per-pixel ToT to energy calibration of decoded raw hits
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef ENERGY_CALIB_H
+#define ENERGY_CALIB_H
+
+#include "tpx3_raw.h"
+#include "tof_histogram.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** Maximum energy windows (one gated image / NDArray address each). */
+constexpr int ENERGY_MAX_GATES = 4;
+/** Maximum bins per energy spectrum (TPX3_ENERGY_SPECTRUM waveform NELM). */
+constexpr int ENERGY_MAX_BINS = 100000;
+
+/** @brief Energy window [low, high) in keV. */
+struct EnergyGate {
+    double low = 0.0;
+    double high = 0.0;
+};
+
+/**
+ * @brief Parse an energy window list "low:high,low:high,..." (keV)
+ *
+ * Whitespace is ignored. Each window needs high > low >= 0. At most
+ * ENERGY_MAX_GATES.
+ * @return true on success; on failure gates is left empty and err describes the problem
+ */
+bool parseEnergyGates(const std::string& spec, std::vector<EnergyGate>& gates, std::string& err);
+
+/**
+ * @brief Per-pixel surrogate calibration ToT = a*E + b - c / (E - t)
+ *
+ * The four coefficient tables (caliba.txt, calibb.txt, calibc.txt,
+ * calibt.txt in one directory) hold one whitespace-separated value per pixel
+ * in chip order, 256 rows of 256 per chip: the same BPC order as the mask and
+ * BPC files. They are mapped to image pixels with the decoder pixel LUT
+ * (bpc2ImgIndex), so lookups use Tpx3HitBatch::pixel directly.
+ *
+ * The inversion is the root above t,
+ *   E = (u + a t + sqrt((u - a t)^2 + 4 a c)) / (2 a),  u = ToT - b,
+ * with a*t, 4*a*c and 1/(2a) precomputed per pixel. convert() first gathers
+ * the coefficients of a batch into contiguous arrays, then evaluates the
+ * formula in one branch-free loop the compiler vectorizes.
+ */
+class EnergyCalibration {
+public:
+    /**
+     * @brief Load the tables from dir
+     * @param pixel_lut BPC index -> image index (TPX3_PIXEL_NONE unmapped); its size is the expected value count
+     * @param image_pixels image width * height
+     */
+    bool load(const std::string& dir, const std::vector<uint32_t>& pixel_lut, size_t image_pixels, std::string& err);
+
+    /** Energy in keV per hit; -1 for pixels without a calibration (a <= 0) or image position. */
+    void convert(const Tpx3HitBatch& hits, std::vector<float>& kev);
+
+    bool is_loaded() const { return !coef_.empty(); }
+    const std::string& get_dir() const { return dir_; }
+    size_t get_pixels() const { return pixels_; }
+    /** Image pixels with a usable calibration. */
+    size_t get_calibrated() const { return calibrated_; }
+
+private:
+    std::string dir_;
+    size_t pixels_ = 0;
+    size_t calibrated_ = 0;
+    /** Precomputed coefficients of one pixel; one 16-byte load per hit in the gather. */
+    struct Coef {
+        float b;
+        float at;                     // a * t
+        float ac4;                    // 4 * a * c
+        float inv_2a;                 // 1 / (2 a), 0 = uncalibrated
+    };
+    // Per image pixel, plus one trailing uncalibrated entry for unmapped hits
+    std::vector<Coef> coef_;
+    // convert() scratch
+    std::vector<uint32_t> index_;
+    std::vector<float> gb_;
+    std::vector<float> gat_;
+    std::vector<float> gac4_;
+    std::vector<float> ginv_;
+};
+
+/** @brief Gated images and spectra configuration. */
+struct EnergyImageConfig {
+    size_t image_width = 0;
+    size_t image_height = 0;
+    std::vector<EnergyGate> gates;
+    std::vector<TofRoi> rois;         // empty = one spectrum of the whole detector
+    double min_kev = 0.0;
+    double max_kev = 100.0;
+    int bins = 1000;
+};
+
+/** @brief Counters since reset(). */
+struct EnergyImageStats {
+    uint64_t hits = 0;
+    uint64_t uncalibrated = 0;
+    uint64_t out_of_range = 0;        // energy outside [min, max) of the spectrum
+};
+
+/**
+ * @brief Energy-gated count images and per-ROI energy spectra
+ *
+ * Fed with a hit batch and the energies from EnergyCalibration::convert().
+ * Gate g counts hits with low <= E < high in an image-sized uint32 map;
+ * spectrum group r histograms E of hits inside ROI r (linear bins).
+ */
+class EnergyImager {
+public:
+    explicit EnergyImager(const EnergyImageConfig& config);
+
+    void add(const Tpx3HitBatch& hits, const std::vector<float>& kev);
+
+    /** Zero images, spectra and counters. */
+    void reset();
+
+    const EnergyImageConfig& config() const { return config_; }
+    int get_gates() const { return static_cast<int>(config_.gates.size()); }
+    int get_groups() const { return groups_; }
+    int get_bins() const { return config_.bins; }
+    const uint32_t* image(int gate) const { return images_.data() + static_cast<size_t>(gate) * pixels_; }
+    uint64_t gate_counts(int gate) const { return gate_counts_[gate]; }
+    /** Spectra, group-major (groups x bins). */
+    const std::vector<uint64_t>& spectra() const { return spectra_; }
+    const EnergyImageStats& stats() const { return stats_; }
+    /** Bin centres in keV. */
+    std::vector<double> bin_centers_kev() const;
+
+private:
+    EnergyImageConfig config_;
+    size_t pixels_;
+    int groups_;
+    double bin_scale_;                // bins per keV
+    std::vector<uint32_t> images_;    // gates x pixels
+    std::vector<uint64_t> gate_counts_;
+    std::vector<uint64_t> spectra_;
+    EnergyImageStats stats_;
+};
+
+#endif // ENERGY_CALIB_H
@@ -0,0 +1,277 @@
+/*
+ * ADTimePix3 - Event-mode image builder (count / ToT-sum / first-ToA images from raw hits)
+ *
+ * Fed from the Raw TCP decoder (TPX3_RAW_DECODE=1) when TPX3_EVTIMG_ENABLE=1.
+ * Each completed window is published as three NDUInt32 images: hit count
+ * (addr 18), summed ToT (addr 19) and earliest ToA within the window (addr 20).
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "event_image.h"
+#include "tof_gate.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+extern const char* driverName;
+
+// EventImageBuilder class implementation
+EventImageBuilder::EventImageBuilder(size_t width, size_t height, EventWindowMode mode,
+                                     uint64_t duration_ticks, uint64_t events_per_window, uint8_t tdc_edge)
+    : width_(width), height_(height), mode_(mode),
+      duration_(std::max<uint64_t>(duration_ticks, 1)),
+      events_per_window_(std::max<uint64_t>(events_per_window, 1)),
+      tdc_edge_(tdc_edge) {
+    const size_t n = width * height;
+    count_.assign(n, 0);
+    tot_sum_.assign(n, 0);
+    first_toa_.assign(n, 0);
+    touched_.reserve(4096);
+}
+
+void EventImageBuilder::clear_images() {
+    // Sparse windows: zero only what was written; dense ones: plain fill is faster
+    if (touched_.size() * 8 < count_.size()) {
+        for (uint32_t p : touched_) {
+            count_[p] = 0;
+            tot_sum_[p] = 0;
+            first_toa_[p] = 0;
+        }
+    } else {
+        std::fill(count_.begin(), count_.end(), 0u);
+        std::fill(tot_sum_.begin(), tot_sum_.end(), 0u);
+        std::fill(first_toa_.begin(), first_toa_.end(), 0u);
+    }
+    touched_.clear();
+}
+
+void EventImageBuilder::open_window(uint64_t start) {
+    window_open_ = true;
+    window_start_ = start;
+    window_events_ = 0;
+}
+
+void EventImageBuilder::close_window(uint64_t end, const FrameCallback& on_frame) {
+    if (on_frame) {
+        EventImageFrame frame;
+        frame.count = count_.data();
+        frame.tot_sum = tot_sum_.data();
+        frame.first_toa = first_toa_.data();
+        frame.width = width_;
+        frame.height = height_;
+        frame.index = frames_;
+        frame.window_start = window_start_;
+        frame.window_end = end;
+        frame.events = window_events_;
+        on_frame(frame);
+    }
+    ++frames_;
+    clear_images();
+    window_open_ = false;
+    window_events_ = 0;
+}
+
+void EventImageBuilder::add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs, const FrameCallback& on_frame) {
+    if (mode_ == EVENT_WINDOW_TDC) {
+        for (size_t k = 0; k < tdcs.size(); ++k) {
+            if (tdcs.edge[k] == tdc_edge_) pending_tdc_.push_back(tdcs.time[k]);
+        }
+    }
+
+    const size_t npix = count_.size();
+    const uint64_t maxRel = std::numeric_limits<uint32_t>::max();
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const uint32_t pix = hits.pixel[i];
+        const uint64_t t = hits.toa[i];
+        if (pix >= npix) {
+            ++dropped_;
+            continue;
+        }
+
+        if (mode_ == EVENT_WINDOW_DURATION) {
+            if (!window_open_) {
+                open_window(t);
+            } else if (t >= window_start_ + duration_) {
+                const uint64_t next = window_start_ + ((t - window_start_) / duration_) * duration_;
+                close_window(window_start_ + duration_, on_frame);
+                open_window(next);
+            }
+        } else if (mode_ == EVENT_WINDOW_TDC) {
+            while (!pending_tdc_.empty() && pending_tdc_.front() <= t) {
+                const uint64_t edge = pending_tdc_.front();
+                pending_tdc_.pop_front();
+                if (window_open_) close_window(edge, on_frame);
+                open_window(edge);
+            }
+            if (!window_open_) {
+                ++dropped_;
+                continue;
+            }
+        } else if (!window_open_) {
+            open_window(t);
+        }
+
+        const uint32_t rel = static_cast<uint32_t>(
+            std::min<uint64_t>((t > window_start_ ? t - window_start_ : 0) / TPX3_TICKS_PER_FTOA, maxRel));
+        if (count_[pix]++ == 0) {
+            touched_.push_back(pix);
+            first_toa_[pix] = rel;
+        } else if (rel < first_toa_[pix]) {
+            first_toa_[pix] = rel;
+        }
+        tot_sum_[pix] += hits.tot[i];
+        ++window_events_;
+        last_hit_toa_ = std::max(last_hit_toa_, t);
+
+        if (mode_ == EVENT_WINDOW_EVENTS && window_events_ >= events_per_window_) {
+            close_window(last_hit_toa_ + 1, on_frame);
+        }
+    }
+}
+
+void EventImageBuilder::flush(const FrameCallback& on_frame) {
+    if (window_open_ && window_events_ > 0) {
+        const uint64_t end = (mode_ == EVENT_WINDOW_DURATION) ? window_start_ + duration_ : last_hit_toa_ + 1;
+        close_window(end, on_frame);
+    }
+}
+
+void EventImageBuilder::reset() {
+    clear_images();
+    window_open_ = false;
+    window_start_ = 0;
+    window_events_ = 0;
+    last_hit_toa_ = 0;
+    pending_tdc_.clear();
+    frames_ = 0;
+    dropped_ = 0;
+}
+
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: raw batches -> EventImageBuilder -> NDArray addrs 18..20
+// -----------------------------------------------------------------------
+
+/** Mark the builder for rebuild from TPX3_EVTIMG_* (applied on the Raw worker thread). */
+void ADTimePix::invalidateEventImageBuilder() {
+    if (!evtImgMutex_) return;
+    epicsMutexLock(evtImgMutex_);
+    evtImgConfigDirty_ = true;
+    epicsMutexUnlock(evtImgMutex_);
+}
+
+/** Caller holds evtImgMutex_. */
+void ADTimePix::rebuildEventImageBuilder() {
+    int mode = EVENT_WINDOW_DURATION, events = 1, tdcEdge = TPX3_TDC1_RISE;
+    double durationMs = 1.0;
+    getIntegerParam(ADTimePixEvtImgMode, &mode);
+    getIntegerParam(ADTimePixEvtImgEvents, &events);
+    getIntegerParam(ADTimePixEvtImgTdcEdge, &tdcEdge);
+    getDoubleParam(ADTimePixEvtImgDurationMs, &durationMs);
+    if (mode < EVENT_WINDOW_DURATION || mode > EVENT_WINDOW_EVENTS) mode = EVENT_WINDOW_DURATION;
+    if (tdcEdge < TPX3_TDC1_RISE || tdcEdge > TPX3_TDC2_FALL) tdcEdge = TPX3_TDC1_RISE;
+
+    epicsMutexLock(rawMutex_);
+    const int width = rawImageWidth_;
+    const int height = rawImageHeight_;
+    epicsMutexUnlock(rawMutex_);
+
+    evtImgBuilder_.reset();
+    if (width > 0 && height > 0) {
+        evtImgBuilder_.reset(new EventImageBuilder(width, height, static_cast<EventWindowMode>(mode),
+                                                   tofMsToTicks(durationMs),
+                                                   static_cast<uint64_t>(std::max(events, 1)),
+                                                   static_cast<uint8_t>(tdcEdge)));
+    }
+    evtImgConfigDirty_ = false;
+    evtImgSkipped_ = 0;
+    evtImgLastPublishTime_ = 0.0;
+}
+
+/** Push one completed window as three NDUInt32 arrays. Caller holds evtImgMutex_. */
+void ADTimePix::publishEventImageFrame(const EventImageFrame& frame) {
+    double maxRate = 0.0;
+    getDoubleParam(ADTimePixEvtImgMaxRate, &maxRate);
+    const double nowSec = nowSeconds();
+    if (maxRate > 0.0 && nowSec - evtImgLastPublishTime_ < 1.0 / maxRate) {
+        ++evtImgSkipped_;
+        return;
+    }
+    evtImgLastPublishTime_ = nowSec;
+
+    setIntegerParam(ADTimePixEvtImgFrames, static_cast<int>(frame.index + 1));
+    setIntegerParam(ADTimePixEvtImgFrameEvents, static_cast<int>(std::min<uint64_t>(frame.events, 0x7FFFFFFF)));
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return;
+
+    const uint32_t* planes[3] = { frame.count, frame.tot_sum, frame.first_toa };
+    const int addrs[3] = { NDARRAY_ADDR_EVTIMG_COUNT, NDARRAY_ADDR_EVTIMG_TOT, NDARRAY_ADDR_EVTIMG_TOA };
+    size_t dims[3] = { frame.width, frame.height, 0 };
+    const size_t bytes = frame.width * frame.height * sizeof(uint32_t);
+    epicsInt32 windowIndex = static_cast<epicsInt32>(frame.index);
+    double windowStartNs = frame.window_start * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+    double windowLengthNs = (frame.window_end - frame.window_start) * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+    epicsInt64 windowEvents = static_cast<epicsInt64>(frame.events);
+
+    for (int k = 0; k < 3; ++k) {
+        NDArray* pArr = pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+        if (!pArr || !pArr->pData) {
+            if (pArr) pArr->release();
+            ERR("Failed to allocate event image NDArray");
+            return;
+        }
+        std::memcpy(pArr->pData, planes[k], bytes);
+        pArr->uniqueId = windowIndex;
+        epicsTimeGetCurrent(&pArr->epicsTS);
+        pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+        if (pArr->pAttributeList) {
+            getAttributes(pArr->pAttributeList);
+            pArr->pAttributeList->add("WindowIndex", "Event window index", NDAttrInt32, &windowIndex);
+            pArr->pAttributeList->add("WindowStartNs", "Window start (ns, detector clock)", NDAttrFloat64, &windowStartNs);
+            pArr->pAttributeList->add("WindowLengthNs", "Window length (ns)", NDAttrFloat64, &windowLengthNs);
+            pArr->pAttributeList->add("WindowEvents", "Hits in window", NDAttrInt64, &windowEvents);
+        }
+        doCallbacksGenericPointer(pArr, NDArrayData, addrs[k]);
+        pArr->release();
+    }
+}
+
+/** Raw worker hook: feed one decoded batch into the event image builder. */
+void ADTimePix::processEventImageBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    int enable = 0;
+    getIntegerParam(ADTimePixEvtImgEnable, &enable);
+    if (!enable) return;
+
+    epicsMutexLock(evtImgMutex_);
+    if (evtImgConfigDirty_ || !evtImgBuilder_) rebuildEventImageBuilder();
+    if (evtImgBuilder_) {
+        evtImgBuilder_->add(hits, tdcs, [this](const EventImageFrame& f) { publishEventImageFrame(f); });
+        setInteger64Param(ADTimePixEvtImgDropped, static_cast<epicsInt64>(evtImgBuilder_->get_dropped()));
+        setInteger64Param(ADTimePixEvtImgSkipped, static_cast<epicsInt64>(evtImgSkipped_));
+    }
+    epicsMutexUnlock(evtImgMutex_);
+}
+
+/** Emit the partially filled window at end of acquisition and drop builder state. */
+void ADTimePix::flushEventImage() {
+    if (!evtImgMutex_) return;
+    epicsMutexLock(evtImgMutex_);
+    if (evtImgBuilder_) {
+        evtImgLastPublishTime_ = 0.0;  // always publish the final window
+        evtImgBuilder_->flush([this](const EventImageFrame& f) { publishEventImageFrame(f); });
+        evtImgBuilder_->reset();
+    }
+    evtImgConfigDirty_ = true;
+    epicsMutexUnlock(evtImgMutex_);
+    callParamCallbacks();
+}
@@ -0,0 +1,103 @@
+/*
+ * ADTimePix3 - Event-mode image builder (count / ToT-sum / first-ToA images from raw hits)
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef EVENT_IMAGE_H
+#define EVENT_IMAGE_H
+
+#include "tpx3_raw.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** TPX3_EVTIMG_MODE values: how a window is closed. */
+enum EventWindowMode {
+    EVENT_WINDOW_DURATION = 0,  // fixed duration in TDC ticks, aligned to the first hit
+    EVENT_WINDOW_TDC = 1,       // from one TDC edge to the next
+    EVENT_WINDOW_EVENTS = 2     // after N hits
+};
+
+/**
+ * @brief One completed window; pointers are valid only inside the callback
+ *
+ * first_toa is relative to window_start in 1.5625 ns units (pixel FToA LSB) and
+ * is meaningful only where count > 0.
+ */
+struct EventImageFrame {
+    const uint32_t* count;
+    const uint32_t* tot_sum;
+    const uint32_t* first_toa;
+    size_t width;
+    size_t height;
+    uint64_t index;            // window number since reset
+    uint64_t window_start;     // TDC ticks
+    uint64_t window_end;       // TDC ticks (exclusive; last hit + 1 in EVENTS mode)
+    uint64_t events;
+};
+
+/**
+ * @brief Builds count, summed-ToT and first-ToA images over time windows
+ *
+ * Hits must carry an image pixel index (decoder LUT). Hits are taken in batch
+ * order; a hit earlier than the open window (out-of-order within a chip batch)
+ * is counted into the open window. Only touched pixels are cleared between
+ * windows, so sub-millisecond windows on a sparse detector stay cheap.
+ * In Duration mode windows without any hit are skipped, not emitted empty.
+ */
+class EventImageBuilder {
+public:
+    typedef std::function<void(const EventImageFrame&)> FrameCallback;
+
+    EventImageBuilder(size_t width, size_t height, EventWindowMode mode,
+                      uint64_t duration_ticks, uint64_t events_per_window, uint8_t tdc_edge);
+
+    /** Add a decoded batch; completed windows are passed to on_frame. */
+    void add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs, const FrameCallback& on_frame);
+
+    /** Emit the open window if it holds any hits (end of acquisition). */
+    void flush(const FrameCallback& on_frame);
+
+    /** Drop the open window and counters. */
+    void reset();
+
+    size_t get_width() const { return width_; }
+    size_t get_height() const { return height_; }
+    uint64_t get_frames() const { return frames_; }
+    /** Hits without an image pixel, or before the first TDC edge in TDC mode. */
+    uint64_t get_dropped() const { return dropped_; }
+
+private:
+    void open_window(uint64_t start);
+    void close_window(uint64_t end, const FrameCallback& on_frame);
+    void clear_images();
+
+    size_t width_;
+    size_t height_;
+    EventWindowMode mode_;
+    uint64_t duration_;
+    uint64_t events_per_window_;
+    uint8_t tdc_edge_;
+
+    std::vector<uint32_t> count_;
+    std::vector<uint32_t> tot_sum_;
+    std::vector<uint32_t> first_toa_;
+    std::vector<uint32_t> touched_;   // pixels with count_ > 0 in the open window
+
+    bool window_open_ = false;
+    uint64_t window_start_ = 0;
+    uint64_t window_events_ = 0;
+    uint64_t last_hit_toa_ = 0;
+    std::deque<uint64_t> pending_tdc_;  // TDC edges not yet passed by a hit
+    uint64_t frames_ = 0;
+    uint64_t dropped_ = 0;
+};
+
+#endif // EVENT_IMAGE_H
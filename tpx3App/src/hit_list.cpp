@@ -0,0 +1,155 @@
+/*
+ * ADTimePix3 - List-mode NDArrays of decoded Raw hits
+ *
+ * With TPX3_HITLIST_ENABLE=1 the Raw decode worker copies every hit with an
+ * image position into batches published on NDArray address 39, for plugins that
+ * store events rather than images (e.g. NDFileHDF5). A batch is an NDFloat64
+ * {4, N} array with one row of x, y, ToA ns, ToT (25 ns units) per hit, the
+ * same row layout as the cluster list; it is closed after TPX3_HITLIST_EVENTS
+ * hits or once it spans TPX3_HITLIST_DURATION_MS of detector time. Rows are
+ * staged in a reusable buffer and copied once into a pool array of exactly
+ * {4, N} when the batch closes, so short batches take only what they hold from
+ * the NDArray pool; every plugin shares that array.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "tof_gate.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cstring>
+
+extern const char* driverName;
+
+namespace {
+
+/** Number of columns in a hit list (x, y, toa_ns, tot). */
+constexpr size_t HIT_LIST_COLUMNS = 4;
+/** Largest batch (128 MB of rows). */
+constexpr int HIT_LIST_MAX_EVENTS = 1 << 22;
+
+}  // namespace
+
+/** Caller holds hitListMutex_. Start a batch at detector time startTicks. */
+void ADTimePix::beginHitList(uint64_t startTicks) {
+    int events = 0;
+    getIntegerParam(ADTimePixHitListEvents, &events);
+    epicsMutexLock(rawMutex_);
+    hitListWidth_ = std::max(rawImageWidth_, 1);
+    epicsMutexUnlock(rawMutex_);
+    hitListOpen_ = true;
+    hitListCapacity_ = static_cast<size_t>(std::min(std::max(events, 1), HIT_LIST_MAX_EVENTS));
+    hitListCount_ = 0;
+    hitListRows_.clear();
+    hitListStart_ = startTicks;
+    hitListEnd_ = startTicks;
+}
+
+/** Caller holds hitListMutex_. Copy the open batch into a {4, rows} pool array and hand it to the plugins. */
+void ADTimePix::publishHitList() {
+    if (!hitListOpen_) return;
+    hitListOpen_ = false;
+    if (hitListCount_ == 0) return;
+    size_t dims[2] = { HIT_LIST_COLUMNS, hitListCount_ };
+    NDArray* pArr = pNDArrayPool ? pNDArrayPool->alloc(2, dims, NDFloat64, 0, NULL) : NULL;
+    if (!pArr || !pArr->pData) {
+        if (pArr) pArr->release();
+        hitListDropped_ += hitListCount_;  // pool exhausted: lose this batch
+        hitListCount_ = 0;
+        return;
+    }
+    std::memcpy(pArr->pData, hitListRows_.data(), hitListCount_ * HIT_LIST_COLUMNS * sizeof(epicsFloat64));
+    hitListHits_ += hitListCount_;
+    ++hitListBatches_;
+    epicsInt32 events = static_cast<epicsInt32>(hitListCount_);
+    epicsInt64 batch = static_cast<epicsInt64>(hitListBatches_);
+    epicsFloat64 startNs = hitListStart_ * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+    epicsFloat64 endNs = hitListEnd_ * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+    pArr->uniqueId = static_cast<int>(hitListBatches_);
+    epicsTimeGetCurrent(&pArr->epicsTS);
+    pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+    if (pArr->pAttributeList) {
+        getAttributes(pArr->pAttributeList);
+        pArr->pAttributeList->add("Columns", "Column names", NDAttrString, const_cast<char*>("x,y,toa_ns,tot"));
+        pArr->pAttributeList->add("Events", "Hits in this batch", NDAttrInt32, &events);
+        pArr->pAttributeList->add("BatchNumber", "Batches since start", NDAttrInt64, &batch);
+        pArr->pAttributeList->add("BatchStartNs", "ToA of the first hit (ns)", NDAttrFloat64, &startNs);
+        pArr->pAttributeList->add("BatchEndNs", "Latest ToA in the batch (ns)", NDAttrFloat64, &endNs);
+    }
+    doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_HIT_LIST);
+    pArr->release();
+    hitListCount_ = 0;
+}
+
+/** Raw worker hook: append one decoded batch to the open hit list. */
+void ADTimePix::processHitListBatch(const Tpx3HitBatch& hits) {
+    int enable = 0, arrayCallbacks = 0;
+    getIntegerParam(ADTimePixHitListEnable, &enable);
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!enable || !arrayCallbacks || hits.empty()) return;
+    double durationMs = 0.0;
+    getDoubleParam(ADTimePixHitListDurationMs, &durationMs);
+    const uint64_t duration = durationMs > 0.0 ? tofMsToTicks(durationMs) : 0;
+    const double nsPerTick = TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+
+    epicsMutexLock(hitListMutex_);
+    const size_t n = hits.size();
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t pixel = hits.pixel[i];
+        if (pixel == TPX3_PIXEL_NONE) {
+            ++hitListUnmapped_;
+            continue;
+        }
+        const uint64_t toa = hits.toa[i];
+        if (hitListOpen_ && duration && toa >= hitListStart_ && toa - hitListStart_ >= duration) {
+            publishHitList();
+        }
+        if (!hitListOpen_) beginHitList(toa);
+        hitListRows_.push_back(pixel % hitListWidth_);
+        hitListRows_.push_back(pixel / hitListWidth_);
+        hitListRows_.push_back(toa * nsPerTick);
+        hitListRows_.push_back(hits.tot[i]);
+        hitListEnd_ = std::max(hitListEnd_, toa);
+        if (++hitListCount_ == hitListCapacity_) publishHitList();
+    }
+    setIntegerParam(ADTimePixHitListBatches, static_cast<int>(hitListBatches_));
+    setInteger64Param(ADTimePixHitListHits, static_cast<epicsInt64>(hitListHits_));
+    setInteger64Param(ADTimePixHitListUnmapped, static_cast<epicsInt64>(hitListUnmapped_));
+    setInteger64Param(ADTimePixHitListDropped, static_cast<epicsInt64>(hitListDropped_));
+    epicsMutexUnlock(hitListMutex_);
+}
+
+/** Drop an open batch and zero the counters (new stream). */
+void ADTimePix::resetHitList() {
+    if (!hitListMutex_) return;
+    epicsMutexLock(hitListMutex_);
+    hitListOpen_ = false;
+    hitListRows_.clear();
+    hitListCount_ = 0;
+    hitListBatches_ = 0;
+    hitListHits_ = 0;
+    hitListUnmapped_ = 0;
+    hitListDropped_ = 0;
+    epicsMutexUnlock(hitListMutex_);
+    setIntegerParam(ADTimePixHitListBatches, 0);
+    setInteger64Param(ADTimePixHitListHits, 0);
+    setInteger64Param(ADTimePixHitListUnmapped, 0);
+    setInteger64Param(ADTimePixHitListDropped, 0);
+}
+
+/** Publish the partial batch at end of acquisition. */
+void ADTimePix::flushHitList() {
+    if (!hitListMutex_) return;
+    epicsMutexLock(hitListMutex_);
+    publishHitList();
+    setIntegerParam(ADTimePixHitListBatches, static_cast<int>(hitListBatches_));
+    setInteger64Param(ADTimePixHitListHits, static_cast<epicsInt64>(hitListHits_));
+    setInteger64Param(ADTimePixHitListDropped, static_cast<epicsInt64>(hitListDropped_));
+    epicsMutexUnlock(hitListMutex_);
+    callParamCallbacks();
+}
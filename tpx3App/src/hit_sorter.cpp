@@ -0,0 +1,240 @@
+/*
+ * ADTimePix3 - Time ordering of decoded raw hits across chips
+ *
+ * Used by the Raw decode worker (raw_stream.cpp) between Tpx3RawDecoder and
+ * processRawBatch() when TPX3_RAW_SORT=1, so event images, clustering and ToF
+ * histograms see one monotonic stream.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "hit_sorter.h"
+#include <algorithm>
+
+namespace {
+
+/** Min-heap order on (toa, chip) run heads; chip breaks ties deterministically. */
+inline bool headAfter(const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+    return a.first > b.first || (a.first == b.first && a.second > b.second);
+}
+
+}  // namespace
+
+Tpx3HitSorter::Tpx3HitSorter(uint64_t latency_ticks) : latency_(latency_ticks) {}
+
+void Tpx3HitSorter::reset() {
+    started_ = false;
+    newest_ = 0;
+    pixel_base_ = 0;
+    tdc_base_ = 0;
+    emitted_until_ = 0;
+    runs_.clear();
+    tdc_pending_.clear();
+    tdc_head_ = 0;
+    tdc_staging_.clear();
+    stats_ = HitSorterStats();
+}
+
+size_t Tpx3HitSorter::get_buffered_hits() const {
+    size_t n = 0;
+    for (const Run& run : runs_) n += run.pending.size() - run.head;
+    return n;
+}
+
+/** Extend a wrapped time t to the period instance closest to newest_. */
+uint64_t Tpx3HitSorter::unwrap(uint64_t t, uint64_t period, uint64_t base) const {
+    const uint64_t half = period / 2;
+    uint64_t u = base + t;
+    if (u + half < newest_) {
+        u += period;                // newest_ is late in its period, t already wrapped
+    } else if (u > newest_ + half && u >= period) {
+        u -= period;                // t is from before the last wrap
+    }
+    return u;
+}
+
+void Tpx3HitSorter::advance(uint64_t t) {
+    if (t <= newest_) return;
+    newest_ = t;
+    while (newest_ >= pixel_base_ + TPX3_PIXEL_TOA_PERIOD_TICKS) {
+        pixel_base_ += TPX3_PIXEL_TOA_PERIOD_TICKS;
+        ++stats_.rollovers;
+    }
+    while (newest_ >= tdc_base_ + TPX3_TDC_TIME_PERIOD_TICKS) {
+        tdc_base_ += TPX3_TDC_TIME_PERIOD_TICKS;
+    }
+}
+
+uint64_t Tpx3HitSorter::add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs,
+                            Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs) {
+    if (!started_ && (!hits.empty() || !tdcs.empty())) {
+        // Both clocks start together; anchor the timeline on the first value
+        const uint64_t first = !hits.empty() ? hits.toa[0] : tdcs.time[0];
+        newest_ = first;
+        pixel_base_ = first - first % TPX3_PIXEL_TOA_PERIOD_TICKS;
+        tdc_base_ = first - first % TPX3_TDC_TIME_PERIOD_TICKS;
+        started_ = true;
+    }
+
+    // Extend times and split hits into per-chip runs
+    uint64_t batchNewest = 0;
+    const size_t n = hits.size();
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t u = unwrap(hits.toa[i], TPX3_PIXEL_TOA_PERIOD_TICKS, pixel_base_);
+        if (u < emitted_until_) {
+            ++stats_.late_hits;
+            continue;
+        }
+        if (u < newest_) {
+            stats_.max_disorder = std::max(stats_.max_disorder, newest_ - u);
+        } else {
+            advance(u);
+        }
+        batchNewest = std::max(batchNewest, u);
+        const uint8_t chip = hits.chip[i];
+        if (chip >= runs_.size()) runs_.resize(static_cast<size_t>(chip) + 1);
+        runs_[chip].staging.push_back(Hit{ u, hits.pixel[i], hits.tot[i], hits.x[i], hits.y[i] });
+        ++stats_.hits;
+    }
+    for (size_t i = 0; i < tdcs.size(); ++i) {
+        const uint64_t u = unwrap(tdcs.time[i], TPX3_TDC_TIME_PERIOD_TICKS, tdc_base_);
+        if (u < emitted_until_) {
+            ++stats_.late_tdcs;
+            continue;
+        }
+        advance(u);
+        batchNewest = std::max(batchNewest, u);
+        tdc_staging_.push_back(Tdc{ u, tdcs.trigger[i], tdcs.edge[i], tdcs.chip[i] });
+        ++stats_.tdcs;
+    }
+
+    // Sort each run's new hits and merge them behind its pending hits
+    auto hitLess = [](const Hit& a, const Hit& b) { return a.toa < b.toa; };
+    for (Run& run : runs_) {
+        if (run.staging.empty()) continue;
+        if (!std::is_sorted(run.staging.begin(), run.staging.end(), hitLess)) {
+            std::stable_sort(run.staging.begin(), run.staging.end(), hitLess);
+        }
+        if (run.head > 0) {
+            run.pending.erase(run.pending.begin(), run.pending.begin() + run.head);
+            run.head = 0;
+        }
+        const size_t mid = run.pending.size();
+        run.pending.insert(run.pending.end(), run.staging.begin(), run.staging.end());
+        if (mid > 0 && run.pending[mid].toa < run.pending[mid - 1].toa) {
+            std::inplace_merge(run.pending.begin(), run.pending.begin() + mid, run.pending.end(), hitLess);
+        }
+        run.staging.clear();
+    }
+    if (!tdc_staging_.empty()) {
+        auto tdcLess = [](const Tdc& a, const Tdc& b) { return a.time < b.time; };
+        std::stable_sort(tdc_staging_.begin(), tdc_staging_.end(), tdcLess);
+        if (tdc_head_ > 0) {
+            tdc_pending_.erase(tdc_pending_.begin(), tdc_pending_.begin() + tdc_head_);
+            tdc_head_ = 0;
+        }
+        const size_t mid = tdc_pending_.size();
+        tdc_pending_.insert(tdc_pending_.end(), tdc_staging_.begin(), tdc_staging_.end());
+        std::inplace_merge(tdc_pending_.begin(), tdc_pending_.begin() + mid, tdc_pending_.end(), tdcLess);
+        tdc_staging_.clear();
+    }
+
+    if (newest_ > latency_) {
+        const uint64_t watermark = newest_ - latency_;
+        if (watermark > emitted_until_) emit(watermark, out_hits, out_tdcs);
+    }
+    return batchNewest;
+}
+
+void Tpx3HitSorter::flush(Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs) {
+    if (!started_) return;
+    emit(newest_ + 1, out_hits, out_tdcs);
+}
+
+/** K-way merge of every run's hits with toa < until into the output. */
+void Tpx3HitSorter::emit(uint64_t until, Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs) {
+    auto belowUntil = [](const Hit& h, uint64_t t) { return h.toa < t; };
+
+    heap_.clear();
+    run_end_.assign(runs_.size(), 0);
+    size_t total = 0;
+    for (size_t c = 0; c < runs_.size(); ++c) {
+        Run& run = runs_[c];
+        const auto end = std::lower_bound(run.pending.begin() + run.head, run.pending.end(), until, belowUntil);
+        run_end_[c] = static_cast<size_t>(end - run.pending.begin());
+        if (run_end_[c] > run.head) {
+            total += run_end_[c] - run.head;
+            heap_.emplace_back(run.pending[run.head].toa, static_cast<uint32_t>(c));
+        }
+    }
+
+    size_t j = out_hits.size();
+    const size_t newSize = j + total;
+    out_hits.pixel.resize(newSize);
+    out_hits.toa.resize(newSize);
+    out_hits.tot.resize(newSize);
+    out_hits.x.resize(newSize);
+    out_hits.y.resize(newSize);
+    out_hits.chip.resize(newSize);
+
+    if (heap_.size() == 1) {
+        // Single chip (or only one run in range): straight copy
+        const uint32_t c = heap_[0].second;
+        Run& run = runs_[c];
+        for (size_t k = run.head; k < run_end_[c]; ++k, ++j) {
+            const Hit& h = run.pending[k];
+            out_hits.pixel[j] = h.pixel;
+            out_hits.toa[j] = h.toa;
+            out_hits.tot[j] = h.tot;
+            out_hits.x[j] = h.x;
+            out_hits.y[j] = h.y;
+            out_hits.chip[j] = static_cast<uint8_t>(c);
+        }
+        run.head = run_end_[c];
+    } else {
+        std::make_heap(heap_.begin(), heap_.end(), headAfter);
+        while (!heap_.empty()) {
+            std::pop_heap(heap_.begin(), heap_.end(), headAfter);
+            const uint32_t c = heap_.back().second;
+            Run& run = runs_[c];
+            // Drain this run while it stays at or below the next run's head
+            const uint64_t limit = heap_.size() > 1 ? heap_.front().first : UINT64_MAX;
+            size_t k = run.head;
+            do {
+                const Hit& h = run.pending[k];
+                out_hits.pixel[j] = h.pixel;
+                out_hits.toa[j] = h.toa;
+                out_hits.tot[j] = h.tot;
+                out_hits.x[j] = h.x;
+                out_hits.y[j] = h.y;
+                out_hits.chip[j] = static_cast<uint8_t>(c);
+                ++j;
+                ++k;
+            } while (k < run_end_[c] && run.pending[k].toa <= limit);
+            run.head = k;
+            if (k < run_end_[c]) {
+                heap_.back().first = run.pending[k].toa;
+                std::push_heap(heap_.begin(), heap_.end(), headAfter);
+            } else {
+                heap_.pop_back();
+            }
+        }
+    }
+
+    const size_t tdcEnd = static_cast<size_t>(
+        std::lower_bound(tdc_pending_.begin() + tdc_head_, tdc_pending_.end(), until,
+                         [](const Tdc& d, uint64_t t) { return d.time < t; }) - tdc_pending_.begin());
+    for (size_t k = tdc_head_; k < tdcEnd; ++k) {
+        const Tdc& d = tdc_pending_[k];
+        out_tdcs.time.push_back(d.time);
+        out_tdcs.trigger.push_back(d.trigger);
+        out_tdcs.edge.push_back(d.edge);
+        out_tdcs.chip.push_back(d.chip);
+    }
+    tdc_head_ = tdcEnd;
+
+    emitted_until_ = until;
+}
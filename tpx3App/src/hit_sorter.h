@@ -0,0 +1,107 @@
+/*
+ * ADTimePix3 - Time ordering of decoded raw hits across chips
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef HIT_SORTER_H
+#define HIT_SORTER_H
+
+#include "tpx3_raw.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Sorter counters (monotonic until reset()). */
+struct HitSorterStats {
+    uint64_t hits = 0;           // hits accepted
+    uint64_t late_hits = 0;      // dropped: older than the already emitted range
+    uint64_t tdcs = 0;
+    uint64_t late_tdcs = 0;
+    uint64_t rollovers = 0;      // pixel ToA wraps crossed
+    uint64_t max_disorder = 0;   // ticks: largest (newest time - time) seen
+};
+
+/**
+ * @brief Bounded-latency time ordering of hit and TDC batches
+ *
+ * The decoder emits hits chip by chip in readout order, which is only roughly
+ * time ordered. Wrapped pixel ToA (34-bit, ~26.8 s) and TDC time (35-bit coarse,
+ * ~107 s) are first extended to one 64-bit timeline, taking for each value the
+ * period closest to the newest time seen. Hits then go to a per-chip run that is
+ * kept sorted; everything older than (newest time - latency) is k-way merged
+ * across chips through a min-heap and emitted, together with the TDC events of
+ * the same range. Output is therefore monotonic in time; hits arriving behind
+ * the emitted range are dropped and counted as late.
+ */
+class Tpx3HitSorter {
+public:
+    explicit Tpx3HitSorter(uint64_t latency_ticks = 0);
+
+    /** Reorder window in TDC ticks; takes effect on the next add(). */
+    void set_latency(uint64_t ticks) { latency_ = ticks; }
+    uint64_t get_latency() const { return latency_; }
+
+    /**
+     * @brief Add decoded batches; time-ordered output is appended to out_hits / out_tdcs
+     * @return newest extended time accepted from this batch (0 = none); lets a
+     *         caller merging several sources track how far each one has got
+     */
+    uint64_t add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs,
+                 Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs);
+
+    /** Emit everything still buffered (end of stream or idle). */
+    void flush(Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs);
+
+    /** Drop buffered data, timeline and counters (new stream). */
+    void reset();
+
+    const HitSorterStats& stats() const { return stats_; }
+    /** Newest extended time seen from any batch. */
+    uint64_t get_newest() const { return newest_; }
+    size_t get_buffered_hits() const;
+
+private:
+    struct Hit {
+        uint64_t toa;
+        uint32_t pixel;
+        uint16_t tot;
+        uint8_t x;
+        uint8_t y;
+    };
+    struct Tdc {
+        uint64_t time;
+        uint16_t trigger;
+        uint8_t edge;
+        uint8_t chip;
+    };
+    struct Run {
+        std::vector<Hit> pending;    // sorted; [head, end) not yet emitted
+        size_t head = 0;
+        std::vector<Hit> staging;    // this batch, arrival order
+    };
+
+    uint64_t unwrap(uint64_t t, uint64_t period, uint64_t base) const;
+    void advance(uint64_t t);
+    void emit(uint64_t until, Tpx3HitBatch& out_hits, Tpx3TdcBatch& out_tdcs);
+
+    uint64_t latency_;
+    bool started_ = false;
+    uint64_t newest_ = 0;           // newest extended time seen
+    uint64_t pixel_base_ = 0;       // start of the pixel ToA period containing newest_
+    uint64_t tdc_base_ = 0;         // start of the TDC period containing newest_
+    uint64_t emitted_until_ = 0;    // everything older than this was emitted
+    std::vector<Run> runs_;         // index = chip
+    std::vector<Tdc> tdc_pending_;  // sorted; [tdc_head_, end) not yet emitted
+    size_t tdc_head_ = 0;
+    std::vector<Tdc> tdc_staging_;
+    std::vector<std::pair<uint64_t, uint32_t>> heap_;   // (toa, chip) of run heads
+    std::vector<size_t> run_end_;
+    HitSorterStats stats_;
+};
+
+#endif // HIT_SORTER_H
@@ -0,0 +1,433 @@
+/*
+ * ADTimePix3 - Bit-packed pixel mask with word-level shape ops and mask algebra
+ *
+ * The MaskBPC waveform used to be the mask: maskReset(), maskRectangle() and
+ * maskCircle() wrote one epicsInt32 per pixel into the record buffer, and
+ * TPX3_MASK_WRITE walked every pixel through pelIndex(). The driver now keeps
+ * a working BitMask (1 bit per pixel) that the shape PVs edit with word
+ * operations, a stack of named masks (TPX3_MASK_NAME + STORE / RECALL /
+ * DELETE), and TPX3_MASK_OP / TPX3_MASK_OP_APPLY for union, intersect,
+ * subtract, invert, dilate, erode and "from BPC file" on the working mask.
+ * The waveform shows the working mask in bit 0 when it is processed, and a
+ * mask write ORs the set bits into the BPC bytes through the CoordMap table.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "mask_engine.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+
+#include <algorithm>
+#include <cmath>
+
+extern const char* driverName;
+
+namespace {
+
+/** Bits lo..hi (inclusive, 0..63) of a word. */
+inline uint64_t bitRange(int lo, int hi) {
+    const uint64_t upper = hi == 63 ? ~0ULL : ((1ULL << (hi + 1)) - 1);
+    return upper & ~((1ULL << lo) - 1);
+}
+
+/** Largest d with d * d <= v (v >= 0). */
+inline int64_t isqrt(int64_t v) {
+    int64_t d = static_cast<int64_t>(std::sqrt(static_cast<double>(v)));
+    while (d * d > v) --d;
+    while ((d + 1) * (d + 1) <= v) ++d;
+    return d;
+}
+
+}  // namespace
+
+void BitMask::resize(int width, int height, bool value) {
+    width_ = std::max(width, 0);
+    height_ = std::max(height, 0);
+    wordsPerRow_ = (static_cast<size_t>(width_) + 63) / 64;
+    lastWordMask_ = (width_ & 63) ? ((1ULL << (width_ & 63)) - 1) : ~0ULL;
+    words_.assign(wordsPerRow_ * static_cast<size_t>(height_), 0);
+    if (value) fill(true);
+}
+
+void BitMask::clear_padding() {
+    if (wordsPerRow_ == 0 || lastWordMask_ == ~0ULL) return;
+    for (int y = 0; y < height_; ++y) mutable_row(y)[wordsPerRow_ - 1] &= lastWordMask_;
+}
+
+void BitMask::fill(bool value) {
+    std::fill(words_.begin(), words_.end(), value ? ~0ULL : 0ULL);
+    if (value) clear_padding();
+}
+
+void BitMask::fill_span(int y, int x0, int x1, bool value) {
+    if (y < 0 || y >= height_) return;
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, width_ - 1);
+    if (x0 > x1) return;
+    uint64_t* r = mutable_row(y);
+    const int w0 = x0 >> 6, w1 = x1 >> 6;
+    for (int w = w0; w <= w1; ++w) {
+        const uint64_t bits = bitRange(w == w0 ? (x0 & 63) : 0, w == w1 ? (x1 & 63) : 63);
+        if (value) r[w] |= bits;
+        else r[w] &= ~bits;
+    }
+}
+
+void BitMask::fill_rect(int x, int y, int w, int h, bool value) {
+    if (w <= 0 || h <= 0) return;
+    const int y1 = std::min(y + h, height_);
+    for (int j = std::max(y, 0); j < y1; ++j) fill_span(j, x, x + w - 1, value);
+}
+
+void BitMask::fill_circle(int cx, int cy, int r, bool value) {
+    if (r < 0) return;
+    const int64_t r2 = static_cast<int64_t>(r) * r;
+    for (int j = std::max(cy - r, 0); j <= std::min(cy + r, height_ - 1); ++j) {
+        const int64_t dy = j - cy;
+        const int dx = static_cast<int>(isqrt(r2 - dy * dy));
+        fill_span(j, cx - dx, cx + dx, value);
+    }
+}
+
+bool BitMask::unite(const BitMask& o) {
+    if (!same_size(o)) return false;
+    for (size_t i = 0; i < words_.size(); ++i) words_[i] |= o.words_[i];
+    return true;
+}
+
+bool BitMask::intersect(const BitMask& o) {
+    if (!same_size(o)) return false;
+    for (size_t i = 0; i < words_.size(); ++i) words_[i] &= o.words_[i];
+    return true;
+}
+
+bool BitMask::subtract(const BitMask& o) {
+    if (!same_size(o)) return false;
+    for (size_t i = 0; i < words_.size(); ++i) words_[i] &= ~o.words_[i];
+    return true;
+}
+
+void BitMask::invert() {
+    for (uint64_t& w : words_) w = ~w;
+    clear_padding();
+}
+
+void BitMask::dilate(int steps) {
+    if (empty()) return;
+    const size_t n = wordsPerRow_;
+    std::vector<uint64_t> horiz(words_.size());
+    for (int s = 0; s < steps; ++s) {
+        // Left / right neighbours, carrying across word boundaries
+        for (int y = 0; y < height_; ++y) {
+            const uint64_t* r = row(y);
+            uint64_t* h = horiz.data() + static_cast<size_t>(y) * n;
+            for (size_t w = 0; w < n; ++w) {
+                const uint64_t prev = w > 0 ? r[w - 1] >> 63 : 0;
+                const uint64_t next = w + 1 < n ? r[w + 1] << 63 : 0;
+                h[w] = r[w] | (r[w] << 1) | prev | (r[w] >> 1) | next;
+            }
+        }
+        // Rows above / below
+        for (int y = 0; y < height_; ++y) {
+            uint64_t* out = mutable_row(y);
+            const uint64_t* h = horiz.data() + static_cast<size_t>(y) * n;
+            const uint64_t* up = y > 0 ? h - n : nullptr;
+            const uint64_t* down = y + 1 < height_ ? h + n : nullptr;
+            for (size_t w = 0; w < n; ++w) {
+                out[w] = h[w] | (up ? up[w] : 0) | (down ? down[w] : 0);
+            }
+        }
+        clear_padding();
+    }
+}
+
+void BitMask::erode(int steps) {
+    invert();
+    dilate(steps);
+    invert();
+}
+
+size_t BitMask::count() const {
+    size_t n = 0;
+    for (uint64_t w : words_) n += static_cast<size_t>(__builtin_popcountll(w));
+    return n;
+}
+
+void BitMask::to_int32(int32_t* out, size_t n) const {
+    const size_t pixels = std::min(n, static_cast<size_t>(width_) * static_cast<size_t>(height_));
+    std::fill(out, out + n, 0);
+    for_each_set([&](size_t p) {
+        if (p < pixels) out[p] = 1;
+    });
+}
+
+void BitMask::from_int32(const int32_t* in, size_t n) {
+    fill(false);
+    const size_t pixels = std::min(n, static_cast<size_t>(width_) * static_cast<size_t>(height_));
+    for (size_t p = 0; p < pixels; ++p) {
+        if (in[p] & 1) {
+            const int y = static_cast<int>(p / static_cast<size_t>(width_));
+            const int x = static_cast<int>(p % static_cast<size_t>(width_));
+            mutable_row(y)[x >> 6] |= 1ULL << (x & 63);
+        }
+    }
+}
+
+void BitMask::from_bpc(const char* bpc, size_t size, const CoordMap& map) {
+    resize(map.layout().width(), map.layout().height());
+    const std::vector<int32_t>& toFile = map.image_to_file();
+    for (int y = 0; y < height_; ++y) {
+        uint64_t* r = mutable_row(y);
+        const int32_t* k = toFile.data() + static_cast<size_t>(y) * static_cast<size_t>(width_);
+        for (int x = 0; x < width_; ++x) {
+            if (k[x] >= 0 && static_cast<size_t>(k[x]) < size && (bpc[k[x]] & 1)) {
+                r[x >> 6] |= 1ULL << (x & 63);
+            }
+        }
+    }
+}
+
+size_t BitMask::to_bpc(char* bpc, size_t size, const CoordMap& map) const {
+    const std::vector<int32_t>& toFile = map.image_to_file();
+    size_t written = 0;
+    for_each_set([&](size_t p) {
+        if (p >= toFile.size()) return;
+        const int32_t k = toFile[p];
+        if (k >= 0 && static_cast<size_t>(k) < size) {
+            bpc[k] |= 1;
+            ++written;
+        }
+    });
+    return written;
+}
+
+namespace {
+
+inline uint16_t swapPixel(uint16_t v) { return __builtin_bswap16(v); }
+inline uint32_t swapPixel(uint32_t v) { return __builtin_bswap32(v); }
+
+template <typename T>
+size_t byteSwapMaskedT(const T* in, T* out, size_t n, const BitMask* mask, T fill) {
+    const size_t width = mask ? static_cast<size_t>(mask->width()) : 0;
+    if (!mask || width == 0 || width * static_cast<size_t>(mask->height()) != n) {
+        for (size_t i = 0; i < n; ++i) out[i] = swapPixel(in[i]);
+        return 0;
+    }
+    size_t filled = 0;
+    for (int y = 0; y < mask->height(); ++y) {
+        const T* src = in + static_cast<size_t>(y) * width;
+        T* dst = out + static_cast<size_t>(y) * width;
+        for (size_t x = 0; x < width; ++x) dst[x] = swapPixel(src[x]);
+        const uint64_t* r = mask->row(y);
+        for (size_t w = 0; w < mask->words_per_row(); ++w) {
+            uint64_t bits = r[w];
+            while (bits) {
+                dst[w * 64 + static_cast<size_t>(__builtin_ctzll(bits))] = fill;
+                bits &= bits - 1;
+                ++filled;
+            }
+        }
+    }
+    return filled;
+}
+
+}  // namespace
+
+size_t byteSwapMasked(const uint16_t* in, uint16_t* out, size_t n, const BitMask* mask, uint16_t fill) {
+    return byteSwapMaskedT(in, out, n, mask, fill);
+}
+
+size_t byteSwapMasked(const uint32_t* in, uint32_t* out, size_t n, const BitMask* mask, uint32_t fill) {
+    return byteSwapMaskedT(in, out, n, mask, fill);
+}
+
+bool MaskStack::store(const std::string& name, const BitMask& mask) {
+    if (name.empty()) return false;
+    for (auto& m : masks_) {
+        if (m.first == name) {
+            m.second = mask;
+            return true;
+        }
+    }
+    if (masks_.size() >= MAX_MASKS) return false;
+    masks_.emplace_back(name, mask);
+    return true;
+}
+
+const BitMask* MaskStack::find(const std::string& name) const {
+    for (const auto& m : masks_) {
+        if (m.first == name) return &m.second;
+    }
+    return nullptr;
+}
+
+bool MaskStack::remove(const std::string& name) {
+    for (auto it = masks_.begin(); it != masks_.end(); ++it) {
+        if (it->first == name) {
+            masks_.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string MaskStack::names() const {
+    std::string out;
+    for (const auto& m : masks_) {
+        if (!out.empty()) out += ",";
+        out += m.first;
+    }
+    return out;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: working mask, named masks and TPX3_MASK_* commands
+// -----------------------------------------------------------------------
+
+/** Working mask sized for the current layout (cleared when the layout changed). Port thread. */
+BitMask& ADTimePix::workMask() {
+    const CoordLayout& layout = coordMap()->layout();
+    if (maskWork_.width() != layout.width() || maskWork_.height() != layout.height()) {
+        maskWork_.resize(layout.width(), layout.height());
+        FLOW_ARGS("Mask: working mask %dx%d", maskWork_.width(), maskWork_.height());
+    }
+    return maskWork_;
+}
+
+/**
+ * Show the working mask in bit 0 of the MaskBPC waveform. keepOtherBits leaves
+ * the remaining bits (e.g. bit 1 from TPX3_MASK_PEL) as they are.
+ */
+void ADTimePix::exportWorkMask(epicsInt32* value, size_t nElements, bool keepOtherBits) {
+    const BitMask& mask = workMask();
+    if (keepOtherBits) {
+        for (size_t p = 0; p < nElements; ++p) value[p] &= ~1;
+        const size_t pixels = std::min(nElements, static_cast<size_t>(mask.width()) * mask.height());
+        mask.for_each_set([&](size_t p) {
+            if (p < pixels) value[p] |= 1;
+        });
+    } else {
+        mask.to_int32(value, nElements);
+    }
+    setIntegerParam(ADTimePixMaskCount, static_cast<int>(mask.count()));
+}
+
+/** TPX3_MASK_STORE / RECALL / DELETE / OP_APPLY (port thread, one-shot). */
+void ADTimePix::maskCommand(int function) {
+    std::string name;
+    int op = 0, size = 1;
+    getStringParam(ADTimePixMaskName, name);
+    getIntegerParam(ADTimePixMaskOp, &op);
+    getIntegerParam(ADTimePixMaskOpSize, &size);
+    BitMask& work = workMask();
+    const BitMask* named = maskStack_.find(name);
+    char msg[128];
+
+    if (function == ADTimePixMaskStore) {
+        if (maskStack_.store(name, work)) {
+            epicsSnprintf(msg, sizeof(msg), "Stored \"%s\" (%zu px)", name.c_str(), work.count());
+        } else if (name.empty()) {
+            epicsSnprintf(msg, sizeof(msg), "Store: no mask name");
+        } else {
+            epicsSnprintf(msg, sizeof(msg), "Store: stack full (%zu masks)", MaskStack::MAX_MASKS);
+        }
+    } else if (function == ADTimePixMaskRecall || function == ADTimePixMaskDelete) {
+        if (!named) {
+            epicsSnprintf(msg, sizeof(msg), "No mask \"%s\"", name.c_str());
+        } else if (function == ADTimePixMaskDelete) {
+            maskStack_.remove(name);
+            epicsSnprintf(msg, sizeof(msg), "Deleted \"%s\"", name.c_str());
+        } else if (!named->same_size(work)) {
+            epicsSnprintf(msg, sizeof(msg), "\"%s\" is for another layout", name.c_str());
+        } else {
+            work = *named;
+            epicsSnprintf(msg, sizeof(msg), "Recalled \"%s\"", name.c_str());
+        }
+    } else {
+        static const char* opNames[] = {"Union", "Intersect", "Subtract", "Invert",
+                                        "Dilate", "Erode", "From BPC"};
+        const bool binary = op >= MaskOpUnion && op <= MaskOpSubtract;
+        const char* opName = (op >= 0 && op <= MaskOpFromBpc) ? opNames[op] : "?";
+        if (binary && (!named || !named->same_size(work))) {
+            epicsSnprintf(msg, sizeof(msg), "%s: no mask \"%s\" for this layout", opName, name.c_str());
+        } else {
+            bool ok = true;
+            switch (op) {
+                case MaskOpUnion:     work.unite(*named); break;
+                case MaskOpIntersect: work.intersect(*named); break;
+                case MaskOpSubtract:  work.subtract(*named); break;
+                case MaskOpInvert:    work.invert(); break;
+                case MaskOpDilate:    work.dilate(std::max(size, 1)); break;
+                case MaskOpErode:     work.erode(std::max(size, 1)); break;
+                case MaskOpFromBpc: {
+                    std::shared_ptr<const BitMask> bpc = bpcImageMask();
+                    if (bpc && bpc->same_size(work)) work = *bpc;
+                    else ok = false;
+                    break;
+                }
+                default: ok = false; break;
+            }
+            if (ok) epicsSnprintf(msg, sizeof(msg), "%s: %zu px masked", opName, work.count());
+            else epicsSnprintf(msg, sizeof(msg), "%s failed", opName);
+        }
+    }
+
+    FLOW_ARGS("Mask: %s", msg);
+    setStringParam(ADTimePixMaskStatus, msg);
+    setStringParam(ADTimePixMaskNames, maskStack_.names().c_str());
+    setIntegerParam(ADTimePixMaskStack, static_cast<int>(maskStack_.size()));
+    setIntegerParam(ADTimePixMaskCount, static_cast<int>(work.count()));
+}
+
+/**
+ * BPC mask for TPX3_MASK_OUTPUT on a width x height frame (stream workers),
+ * nullptr when output masking is off, no BPC file is loaded or the frame is
+ * not the detector layout. The BPC file is checked at most once per second;
+ * between checks the frame loop only copies a shared_ptr.
+ */
+std::shared_ptr<const BitMask> ADTimePix::outputMask(size_t width, size_t height) {
+    int mode = MaskOutputOff;
+    getIntegerParam(ADTimePixMaskOutput, &mode);
+    if (mode == MaskOutputOff) return nullptr;
+
+    const double now = nowSeconds();
+    std::lock_guard<std::mutex> lock(outputMaskMutex_);
+    if (now - outputMaskCheckedAt_ >= 1.0 || now < outputMaskCheckedAt_) {
+        outputMask_ = bpcImageMask();
+        outputMaskCheckedAt_ = now;
+    }
+    if (!outputMask_) return nullptr;
+    if (static_cast<size_t>(outputMask_->width()) != width ||
+        static_cast<size_t>(outputMask_->height()) != height) {
+        if (!outputMaskSizeWarned_) {
+            WARN_ARGS("Mask output: frame %zux%zu is not the %dx%d detector layout, not masked",
+                      width, height, outputMask_->width(), outputMask_->height());
+            outputMaskSizeWarned_ = true;
+        }
+        return nullptr;
+    }
+    return outputMask_;
+}
+
+/** Stream worker: swap a jsonimage payload into pData, masking per TPX3_MASK_OUTPUT. */
+void ADTimePix::byteSwapFrame(const char* payload, void* pData, size_t width, size_t height, bool is_uint32) {
+    int mode = MaskOutputOff;
+    getIntegerParam(ADTimePixMaskOutput, &mode);
+    const std::shared_ptr<const BitMask> mask = outputMask(width, height);
+    const bool flag = mode == MaskOutputFlag;
+    const size_t n = width * height;
+    size_t filled;
+    if (is_uint32) {
+        filled = byteSwapMasked(reinterpret_cast<const uint32_t*>(payload), reinterpret_cast<uint32_t*>(pData),
+                                n, mask.get(), flag ? 0xFFFFFFFFu : 0u);
+    } else {
+        filled = byteSwapMasked(reinterpret_cast<const uint16_t*>(payload), reinterpret_cast<uint16_t*>(pData),
+                                n, mask.get(), static_cast<uint16_t>(flag ? 0xFFFFu : 0u));
+    }
+    setIntegerParam(ADTimePixMaskOutputPixels, static_cast<int>(filled));
+}
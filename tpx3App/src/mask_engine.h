@@ -0,0 +1,158 @@
+/*
+ * ADTimePix3 - Bit-packed pixel mask with word-level shape ops and mask algebra
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef MASK_ENGINE_H
+#define MASK_ENGINE_H
+
+#include "coord_map.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief width x height pixel mask, 1 bit per pixel
+ *
+ * Rows are padded to whole 64-bit words; pixel x of row y is bit (x % 64) of
+ * word y * words_per_row() + x / 64, and padding bits are always zero. Shapes
+ * are rasterized as horizontal spans filled a word at a time, and the algebra
+ * (unite/intersect/subtract/invert) and morphology (dilate/erode with a 3x3
+ * element) work on whole words, so an edit of an 8-chip (1024 x 512) mask
+ * touches 8192 words instead of 524288 pixels.
+ */
+class BitMask {
+public:
+    BitMask() = default;
+    BitMask(int width, int height, bool value = false) { resize(width, height, value); }
+
+    /** Change the size; all pixels become value. */
+    void resize(int width, int height, bool value = false);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    size_t words_per_row() const { return wordsPerRow_; }
+    bool empty() const { return width_ == 0 || height_ == 0; }
+    bool same_size(const BitMask& o) const { return width_ == o.width_ && height_ == o.height_; }
+    const std::vector<uint64_t>& words() const { return words_; }
+    const uint64_t* row(int y) const { return words_.data() + static_cast<size_t>(y) * wordsPerRow_; }
+
+    bool get(int x, int y) const {
+        if (x < 0 || y < 0 || x >= width_ || y >= height_) return false;
+        return (row(y)[x >> 6] >> (x & 63)) & 1u;
+    }
+
+    void fill(bool value);
+    /** Pixels x0..x1 (inclusive, clipped) of row y. */
+    void fill_span(int y, int x0, int x1, bool value);
+    void fill_rect(int x, int y, int w, int h, bool value);
+    /** Pixels with (x - cx)^2 + (y - cy)^2 <= r^2. */
+    void fill_circle(int cx, int cy, int r, bool value);
+
+    /** Algebra with a mask of the same size (false, unchanged, otherwise). */
+    bool unite(const BitMask& o);
+    bool intersect(const BitMask& o);
+    bool subtract(const BitMask& o);
+    void invert();
+    /**
+     * Grow / shrink by steps 3x3 neighbourhoods. Pixels outside the image
+     * count as unmasked for dilate and as masked for erode, so eroding never
+     * unmasks the detector edge.
+     */
+    void dilate(int steps);
+    void erode(int steps);
+
+    size_t count() const;
+
+    /** Row-major image (y * width + x) as 0 / 1 values; n beyond the image is zero-filled. */
+    void to_int32(int32_t* out, size_t n) const;
+    /** Set from bit 0 of a row-major image of n values. */
+    void from_int32(const int32_t* in, size_t n);
+
+    /** Set from bit 0 of the BPC file bytes through the image -> file table. */
+    void from_bpc(const char* bpc, size_t size, const CoordMap& map);
+    /** Set bit 0 of the BPC bytes of every masked pixel; returns pixels written. */
+    size_t to_bpc(char* bpc, size_t size, const CoordMap& map) const;
+
+    /** f(linear image index) for every masked pixel, in order. */
+    template <typename F>
+    void for_each_set(F f) const {
+        for (int y = 0; y < height_; ++y) {
+            const uint64_t* r = row(y);
+            const size_t base = static_cast<size_t>(y) * static_cast<size_t>(width_);
+            for (size_t w = 0; w < wordsPerRow_; ++w) {
+                uint64_t bits = r[w];
+                while (bits) {
+                    f(base + w * 64 + static_cast<size_t>(__builtin_ctzll(bits)));
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+private:
+    uint64_t* mutable_row(int y) { return words_.data() + static_cast<size_t>(y) * wordsPerRow_; }
+    /** Zero the padding bits past width in every row. */
+    void clear_padding();
+
+    int width_ = 0;
+    int height_ = 0;
+    size_t wordsPerRow_ = 0;
+    uint64_t lastWordMask_ = 0;
+    std::vector<uint64_t> words_;
+};
+
+/** @brief Named masks kept next to the working mask (store / recall / operands). */
+class MaskStack {
+public:
+    static constexpr size_t MAX_MASKS = 16;
+
+    /** Store (or replace) name; false when the stack is full or name is empty. */
+    bool store(const std::string& name, const BitMask& mask);
+    const BitMask* find(const std::string& name) const;
+    bool remove(const std::string& name);
+    void clear() { masks_.clear(); }
+    size_t size() const { return masks_.size(); }
+    /** Names in store order, comma separated. */
+    std::string names() const;
+
+private:
+    std::vector<std::pair<std::string, BitMask>> masks_;
+};
+
+/**
+ * Byte-swap n big-endian pixels (the SERVAL jsonimage payload) into out and,
+ * with a mask of the frame's size (n == width * height), set every masked
+ * pixel to fill. Runs row by row: the swap of a row and the masked writes into
+ * it happen while the row is in L1, so masking adds no pass over the frame.
+ * Returns the pixels filled (0 without a mask).
+ */
+size_t byteSwapMasked(const uint16_t* in, uint16_t* out, size_t n, const BitMask* mask, uint16_t fill);
+size_t byteSwapMasked(const uint32_t* in, uint32_t* out, size_t n, const BitMask* mask, uint32_t fill);
+
+/** TPX3_MASK_OUTPUT values (masked pixels in outgoing PrvImg / Img frames). */
+enum MaskOutputMode {
+    MaskOutputOff = 0,
+    MaskOutputZero,                    // masked pixels read 0
+    MaskOutputFlag                     // masked pixels read the type's maximum
+};
+
+/** TPX3_MASK_OP values (applied to the working mask by TPX3_MASK_OP_APPLY). */
+enum MaskOp {
+    MaskOpUnion = 0,                   // working |= named
+    MaskOpIntersect,                   // working &= named
+    MaskOpSubtract,                    // working &= ~named
+    MaskOpInvert,
+    MaskOpDilate,                      // TPX3_MASK_OP_SIZE steps
+    MaskOpErode,
+    MaskOpFromBpc                      // working = masked pels of the BPC file
+};
+
+#endif // MASK_ENGINE_H
@@ -4,7 +4,8 @@
  * Timepix3: one config byte per chip pixel (65536 B/chip at 256x256).
  * Medipix3 (dual counter): two threshold slices per chip — [th0: 64KiB][th1: 64KiB]
  * (131072 B/chip). MPX3 disable-byte semantics TBD (do not assume TPX3 bit 0).
- * mask_io paths today use pelIndex() as TPX3 (first slice only); MPX3 needs
+ * mask_io paths today use pelIndex() as TPX3 (first slice only; tables in
+ * coord_map.cpp); MPX3 needs
  * threshold-aware indexing and refreshPixelConfigFromServal() chip stride —
  * see PIXELCONFIG_BPC_DIFF.md. TPX3 Accos bad pixels use byte 31 (0b11111).
  *
@@ -85,17 +86,9 @@ asynStatus ADTimePix::readInt32Array(asynUser *pasynUser, epicsInt32 *value,
     int maskOnOff_val, maskReset_val, maskRectangle_val, maskCircle_val;
     int maskRectangle_MinX, maskRectangle_SizeX, maskRectangle_MinY, maskRectangle_SizeY, maskCircle_Radius;
     int maskBPCfile_val, maskWrite_val;
-    int pathExists=0;
 
-    std::string BPCFilePath, BPCFileName, maskFileName, fullFileName;
+    std::string BPCFilePath, BPCFileName, maskFileName;
 
-    // buffer for reading BPC file (caller must free when done)
-    char *bufBPC = NULL;
-    int bufBPCSize = 0;
-
-    // write new mask
-    int ROWS = 0, COLS = 0, xCHIPS = 0, yCHIPS = 0, PelWidth = 0;
- 
 	if(reason == ADTimePixMaskBPC){
         getIntegerParam(ADTimePixMaskReset,&maskReset_val);
         getIntegerParam(ADTimePixMaskOnOffPel,&maskOnOff_val);
@@ -116,97 +109,65 @@ asynStatus ADTimePix::readInt32Array(asynUser *pasynUser, epicsInt32 *value,
 
         if (maskReset_val == 1) {            
             FLOW_ARGS("MaskBPC: reset (waveform nElements=%zu)", nElements);
-            maskReset(value, maskOnOff_val);              
+            maskReset(maskOnOff_val);
+            exportWorkMask(value, nElements, false);
         }
         else if (maskRectangle_val == 1) {
             FLOW_ARGS("MaskBPC: rectangle (waveform nElements=%zu)", nElements);
-            maskRectangle(value, maskRectangle_MinX, maskRectangle_SizeX, maskRectangle_MinY, maskRectangle_SizeY, maskOnOff_val);
+            maskRectangle(maskRectangle_MinX, maskRectangle_SizeX, maskRectangle_MinY, maskRectangle_SizeY, maskOnOff_val);
+            exportWorkMask(value, nElements, true);
         }
         else if (maskCircle_val == 1) {
             FLOW_ARGS("MaskBPC: circle (waveform nElements=%zu)", nElements);
-            maskCircle(value, maskRectangle_MinX, maskRectangle_MinY, maskCircle_Radius, maskOnOff_val);
+            maskCircle(maskRectangle_MinX, maskRectangle_MinY, maskCircle_Radius, maskOnOff_val);
+            exportWorkMask(value, nElements, true);
         }
         else if (maskBPCfile_val == 1) {
-            fullFileName = BPCFilePath + BPCFileName;
-        //    printf("The readInt32Array bpc file read, %ld\n", nElements);
-            pathExists = checkFile(fullFileName);
-            if (pathExists == 2) {  // BPC file exists, read and process it
-        //        printf("mask,BPC file Exists=%d\n",pathExists);
-                readBPCfile(&bufBPC, &bufBPCSize);
-                rowsCols(&ROWS, &COLS, &xCHIPS, &yCHIPS, &PelWidth);
-                if (bufBPCSize > 0) {
-                    /* Same image <-> file map as mask write / PixelConfigDiff: pelIndex(i,j), not bpc2ImgIndex. */
-                    for (size_t v = 0; v < nElements; ++v) {
-                        value[v] = 0;
-                    }
-                    for (int j = 0; j < COLS; ++j) {
-                        for (int i = 0; i < ROWS; ++i) {
-                            const size_t idx = static_cast<size_t>(j) * static_cast<size_t>(COLS) +
-                                               static_cast<size_t>(i);
-                            if (idx >= nElements) continue;
-                            const int k = pelIndex(i, j);
-                            if (k >= 0 && k < bufBPCSize && (bufBPC[k] & (1 << 0))) {
-                                value[idx] |= 1 << 1;
-                            }
-                        }
-                    }
-                }
+            /* Same image <-> file map as mask write / PixelConfigDiff: pelIndex(i,j), not bpc2ImgIndex. */
+            const std::shared_ptr<const BitMask> mask = bpcImageMask();
+            if (mask) {  // BPC file exists, show its masked pels
+                std::fill(value, value + nElements, 0);
+                mask->for_each_set([&](size_t v) {
+                    if (v < nElements) value[v] = 1 << 1;
+                });
             }
         }
         else if (maskWrite_val == 1) {
-            fullFileName = BPCFilePath + BPCFileName;
-            pathExists = checkFile(fullFileName);
-            if (pathExists == 2) {  // BPC file exists, read it into bufBPC, and apply mask
-
-                readBPCfile(&bufBPC, &bufBPCSize);
-                rowsCols(&ROWS, &COLS, &xCHIPS, &yCHIPS, &PelWidth);
-                for (int j = 0; j < COLS; ++j) {
-                    for (int i = 0; i < ROWS; ++i) {
-                        if (value[j*COLS + i]  & (1 << 0)) {
-                            bufBPC[pelIndex(i, j)] |= (1 << 0);
-                        }
-                    }
-                }
-                writeBPCfile(&bufBPC, &bufBPCSize);
+            const std::shared_ptr<const BpcSnapshot> bpc = bpcFile();
+            if (bpc) {  // BPC file exists, copy it into bufBPC, and apply the working mask
+                std::vector<char> bufBPC(bpc->bytes);
+                char *pBufBPC = bufBPC.data();
+                int bufBPCSize = static_cast<int>(bufBPC.size());
+                const size_t nMasked = workMask().to_bpc(pBufBPC, bufBPC.size(), *coordMap());
+                FLOW_ARGS("Mask write: %zu pels from the working mask", nMasked);
+                exportWorkMask(value, nElements, true);
+                writeBPCfile(&pBufBPC, &bufBPCSize);
+                bpcCache_.invalidate();
+                invalidateRawFilter();
             }
             else {
-                    WARN_ARGS("Mask write: BPC path not ready (pathExists=%d) for \"%s\"", pathExists,
-                              BPCFilePath.c_str());
+                    WARN_ARGS("Mask write: BPC file not readable \"%s%s\"", BPCFilePath.c_str(),
+                              BPCFileName.c_str());
                 }
         }
         else {
             FLOW_ARGS("MaskBPC: no draw op (nElements=%zu)", nElements);
+            exportWorkMask(value, nElements, true);
         }
     }
     else if (reason == ADTimePixBPC) {
-        getStringParam(ADTimePixBPCFilePath, BPCFilePath);
-        getStringParam(ADTimePixBPCFileName, BPCFileName);
-        fullFileName = BPCFilePath + BPCFileName;
-
-    //    printf("calib,The readInt32Array bpc file read, %ld\n", nElements);
-        pathExists = checkFile(fullFileName);
-    //    printf("calibration, BPC file Exists=%d\n",pathExists);
-        if (pathExists == 2) {  // BPC file exists, read and process it
-            readBPCfile(&bufBPC, &bufBPCSize);
-    //        printf("bufPBCSize=%d, strLen_bufBPC=%ld\n",bufBPCSize, strlen(bufBPC));
-            if (bufBPCSize > 0) {
-                for(size_t i = 0; i < nElements; i++){
-                    value[i] = bufBPC[i];
-                    if (bufBPC[i] & (1 << 0)) {
-                        value[i] |= 1 << 8;     // masked pel, 31-> 287
-                //        printf("bufBPC[%ld]=%d\n",i,value[i]);
-                    }
+        const std::shared_ptr<const BpcSnapshot> bpc = bpcFile();
+        if (bpc && !bpc->bytes.empty()) {  // BPC file exists, process it
+            const std::vector<char>& bufBPC = bpc->bytes;
+            for(size_t i = 0; i < nElements; i++){
+                value[i] = i < bufBPC.size() ? bufBPC[i] : 0;
+                if (value[i] & (1 << 0)) {
+                    value[i] |= 1 << 8;     // masked pel, 31-> 287
                 }
             }
         }
     }
 
-    // Free BPC buffer if readBPCfile() allocated it (avoids memory leak)
-    if (bufBPC) {
-        free(bufBPC);
-        bufBPC = NULL;
-    }
-
     callParamCallbacks();
 
     *nIn=nElements;
@@ -233,60 +194,21 @@ asynStatus ADTimePix::rowsCols(int *rows, int *cols, int *xChips, int *yChips, i
     return asynSuccess;
 }
 
-asynStatus ADTimePix::maskReset(epicsInt32 *buf, int OnOff) {
-//    printf("OnOff=%d\n", OnOff);
-    int ROWS = 0, COLS = 0, xCHIPS = 0, yCHIPS = 0, PelWidth = 0;
-    rowsCols(&ROWS, &COLS, &xCHIPS, &yCHIPS, &PelWidth);
-
-//    printf("Reset:rows=%d, cols=%d, xChips=%d, yChips=%d, chipPelWidth=%d\n\n", ROWS, COLS, xCHIPS, yCHIPS, PelWidth);
-    for (int j = 0; j < ROWS; ++j) {
-        for (int i = 0; i < COLS; ++i) {
-            buf[j*ROWS + i] = OnOff;
-        }
-    }
+asynStatus ADTimePix::maskReset(int OnOff) {
+    workMask().fill(OnOff != 0);
     return asynSuccess;
 }
 
 // Mask a nXsize x nYsize rectangle, or pint (nXsize=nYsize=1), or line respectivly
-asynStatus ADTimePix::maskRectangle(epicsInt32 *buf, int nX,int nXsize, int nY, int nYsize, int OnOff) {
-    int ROWS = 0, COLS = 0, xCHIPS = 0, yCHIPS = 0, PelWidth = 0;
-    rowsCols(&ROWS, &COLS, &xCHIPS, &yCHIPS, &PelWidth);
-
-    for (int j = nY; j < nY+nYsize; ++j) {
-        if ( j < ROWS ) {
-            for (int i = nX; i < nX + nXsize; ++i) {
-                if (i < COLS) {
-                    if (OnOff) {
-                        buf[j*ROWS + i] |= (1 << 0);    // set mask bit to 1
-                    }
-                    else {
-                        buf[j*ROWS + i] &= ~(1 << 0);   // set mask bit 0 0
-                    }
-                }
-            }
-        }
-    }
+asynStatus ADTimePix::maskRectangle(int nX,int nXsize, int nY, int nYsize, int OnOff) {
+    workMask().fill_rect(nX, nY, nXsize, nYsize, OnOff != 0);
     return asynSuccess;
 }
 
 // Mask a circle: OnOff=1 set bit to 1; OnOff=0, set bit to 0
 // 0 -> pixel is counting; 1-> pixel is not counting
-asynStatus ADTimePix::maskCircle(epicsInt32 *buf, int nX,int nY, int nRadius, int OnOff) {
-    int ROWS = 0, COLS = 0, xCHIPS = 0, yCHIPS = 0, PelWidth = 0;
-    rowsCols(&ROWS, &COLS, &xCHIPS, &yCHIPS, &PelWidth);
-
-    for (int j = nY - nRadius; j <= nY+nRadius; ++j) {
-        for (int i = nX - nRadius; i <= nX + nRadius; ++i) {
-            if ((j >= 0) && (j < ROWS) && (i >= 0) && (i < COLS) && (((i - nX)*(i - nX) + (j - nY)*(j - nY)) <= nRadius*nRadius)) {
-                if (OnOff) {
-                    buf[j*ROWS + i] |= (1 << 0);    // set mask bit to 1
-                }
-                else {
-                    buf[j*ROWS + i] &= ~(1 << 0);   // set mask bit 0 0
-                }
-            }
-        }
-    }
+asynStatus ADTimePix::maskCircle(int nX,int nY, int nRadius, int OnOff) {
+    workMask().fill_circle(nX, nY, nRadius, OnOff != 0);
     return asynSuccess;
 }
 
@@ -349,6 +271,7 @@ asynStatus ADTimePix::uploadBPC(){
 
     getStringParam(ADTimePixBPCFilePath, filePath);
     getStringParam(ADTimePixBPCFileName, fileName);
+    maskUploadedPath_.clear();  // commitBPC() / maskUndoRedo() record their upload on success
     bpc_file = this->serverURL + std::string("/config/load?format=pixelconfig&file=") + std::string(filePath) + std::string(fileName);
 
     cpr::Response r = servalHttpGetAuthOnly(bpc_file);
@@ -363,84 +286,15 @@ asynStatus ADTimePix::uploadBPC(){
     return status;
 }
 
-/*
-* buf - bpc file read into char array
-* bufSize - number of bytes / elements / pixels in the bpc file
-*/
-asynStatus ADTimePix::readBPCfile(char **buf, int *bufSize) {   
-
-    FILE *sourceFile;
-    long fileSize;
-    char *buffer;
-    int nMaskedPel=0;
-    int nRead=0;
-
-    *bufSize = 0;
-
-    // BPC calibration mask file to read, and write new mask.
-    std::string maskFile, filePath, fileName, fullFileName;
-
-    getStringParam(ADTimePixBPCFilePath, filePath);
-    getStringParam(ADTimePixBPCFileName, fileName);
-    fullFileName = filePath + fileName;
-
-//    printf("ReadBPC: name=%s\n", fullFileName.c_str());
-
-    // Open the source file for reading
-    sourceFile = fopen(fullFileName.c_str(), "rb");
-    if (sourceFile == NULL) {
-        perror("Error opening source file");
-        return asynSuccess;
-    }
-
-    // Determine the size of the source file
-    fseek(sourceFile, 0, SEEK_END);  // Move to the end of the file
-    fileSize = ftell(sourceFile);    // Get the current position (file size)
-    rewind(sourceFile);              // Go back to the beginning of the file
-
-    // Allocate memory for the buffer
-    buffer = (char *)malloc(fileSize);
-    if (buffer == NULL) {
-        perror("Error allocating memory");
-        fclose(sourceFile);
-        return asynSuccess;
-    }
-
-    // Read the entire BPC file into the buffer
-    nRead = fread(buffer, 1, fileSize, sourceFile);
-    fclose(sourceFile);
-
-    // pass pointer to buffer;
-    *buf = buffer;
-    *bufSize = fileSize;
-    // printf("\nbufSize=%d, fileSize=%ld, strlen_buf=%ld, strlen_buffer=%ld\n", *bufSize, fileSize, strlen(*buf), strlen(buffer));
-
-    for (int i = 0; i < fileSize; i++) {
-        // Check if the bit at position N=0 is set to 1
-        if (buffer[i] & (1 << 0)) {
-            nMaskedPel += 1;
-        //    printf("Bit i=%d, nMaskedPel=%d, buffer[i]=%d\n", i, nMaskedPel, buffer[i]);
-        }
-    }
-    setIntegerParam(ADTimePixBPCn, nMaskedPel);
-    LOG_ARGS("ReadBPC: file=\"%s\" bytes read=%d bytes with mask bit0 set=%d (used for BPCn)",
-             fullFileName.c_str(), nRead, nMaskedPel);
-
-    callParamCallbacks();
-
-    return asynSuccess;
-}
-
 /*
 * Write bpc file containing mask created.
 */
 asynStatus ADTimePix::writeBPCfile(char **buf, int *bufSize) {
     int status = asynSuccess;
     int pathExists = 0, maskExists = 0;
-    FILE *destFile;
 
     // BPC calibration mask file to write new mask.
-    std::string maskFile, filePath, fileName, fullFileName, bpcFileName;
+    std::string maskFile, filePath, fileName, fullFileName;
 
     getStringParam(ADTimePixBPCFilePath, filePath);
     getStringParam(ADTimePixMaskFileName, maskFile);
@@ -475,36 +329,36 @@ asynStatus ADTimePix::writeBPCfile(char **buf, int *bufSize) {
         return asynSuccess;
     }
 
-    destFile = fopen(fullFileName.c_str(), "wb");
-    if (destFile == NULL) {
-        perror("Error opening destination file");
-        return asynError;
-    }
-
-    // Write the buffer to the destination file
-    fwrite(*buf, 1, *bufSize, destFile);
-
-    // Clean up
-    fclose(destFile);
-
-//    printf("File copied successfully.\n");
-
-    // Write mask file to TimePix3 chip
-    getStringParam(ADTimePixBPCFileName, bpcFileName);
-    setStringParam(ADTimePixBPCFileName,maskFile.c_str());
-    status = uploadBPC();
-    setStringParam(ADTimePixBPCFileName,bpcFileName.c_str());
+    // Temp file + rename, journaled for undo; not rewritten or uploaded when unchanged
+    const std::vector<char> bytes(*buf, *buf + *bufSize);
+    std::vector<char> base;
+    std::shared_ptr<const BpcSnapshot> bpc = bpcFile();
+    if (bpc) base = bpc->bytes;
+    status = commitBPC(filePath, maskFile, bytes, base);
 
     callParamCallbacks();
 
     if (status) {
-        ERR("WriteBPC: uploadBPC to SERVAL failed");
+        ERR("WriteBPC: mask commit / uploadBPC to SERVAL failed");
         return asynError;
     }
 
     return asynSuccess;
 }
 
+/* uploadBPC() for dir + name instead of BPCFilePath + BPCFileName (mask commits, undo / redo). */
+asynStatus ADTimePix::uploadBPCAs(const std::string& dir, const std::string& name) {
+    std::string bpcFilePath, bpcFileName;
+    getStringParam(ADTimePixBPCFilePath, bpcFilePath);
+    getStringParam(ADTimePixBPCFileName, bpcFileName);
+    setStringParam(ADTimePixBPCFilePath, dir.c_str());
+    setStringParam(ADTimePixBPCFileName, name.c_str());
+    asynStatus status = uploadBPC();
+    setStringParam(ADTimePixBPCFilePath, bpcFilePath.c_str());
+    setStringParam(ADTimePixBPCFileName, bpcFileName.c_str());
+    return status;
+}
+
 /*
 * Returns which chip image tile pixel belongs to. Need to convert to TimePix3 chip order.
 * Input: x, y  (pixel coordinate)
@@ -527,428 +381,3 @@ asynStatus ADTimePix::findChip(int x, int y, int *xChip, int *yChip, int *width)
     return asynSuccess;
 }
 
-/* bpc vector index into AD image index;  x/y (i,j) are image coordinates
-* i,j coordinates of the AD image with pixel starting from top left in image mask PV
-* bpcIndex - index of pixel in bpc file
-* imgIndex - index of pixel in AD image
-*/
-// int ADTimePix::bpc2ImgIndex(int *x, int *y, int bpcIndexIn, int chipPelWidthIn) {
-int ADTimePix::bpc2ImgIndex(int bpcIndexIn, int chipPelWidthIn) {
-    int i=0, j=0;
-    int detOrientation=0, imgIndex=0, bpcIndex=0;
-    int numChips=0, chip=0, chipPelCount=0, chipPelWidth=0;
-
-    getIntegerParam(ADTimePixDetectorOrientation, &detOrientation);
-    getIntegerParam(ADTimePixNumberOfChips, &numChips);
-    chipPelWidth = chipPelWidthIn;
-    bpcIndex = bpcIndexIn;
-    chipPelCount = (chipPelWidth) * (chipPelWidth);
-    /* 0-based chip from linear BPC index: [0,chipPelCount) -> 0, etc. Do not use (bpcIndex+1)/chipPelCount;
-     * that maps the last pel of each chip (e.g. 65535) to the next chip and bpcIndex 262143 -> chip 4,
-     * falsely tripping "detector larger than 2x2" and misplacing boundary pixels. */
-    chip = (chipPelCount > 0) ? (bpcIndex / chipPelCount) : 0;
-
-    if (numChips == 1) { // single chip TimePix3
-        if (detOrientation == 0) {  // UP detector orientation
-            i = bpcIndex % chipPelWidth;
-            j = chipPelWidth - 1 - bpcIndex / chipPelWidth;
-        } else if (detOrientation == 1) {  // RIGHT
-            i = bpcIndex / chipPelWidth;
-            j = bpcIndex % chipPelWidth;
-        } else if (detOrientation == 2) {  // DOWN
-            i = chipPelWidth - 1 - bpcIndex % chipPelWidth;
-            j = bpcIndex / chipPelWidth;
-        } else if (detOrientation == 3) {  // LEFT
-            i = chipPelWidth - 1 - bpcIndex / chipPelWidth;
-            j = chipPelWidth - 1 - bpcIndex % chipPelWidth;
-        } else if (detOrientation == 4) {  // UP MIRRORED
-            i = chipPelWidth - 1 - bpcIndex % chipPelWidth;
-            j = chipPelWidth - 1 - bpcIndex / chipPelWidth;
-        } else if (detOrientation == 5) {  // RIGHT MIRRORED
-            i = chipPelWidth - 1 - bpcIndex / chipPelWidth;
-            j = bpcIndex % chipPelWidth;
-        } else if (detOrientation == 6) {  // DOWN MIRRORED
-            i = bpcIndex % chipPelWidth;
-            j = bpcIndex / chipPelWidth;
-        } else if (detOrientation == 7) {  // LEFT MIRRORED
-            i = bpcIndex / chipPelWidth;
-            j = chipPelWidth - 1 - bpcIndex % chipPelWidth;
-        } else {
-            WARN("bpc2ImgIndex: single-chip orientation not supported");
-        }
-        imgIndex = i + chipPelWidth*j;
-    } else if (numChips == 4) {  // quad chip 2x2 TimePix3
-        if (detOrientation == 0) {  // UP detector orientation
-            if (chip == 0) { // tile (1,1), chip 0
-                i = chipPelWidth + bpcIndex % chipPelWidth;
-                j = 2*chipPelWidth - 1 - bpcIndex / chipPelWidth;
-            } else if (chip == 1) { // tile (1,0), chip 1
-                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
-                j = (bpcIndex - chipPelCount) / chipPelWidth;
-            } else if (chip == 2) { // tile (0,0), chip 2
-                i = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
-                j = (bpcIndex - 2*chipPelCount) / chipPelWidth;
-            } else if (chip == 3) { // tile (0,1), chip 3
-                i = (bpcIndex - 3*chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: UP layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: UP unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 3) {  // LEFT detector orientation
-            if (chip == 3) { // tile (1,1), chip 3
-                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
-            } else if (chip == 0) { // tile (1,0), chip 0
-                i = 2*chipPelWidth - 1 - bpcIndex / chipPelWidth;
-                j = bpcIndex % chipPelWidth;
-            } else if (chip == 1) { // tile (0,0), chip 1
-                i = (bpcIndex - chipPelCount) / chipPelWidth;
-                j = (bpcIndex - chipPelCount) % chipPelWidth;
-            } else if (chip == 2) { // tile (0,1), chip 2
-                i = (bpcIndex - 2*chipPelCount) / chipPelWidth;
-                j = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: LEFT layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: LEFT unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 1) {  // RIGHT detector orientation
-            if (chip == 1) { // tile (1,1), chip 1
-                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
-            } else if (chip == 2) { // tile (1,0), chip 2
-                i = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
-                j = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
-            } else if (chip == 3) { // tile (0,0), chip 3
-                i = (bpcIndex - 3*chipPelCount) / chipPelWidth;
-                j = (bpcIndex - 3*chipPelCount) % chipPelWidth;
-            } else if (chip == 0) { // tile (0,1), chip 0
-                i = (bpcIndex) / chipPelWidth;
-                j = chipPelWidth + (bpcIndex) % chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: RIGHT layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: RIGHT unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 2) {  // DOWN detector orientation
-            if (chip == 2) { // tile (1,1), chip 2
-                i = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
-            } else if (chip == 3) { // tile (1,0), chip 3
-                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
-                j = (bpcIndex - 3*chipPelCount) / chipPelWidth;
-            } else if (chip == 0) { // tile (0,0), chip 0
-                i = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
-                j = (bpcIndex) / chipPelWidth;
-            } else if (chip == 1) { // tile (0,1), chip 1
-                i = (bpcIndex - chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: DOWN layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: DOWN unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 4) {  // UP MIRRORED detector orientation
-            if (chip == 3) { // tile (1,1), chip 3
-                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
-            } else if (chip == 2) { // tile (1,0), chip 2
-                i = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
-                j = (bpcIndex - 2*chipPelCount) / chipPelWidth;
-            } else if (chip == 1) { // tile (0,0), chip 1
-                i = (bpcIndex - chipPelCount) % chipPelWidth;
-                j = (bpcIndex - chipPelCount) / chipPelWidth;
-            } else if (chip == 0) { // tile (0,1), chip 0
-                i = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex) / chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: UP MIRRORED layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: UP MIRRORED unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 5) {  // RIGHT MIRRORED detector orientation
-            if (chip == 0) { // tile (1,1), chip 0
-                i = 2*chipPelWidth - 1 - (bpcIndex) / chipPelWidth;
-                j = chipPelWidth + (bpcIndex) % chipPelWidth;
-            } else if (chip == 3) { // tile (1,0), chip 3
-                i = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) / chipPelWidth;
-                j = (bpcIndex - 3*chipPelCount) % chipPelWidth;
-            } else if (chip == 2) { // tile (0,0), chip 2
-                i = (bpcIndex - 2*chipPelCount) / chipPelWidth;
-                j = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
-            } else if (chip == 1) { // tile (0,1), chip 1
-                i = (bpcIndex - chipPelCount) / chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: RIGHT MIRRORED layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: RIGHT MIRRORED unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 6) {  // DOWN MIRRORED detector orientation
-            if (chip == 1) { // tile (1,1), chip 1
-                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
-            } else if (chip == 0) { // tile (1,0), chip 0
-                i = chipPelWidth + (bpcIndex) % chipPelWidth;
-                j = (bpcIndex) / chipPelWidth;
-            } else if (chip == 3) { // tile (0,0), chip 3
-                i = (bpcIndex - 3*chipPelCount) % chipPelWidth;
-                j = (bpcIndex - 3*chipPelCount) / chipPelWidth;
-            } else if (chip == 2) { // tile (0,1), chip 2
-                i = chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) % chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: DOWN MIRRORED layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: DOWN MIRRORED unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else if (detOrientation == 7) {  // LEFT MIRRORED detector orientation
-            if (chip == 2) { // tile (1,1), chip 2
-                i = 2*chipPelWidth - 1 - (bpcIndex - 2*chipPelCount) / chipPelWidth;
-                j = chipPelWidth + (bpcIndex - 2*chipPelCount) % chipPelWidth;
-            } else if (chip == 1) { // tile (1,0), chip 1
-                i = 2*chipPelWidth - 1 - (bpcIndex - chipPelCount) / chipPelWidth;
-                j = (bpcIndex - chipPelCount) % chipPelWidth;
-            } else if (chip == 0) { // tile (0,0), chip 0
-                i = (bpcIndex) / chipPelWidth;
-                j = chipPelWidth - 1 - (bpcIndex) % chipPelWidth;
-            } else if (chip == 3) { // tile (0,1), chip 3
-                i = (bpcIndex - 3*chipPelCount) / chipPelWidth;
-                j = 2*chipPelWidth - 1 - (bpcIndex - 3*chipPelCount) % chipPelWidth;
-            } else if (chip > 3) {
-                WARN("bpc2ImgIndex: LEFT MIRRORED layout chip index out of range for 2x2");
-                imgIndex = -1;
-            } else {
-                WARN_ARGS("bpc2ImgIndex: LEFT MIRRORED unspecified chip tile i=%d j=%d", i, j);
-            }
-        } else {
-            WARN("bpc2ImgIndex: quad 2x2 orientation not supported");
-        }
-        imgIndex = i + 2*chipPelWidth*j;
-    } else if (numChips == 8) {
-        /* 2×4 (or 4×2) mosaic: uniform grid, BPC chip order chip = Y_CHIP * xChips + X_CHIP,
-         * intra-chip mapping matches single-chip UP (same convention as one tile of the 2×2 case).
-         * Only DetectorOrientation UP (0); other orientations need per-layout tables like 2×2. */
-        if (detOrientation != 0) {
-            WARN("bpc2ImgIndex: 8-chip mapping only for DetectorOrientation UP (0)");
-            return -1;
-        }
-        int ROWS = 0, COLS = 0, xChips = 0, yChips = 0, w = 0;
-        rowsCols(&ROWS, &COLS, &xChips, &yChips, &w);
-        if (xChips * yChips != 8 || chipPelCount <= 0 || chip < 0 || chip > 7) {
-            WARN("bpc2ImgIndex: 8-chip requires xChips*yChips==8 and chip index 0..7");
-            return -1;
-        }
-        int local = bpcIndex - chip * chipPelCount;
-        int lx = local % w;
-        int ly = local / w;
-        int X_CHIP = chip % xChips;
-        int Y_CHIP = chip / xChips;
-        i = X_CHIP * w + lx;
-        j = Y_CHIP * w + (w - 1 - ly);
-        imgIndex = i + (xChips * w) * j;
-    } else {
-        WARN_ARGS("bpc2ImgIndex: chip count %d not supported (use 1, 4, or 8)", numChips);
-        imgIndex = -1;
-    }
-
-    return imgIndex;
-}
-
-/*
-* Index of mask vector
-* i,j coordinates of the pixel starting from top left in image mask PV
-*/
-int ADTimePix::pelIndex(int i, int j) {
-    int index=0, ii=0,jj=0;
-    int X_CHIP=0, Y_CHIP=0, PelWidth=0, detOrientation=0;
-    int numChips=0;
-
-    getIntegerParam(ADTimePixDetectorOrientation, &detOrientation);
-    getIntegerParam(ADTimePixNumberOfChips, &numChips);
-    findChip(i, j, &X_CHIP, &Y_CHIP, &PelWidth);
-
-    // TODO: 2x4 chip detector
-    // One-chip TimePix3 detector
-    if (numChips == 1) {
-        if (detOrientation == 0) {  // UP detector orientation
-            index = i + ((PelWidth - 1) - j)*PelWidth;
-        } else if (detOrientation == 1) {  // RIGHT
-            index = j + i*PelWidth;
-        } else if (detOrientation == 2) {  // DOWN
-            index = ((PelWidth - 1) - i) + j*PelWidth;
-        } else if (detOrientation == 3) {  // LEFT
-            index =  ((PelWidth - 1) - j) +  ((PelWidth - 1) - i)*PelWidth;
-        } else if (detOrientation == 4) {  // UP MIRRORED
-            index =  ((PelWidth - 1) - i) +  ((PelWidth - 1) - j)*PelWidth;
-        } else if (detOrientation == 5) {  // RIGHT MIRRORED
-            index = j + ((PelWidth - 1) - i)*PelWidth;
-        } else if (detOrientation == 6) {  // DOWN MIRRORED
-            index = i + j*PelWidth;
-        } else if (detOrientation == 7) {  // LEFT MIRRORED
-            index = ((PelWidth - 1) - j) + i*PelWidth;
-        } else {
-            WARN("pelIndex: single-chip orientation not supported");
-        }
-
-    } else if (numChips == 4) {
-        // Four chip 2x2 TimePix3 detector orientations
-        ii = i - PelWidth;
-        jj = j - PelWidth;
-
-        if (detOrientation == 0) {  // UP detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 0
-                index = ii - (jj - (PelWidth - 1))*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 1
-                index = PelWidth*PelWidth + ((PelWidth - 1) - ii) + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 2
-                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - i) + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 3
-                index = 3*PelWidth*PelWidth + i - (jj - (PelWidth - 1))*PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: UP layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: UP unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 3) {  // LEFT detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 3
-                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - jj) + ((PelWidth - 1) - ii)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 0
-                index = ((PelWidth - 1) - j) +  ((PelWidth - 1) - ii) * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 1
-                index = PelWidth*PelWidth + j + i * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 2
-                index = 2*PelWidth*PelWidth + jj + i * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: LEFT layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: LEFT unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 1) {  // RIGHT detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 1
-                index = PelWidth*PelWidth + ((PelWidth - 1) - jj) + ((PelWidth - 1) - ii)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 2
-                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - j) +  ((PelWidth - 1) - ii) * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 3
-                index = 3*PelWidth*PelWidth + j + i * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 0
-                index = jj +  i * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: RIGHT layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: RIGHT unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 2) {  // DOWN detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 2
-                index = 2*PelWidth*PelWidth + ii + ((PelWidth - 1) - jj)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 3
-                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - ii) +  j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 0
-                index =  ((PelWidth - 1) - i) + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 1
-                index = PelWidth*PelWidth + i +  ((PelWidth - 1) - jj) * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: DOWN layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: DOWN unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 4) {  // UP MIRRORED detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 3
-                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - ii) + ((PelWidth - 1) - jj)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 2
-                index = 2*PelWidth*PelWidth + ii + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 1
-                index =  PelWidth*PelWidth + i + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 0
-                index = ((PelWidth - 1) - i) + ((PelWidth - 1) - jj) * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: UP MIRRORED layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: UP MIRRORED unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 5) {  // RIGHT MIRRORED detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 0
-                index = jj + ((PelWidth - 1) - ii)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 3
-                index = 3*PelWidth*PelWidth + j + ((PelWidth - 1) - ii) * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 2
-                index =  2*PelWidth*PelWidth + ((PelWidth - 1) - j) + i * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 1
-                index = PelWidth*PelWidth + ((PelWidth - 1) - jj) + i * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: RIGHT MIRRORED layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: RIGHT MIRRORED unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 6) {  // DOWN MIRRORED detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 1
-                index = PelWidth*PelWidth + ((PelWidth - 1) - ii) + ((PelWidth - 1) - jj)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 0
-                index = ii + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 3
-                index =  3*PelWidth*PelWidth + i + j * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 2
-                index = 2*PelWidth*PelWidth + ((PelWidth - 1) - i) + ((PelWidth - 1) - jj) * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: DOWN MIRRORED layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: DOWN MIRRORED unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-        } else if (detOrientation == 7) {  // LEFT MIRRORED detector orientation
-            if ((X_CHIP == 1) && (Y_CHIP == 1)) { // tile (1,1), chip 2
-                index = 2*PelWidth*PelWidth + jj + ((PelWidth - 1) - ii)*PelWidth;
-            } else if ((X_CHIP == 1) && (Y_CHIP == 0)) { // tile (1,0), chip 1
-                index = PelWidth*PelWidth + j + ((PelWidth - 1) - ii) * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 0)) { // tile (0,0), chip 0
-                index =  ((PelWidth - 1) - j) + i * PelWidth;
-            } else if ((X_CHIP == 0) && (Y_CHIP == 1)) { // tile (0,1), chip 3
-                index = 3*PelWidth*PelWidth + ((PelWidth - 1) - jj) + i * PelWidth;
-            } else if ((X_CHIP > 1) || (Y_CHIP > 1)) {
-                WARN("pelIndex: LEFT MIRRORED layout chip index out of range for 2x2");
-                index = -1;
-            } else {
-                WARN_ARGS("pelIndex: LEFT MIRRORED unspecified tile i=%d j=%d xChip=%d yChip=%d", i, j, X_CHIP, Y_CHIP);
-            }
-
-        } else {
-            WARN("pelIndex: quad orientation not supported for this layout");
-        }
-    } else if (numChips == 8) {
-        if (detOrientation != 0) {
-            WARN("pelIndex: 8-chip mapping only for DetectorOrientation UP (0)");
-            index = -1;
-        } else {
-            int ROWS = 0, COLS = 0, xChips = 0, yChips = 0, Pel = 0;
-            rowsCols(&ROWS, &COLS, &xChips, &yChips, &Pel);
-            if (xChips * yChips != 8 || Pel <= 0 || X_CHIP >= xChips || Y_CHIP >= yChips) {
-                WARN("pelIndex: 8-chip geometry mismatch (expect xChips*yChips==8)");
-                index = -1;
-            } else {
-                int lx = i - X_CHIP * Pel;
-                int ly = j - Y_CHIP * Pel;
-                int chipIdx = Y_CHIP * xChips + X_CHIP;
-                index = chipIdx * Pel * Pel + lx + ((Pel - 1) - ly) * Pel;
-            }
-        }
-    } else {
-        WARN_ARGS("pelIndex: chip count %d not supported (use 1, 4, or 8)", numChips);
-    }
-
-    return index;
-}
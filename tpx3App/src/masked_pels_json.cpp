@@ -0,0 +1,364 @@
+/*
+ * ADTimePix3 - Streaming <stem>_masked_pels.json writer
+ *
+ * RefreshPixelConfig used to build the masked-pels export as an nlohmann
+ * tree (one object per masked pel, twice) and dump it on every refresh. The
+ * file is now written straight from the BPC bytes and the image index table
+ * into one string, renamed into place, and not rewritten at all when the
+ * masked pels and header are the same as in the last export.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "masked_pels_json.h"
+#include "bpc_journal.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/stat.h>
+
+extern const char* driverName;
+
+namespace {
+
+const char* const kTool = "ADTimePix RefreshPixelConfig mask export";
+
+/** f(BPC index, byte) for every byte with bit 0 set, skipping clear 8-byte words. */
+template <typename F>
+void forEachMasked(const char* bpc, size_t size, F f) {
+    const uint64_t bit0 = 0x0101010101010101ull;
+    size_t k = 0;
+    for (; k + 8 <= size; k += 8) {
+        uint64_t w;
+        memcpy(&w, bpc + k, sizeof(w));
+        if ((w & bit0) == 0) continue;
+        for (size_t b = k; b < k + 8; ++b) {
+            if (bpc[b] & 1) f(b, static_cast<unsigned char>(bpc[b]));
+        }
+    }
+    for (; k < size; ++k) {
+        if (bpc[k] & 1) f(k, static_cast<unsigned char>(bpc[k]));
+    }
+}
+
+class Fnv1a {
+public:
+    void bytes(const void* p, size_t n) {
+        const unsigned char* c = static_cast<const unsigned char*>(p);
+        for (size_t i = 0; i < n; ++i) {
+            h_ ^= c[i];
+            h_ *= 0x100000001b3ull;
+        }
+    }
+    void u64(uint64_t v) { bytes(&v, sizeof(v)); }
+    void str(const std::string& s) {
+        u64(s.size());
+        bytes(s.data(), s.size());
+    }
+    uint64_t value() const { return h_; }
+
+private:
+    uint64_t h_ = 0xcbf29ce484222325ull;
+};
+
+void appendInt(std::string& out, long long v) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    const bool neg = v < 0;
+    unsigned long long u = neg ? 0ull - static_cast<unsigned long long>(v) : static_cast<unsigned long long>(v);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (neg) *--p = '-';
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+/** JSON string with nlohmann's escapes (control characters as lowercase \u00xx). */
+void appendString(std::string& out, const std::string& s) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (char ch : s) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 15];
+                } else {
+                    out += ch;
+                }
+        }
+    }
+    out += '"';
+}
+
+/** Newline, indent and "key": */
+void appendKey(std::string& out, int indent, const char* key) {
+    out += '\n';
+    out.append(static_cast<size_t>(indent), ' ');
+    out += '"';
+    out += key;
+    out += "\": ";
+}
+
+void appendIntMember(std::string& out, int indent, const char* key, long long v) {
+    appendKey(out, indent, key);
+    appendInt(out, v);
+}
+
+void appendStringMember(std::string& out, int indent, const char* key, const std::string& v) {
+    appendKey(out, indent, key);
+    appendString(out, v);
+}
+
+}  // namespace
+
+uint64_t maskedPelsHash(const char* bpc, size_t size, const MaskedPelsHeader& h) {
+    Fnv1a f;
+    f.str(h.file_path);
+    f.str(h.file_name);
+    f.str(h.det_type);
+    f.u64(static_cast<uint64_t>(h.num_chips));
+    f.u64(static_cast<uint64_t>(h.detector_orientation));
+    f.u64(static_cast<uint64_t>(h.chip_pel_width));
+    f.u64(static_cast<uint64_t>(h.cols));
+    f.u64(size);
+    forEachMasked(bpc, size, [&](size_t pos, unsigned char byte) {
+        f.u64(pos);
+        f.bytes(&byte, 1);
+    });
+    return f.value();
+}
+
+void writeMaskedPelsJson(std::string& out, const char* bpc, size_t size, const CoordMap& map,
+                         const MaskedPelsHeader& h, int& masked, int& unmapped) {
+    const int pelW = h.chip_pel_width;
+    const int chipPelCount = pelW * pelW;
+    const int cols = h.cols;
+    masked = 0;
+    unmapped = 0;
+
+    // Keys in the order dump() sorts them: "Bad pixels" and "counts" come
+    // before "masked_pels", so the pels are walked twice.
+    out += "{";
+    appendKey(out, 2, "Bad pixels");
+    out += '[';
+    forEachMasked(bpc, size, [&](size_t pos, unsigned char) {
+        const int imgIdx = map.image_index(static_cast<int>(pos));
+        if (imgIdx < 0 || cols <= 0) {
+            ++unmapped;
+            return;
+        }
+        out += masked++ ? ",\n    {" : "\n    {";
+        out += "\n      \"Median\": [\n        1,\n        1\n      ],\n      \"Pixel\": [\n        ";
+        appendInt(out, imgIdx % cols);
+        out += ",\n        ";
+        appendInt(out, imgIdx / cols);
+        out += "\n      ]\n    }";
+    });
+    out += masked ? "\n  ]," : "],";
+
+    appendKey(out, 2, "acquisition");
+    out += '{';
+    appendStringMember(out, 4, "BPCFileName", h.file_name);
+    out += ',';
+    appendStringMember(out, 4, "BPCFilePath", h.file_path);
+    out += ',';
+    appendIntMember(out, 4, "detector_orientation", h.detector_orientation);
+    out += "\n  },";
+
+    appendKey(out, 2, "counts");
+    out += '{';
+    appendIntMember(out, 4, "masked_pels", masked);
+    if (unmapped > 0) {
+        out += ',';
+        appendIntMember(out, 4, "skipped_unmapped_bpc_index", unmapped);
+    }
+    out += "\n  },";
+
+    if (!h.det_type.empty()) {
+        appendKey(out, 2, "detector");
+        out += '{';
+        appendStringMember(out, 4, "type", h.det_type);
+        out += "\n  },";
+    }
+
+    appendIntMember(out, 2, "format_version", 1);
+    out += ',';
+
+    appendKey(out, 2, "masked_pels");
+    out += '[';
+    int counter = 0;
+    forEachMasked(bpc, size, [&](size_t pos, unsigned char byte) {
+        const int imgIdx = map.image_index(static_cast<int>(pos));
+        if (imgIdx < 0 || cols <= 0) return;
+        const int k = static_cast<int>(pos);
+        int chip = 0, lx = 0, ly = 0;
+        if (chipPelCount > 0) {
+            chip = k / chipPelCount;
+            const int local = k - chip * chipPelCount;
+            lx = local % pelW;
+            ly = local / pelW;
+        }
+        out += counter++ ? ",\n    {" : "\n    {";
+        appendIntMember(out, 6, "bpc_index", k);
+        out += ',';
+        appendIntMember(out, 6, "chip", chip);
+        out += ',';
+        appendIntMember(out, 6, "i", imgIdx % cols);
+        out += ',';
+        appendIntMember(out, 6, "index", counter);
+        out += ',';
+        appendIntMember(out, 6, "j", imgIdx / cols);
+        out += ',';
+        appendIntMember(out, 6, "lx", lx);
+        out += ',';
+        appendIntMember(out, 6, "ly", ly);
+        out += ',';
+        appendIntMember(out, 6, "value", byte);
+        out += "\n    }";
+    });
+    out += counter ? "\n  ]," : "],";
+
+    appendKey(out, 2, "source");
+    out += '{';
+    appendStringMember(out, 4, "bpc_path", h.file_path + h.file_name);
+    out += ',';
+    appendIntMember(out, 4, "chip_pel_width", pelW);
+    out += ',';
+    appendIntMember(out, 4, "detector_orientation", h.detector_orientation);
+    out += ',';
+    appendStringMember(out, 4, "exported_at_utc", h.exported_at_utc);
+    out += ',';
+    appendIntMember(out, 4, "num_chips", h.num_chips);
+    out += ',';
+    appendStringMember(out, 4, "tool", kTool);
+    out += "\n  }\n}";
+}
+
+std::string maskedPelsStem(const std::string& fileName) {
+    if (fileName.size() < 4) return fileName;
+    std::string suf = fileName.substr(fileName.size() - 4);
+    for (char& c : suf) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    if (suf == ".bpc") return fileName.substr(0, fileName.size() - 4);
+    return fileName;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: RefreshPixelConfig masked-pels export
+// -----------------------------------------------------------------------
+
+namespace {
+std::string utcIso8601Now()
+{
+    std::time_t t = std::time(nullptr);
+    std::tm g;
+#if defined(_WIN32)
+    gmtime_s(&g, &t);
+#else
+    gmtime_r(&t, &g);
+#endif
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &g);
+    return buf;
+}
+}  // namespace
+
+void ADTimePix::exportMaskedPelsJsonFromBpcBuffer(const char* bpcBuf, int bpcSize)
+{
+    const char* okEmpty = "Skipped: no BPC buffer";
+    if (!bpcBuf || bpcSize <= 0) {
+        setStringParam(0, ADTimePixMaskedPelsJsonPath, "");
+        setIntegerParam(0, ADTimePixMaskedPelsCount, 0);
+        setStringParam(0, ADTimePixMaskedPelsExportStatus, okEmpty);
+        callParamCallbacks(0);
+        return;
+    }
+
+    MaskedPelsHeader h;
+    getStringParam(ADTimePixBPCFilePath, h.file_path);
+    getStringParam(ADTimePixBPCFileName, h.file_name);
+    if (h.file_name.empty()) {
+        setStringParam(0, ADTimePixMaskedPelsJsonPath, "");
+        setIntegerParam(0, ADTimePixMaskedPelsCount, 0);
+        setStringParam(0, ADTimePixMaskedPelsExportStatus, "Skipped: BPCFileName empty");
+        callParamCallbacks(0);
+        return;
+    }
+
+    const std::string outPath = h.file_path + maskedPelsStem(h.file_name) + "_masked_pels.json";
+    int rows = 0, xChips = 0, yChips = 0;
+    rowsCols(&rows, &h.cols, &xChips, &yChips, &h.chip_pel_width);
+    getIntegerParam(ADTimePixNumberOfChips, &h.num_chips);
+    getIntegerParam(ADTimePixDetectorOrientation, &h.detector_orientation);
+    getStringParam(ADTimePixDetType, h.det_type);
+
+    // Same pels, layout and names as the file already on disk: keep it (and its timestamp)
+    const size_t size = static_cast<size_t>(bpcSize);
+    const uint64_t hash = maskedPelsHash(bpcBuf, size, h);
+    struct stat st;
+    if (hash == maskedPelsExport_.hash && outPath == maskedPelsExport_.path && stat(outPath.c_str(), &st) == 0) {
+        char smsg[160];
+        epicsSnprintf(smsg, sizeof(smsg), "OK: unchanged, %d masked pels", maskedPelsExport_.masked);
+        setStringParam(0, ADTimePixMaskedPelsJsonPath, outPath.c_str());
+        setIntegerParam(0, ADTimePixMaskedPelsCount, maskedPelsExport_.masked);
+        setStringParam(0, ADTimePixMaskedPelsExportStatus, smsg);
+        FLOW_ARGS("masked pels JSON %s unchanged, not rewritten", outPath.c_str());
+        callParamCallbacks(0);
+        return;
+    }
+
+    h.exported_at_utc = utcIso8601Now();
+    const std::shared_ptr<const CoordMap> map = coordMap();
+    std::string out;
+    int counter = 0, skippedUnmapped = 0;
+    writeMaskedPelsJson(out, bpcBuf, size, *map, h, counter, skippedUnmapped);
+
+    std::string err;
+    if (!writeFileAtomic(outPath, out.data(), out.size(), err)) {
+        char emsg[256];
+        epicsSnprintf(emsg, sizeof(emsg), "Write failed: %s", err.c_str());
+        setStringParam(0, ADTimePixMaskedPelsJsonPath, "");
+        setIntegerParam(0, ADTimePixMaskedPelsCount, 0);
+        setStringParam(0, ADTimePixMaskedPelsExportStatus, emsg);
+        ERR_ARGS("exportMaskedPelsJson: %s", emsg);
+        maskedPelsExport_ = MaskedPelsExport();
+        callParamCallbacks(0);
+        return;
+    }
+    maskedPelsExport_.hash = hash;
+    maskedPelsExport_.path = outPath;
+    maskedPelsExport_.masked = counter;
+    maskedPelsExport_.unmapped = skippedUnmapped;
+
+    setStringParam(0, ADTimePixMaskedPelsJsonPath, outPath.c_str());
+    setIntegerParam(0, ADTimePixMaskedPelsCount, counter);
+    {
+        char smsg[160];
+        if (skippedUnmapped > 0) {
+            epicsSnprintf(smsg, sizeof(smsg), "OK: %d masked pels, %d index unmapped", counter,
+                          skippedUnmapped);
+        } else {
+            epicsSnprintf(smsg, sizeof(smsg), "OK: wrote %d masked pels", counter);
+        }
+        setStringParam(0, ADTimePixMaskedPelsExportStatus, smsg);
+    }
+    FLOW_ARGS("masked pels JSON %s (%d entries, %zu bytes)", outPath.c_str(), counter, out.size());
+    callParamCallbacks(0);
+}
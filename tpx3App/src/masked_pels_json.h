@@ -0,0 +1,58 @@
+/*
+ * ADTimePix3 - Streaming <stem>_masked_pels.json writer
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef MASKED_PELS_JSON_H
+#define MASKED_PELS_JSON_H
+
+#include "coord_map.h"
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Everything in the export besides the masked pels themselves. */
+struct MaskedPelsHeader {
+    std::string file_path;             // TPX3_BPC_FILE_PATH
+    std::string file_name;             // TPX3_BPC_FILE_NAME
+    std::string det_type;              // omitted from the file when empty
+    int num_chips = 1;
+    int detector_orientation = 0;
+    int chip_pel_width = 0;
+    int cols = 0;                      // image width for (i, j)
+    std::string exported_at_utc;       // not part of the content hash
+};
+
+/** @brief What the last export wrote (ADTimePix keeps one to skip unchanged rewrites). */
+struct MaskedPelsExport {
+    uint64_t hash = 0;
+    std::string path;
+    int masked = 0;
+    int unmapped = 0;
+};
+
+/**
+ * FNV-1a hash of the export contents: the header (without the timestamp)
+ * and the (BPC index, byte) of every masked pel. Bytes are tested eight at a
+ * time, so an unchanged 8-chip mask costs one pass over 512 KiB.
+ */
+uint64_t maskedPelsHash(const char* bpc, size_t size, const MaskedPelsHeader& h);
+
+/**
+ * Append the export for the BPC bytes (bit 0 = masked) to out, formatted
+ * exactly as nlohmann::json::dump(2) formats the equivalent tree (keys
+ * sorted, two-space indent, no trailing newline), without building one.
+ * Sets masked / unmapped from the pels written and skipped.
+ */
+void writeMaskedPelsJson(std::string& out, const char* bpc, size_t size, const CoordMap& map,
+                         const MaskedPelsHeader& h, int& masked, int& unmapped);
+
+/** fileName without a trailing ".bpc" (any case). */
+std::string maskedPelsStem(const std::string& fileName);
+
+#endif // MASKED_PELS_JSON_H
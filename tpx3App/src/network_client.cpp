@@ -13,6 +13,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -220,6 +221,19 @@ ssize_t NetworkClient::receive(char* buffer, size_t max_size) {
     return bytes_read;
 }
 
+bool NetworkClient::wait_readable(double timeout_sec) {
+    if (!connected_ || socket_fd_ < 0) {
+        return false;
+    }
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(socket_fd_, &readfds);
+    struct timeval tv;
+    tv.tv_sec = static_cast<time_t>(timeout_sec);
+    tv.tv_usec = static_cast<suseconds_t>((timeout_sec - static_cast<double>(tv.tv_sec)) * 1e6);
+    return select(socket_fd_ + 1, &readfds, nullptr, nullptr, &tv) > 0;
+}
+
 bool NetworkClient::receive_exact(char* buffer, size_t size) {
     size_t total_received = 0;
     
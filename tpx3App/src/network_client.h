@@ -63,6 +63,13 @@ public:
      */
     ssize_t receive(char* buffer, size_t max_size);
 
+    /**
+     * @brief Wait until data (or EOF) is readable
+     * @param timeout_sec Maximum wait in seconds
+     * @return true if a receive() will not block, false on timeout or when not connected
+     */
+    bool wait_readable(double timeout_sec);
+
     /**
      * @brief Receive exact amount of data
      * @param buffer Buffer to store received data
@@ -0,0 +1,489 @@
+/*
+ * ADTimePix3 - Compressed, frame-indexed archive of the Raw (.tpx3) TCP stream
+ *
+ * With TPX3_RAW_ARCHIVE_ENABLE=1 each Raw decode reader (raw_stream.cpp) also
+ * hands the bytes it receives to a RawArchiver, so one TCP stream feeds both
+ * the live consumers and the files on disk (Serval does not have to write
+ * .tpx3 files for us to read back). Files are <Path>/<Prefix>_<start
+ * time>_ch<c>_<seq>.tpx3z; `tpx3file unpack` turns them back into .tpx3.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "raw_archive.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <epicsStdio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+extern const char* driverName;
+
+namespace {
+
+/** Aligned staging buffer; the file gets writes of this size (and a padded tail). */
+constexpr size_t ARCHIVE_STAGING_BYTES = 8 * 1024 * 1024;
+constexpr size_t ARCHIVE_ALIGN = 4096;
+
+/** Sequence numbers tried past existing files (restart within the same second). */
+constexpr int ARCHIVE_OPEN_ATTEMPTS = 1000;
+
+int64_t wallNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+double steadySeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+RawArchiver::RawArchiver(const RawArchiveConfig& config)
+    : config_(config) {
+    config_.threads = std::min(std::max(config_.threads, 1), 16);
+    config_.level = std::min(std::max(config_.level, 0), 9);
+    config_.frame_bytes = std::max<size_t>(config_.frame_bytes, 64 * 1024);
+    max_inflight_ = static_cast<size_t>(config_.threads) * 2 + 2;
+}
+
+RawArchiver::~RawArchiver() {
+    close();
+    free(staging_);
+}
+
+bool RawArchiver::start(std::string& err) {
+    if (config_.directory.empty() || access(config_.directory.c_str(), W_OK) != 0) {
+        err = "Archive directory not writable: " + config_.directory;
+        return false;
+    }
+    if (!staging_ && posix_memalign(reinterpret_cast<void**>(&staging_), ARCHIVE_ALIGN, ARCHIVE_STAGING_BYTES) != 0) {
+        staging_ = nullptr;
+        err = "Out of memory";
+        return false;
+    }
+    stopping_ = false;
+    started_ = true;
+    for (int t = 0; t < config_.threads; ++t) pool_.emplace_back(&RawArchiver::compressLoop, this);
+    writer_ = std::thread(&RawArchiver::writerLoop, this);
+    return true;
+}
+
+void RawArchiver::write(const uint8_t* data, size_t len) {
+    if (!started_) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.bytes_in += len;
+    }
+    while (len > 0) {
+        if (!current_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (inflight_.size() >= max_inflight_) {
+                ++stats_.stalls;
+                space_cv_.wait(lock, [this] { return inflight_.size() < max_inflight_ || stopping_; });
+            }
+            if (!free_.empty()) {
+                current_ = std::move(free_.back());
+                free_.pop_back();
+            } else {
+                current_.reset(new Frame());
+            }
+            lock.unlock();
+            current_->raw.clear();
+            current_->raw.reserve(config_.frame_bytes);
+        }
+        const size_t n = std::min(len, config_.frame_bytes - current_->raw.size());
+        current_->raw.insert(current_->raw.end(), data, data + n);
+        data += n;
+        len -= n;
+        if (current_->raw.size() >= config_.frame_bytes) submit();
+    }
+}
+
+void RawArchiver::new_stream() {
+    if (!started_) return;
+    if (current_ && !current_->raw.empty()) submit();
+    pending_new_file_ = true;
+    stream_offset_ = 0;
+}
+
+/** Queue the current frame for compression (producer thread). */
+void RawArchiver::submit() {
+    Frame* frame = current_.get();
+    frame->raw_offset = stream_offset_;
+    frame->wall_ns = wallNs();
+    frame->new_file = pending_new_file_;
+    frame->done = false;
+    stream_offset_ += frame->raw.size();
+    pending_new_file_ = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    inflight_.push_back(std::move(current_));
+    todo_.push_back(frame);
+    work_cv_.notify_one();
+}
+
+void RawArchiver::compressLoop() {
+    for (;;) {
+        Frame* frame = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [this] { return !todo_.empty() || stopping_; });
+            if (todo_.empty()) return;
+            frame = todo_.front();
+            todo_.pop_front();
+        }
+        const uInt rawLen = static_cast<uInt>(frame->raw.size());
+        frame->crc = static_cast<uint32_t>(crc32(0L, frame->raw.data(), rawLen));
+        frame->flags = 0;
+        if (config_.level > 0) {
+            uLongf len = compressBound(rawLen);
+            frame->stored.resize(len);
+            if (compress2(frame->stored.data(), &len, frame->raw.data(), rawLen, config_.level) == Z_OK &&
+                len < rawLen) {
+                frame->stored.resize(len);
+                frame->flags = TPX3_ARCHIVE_FRAME_ZLIB;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        frame->done = true;
+        done_cv_.notify_all();
+    }
+}
+
+void RawArchiver::writerLoop() {
+    for (;;) {
+        std::unique_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            done_cv_.wait(lock, [this] { return (!inflight_.empty() && inflight_.front()->done) ||
+                                                (stopping_ && inflight_.empty()); });
+            if (inflight_.empty()) break;
+            frame = std::move(inflight_.front());
+            inflight_.pop_front();
+        }
+        writeFrame(*frame);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < max_inflight_) free_.push_back(std::move(frame));
+        space_cv_.notify_all();
+    }
+    closeFile();
+}
+
+void RawArchiver::writeFrame(const Frame& frame) {
+    if (fd_ >= 0 && (frame.new_file ||
+                     (config_.rotate_bytes && file_bytes_ >= config_.rotate_bytes) ||
+                     (config_.rotate_sec > 0.0 && steadySeconds() - file_opened_ >= config_.rotate_sec))) {
+        closeFile();
+    }
+    if (fd_ < 0 && !failed_ && !openFile()) failed_ = true;
+    if (failed_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.dropped_bytes += frame.raw.size();
+        return;
+    }
+
+    const bool zipped = (frame.flags & TPX3_ARCHIVE_FRAME_ZLIB) != 0;
+    const std::vector<uint8_t>& payload = zipped ? frame.stored : frame.raw;
+    Tpx3ArchiveFrame h = Tpx3ArchiveFrame();
+    std::memcpy(h.magic, "TZFR", 4);
+    h.flags = frame.flags;
+    h.stored_bytes = static_cast<uint32_t>(payload.size());
+    h.raw_bytes = static_cast<uint32_t>(frame.raw.size());
+    h.crc = frame.crc;
+    h.raw_offset = frame.raw_offset;
+    h.wall_ns = frame.wall_ns;
+    index_.push_back({ file_bytes_, h.stored_bytes, h.raw_bytes, h.raw_offset, h.wall_ns });
+    if (!append(&h, sizeof(h)) || !append(payload.data(), payload.size())) {
+        failed_ = true;
+        closeFile();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.frames;
+    stats_.bytes_out += sizeof(h) + payload.size();
+}
+
+bool RawArchiver::openFile() {
+    const int flags = O_WRONLY | O_CREAT | O_EXCL;
+    std::string path;
+    bool direct = false;
+    // The prefix carries the start time in seconds, so an archive restarted
+    // within the same second finds its names taken: step the sequence past them.
+    for (int attempt = 0; attempt < ARCHIVE_OPEN_ATTEMPTS; ++attempt) {
+        ++file_seq_;
+        char name[64];
+        snprintf(name, sizeof(name), "_ch%d_%06llu", config_.channel, static_cast<unsigned long long>(file_seq_));
+        path = config_.directory;
+        if (path.back() != '/') path += '/';
+        path += config_.prefix + name + TPX3_ARCHIVE_SUFFIX;
+
+        direct = false;
+#ifdef O_DIRECT
+        if (config_.direct_io) {
+            fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            direct = fd_ >= 0;
+            if (fd_ < 0 && errno == EINVAL) {
+                fd_ = ::open(path.c_str(), flags, 0644);  // file system without O_DIRECT
+            }
+        } else {
+            fd_ = ::open(path.c_str(), flags, 0644);
+        }
+#else
+        fd_ = ::open(path.c_str(), flags, 0644);
+#endif
+        if (fd_ >= 0 || errno != EEXIST) break;
+    }
+    if (fd_ < 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stats_.error.empty()) stats_.error = "Cannot create " + path + ": " + strerror(errno);
+        return false;
+    }
+    file_path_ = path;
+    file_bytes_ = 0;
+    file_opened_ = steadySeconds();
+    staged_ = 0;
+    index_.clear();
+
+    Tpx3ArchiveHeader h = Tpx3ArchiveHeader();
+    std::memcpy(h.magic, "TPX3ZARC", 8);
+    h.version = 1;
+    h.channel = static_cast<uint32_t>(config_.channel);
+    h.file_seq = file_seq_;
+    h.created_ns = wallNs();
+    h.frame_bytes = config_.frame_bytes;
+    h.level = config_.level;
+    std::memset(staging_, 0, TPX3_ARCHIVE_HEADER_BYTES);
+    std::memcpy(staging_, &h, sizeof(h));
+    staged_ = TPX3_ARCHIVE_HEADER_BYTES;
+    file_bytes_ = TPX3_ARCHIVE_HEADER_BYTES;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.files;
+    stats_.bytes_out += TPX3_ARCHIVE_HEADER_BYTES;
+    stats_.direct = direct;
+    stats_.file = path;
+    return true;
+}
+
+/** Copy into the staging buffer, writing it out whenever it fills. */
+bool RawArchiver::append(const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len > 0) {
+        const size_t n = std::min(len, ARCHIVE_STAGING_BYTES - staged_);
+        std::memcpy(staging_ + staged_, p, n);
+        staged_ += n;
+        p += n;
+        len -= n;
+        file_bytes_ += n;
+        if (staged_ == ARCHIVE_STAGING_BYTES && !flushStaging(false)) return false;
+    }
+    return true;
+}
+
+/**
+ * Write the staged bytes. Only whole ARCHIVE_ALIGN blocks go out, except on
+ * the final flush, which pads the tail and then truncates the file to size.
+ */
+bool RawArchiver::flushStaging(bool final) {
+    size_t out = final ? (staged_ + ARCHIVE_ALIGN - 1) / ARCHIVE_ALIGN * ARCHIVE_ALIGN
+                       : staged_ / ARCHIVE_ALIGN * ARCHIVE_ALIGN;
+    if (final) std::memset(staging_ + staged_, 0, out - staged_);
+    size_t done = 0;
+    while (done < out) {
+        const ssize_t n = ::write(fd_, staging_ + done, out - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stats_.error.empty()) stats_.error = "Write " + file_path_ + ": " + strerror(errno);
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    if (final) {
+        staged_ = 0;
+        return ftruncate(fd_, static_cast<off_t>(file_bytes_)) == 0;
+    }
+    std::memmove(staging_, staging_ + out, staged_ - out);
+    staged_ -= out;
+    return true;
+}
+
+/** Flush and close the current file, then write its .zidx sidecar. */
+void RawArchiver::closeFile() {
+    if (fd_ < 0) return;
+    if (staged_ > 0) flushStaging(true);
+    ::close(fd_);
+    fd_ = -1;
+
+    const std::string idx = file_path_ + TPX3_ARCHIVE_INDEX_SUFFIX;
+    FILE* f = fopen(idx.c_str(), "wb");
+    if (f) {
+        const uint64_t count = index_.size();
+        bool ok = fwrite("TPX3ZIDX", 8, 1, f) == 1 && fwrite(&count, sizeof(count), 1, f) == 1 &&
+                  fwrite(index_.data(), sizeof(Tpx3ArchiveIndexEntry), index_.size(), f) == index_.size();
+        ok = (fclose(f) == 0) && ok;
+        if (!ok) remove(idx.c_str());
+    }
+    index_.clear();
+}
+
+void RawArchiver::close() {
+    if (!started_) return;
+    if (current_ && !current_->raw.empty()) submit();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    done_cv_.notify_all();
+    space_cv_.notify_all();
+    for (std::thread& t : pool_) t.join();
+    pool_.clear();
+    done_cv_.notify_all();
+    if (writer_.joinable()) writer_.join();
+    started_ = false;
+}
+
+RawArchiveStats RawArchiver::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: Raw reader bytes -> RawArchiver per channel
+// -----------------------------------------------------------------------
+
+/**
+ * Create one archiver per decoded Raw channel (startRawDecode, before the
+ * readers start). Errors leave the channel without an archiver and a status.
+ */
+void ADTimePix::startRawArchive(int numChannels) {
+    int enable = 0, level = 1, threads = 2, direct = 1;
+    double rotateMB = 0.0, rotateSec = 0.0;
+    std::string dir, prefix;
+    getIntegerParam(ADTimePixRawArchiveEnable, &enable);
+    getIntegerParam(ADTimePixRawArchiveLevel, &level);
+    getIntegerParam(ADTimePixRawArchiveThreads, &threads);
+    getIntegerParam(ADTimePixRawArchiveDirect, &direct);
+    getDoubleParam(ADTimePixRawArchiveRotateMB, &rotateMB);
+    getDoubleParam(ADTimePixRawArchiveRotateSec, &rotateSec);
+    getStringParam(ADTimePixRawArchivePath, dir);
+    getStringParam(ADTimePixRawArchivePrefix, prefix);
+
+    rawArchiveLastIn_ = 0;
+    setStringParam(ADTimePixRawArchiveFile, "");
+    setIntegerParam(ADTimePixRawArchiveFiles, 0);
+    setDoubleParam(ADTimePixRawArchiveInMB, 0.0);
+    setDoubleParam(ADTimePixRawArchiveOutMB, 0.0);
+    setDoubleParam(ADTimePixRawArchiveRatio, 0.0);
+    setDoubleParam(ADTimePixRawArchiveRate, 0.0);
+    setInteger64Param(ADTimePixRawArchiveStalls, 0);
+    setDoubleParam(ADTimePixRawArchiveDroppedMB, 0.0);
+    if (!enable) {
+        setStringParam(ADTimePixRawArchiveStatus, "Off");
+        return;
+    }
+
+    char stamp[32];
+    const time_t now = time(NULL);
+    struct tm tmNow;
+    localtime_r(&now, &tmNow);
+    strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", &tmNow);
+    for (int c = 0; c < numChannels; ++c) {
+        RawArchiveConfig cfg;
+        cfg.directory = dir;
+        cfg.prefix = (prefix.empty() ? std::string("raw") : prefix) + "_" + stamp;
+        cfg.channel = c;
+        cfg.level = level;
+        cfg.threads = threads;
+        cfg.rotate_bytes = rotateMB > 0.0 ? static_cast<uint64_t>(rotateMB * 1024.0 * 1024.0) : 0;
+        cfg.rotate_sec = rotateSec;
+        cfg.direct_io = direct != 0;
+        std::unique_ptr<RawArchiver> archiver(new RawArchiver(cfg));
+        std::string err;
+        if (!archiver->start(err)) {
+            ERR_ARGS("Raw%d archive: %s", c, err.c_str());
+            setStringParam(ADTimePixRawArchiveStatus, err.c_str());
+            continue;
+        }
+        rawChannels_[c].archiver = std::move(archiver);
+    }
+    if (rawChannels_[0].archiver) {
+        setStringParam(ADTimePixRawArchiveStatus, "Archiving");
+        LOG_ARGS("Archiving Raw stream to %s/%s_%s_ch*.tpx3z", dir.c_str(),
+                 prefix.empty() ? "raw" : prefix.c_str(), stamp);
+    }
+}
+
+/** Drain and close the archivers (stopRawDecode, after the readers joined). */
+void ADTimePix::stopRawArchive() {
+    bool any = false;
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        if (!rawChannels_[c].archiver) continue;
+        rawChannels_[c].archiver->close();
+        any = true;
+    }
+    if (!any) return;
+    epicsMutexLock(rawMutex_);
+    const bool teardown = rawTeardown_;
+    epicsMutexUnlock(rawMutex_);
+    if (!teardown) updateRawArchiveStats(0.0);
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) rawChannels_[c].archiver.reset();
+    if (teardown) return;
+    setDoubleParam(ADTimePixRawArchiveRate, 0.0);
+    callParamCallbacks();
+}
+
+/** Sum the channel counters into the TPX3_RAW_ARCHIVE_* PVs (caller does callParamCallbacks). */
+void ADTimePix::updateRawArchiveStats(double dt) {
+    RawArchiveStats total;
+    std::string error;
+    bool any = false;
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        if (!rawChannels_[c].archiver) continue;
+        const RawArchiveStats st = rawChannels_[c].archiver->stats();
+        total.bytes_in += st.bytes_in;
+        total.bytes_out += st.bytes_out;
+        total.dropped_bytes += st.dropped_bytes;
+        total.files += st.files;
+        total.stalls += st.stalls;
+        if (c == 0) {
+            total.file = st.file;
+            total.direct = st.direct;
+        }
+        if (error.empty()) error = st.error;
+        any = true;
+    }
+    if (!any) return;
+    const double mb = 1024.0 * 1024.0;
+    if (dt > 0.0) {
+        setDoubleParam(ADTimePixRawArchiveRate, (total.bytes_in - std::min(rawArchiveLastIn_, total.bytes_in)) / dt / mb);
+    }
+    rawArchiveLastIn_ = total.bytes_in;
+    setStringParam(ADTimePixRawArchiveFile, total.file.c_str());
+    setIntegerParam(ADTimePixRawArchiveFiles, static_cast<int>(total.files));
+    setDoubleParam(ADTimePixRawArchiveInMB, total.bytes_in / mb);
+    setDoubleParam(ADTimePixRawArchiveOutMB, total.bytes_out / mb);
+    setDoubleParam(ADTimePixRawArchiveRatio, total.bytes_out ? static_cast<double>(total.bytes_in) / total.bytes_out : 0.0);
+    setInteger64Param(ADTimePixRawArchiveStalls, static_cast<epicsInt64>(total.stalls));
+    setDoubleParam(ADTimePixRawArchiveDroppedMB, total.dropped_bytes / mb);
+    if (!error.empty()) {
+        setStringParam(ADTimePixRawArchiveStatus, error.c_str());
+    } else if (total.files) {
+        setStringParam(ADTimePixRawArchiveStatus, total.direct ? "Archiving (O_DIRECT)" : "Archiving (buffered)");
+    }
+}
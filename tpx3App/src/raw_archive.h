@@ -0,0 +1,136 @@
+/*
+ * ADTimePix3 - Compressed, frame-indexed archive of the Raw (.tpx3) TCP stream
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RAW_ARCHIVE_H
+#define RAW_ARCHIVE_H
+
+#include "tpx3_file.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Archive settings; files are <directory>/<prefix>_ch<channel>_<seq>.tpx3z. */
+struct RawArchiveConfig {
+    std::string directory;
+    std::string prefix;                // e.g. run name and start time
+    int channel = 0;
+    int level = 1;                     // zlib level; 0 = store
+    int threads = 2;                   // compression threads
+    uint64_t rotate_bytes = 0;         // start a new file after this many written bytes; 0 = never
+    double rotate_sec = 0.0;           // ... or after this long; 0 = never
+    bool direct_io = true;             // O_DIRECT when the file system supports it
+    size_t frame_bytes = 4 * 1024 * 1024;
+};
+
+/** @brief Counters since start(). */
+struct RawArchiveStats {
+    uint64_t bytes_in = 0;             // raw stream bytes accepted
+    uint64_t bytes_out = 0;            // archive bytes written (headers included)
+    uint64_t dropped_bytes = 0;        // raw bytes lost after a file error
+    uint64_t frames = 0;
+    uint64_t files = 0;
+    uint64_t stalls = 0;               // write() waits for the compressors / disk
+    bool direct = false;               // current file uses O_DIRECT
+    std::string file;                  // current (or last) file
+    std::string error;                 // first file error
+};
+
+/**
+ * @brief Persist the received Raw byte stream next to the live decode
+ *
+ * write() copies the stream into frames of frame_bytes; full frames are
+ * zlib-compressed on a pool of `threads` threads and a writer thread appends
+ * them in order to the current file through an aligned staging buffer, so the
+ * file sees large 4 KiB-aligned writes (O_DIRECT when available, buffered
+ * otherwise). Files rotate at frame boundaries by size or age, and at
+ * new_stream() so each file holds one connection; each closed file gets a
+ * .zidx sidecar with its frame offsets, stream offsets and wall times.
+ * write() blocks when 2 * threads + 2 frames are in flight.
+ */
+class RawArchiver {
+public:
+    explicit RawArchiver(const RawArchiveConfig& config);
+    ~RawArchiver();
+    RawArchiver(const RawArchiver&) = delete;
+    RawArchiver& operator=(const RawArchiver&) = delete;
+
+    /** Check the directory and start the threads; no file is created before the first frame. */
+    bool start(std::string& err);
+    /** Append stream bytes (one producer thread). */
+    void write(const uint8_t* data, size_t len);
+    /** The stream restarted (reconnect): close the frame, next frame opens a new file. */
+    void new_stream();
+    /** Write out everything queued, close the file and join the threads. */
+    void close();
+
+    RawArchiveStats stats() const;
+    const RawArchiveConfig& config() const { return config_; }
+
+private:
+    struct Frame {
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> stored;
+        uint64_t raw_offset = 0;
+        int64_t wall_ns = 0;
+        uint32_t crc = 0;
+        uint32_t flags = 0;
+        bool new_file = false;
+        bool done = false;
+    };
+
+    void submit();
+    void compressLoop();
+    void writerLoop();
+    void writeFrame(const Frame& frame);
+    bool openFile();
+    void closeFile();
+    bool append(const void* data, size_t len);
+    bool flushStaging(bool final);
+
+    RawArchiveConfig config_;
+    size_t max_inflight_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_cv_;   // frame to compress, or stopping
+    std::condition_variable done_cv_;   // frame compressed, or stopping
+    std::condition_variable space_cv_;  // frame written
+    std::deque<Frame*> todo_;
+    std::deque<std::unique_ptr<Frame>> inflight_;  // submission order
+    std::vector<std::unique_ptr<Frame>> free_;
+    bool stopping_ = false;
+    bool started_ = false;
+    RawArchiveStats stats_;
+    std::vector<std::thread> pool_;
+    std::thread writer_;
+
+    // Producer side
+    std::unique_ptr<Frame> current_;
+    uint64_t stream_offset_ = 0;
+    bool pending_new_file_ = false;
+
+    // Writer thread
+    int fd_ = -1;
+    bool failed_ = false;
+    uint8_t* staging_ = nullptr;
+    size_t staged_ = 0;
+    uint64_t file_bytes_ = 0;
+    uint64_t file_seq_ = 0;
+    double file_opened_ = 0.0;
+    std::string file_path_;
+    std::vector<Tpx3ArchiveIndexEntry> index_;
+};
+
+#endif // RAW_ARCHIVE_H
@@ -0,0 +1,172 @@
+/*
+ * ADTimePix3 - Latency-targeted batching of decoded hits for the Raw consumers
+ *
+ * The Raw worker (raw_stream.cpp) no longer hands every decoded (and sorted)
+ * batch straight to processRawBatch(): a RawBatcher coalesces them into batches
+ * of about (hit rate * TPX3_RAW_BATCH_LATENCY_MS) hits, capped at
+ * TPX3_RAW_BATCH_MAX_HITS, so live images stay responsive at low flux and the
+ * consumers' per-batch overhead is amortised at high flux. With
+ * TPX3_RAW_BATCH_ADAPT=0 decoded batches are passed on as they come. The
+ * current target, smoothed rate, dispatch reasons, longest wait and a log2
+ * histogram of dispatched batch sizes are published once per second.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "raw_batcher.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <algorithm>
+#include <utility>
+
+extern const char* driverName;
+
+namespace {
+
+/** Smoothing of the rate estimate: follow increases fast, decreases slowly. */
+constexpr double RATE_ALPHA_UP = 0.5;
+constexpr double RATE_ALPHA_DOWN = 0.125;
+/** Largest TPX3_RAW_BATCH_MAX_HITS. */
+constexpr int RAW_BATCH_MAX_HITS_LIMIT = 1 << 24;
+
+int sizeBin(size_t n) {
+    int bin = 0;
+    while (n > 1 && bin < RAW_BATCHER_SIZE_BINS - 1) {
+        n >>= 1;
+        ++bin;
+    }
+    return bin;
+}
+
+}  // namespace
+
+void RawBatcher::set_config(const RawBatcherConfig& config) {
+    config_ = config;
+    config_.max_hits = std::max<size_t>(config_.max_hits, 1);
+    config_.min_hits = std::min(std::max<size_t>(config_.min_hits, 1), config_.max_hits);
+    config_.latency_sec = std::max(config_.latency_sec, 0.0);
+    update_target();
+}
+
+void RawBatcher::add(Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs, double now) {
+    if (hits.empty() && tdcs.empty()) return;
+    if (empty()) {
+        first_add_ = now;
+        std::swap(hits_, hits);
+        std::swap(tdcs_, tdcs);
+        hits.clear();
+        tdcs.clear();
+        return;
+    }
+    hits_.append(hits);
+    tdcs_.append(tdcs);
+    hits.clear();
+    tdcs.clear();
+}
+
+bool RawBatcher::ready(double now) const {
+    if (empty()) return false;
+    if (!config_.adaptive) return true;
+    return hits_.size() >= target_ || now - first_add_ >= config_.latency_sec;
+}
+
+double RawBatcher::time_to_due(double now) const {
+    if (empty() || !config_.adaptive) return 0.0;
+    return std::max(0.0, config_.latency_sec - (now - first_add_));
+}
+
+void RawBatcher::take(Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs, double now) {
+    hits.clear();
+    tdcs.clear();
+    if (empty()) return;
+    const size_t n = hits_.size();
+    const double wait = now - first_add_;
+    ++stats_.batches;
+    stats_.hits += n;
+    ++stats_.size_hist[sizeBin(n)];
+    if (n >= target_) {
+        ++stats_.by_size;
+    } else if (wait >= config_.latency_sec) {
+        ++stats_.by_age;
+    }
+    stats_.max_wait_sec = std::max(stats_.max_wait_sec, wait);
+
+    // Hits per second over the span since the previous dispatch
+    if (last_take_ > 0.0) {
+        const double span = now - last_take_;
+        const double inst = span > 1e-6 ? n / span : static_cast<double>(config_.max_hits) / std::max(config_.latency_sec, 1e-3);
+        const double alpha = inst > rate_ ? RATE_ALPHA_UP : RATE_ALPHA_DOWN;
+        rate_ += alpha * (inst - rate_);
+    }
+    last_take_ = now;
+    update_target();
+
+    std::swap(hits, hits_);
+    std::swap(tdcs, tdcs_);
+}
+
+void RawBatcher::reset() {
+    hits_.clear();
+    tdcs_.clear();
+    first_add_ = 0.0;
+    last_take_ = 0.0;
+    rate_ = 0.0;
+    stats_ = RawBatcherStats();
+    update_target();
+}
+
+void RawBatcher::update_target() {
+    const double want = rate_ * config_.latency_sec;
+    target_ = want >= static_cast<double>(config_.max_hits)
+                  ? config_.max_hits
+                  : std::max(config_.min_hits, static_cast<size_t>(want));
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: TPX3_RAW_BATCH_* -> RawBatcher, stats
+// -----------------------------------------------------------------------
+
+/** Worker thread: apply TPX3_RAW_BATCH_* (cheap; called once per merged batch). */
+void ADTimePix::configureRawBatcher(RawBatcher& batcher) {
+    int adapt = 1, maxHits = 0;
+    double latencyMs = 0.0;
+    getIntegerParam(ADTimePixRawBatchAdapt, &adapt);
+    getIntegerParam(ADTimePixRawBatchMaxHits, &maxHits);
+    getDoubleParam(ADTimePixRawBatchLatencyMs, &latencyMs);
+    const RawBatcherConfig& cur = batcher.config();
+    const size_t max = static_cast<size_t>(std::min(std::max(maxHits, 1), RAW_BATCH_MAX_HITS_LIMIT));
+    if (cur.adaptive == (adapt != 0) && cur.max_hits == max && cur.latency_sec == latencyMs / 1000.0) return;
+    RawBatcherConfig config = cur;
+    config.adaptive = adapt != 0;
+    config.max_hits = max;
+    config.latency_sec = latencyMs / 1000.0;
+    batcher.set_config(config);
+}
+
+/** Push batcher counters (worker thread; caller does callParamCallbacks). */
+void ADTimePix::updateRawBatchStats(const RawBatcher& batcher, double dt) {
+    const RawBatcherStats& st = batcher.stats();
+    if (dt > 0.0) {
+        const uint64_t batches = st.batches - std::min(rawBatchLastBatches_, st.batches);
+        const uint64_t hits = st.hits - std::min(rawBatchLastHits_, st.hits);
+        setDoubleParam(ADTimePixRawBatchRate, batches / dt);
+        setDoubleParam(ADTimePixRawBatchMeanHits, batches ? static_cast<double>(hits) / batches : 0.0);
+    }
+    rawBatchLastBatches_ = st.batches;
+    rawBatchLastHits_ = st.hits;
+    setIntegerParam(ADTimePixRawBatchTarget, static_cast<int>(batcher.get_target()));
+    setDoubleParam(ADTimePixRawBatchHitRate, batcher.get_rate());
+    setInteger64Param(ADTimePixRawBatches, static_cast<epicsInt64>(st.batches));
+    setInteger64Param(ADTimePixRawBatchBySize, static_cast<epicsInt64>(st.by_size));
+    setInteger64Param(ADTimePixRawBatchByAge, static_cast<epicsInt64>(st.by_age));
+    setDoubleParam(ADTimePixRawBatchMaxWaitMs, st.max_wait_sec * 1000.0);
+    epicsInt32 hist[RAW_BATCHER_SIZE_BINS];
+    for (int k = 0; k < RAW_BATCHER_SIZE_BINS; ++k) {
+        hist[k] = static_cast<epicsInt32>(std::min<uint64_t>(st.size_hist[k], INT32_MAX));
+    }
+    doCallbacksInt32Array(hist, RAW_BATCHER_SIZE_BINS, ADTimePixRawBatchSizeHist, 0);
+}
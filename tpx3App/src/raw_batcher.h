@@ -0,0 +1,94 @@
+/*
+ * ADTimePix3 - Latency-targeted batching of decoded hits for the Raw consumers
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RAW_BATCHER_H
+#define RAW_BATCHER_H
+
+#include "tpx3_raw.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Batcher settings. */
+struct RawBatcherConfig {
+    bool adaptive = true;              // false: every add() is dispatched as is
+    double latency_sec = 0.02;         // longest a hit waits for its batch to fill
+    size_t min_hits = 1024;
+    size_t max_hits = size_t(1) << 22;
+};
+
+/** Batch size histogram bins: bin k holds batches of [2^k, 2^(k+1)) hits (bin 0 also empty ones). */
+constexpr int RAW_BATCHER_SIZE_BINS = 24;
+
+/** @brief Counters since reset(). */
+struct RawBatcherStats {
+    uint64_t batches = 0;
+    uint64_t hits = 0;
+    uint64_t by_size = 0;              // dispatched because the target size was reached
+    uint64_t by_age = 0;               // ... because the oldest hit reached the latency target
+    double max_wait_sec = 0.0;         // longest a batch was held
+    uint64_t size_hist[RAW_BATCHER_SIZE_BINS] = {};
+};
+
+/**
+ * @brief Coalesce decoded batches into consumer batches sized for a target latency
+ *
+ * The Raw worker hands every (sorted) batch to add() and dispatches with take()
+ * once ready(). The target size follows the measured hit rate: rate * latency,
+ * clamped to [min_hits, max_hits], so at low flux batches are small and leave
+ * quickly and at high flux (or when the consumers fall behind and the queues
+ * fill) they grow and the per-batch cost of the consumers is amortised. A
+ * batch also leaves once its oldest data has waited latency_sec, so the target
+ * bounds the added delay whatever the rate. The rate estimate rises quickly and
+ * decays slowly, so a burst does not first go through many small batches.
+ * Concatenation keeps the order of add(), so sorted input stays sorted.
+ */
+class RawBatcher {
+public:
+    void set_config(const RawBatcherConfig& config);
+    const RawBatcherConfig& config() const { return config_; }
+
+    /**
+     * Append a batch at wall time now (seconds). The inputs are left empty; when
+     * nothing is pending they are swapped in rather than copied.
+     */
+    void add(Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs, double now);
+    /** The pending batch should be dispatched. */
+    bool ready(double now) const;
+    /** Seconds until the pending batch is due by age (0 when due or empty). */
+    double time_to_due(double now) const;
+    bool empty() const { return hits_.empty() && tdcs_.empty(); }
+
+    /** Swap the pending batch into hits / tdcs (cleared first) and update the target. */
+    void take(Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs, double now);
+
+    /** Drop pending data, rate estimate and counters. */
+    void reset();
+
+    const RawBatcherStats& stats() const { return stats_; }
+    size_t get_target() const { return target_; }
+    /** Smoothed hit rate seen by the batcher (hits/s). */
+    double get_rate() const { return rate_; }
+    size_t get_pending() const { return hits_.size(); }
+
+private:
+    void update_target();
+
+    RawBatcherConfig config_;
+    Tpx3HitBatch hits_;
+    Tpx3TdcBatch tdcs_;
+    double first_add_ = 0.0;           // wall time of the oldest pending data
+    double last_take_ = 0.0;
+    double rate_ = 0.0;
+    size_t target_ = 1024;
+    RawBatcherStats stats_;
+};
+
+#endif // RAW_BATCHER_H
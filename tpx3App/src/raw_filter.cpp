@@ -0,0 +1,286 @@
+/*
+ * ADTimePix3 - Filter stage for decoded raw hits (ROI, ToT window, BPC mask)
+ *
+ * With TPX3_RAW_FILTER_ENABLE=1 the Raw decode worker (raw_stream.cpp) drops
+ * hits outside TPX3_RAW_FILTER_ROIS, outside the TPX3_RAW_FILTER_TOT_MIN/MAX
+ * window or (TPX3_RAW_FILTER_MASK=1) on pixels masked in the BPC file, right
+ * after decode and time-walk correction, so the sorter and every consumer only
+ * see hits they will use. The pixel flags are rebuilt on the first batch after
+ * a change of settings, BPC file or detector layout.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "raw_filter.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+extern const char* driverName;
+
+namespace {
+
+constexpr uint8_t RAW_FILTER_OUTSIDE_ROI = 1u << 0;
+constexpr uint8_t RAW_FILTER_MASKED = 1u << 1;
+
+/** Keep bytes (0/1) of 8 consecutive hits as a bit mask, hit i -> bit i. */
+inline uint64_t keepBits8(const uint8_t* keep) {
+    uint64_t v;
+    std::memcpy(&v, keep, sizeof(v));
+    return ((v & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+}
+
+#if defined(__AVX512F__)
+inline uint64_t keepBits(const uint8_t* keep, int lanes) {
+    uint64_t m = 0;
+    for (int k = 0; k < lanes; k += 8) m |= keepBits8(keep + k) << k;
+    return m;
+}
+#endif
+
+/** Branch-free in-place compaction: every element is written, the index only advances on keep. */
+template <typename T>
+size_t compactScalar(T* data, const uint8_t* keep, size_t begin, size_t out, size_t n) {
+    for (size_t i = begin; i < n; ++i) {
+        data[out] = data[i];
+        out += keep[i];
+    }
+    return out;
+}
+
+template <typename T>
+size_t compactColumn(T* data, const uint8_t* keep, size_t n) {
+    return compactScalar(data, keep, 0, 0, n);
+}
+
+#if defined(__AVX512F__)
+template <>
+size_t compactColumn<uint64_t>(uint64_t* data, const uint8_t* keep, size_t n) {
+    size_t i = 0, out = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __mmask8 m = static_cast<__mmask8>(keepBits(keep + i, 8));
+        _mm512_mask_compressstoreu_epi64(data + out, m, _mm512_loadu_si512(data + i));
+        out += __builtin_popcount(m);
+    }
+    return compactScalar(data, keep, i, out, n);
+}
+
+template <>
+size_t compactColumn<uint32_t>(uint32_t* data, const uint8_t* keep, size_t n) {
+    size_t i = 0, out = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __mmask16 m = static_cast<__mmask16>(keepBits(keep + i, 16));
+        _mm512_mask_compressstoreu_epi32(data + out, m, _mm512_loadu_si512(data + i));
+        out += __builtin_popcount(m);
+    }
+    return compactScalar(data, keep, i, out, n);
+}
+#endif
+
+#if defined(__AVX512VBMI2__)
+template <>
+size_t compactColumn<uint16_t>(uint16_t* data, const uint8_t* keep, size_t n) {
+    size_t i = 0, out = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __mmask32 m = static_cast<__mmask32>(keepBits(keep + i, 32));
+        _mm512_mask_compressstoreu_epi16(data + out, m, _mm512_loadu_si512(data + i));
+        out += __builtin_popcount(m);
+    }
+    return compactScalar(data, keep, i, out, n);
+}
+
+template <>
+size_t compactColumn<uint8_t>(uint8_t* data, const uint8_t* keep, size_t n) {
+    size_t i = 0, out = 0;
+    for (; i + 64 <= n; i += 64) {
+        const __mmask64 m = static_cast<__mmask64>(keepBits(keep + i, 64));
+        _mm512_mask_compressstoreu_epi8(data + out, m, _mm512_loadu_si512(data + i));
+        out += __builtin_popcountll(m);
+    }
+    return compactScalar(data, keep, i, out, n);
+}
+#endif
+
+}  // namespace
+
+RawHitFilter::RawHitFilter(const RawFilterConfig& config, const std::vector<uint32_t>& pixel_lut,
+                           const char* bpc, size_t bpc_size)
+    : config_(config),
+      pixels_(config.image_width * config.image_height) {
+    const uint8_t outside = config_.rois.empty() ? 0 : RAW_FILTER_OUTSIDE_ROI;
+    flags_.assign(pixels_ + 1, outside);
+    if (!config_.rois.empty()) {
+        for (const TofRoi& r : config_.rois) {
+            const size_t x0 = static_cast<size_t>(std::max(r.x, 0));
+            const size_t y0 = static_cast<size_t>(std::max(r.y, 0));
+            const size_t x1 = std::min(static_cast<size_t>(std::max(r.x + r.width, 0)), config_.image_width);
+            const size_t y1 = std::min(static_cast<size_t>(std::max(r.y + r.height, 0)), config_.image_height);
+            for (size_t y = y0; y < y1; ++y) {
+                for (size_t x = x0; x < x1; ++x) flags_[y * config_.image_width + x] = 0;
+            }
+        }
+    }
+    if (bpc) {
+        const size_t n = std::min(bpc_size, pixel_lut.size());
+        for (size_t k = 0; k < n; ++k) {
+            const uint32_t p = pixel_lut[k];
+            if ((bpc[k] & (1 << 0)) && p < pixels_ && !(flags_[p] & RAW_FILTER_MASKED)) {
+                flags_[p] |= RAW_FILTER_MASKED;
+                ++masked_pixels_;
+            }
+        }
+    }
+}
+
+void RawHitFilter::apply(Tpx3HitBatch& hits) {
+    const size_t n = hits.size();
+    if (n == 0) return;
+    keep_.resize(n);
+    const uint32_t pixels = static_cast<uint32_t>(pixels_);
+    const uint16_t totMin = config_.tot_min;
+    const uint16_t totMax = config_.tot_max ? config_.tot_max : 0xFFFF;
+    const uint8_t* flags = flags_.data();
+    const uint32_t* pixel = hits.pixel.data();
+    const uint16_t* tot = hits.tot.data();
+    uint8_t* keep = keep_.data();
+    size_t outsideRoi = 0, totRejected = 0, masked = 0, passed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t p = pixel[i] < pixels ? pixel[i] : pixels;
+        const uint8_t f = flags[p];
+        const uint8_t totBad = static_cast<uint8_t>((tot[i] < totMin) | (tot[i] > totMax));
+        const uint8_t k = static_cast<uint8_t>((f | totBad) == 0);
+        keep[i] = k;
+        outsideRoi += f & RAW_FILTER_OUTSIDE_ROI;
+        masked += (f & RAW_FILTER_MASKED) >> 1;
+        totRejected += totBad;
+        passed += k;
+    }
+    stats_.hits += n;
+    stats_.passed += passed;
+    stats_.outside_roi += outsideRoi;
+    stats_.tot_rejected += totRejected;
+    stats_.masked += masked;
+    if (passed == n) return;
+
+    compactColumn(hits.pixel.data(), keep, n);
+    compactColumn(hits.toa.data(), keep, n);
+    compactColumn(hits.tot.data(), keep, n);
+    compactColumn(hits.x.data(), keep, n);
+    compactColumn(hits.y.data(), keep, n);
+    compactColumn(hits.chip.data(), keep, n);
+    hits.pixel.resize(passed);
+    hits.toa.resize(passed);
+    hits.tot.resize(passed);
+    hits.x.resize(passed);
+    hits.y.resize(passed);
+    hits.chip.resize(passed);
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: decoded batch -> RawHitFilter -> sorter / consumers
+// -----------------------------------------------------------------------
+
+/** Rebuild the filter from TPX3_RAW_FILTER_* and the BPC file on the next batch. */
+void ADTimePix::invalidateRawFilter() {
+    if (!rawFilterMutex_) return;
+    epicsMutexLock(rawFilterMutex_);
+    rawFilterConfigDirty_ = true;
+    epicsMutexUnlock(rawFilterMutex_);
+}
+
+/** Caller holds rawFilterMutex_. Invalid settings leave no filter (hits pass) and a status message. */
+void ADTimePix::rebuildRawFilter() {
+    int totMin = 0, totMax = 0, useMask = 0;
+    std::string roiSpec;
+    getIntegerParam(ADTimePixRawFilterTotMin, &totMin);
+    getIntegerParam(ADTimePixRawFilterTotMax, &totMax);
+    getIntegerParam(ADTimePixRawFilterMask, &useMask);
+    getStringParam(ADTimePixRawFilterRois, roiSpec);
+
+    rawFilter_.reset();
+    rawFilterConfigDirty_ = false;
+    setIntegerParam(ADTimePixRawFilterMaskedPixels, 0);
+
+    epicsMutexLock(rawMutex_);
+    const int width = rawImageWidth_;
+    const int height = rawImageHeight_;
+    std::vector<uint32_t> lut = rawPixelLut_;
+    epicsMutexUnlock(rawMutex_);
+
+    RawFilterConfig cfg;
+    cfg.image_width = static_cast<size_t>(std::max(width, 0));
+    cfg.image_height = static_cast<size_t>(std::max(height, 0));
+    cfg.tot_min = static_cast<uint16_t>(std::min(std::max(totMin, 0), 0xFFFF));
+    cfg.tot_max = static_cast<uint16_t>(std::min(std::max(totMax, 0), 0xFFFF));
+    if (lut.empty() || cfg.image_width * cfg.image_height == 0) {
+        setStringParam(ADTimePixRawFilterStatus, "No detector pixel map");
+        return;
+    }
+    std::string err;
+    if (!parseTofRois(roiSpec, cfg.rois, err)) {
+        setStringParam(ADTimePixRawFilterStatus, err.c_str());
+        return;
+    }
+    if (cfg.tot_max && cfg.tot_max < cfg.tot_min) {
+        setStringParam(ADTimePixRawFilterStatus, "Need ToT Min <= Max");
+        return;
+    }
+
+    std::shared_ptr<const BpcSnapshot> bpc;
+    if (useMask) bpc = bpcFile();
+    const int bpcSize = bpc ? static_cast<int>(bpc->bytes.size()) : 0;
+    rawFilter_.reset(new RawHitFilter(cfg, lut, bpcSize > 0 ? bpc->bytes.data() : NULL, static_cast<size_t>(bpcSize)));
+
+    setIntegerParam(ADTimePixRawFilterMaskedPixels, static_cast<int>(rawFilter_->get_masked_pixels()));
+    char msg[80];
+    if (useMask && bpcSize <= 0) {
+        epicsSnprintf(msg, sizeof(msg), "OK: %zu ROIs, no BPC mask loaded", cfg.rois.size());
+        WARN("Raw filter: BPC mask requested but no BPC file could be read");
+    } else {
+        epicsSnprintf(msg, sizeof(msg), "OK: %zu ROIs, %zu masked pixels",
+                      cfg.rois.size(), rawFilter_->get_masked_pixels());
+    }
+    setStringParam(ADTimePixRawFilterStatus, msg);
+}
+
+/** Raw worker thread: compact the decoded batch in place before the sorter. */
+void ADTimePix::filterRawHits(Tpx3HitBatch& hits) {
+    int enable = 0;
+    getIntegerParam(ADTimePixRawFilterEnable, &enable);
+    if (!enable || hits.empty()) return;
+
+    epicsMutexLock(rawFilterMutex_);
+    if (rawFilterConfigDirty_) rebuildRawFilter();
+    if (rawFilter_) {
+        rawFilter_->apply(hits);
+        const RawFilterStats& st = rawFilter_->stats();
+        setInteger64Param(ADTimePixRawFilterHits, static_cast<epicsInt64>(st.hits));
+        setInteger64Param(ADTimePixRawFilterPassed, static_cast<epicsInt64>(st.passed));
+        setInteger64Param(ADTimePixRawFilterOutsideRoi, static_cast<epicsInt64>(st.outside_roi));
+        setInteger64Param(ADTimePixRawFilterTotRejected, static_cast<epicsInt64>(st.tot_rejected));
+        setInteger64Param(ADTimePixRawFilterMasked, static_cast<epicsInt64>(st.masked));
+    }
+    epicsMutexUnlock(rawFilterMutex_);
+}
+
+/** TPX3_RAW_FILTER_RESET: zero the reject counters. */
+void ADTimePix::resetRawFilter() {
+    if (!rawFilterMutex_) return;
+    epicsMutexLock(rawFilterMutex_);
+    if (rawFilter_) rawFilter_->reset_stats();
+    epicsMutexUnlock(rawFilterMutex_);
+    setInteger64Param(ADTimePixRawFilterHits, 0);
+    setInteger64Param(ADTimePixRawFilterPassed, 0);
+    setInteger64Param(ADTimePixRawFilterOutsideRoi, 0);
+    setInteger64Param(ADTimePixRawFilterTotRejected, 0);
+    setInteger64Param(ADTimePixRawFilterMasked, 0);
+}
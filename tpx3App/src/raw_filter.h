@@ -0,0 +1,82 @@
+/*
+ * ADTimePix3 - Filter stage for decoded raw hits (ROI, ToT window, BPC mask)
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RAW_FILTER_H
+#define RAW_FILTER_H
+
+#include "tpx3_raw.h"
+#include "tof_histogram.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Filter configuration; ROIs in image pixels, ToT in 25 ns units. */
+struct RawFilterConfig {
+    size_t image_width = 0;
+    size_t image_height = 0;
+    std::vector<TofRoi> rois;         // empty = whole detector
+    uint16_t tot_min = 0;
+    uint16_t tot_max = 0;             // 0 = no upper limit
+};
+
+/**
+ * @brief Counters since reset_stats()
+ *
+ * A hit failing several criteria counts once in each of them, so the
+ * per-criterion counters can add up to more than hits - passed.
+ */
+struct RawFilterStats {
+    uint64_t hits = 0;
+    uint64_t passed = 0;
+    uint64_t outside_roi = 0;         // outside every ROI, or no image position
+    uint64_t tot_rejected = 0;        // ToT outside [tot_min, tot_max]
+    uint64_t masked = 0;              // pixel flagged in the BPC mask (bit 0)
+};
+
+/**
+ * @brief Drop hits the downstream consumers would discard
+ *
+ * ROI membership and the BPC mask are folded into one flag byte per image
+ * pixel at construction, so a hit costs one table lookup and a ToT compare.
+ * apply() first computes a keep byte per hit in a branch-free loop (which also
+ * feeds the reject counters), then compacts every SoA column of the batch in
+ * place. The compaction uses AVX-512 compress stores when the build targets
+ * them (__AVX512F__ for the 64/32-bit columns, __AVX512VBMI2__ for the 16/8-bit
+ * ones) and a branch-free scalar loop otherwise.
+ */
+class RawHitFilter {
+public:
+    /**
+     * @param pixel_lut BPC index -> image index (bpc2ImgIndex), used to map the mask
+     * @param bpc BPC file contents (one byte per pixel in BPC order); NULL = no mask
+     */
+    RawHitFilter(const RawFilterConfig& config, const std::vector<uint32_t>& pixel_lut,
+                 const char* bpc, size_t bpc_size);
+
+    /** Remove rejected hits from the batch, keeping the order of the rest. */
+    void apply(Tpx3HitBatch& hits);
+
+    void reset_stats() { stats_ = RawFilterStats(); }
+    const RawFilterStats& stats() const { return stats_; }
+    const RawFilterConfig& config() const { return config_; }
+    /** Image pixels masked by the BPC file. */
+    size_t get_masked_pixels() const { return masked_pixels_; }
+
+private:
+    RawFilterConfig config_;
+    size_t pixels_;
+    size_t masked_pixels_ = 0;
+    // Per image pixel, plus one trailing entry for hits without an image position
+    std::vector<uint8_t> flags_;
+    std::vector<uint8_t> keep_;
+    RawFilterStats stats_;
+};
+
+#endif // RAW_FILTER_H
@@ -0,0 +1,231 @@
+/*
+ * ADTimePix3 - Replay of a recorded .tpx3 file through the Raw consumers
+ *
+ * TPX3_REPLAY_RUN=1 maps TPX3_REPLAY_FILE with Tpx3FileReader, loads or builds
+ * its <file>.tidx time index, and decodes [TPX3_REPLAY_START_MS,
+ * TPX3_REPLAY_STOP_MS) on TPX3_REPLAY_THREADS threads. The batches take the
+ * same path as a live Raw TCP stream: time-walk correction, hit filter,
+ * Tpx3HitSorter (TPX3_RAW_SORT) and processRawBatch(), so event images,
+ * clusters, histograms, STEM and energy images can be reprocessed offline with
+ * new settings. A replay and the live decode exclude each other; the file is
+ * read as fast as the consumers take it.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include "tpx3_file.h"
+#include "hit_sorter.h"
+#include "tof_gate.h"
+
+#include <epicsStdio.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include <algorithm>
+#include <cstdint>
+
+extern const char* driverName;
+
+namespace {
+
+constexpr double REPLAY_UPDATE_SEC = 1.0;
+
+}  // namespace
+
+void ADTimePix::replayThreadC(void* pPvt) {
+    ADTimePix* pPvtADTimePix = static_cast<ADTimePix*>(pPvt);
+    pPvtADTimePix->replayThread();
+}
+
+/** Start a replay (TPX3_REPLAY_RUN=1, port thread). Refused while the live Raw decode runs. */
+asynStatus ADTimePix::startReplay() {
+    epicsMutexLock(rawMutex_);
+    const bool live = rawRunning_;
+    epicsMutexUnlock(rawMutex_);
+    if (live) {
+        setStringParam(ADTimePixReplayStatus, "Raw decode running; stop acquisition first");
+        ERR("Replay refused: the live Raw decode is running");
+        return asynError;
+    }
+    std::string path;
+    getStringParam(ADTimePixReplayFile, path);
+    if (path.empty()) {
+        setStringParam(ADTimePixReplayStatus, "No file");
+        return asynError;
+    }
+
+    stopReplay();     // join a replay that finished on its own
+    stopRawDecode();  // and a live worker that exited on peer close
+    prepareRawConsumers();
+    setStringParam(ADTimePixReplayStatus, "Indexing");
+    setDoubleParam(ADTimePixReplayProgress, 0.0);
+    setInteger64Param(ADTimePixReplayHits, 0);
+    setInteger64Param(ADTimePixReplayTdcs, 0);
+    setDoubleParam(ADTimePixReplayRate, 0.0);
+
+    epicsThreadOpts opts = EPICS_THREAD_OPTS_INIT;
+    opts.priority = epicsThreadPriorityMedium;
+    opts.stackSize = epicsThreadGetStackSize(epicsThreadStackMedium);
+    opts.joinable = 1;  // Required: stopReplay uses epicsThreadMustJoin
+
+    epicsMutexLock(rawMutex_);
+    replayRunning_ = true;
+    replayThreadId_ = epicsThreadCreateOpt("rawReplay", replayThreadC, this, &opts);
+    if (!replayThreadId_) replayRunning_ = false;
+    epicsMutexUnlock(rawMutex_);
+    if (!replayThreadId_) {
+        setStringParam(ADTimePixReplayStatus, "Thread create failed");
+        ERR("Failed to create replay thread");
+        return asynError;
+    }
+    LOG_ARGS("Started replay of %s", path.c_str());
+    return asynSuccess;
+}
+
+/** Abort and join the replay thread (TPX3_REPLAY_RUN=0, shutdown). */
+void ADTimePix::stopReplay() {
+    if (!rawMutex_) return;
+    epicsMutexLock(rawMutex_);
+    replayRunning_ = false;
+    epicsMutexUnlock(rawMutex_);
+    if (replayThreadId_ != NULL && replayThreadId_ != epicsThreadGetIdSelf()) {
+        epicsThreadMustJoin(replayThreadId_);
+        replayThreadId_ = NULL;
+    }
+}
+
+void ADTimePix::replayThread() {
+    std::string path;
+    double startMs = 0.0, stopMs = 0.0;
+    int threads = 1, sortEnable = 0;
+    double latencyMs = 0.0;
+    getStringParam(ADTimePixReplayFile, path);
+    getDoubleParam(ADTimePixReplayStartMs, &startMs);
+    getDoubleParam(ADTimePixReplayStopMs, &stopMs);
+    getIntegerParam(ADTimePixReplayThreads, &threads);
+    getIntegerParam(ADTimePixRawSort, &sortEnable);
+    getDoubleParam(ADTimePixRawSortLatencyMs, &latencyMs);
+
+    std::vector<uint32_t> pixelLut;
+    epicsMutexLock(rawMutex_);
+    pixelLut = rawPixelLut_;
+    epicsMutexUnlock(rawMutex_);
+
+    Tpx3FileReader reader;
+    std::string err;
+    const double t0 = nowSeconds();
+    if (!reader.open(path, err) || !reader.load_or_build_index(false, err)) {
+        ERR_ARGS("Replay: %s", err.c_str());
+        setStringParam(ADTimePixReplayStatus, err.c_str());
+        epicsMutexLock(rawMutex_);
+        replayRunning_ = false;
+        epicsMutexUnlock(rawMutex_);
+        setIntegerParam(ADTimePixReplayRun, 0);
+        callParamCallbacks();
+        return;
+    }
+    reader.set_pixel_lut(pixelLut.empty() ? nullptr : pixelLut.data(), pixelLut.size());
+
+    const Tpx3IndexSummary& summary = reader.summary();
+    const uint64_t first = summary.t_first;
+    const uint64_t rangeStart = first + static_cast<uint64_t>(tofMsToTicks(std::max(startMs, 0.0)));
+    const uint64_t rangeStop = stopMs > 0.0 ? first + static_cast<uint64_t>(tofMsToTicks(stopMs)) : 0;
+    size_t rangeBlocks = 0;
+    uint64_t rangeBytes = 0;
+    for (const Tpx3IndexEntry& e : reader.index()) {
+        if (e.t_max >= rangeStart && (rangeStop == 0 || e.t_min < rangeStop)) {
+            ++rangeBlocks;
+            rangeBytes += e.bytes;
+        }
+    }
+    setDoubleParam(ADTimePixReplayDurationMs, tofTicksToMs(summary.t_last - summary.t_first));
+    setIntegerParam(ADTimePixReplayBlocks, static_cast<int>(reader.index().size()));
+    setStringParam(ADTimePixReplayStatus, reader.index_from_sidecar() ? "Replaying (index loaded)"
+                                                                      : "Replaying (index built)");
+    callParamCallbacks();
+    LOG_ARGS("Replay: %s, %zu of %zu blocks in range, index %s in %.2f s", path.c_str(), rangeBlocks,
+             reader.index().size(), reader.index_from_sidecar() ? "loaded" : "built", nowSeconds() - t0);
+
+    Tpx3HitSorter sorter;
+    sorter.set_latency(tofMsToTicks(latencyMs));
+    Tpx3HitBatch sortedHits;
+    Tpx3TdcBatch sortedTdcs;
+    size_t blocksDone = 0;
+    uint64_t hitsDone = 0, tdcsDone = 0;
+    bool aborted = false;
+    double lastUpdate = nowSeconds();
+    const double startTime = lastUpdate;
+    const double bytesPerBlock = rangeBlocks ? static_cast<double>(rangeBytes) / rangeBlocks : 0.0;
+
+    const Tpx3RangeStats st = reader.read_range(rangeStart, rangeStop, std::min(std::max(threads, 1), 64),
+                                                [&](Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs) {
+        epicsMutexLock(rawMutex_);
+        const bool running = replayRunning_;
+        epicsMutexUnlock(rawMutex_);
+        if (!running) {
+            aborted = true;
+            return false;
+        }
+        ++blocksDone;
+        hitsDone += hits.size();
+        tdcsDone += tdcs.size();
+        countOccupancy(0, hits);
+        applyTimeWalk(hits);
+        filterRawHits(hits);
+        if (sortEnable) {
+            sorter.add(hits, tdcs, sortedHits, sortedTdcs);
+            if (!sortedHits.empty() || !sortedTdcs.empty()) processRawBatch(sortedHits, sortedTdcs);
+            sortedHits.clear();
+            sortedTdcs.clear();
+        } else {
+            processRawBatch(hits, tdcs);
+        }
+
+        const double now = nowSeconds();
+        if (now - lastUpdate >= REPLAY_UPDATE_SEC) {
+            setDoubleParam(ADTimePixReplayProgress, 100.0 * blocksDone / std::max<size_t>(rangeBlocks, 1));
+            setInteger64Param(ADTimePixReplayHits, static_cast<epicsInt64>(hitsDone));
+            setInteger64Param(ADTimePixReplayTdcs, static_cast<epicsInt64>(tdcsDone));
+            setDoubleParam(ADTimePixReplayRate, blocksDone * bytesPerBlock / (now - startTime) / (1024.0 * 1024.0));
+            if (sortEnable) updateRawSortStats(sorter);
+            callParamCallbacks();
+            lastUpdate = now;
+        }
+        updateOccupancy(false);
+        return true;
+    });
+
+    epicsMutexLock(rawMutex_);
+    const bool teardown = rawTeardown_;
+    if (teardown) replayRunning_ = false;
+    epicsMutexUnlock(rawMutex_);
+    if (teardown) return;  // ~ADTimePix is joining us: publish nothing
+    sorter.flush(sortedHits, sortedTdcs);
+    if (!sortedHits.empty() || !sortedTdcs.empty()) processRawBatch(sortedHits, sortedTdcs);
+    flushRawConsumers();
+    updateOccupancy(true);
+
+    const double elapsed = nowSeconds() - startTime;
+    epicsMutexLock(rawMutex_);
+    replayRunning_ = false;
+    epicsMutexUnlock(rawMutex_);
+    char msg[128];
+    epicsSnprintf(msg, sizeof(msg), "%s: %llu hits in %.2f s", aborted ? "Aborted" : "Done",
+                  static_cast<unsigned long long>(hitsDone), elapsed);
+    setStringParam(ADTimePixReplayStatus, msg);
+    setDoubleParam(ADTimePixReplayProgress, aborted ? 100.0 * blocksDone / std::max<size_t>(rangeBlocks, 1) : 100.0);
+    setInteger64Param(ADTimePixReplayHits, static_cast<epicsInt64>(hitsDone));
+    setInteger64Param(ADTimePixReplayTdcs, static_cast<epicsInt64>(tdcsDone));
+    setDoubleParam(ADTimePixReplayRate, elapsed > 0.0 ? st.bytes / elapsed / (1024.0 * 1024.0) : 0.0);
+    if (sortEnable) updateRawSortStats(sorter);
+    setIntegerParam(ADTimePixReplayRun, 0);
+    callParamCallbacks();
+    LOG_ARGS("Replay %s: %zu blocks, %llu hits, %llu TDCs in %.2f s", aborted ? "aborted" : "done", st.blocks,
+             static_cast<unsigned long long>(hitsDone), static_cast<unsigned long long>(tdcsDone), elapsed);
+}
@@ -0,0 +1,664 @@
+/*
+ * ADTimePix3 - Raw (.tpx3) TCP stream consumer
+ *
+ * When Raw[0].Base is tcp:// and TPX3_RAW_DECODE=1, a reader thread connects to
+ * Serval's raw TCP sender, frames and decodes the chunked .tpx3 stream with
+ * Tpx3RawDecoder, applies time-walk correction and the hit filter, and queues
+ * the hit/TDC batches. With TPX3_RAW1_DECODE=1 and Raw[1].Base also tcp://, a
+ * second reader does the same for Raw[1] on its own core; Serval is expected
+ * to send each destination a disjoint part of the data.
+ *
+ * The rawWorker thread merges the queues into processRawBatch(). With
+ * TPX3_RAW_SORT=1 (always with two channels) batches first pass through
+ * Tpx3HitSorter, so consumers see time-ordered hits on one unwrapped timeline;
+ * the merge takes the next batch from the channel furthest behind in detector
+ * time, and a RawBatcher (raw_batcher.cpp) sizes the batches handed to the
+ * consumers for TPX3_RAW_BATCH_LATENCY_MS. Readers block when their queue is
+ * full rather than drop data. With TPX3_RAW_ARCHIVE_ENABLE=1 each reader also
+ * passes the received bytes to a RawArchiver (raw_archive.cpp) before decoding;
+ * with TPX3_OCC_ENABLE=1 it counts the decoded hits per chip and super-pixel
+ * (chip_occupancy.cpp) before filtering. Packet, hit, TDC and byte rates,
+ * per-channel backlog and merge lag are published once per second.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include "network_client.h"
+#include "tpx3_raw.h"
+#include "hit_sorter.h"
+#include "raw_batcher.h"
+#include "tof_gate.h"
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+extern const char* driverName;
+
+namespace {
+
+/** Bytes per recv(); a few ms of data at full detector rate. */
+constexpr size_t RAW_RECV_BUFFER_SIZE = 4 * 1024 * 1024;
+/** recv() wait so acquireStop can join the worker when the stream is idle. */
+constexpr double RAW_WAIT_READABLE_SEC = 0.2;
+constexpr double RAW_RECONNECT_DELAY_SEC = 1.0;
+constexpr double RAW_RATE_UPDATE_SEC = 1.0;
+/** Shortest worker wait for a batch that is about to be due. */
+constexpr double RAW_BATCH_MIN_WAIT_SEC = 0.001;
+/** Decoded batches a reader may queue ahead of the merge (~4 MB of stream each). */
+constexpr size_t RAW_CHANNEL_MAX_BATCHES = 32;
+
+}  // namespace
+
+void ADTimePix::rawWorkerThreadC(void* pPvt) {
+    ADTimePix* pPvtADTimePix = static_cast<ADTimePix*>(pPvt);
+    pPvtADTimePix->rawWorkerThread();
+}
+
+void ADTimePix::rawReaderThreadC(void* pPvt) {
+    RawChannel* channel = static_cast<RawChannel*>(pPvt);
+    channel->owner->rawReaderThread(*channel);
+}
+
+/**
+ * Build the (chip, y, x) -> image index table used by the decoder from the
+ * coordinate map's file -> image table (bpc2ImgIndex); unmapped pels get
+ * TPX3_PIXEL_NONE.
+ */
+void ADTimePix::buildRawPixelLut() {
+    int rows = 0, cols = 0, xChips = 0, yChips = 0, chipPelWidth = 0, numChips = 0;
+    rowsCols(&rows, &cols, &xChips, &yChips, &chipPelWidth);
+    getIntegerParam(ADTimePixNumberOfChips, &numChips);
+
+    std::vector<uint32_t> lut;
+    if (chipPelWidth == 256 && numChips > 0 && numChips <= 255) {
+        const std::shared_ptr<const CoordMap> map = coordMap();
+        const std::vector<int32_t>& fileToImage = map->file_to_image();
+        lut.resize(static_cast<size_t>(numChips) * chipPelWidth * chipPelWidth, TPX3_PIXEL_NONE);
+        const size_t n = std::min(lut.size(), fileToImage.size());
+        for (size_t k = 0; k < n; ++k) {
+            if (fileToImage[k] >= 0) lut[k] = static_cast<uint32_t>(fileToImage[k]);
+        }
+    } else {
+        WARN_ARGS("Raw decode: no pixel map for %d chips of width %d; image index disabled", numChips, chipPelWidth);
+    }
+
+    epicsMutexLock(rawMutex_);
+    rawPixelLut_.swap(lut);
+    rawImageWidth_ = xChips * chipPelWidth;
+    rawImageHeight_ = yChips * chipPelWidth;
+    epicsMutexUnlock(rawMutex_);
+}
+
+void ADTimePix::rawConnect(RawChannel& channel) {
+    epicsMutexLock(rawMutex_);
+    std::string host = channel.host;
+    int port = channel.port;
+    epicsMutexUnlock(rawMutex_);
+
+    if (host.empty() || port <= 0) {
+        ERR_ARGS("Raw%d TCP: Invalid host or port", channel.index);
+        return;
+    }
+
+    rawDisconnect(channel);
+
+    channel.networkClient.reset(new NetworkClient());
+    if (channel.networkClient->connect(host, port)) {
+        bool allConnected = true;
+        epicsMutexLock(rawMutex_);
+        channel.connected = true;
+        for (int c = 0; c < rawNumChannels_; ++c) allConnected = allConnected && rawChannels_[c].connected;
+        epicsMutexUnlock(rawMutex_);
+        setIntegerParam(ADTimePixRawConnected, allConnected ? 1 : 0);
+        setIntegerParam(channel.index, ADTimePixRawChConnected, 1);
+        setStringParam(ADTimePixRawDecodeStatus, channel.index == 0 ? "Connected" : "Raw1 connected");
+        callParamCallbacks(channel.index);
+        if (channel.index != 0) callParamCallbacks();
+        LOG_ARGS("Raw%d TCP connected to %s:%d", channel.index, host.c_str(), port);
+    } else {
+        ERR_ARGS("Raw%d TCP failed to connect to %s:%d", channel.index, host.c_str(), port);
+        channel.networkClient.reset();
+    }
+}
+
+void ADTimePix::rawDisconnect(RawChannel& channel) {
+    epicsMutexLock(rawMutex_);
+    channel.connected = false;
+    epicsMutexUnlock(rawMutex_);
+
+    if (channel.networkClient) {
+        channel.networkClient->disconnect();
+        channel.networkClient.reset();
+    }
+}
+
+/** Zero decoder counters and rate PVs (acquireStart). */
+void ADTimePix::resetRawDecodeStats() {
+    setDoubleParam(ADTimePixRawHitRate, 0.0);
+    setDoubleParam(ADTimePixRawTdcRate, 0.0);
+    setDoubleParam(ADTimePixRawPacketRate, 0.0);
+    setDoubleParam(ADTimePixRawDataRate, 0.0);
+    setInteger64Param(ADTimePixRawHits, 0);
+    setInteger64Param(ADTimePixRawTdcs, 0);
+    setInteger64Param(ADTimePixRawFramingErrors, 0);
+    setInteger64Param(ADTimePixRawSortLateHits, 0);
+    setInteger64Param(ADTimePixRawSortLateTdcs, 0);
+    setIntegerParam(ADTimePixRawSortRollovers, 0);
+    setDoubleParam(ADTimePixRawSortDisorderMs, 0.0);
+    setIntegerParam(ADTimePixRawSortBuffered, 0);
+    setIntegerParam(ADTimePixRawBatchTarget, 0);
+    setDoubleParam(ADTimePixRawBatchHitRate, 0.0);
+    setDoubleParam(ADTimePixRawBatchRate, 0.0);
+    setDoubleParam(ADTimePixRawBatchMeanHits, 0.0);
+    setInteger64Param(ADTimePixRawBatches, 0);
+    setInteger64Param(ADTimePixRawBatchBySize, 0);
+    setInteger64Param(ADTimePixRawBatchByAge, 0);
+    setDoubleParam(ADTimePixRawBatchMaxWaitMs, 0.0);
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        setIntegerParam(c, ADTimePixRawChConnected, 0);
+        setDoubleParam(c, ADTimePixRawChHitRate, 0.0);
+        setDoubleParam(c, ADTimePixRawChDataRate, 0.0);
+        setInteger64Param(c, ADTimePixRawChHits, 0);
+        setIntegerParam(c, ADTimePixRawChBacklog, 0);
+        setIntegerParam(c, ADTimePixRawChBacklogHits, 0);
+        setInteger64Param(c, ADTimePixRawChStalls, 0);
+        setDoubleParam(c, ADTimePixRawChMergeLagMs, 0.0);
+        if (c != 0) callParamCallbacks(c);
+    }
+}
+
+/** Push reorder counters (worker thread; caller does callParamCallbacks). */
+void ADTimePix::updateRawSortStats(const Tpx3HitSorter& sorter) {
+    const HitSorterStats& st = sorter.stats();
+    setInteger64Param(ADTimePixRawSortLateHits, static_cast<epicsInt64>(st.late_hits));
+    setInteger64Param(ADTimePixRawSortLateTdcs, static_cast<epicsInt64>(st.late_tdcs));
+    setIntegerParam(ADTimePixRawSortRollovers, static_cast<int>(st.rollovers));
+    setDoubleParam(ADTimePixRawSortDisorderMs, tofTicksToMs(st.max_disorder));
+    setIntegerParam(ADTimePixRawSortBuffered, static_cast<int>(sorter.get_buffered_hits()));
+}
+
+/**
+ * Reset the consumers fed by processRawBatch() for a new stream (live decode
+ * or file replay): pixel table, counters, rebuilt engines, time-walk tables.
+ */
+void ADTimePix::prepareRawConsumers() {
+    buildRawPixelLut();
+    resetRawDecodeStats();
+    invalidateEventImageBuilder();
+    setIntegerParam(ADTimePixEvtImgFrames, 0);
+    setInteger64Param(ADTimePixEvtImgDropped, 0);
+    setInteger64Param(ADTimePixEvtImgSkipped, 0);
+    invalidateClusterEngine();
+    setInteger64Param(ADTimePixClusterCount, 0);
+    setInteger64Param(ADTimePixClusterLate, 0);
+    setDoubleParam(ADTimePixClusterRate, 0.0);
+    invalidateRawHistogram();
+    invalidateStemImager();
+    setIntegerParam(ADTimePixVStemFrames, 0);
+    invalidateEnergyImager();
+    int timeWalkEnable = 0;
+    getIntegerParam(ADTimePixTimeWalkEnable, &timeWalkEnable);
+    epicsMutexLock(timeWalkMutex_);
+    const bool timeWalkLoaded = timeWalk_ != nullptr;
+    epicsMutexUnlock(timeWalkMutex_);
+    if (timeWalkEnable && !timeWalkLoaded) loadTimeWalk();
+    invalidateTimeWalkValidation();
+    invalidateRawFilter();
+    resetHitList();
+    resetOccupancy();
+    resetTofGateReferences();
+}
+
+/** Publish what the consumers still hold at the end of a stream. */
+void ADTimePix::flushRawConsumers() {
+    flushEventImage();
+    flushClusters();
+    flushRawHistogram();
+    flushStem();
+    flushEnergy();
+    flushTimeWalk();
+    flushHitList();
+}
+
+/**
+ * Consumer hook for one decoded batch (worker thread). Hits are in arrival
+ * order per chip; times are TDC ticks. The batch is cleared by the caller.
+ */
+void ADTimePix::processRawBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    processTimeWalkBatch(hits, tdcs);
+    processEventImageBatch(hits, tdcs);
+    processClusterBatch(hits);
+    processRawHistogramBatch(hits, tdcs);
+    processStemBatch(hits, tdcs);
+    processEnergyBatch(hits);
+    processHitListBatch(hits);
+    processTofGateBatch(hits, tdcs);
+}
+
+/**
+ * Reader for one Raw[c] channel: receive, decode, time-walk, filter, queue.
+ * Blocks on a full queue so a slow merge backs up into TCP instead of losing data.
+ */
+void ADTimePix::rawReaderThread(RawChannel& channel) {
+    std::vector<uint8_t> recvBuffer(RAW_RECV_BUFFER_SIZE);
+    Tpx3RawDecoder decoder;
+    bool restart = true;
+
+    epicsMutexLock(rawMutex_);
+    decoder.set_pixel_lut(rawPixelLut_.empty() ? nullptr : rawPixelLut_.data(), rawPixelLut_.size());
+    epicsMutexUnlock(rawMutex_);
+
+    while (rawRunning_) {
+        epicsMutexLock(rawMutex_);
+        bool should_connect = rawRunning_ && !channel.connected;
+        epicsMutexUnlock(rawMutex_);
+        if (should_connect) {
+            rawConnect(channel);
+            if (!channel.networkClient) {
+                epicsThreadSleep(RAW_RECONNECT_DELAY_SEC);
+                continue;
+            }
+            decoder.reset();
+            restart = true;
+            if (channel.archiver) channel.archiver->new_stream();
+        }
+
+        if (!channel.networkClient->wait_readable(RAW_WAIT_READABLE_SEC)) continue;
+        ssize_t bytes_read = channel.networkClient->receive(
+            reinterpret_cast<char*>(recvBuffer.data()), recvBuffer.size());
+        if (bytes_read == 0) {
+            LOG_ARGS("Raw%d TCP connection closed by peer", channel.index);
+            setStringParam(ADTimePixRawDecodeStatus, "Closed by peer");
+            break;
+        }
+        if (bytes_read < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            ERR_ARGS("Raw%d TCP socket error: %s", channel.index, strerror(errno));
+            setStringParam(ADTimePixRawDecodeStatus, "Socket error");
+            break;
+        }
+        if (channel.archiver) channel.archiver->write(recvBuffer.data(), static_cast<size_t>(bytes_read));
+        decoder.feed(recvBuffer.data(), static_cast<size_t>(bytes_read));
+        if (decoder.hits().empty() && decoder.tdcs().empty()) {
+            epicsMutexLock(rawMutex_);
+            channel.stats = decoder.stats();
+            epicsMutexUnlock(rawMutex_);
+            continue;
+        }
+        countOccupancy(channel.index, decoder.hits());
+        applyTimeWalk(decoder.hits());
+        filterRawHits(decoder.hits());
+
+        RawChannelBatch batch;
+        epicsMutexLock(rawMutex_);
+        if (channel.queue.size() >= RAW_CHANNEL_MAX_BATCHES) {
+            ++channel.stalls;
+            while (channel.queue.size() >= RAW_CHANNEL_MAX_BATCHES && rawRunning_) {
+                epicsMutexUnlock(rawMutex_);
+                epicsEventWaitWithTimeout(channel.spaceEvent, RAW_WAIT_READABLE_SEC);
+                epicsMutexLock(rawMutex_);
+            }
+        }
+        if (!channel.spare.empty()) {
+            batch = std::move(channel.spare.back());
+            channel.spare.pop_back();
+        }
+        epicsMutexUnlock(rawMutex_);
+
+        // Hand the decoded vectors over; the decoder keeps the spare's capacity
+        batch.hits.clear();
+        batch.tdcs.clear();
+        std::swap(batch.hits, decoder.hits());
+        std::swap(batch.tdcs, decoder.tdcs());
+        batch.restart = restart;
+        restart = false;
+        const size_t hits = batch.hits.size();
+
+        epicsMutexLock(rawMutex_);
+        channel.queue.push_back(std::move(batch));
+        channel.queuedHits += hits;
+        channel.stats = decoder.stats();
+        epicsMutexUnlock(rawMutex_);
+        epicsEventSignal(rawDataEvent_);
+    }
+
+    epicsMutexLock(rawMutex_);
+    channel.stats = decoder.stats();
+    channel.active = false;
+    epicsMutexUnlock(rawMutex_);
+    rawDisconnect(channel);
+    setIntegerParam(channel.index, ADTimePixRawChConnected, 0);
+    callParamCallbacks(channel.index);
+    epicsEventSignal(rawDataEvent_);
+}
+
+/**
+ * Merge the channel queues into processRawBatch() (one thread, so the
+ * downstream stages stay single-threaded). Runs until every reader has exited
+ * and its queue is drained.
+ */
+void ADTimePix::rawWorkerThread() {
+    Tpx3HitSorter sorter;
+    Tpx3HitBatch sortedHits;
+    Tpx3TdcBatch sortedTdcs;
+    RawChannelBatch batch;
+    const int numChannels = rawNumChannels_;
+    uint64_t channelNewest[RAW_MAX_CHANNELS] = {};
+    Tpx3DecoderStats lastStats[RAW_MAX_CHANNELS];
+    RawBatcher batcher;
+    Tpx3HitBatch batchHits;
+    Tpx3TdcBatch batchTdcs;
+    configureRawBatcher(batcher);
+    rawBatchLastBatches_ = 0;
+    rawBatchLastHits_ = 0;
+
+    // Hand the batcher's pending batch to the consumers once it is due (or now)
+    auto dispatch = [&](bool force) {
+        const double now = nowSeconds();
+        if (!(force ? !batcher.empty() : batcher.ready(now))) return;
+        batcher.take(batchHits, batchTdcs, now);
+        processRawBatch(batchHits, batchTdcs);
+        batchHits.clear();
+        batchTdcs.clear();
+    };
+
+    // Move whatever the sorter still holds into the batcher
+    auto flushSorter = [&]() {
+        sorter.flush(sortedHits, sortedTdcs);
+        batcher.add(sortedHits, sortedTdcs, nowSeconds());
+    };
+
+    // Per-channel and summed counters (caller does callParamCallbacks for addr 0)
+    auto updateStats = [&](double dt) {
+        Tpx3DecoderStats total;
+        double hitRate = 0.0, tdcRate = 0.0, packetRate = 0.0, dataRate = 0.0;
+        bool allConnected = true;
+        for (int c = 0; c < numChannels; ++c) {
+            RawChannel& channel = rawChannels_[c];
+            epicsMutexLock(rawMutex_);
+            const Tpx3DecoderStats st = channel.stats;
+            const int backlog = static_cast<int>(channel.queue.size());
+            const int backlogHits = static_cast<int>(std::min<size_t>(channel.queuedHits, INT32_MAX));
+            const uint64_t stalls = channel.stalls;
+            allConnected = allConnected && channel.connected;
+            epicsMutexUnlock(rawMutex_);
+            if (st.bytes < lastStats[c].bytes) lastStats[c] = Tpx3DecoderStats();  // reconnected
+            if (dt > 0.0) {
+                const double chHitRate = (st.pixel_hits - lastStats[c].pixel_hits) / dt;
+                const double chDataRate = (st.bytes - lastStats[c].bytes) / dt / (1024.0 * 1024.0);
+                setDoubleParam(c, ADTimePixRawChHitRate, chHitRate);
+                setDoubleParam(c, ADTimePixRawChDataRate, chDataRate);
+                hitRate += chHitRate;
+                dataRate += chDataRate;
+                tdcRate += (st.tdc_events - lastStats[c].tdc_events) / dt;
+                packetRate += (st.packets - lastStats[c].packets) / dt;
+            }
+            const uint64_t newest = sorter.get_newest();
+            const double lagMs = (numChannels > 1 && channelNewest[c] && newest > channelNewest[c])
+                                     ? tofTicksToMs(newest - channelNewest[c]) : 0.0;
+            setInteger64Param(c, ADTimePixRawChHits, static_cast<epicsInt64>(st.pixel_hits));
+            setIntegerParam(c, ADTimePixRawChBacklog, backlog);
+            setIntegerParam(c, ADTimePixRawChBacklogHits, backlogHits);
+            setInteger64Param(c, ADTimePixRawChStalls, static_cast<epicsInt64>(stalls));
+            setDoubleParam(c, ADTimePixRawChMergeLagMs, lagMs);
+            if (c != 0) callParamCallbacks(c);
+            total.pixel_hits += st.pixel_hits;
+            total.tdc_events += st.tdc_events;
+            total.framing_errors += st.framing_errors;
+            lastStats[c] = st;
+        }
+        if (dt > 0.0) {
+            setDoubleParam(ADTimePixRawHitRate, hitRate);
+            setDoubleParam(ADTimePixRawTdcRate, tdcRate);
+            setDoubleParam(ADTimePixRawPacketRate, packetRate);
+            setDoubleParam(ADTimePixRawDataRate, dataRate);
+        }
+        setInteger64Param(ADTimePixRawHits, static_cast<epicsInt64>(total.pixel_hits));
+        setInteger64Param(ADTimePixRawTdcs, static_cast<epicsInt64>(total.tdc_events));
+        setInteger64Param(ADTimePixRawFramingErrors, static_cast<epicsInt64>(total.framing_errors));
+        setIntegerParam(ADTimePixRawConnected, allConnected ? 1 : 0);
+        updateRawSortStats(sorter);
+        updateRawArchiveStats(dt);
+        updateRawBatchStats(batcher, dt);
+    };
+
+    double lastRateTime = nowSeconds();
+    double lastDataTime = lastRateTime;
+
+    for (;;) {
+        // Next batch from the channel furthest behind; stop once readers are gone and drained
+        int pick = -1;
+        bool readersActive = false;
+        epicsMutexLock(rawMutex_);
+        for (int c = 0; c < numChannels; ++c) {
+            RawChannel& channel = rawChannels_[c];
+            readersActive = readersActive || channel.active;
+            if (!channel.queue.empty() && (pick < 0 || channelNewest[c] < channelNewest[pick])) pick = c;
+        }
+        if (pick >= 0) {
+            RawChannel& channel = rawChannels_[pick];
+            batch = std::move(channel.queue.front());
+            channel.queue.pop_front();
+            channel.queuedHits -= batch.hits.size();
+        }
+        epicsMutexUnlock(rawMutex_);
+
+        if (pick >= 0) {
+            epicsEventSignal(rawChannels_[pick].spaceEvent);
+            lastDataTime = nowSeconds();
+            configureRawBatcher(batcher);
+            if (batch.restart && numChannels == 1) {
+                flushSorter();  // new stream: fresh timeline
+                dispatch(true);
+                sorter.reset();
+            }
+            int sortEnable = 0;
+            double latencyMs = 0.0;
+            getIntegerParam(ADTimePixRawSort, &sortEnable);
+            getDoubleParam(ADTimePixRawSortLatencyMs, &latencyMs);
+            if (sortEnable || numChannels > 1) {
+                sorter.set_latency(tofMsToTicks(latencyMs));
+                const uint64_t newest = sorter.add(batch.hits, batch.tdcs, sortedHits, sortedTdcs);
+                channelNewest[pick] = std::max(channelNewest[pick], newest);
+                batcher.add(sortedHits, sortedTdcs, lastDataTime);
+            } else {
+                flushSorter();  // sorting was just switched off
+                batcher.add(batch.hits, batch.tdcs, lastDataTime);
+            }
+            dispatch(false);
+            batch.hits.clear();
+            batch.tdcs.clear();
+            epicsMutexLock(rawMutex_);
+            RawChannel& channel = rawChannels_[pick];
+            if (channel.spare.size() < RAW_CHANNEL_MAX_BATCHES) channel.spare.push_back(std::move(batch));
+            epicsMutexUnlock(rawMutex_);
+        } else if (!readersActive) {
+            break;
+        } else {
+            // Wake up in time for a pending batch to leave at its latency target
+            const double wait = batcher.empty() ? RAW_WAIT_READABLE_SEC
+                : std::min(RAW_WAIT_READABLE_SEC, std::max(batcher.time_to_due(nowSeconds()), RAW_BATCH_MIN_WAIT_SEC));
+            if (epicsEventWaitWithTimeout(rawDataEvent_, wait) == epicsEventWaitTimeout) {
+                if (nowSeconds() - lastDataTime >= RAW_WAIT_READABLE_SEC) {
+                    flushSorter();  // idle stream: nothing left to reorder against
+                    dispatch(true);
+                } else {
+                    dispatch(false);
+                }
+            }
+        }
+
+        const double now = nowSeconds();
+        const double dt = now - lastRateTime;
+        if (dt >= RAW_RATE_UPDATE_SEC) {
+            updateStats(dt);
+            callParamCallbacks();
+            lastRateTime = now;
+        }
+        updateOccupancy(false);
+    }
+
+    epicsMutexLock(rawMutex_);
+    rawRunning_ = false;
+    const bool teardown = rawTeardown_;
+    epicsMutexUnlock(rawMutex_);
+    if (teardown) {
+        LOG("Raw worker thread exiting (driver teardown)");
+        return;
+    }
+
+    flushSorter();
+    dispatch(true);
+    updateStats(0.0);
+    updateOccupancy(true);
+    setDoubleParam(ADTimePixRawHitRate, 0.0);
+    setDoubleParam(ADTimePixRawTdcRate, 0.0);
+    setDoubleParam(ADTimePixRawPacketRate, 0.0);
+    setDoubleParam(ADTimePixRawDataRate, 0.0);
+    setDoubleParam(ADTimePixRawBatchRate, 0.0);
+    for (int c = 0; c < numChannels; ++c) {
+        setDoubleParam(c, ADTimePixRawChHitRate, 0.0);
+        setDoubleParam(c, ADTimePixRawChDataRate, 0.0);
+        if (c != 0) callParamCallbacks(c);
+    }
+    setIntegerParam(ADTimePixRawConnected, 0);
+    callParamCallbacks();
+    LOG("Raw worker thread exiting");
+}
+
+/**
+ * Start the Raw decode readers and merge worker when Raw[0] (and with
+ * TPX3_RAW1_DECODE=1, Raw[1]) streams to tcp:// and TPX3_RAW_DECODE=1.
+ * Called from acquireStart() after the measurement was started.
+ */
+void ADTimePix::startRawDecode() {
+    int writeRaw = 0, decodeEnable = 0;
+    getIntegerParam(ADTimePixWriteRaw, &writeRaw);
+    getIntegerParam(ADTimePixRawDecode, &decodeEnable);
+    if (!writeRaw || !decodeEnable) return;
+    epicsMutexLock(rawMutex_);
+    const bool replaying = replayRunning_;
+    epicsMutexUnlock(rawMutex_);
+    if (replaying) {
+        setStringParam(ADTimePixRawDecodeStatus, "File replay running");
+        WARN("Raw decode not started: a file replay is feeding the Raw consumers");
+        return;
+    }
+
+    std::string hosts[RAW_MAX_CHANNELS];
+    int ports[RAW_MAX_CHANNELS] = {};
+    std::string rawPath;
+    getStringParam(ADTimePixRawBase, rawPath);
+    if (rawPath.find("tcp://") != 0) {
+        setStringParam(ADTimePixRawDecodeStatus, "Raw Base is not tcp://");
+        return;
+    }
+    if (!parseTcpPath(rawPath, hosts[0], ports[0])) {
+        setStringParam(ADTimePixRawDecodeStatus, "Bad Raw tcp:// path");
+        ERR_ARGS("Failed to parse Raw TCP path: %s", rawPath.c_str());
+        return;
+    }
+    int numChannels = 1;
+    int writeRaw1 = 0, decode1 = 0;
+    getIntegerParam(ADTimePixWriteRaw1, &writeRaw1);
+    getIntegerParam(ADTimePixRaw1Decode, &decode1);
+    if (decode1) {
+        std::string raw1Path;
+        getStringParam(ADTimePixRaw1Base, raw1Path);
+        if (writeRaw1 && raw1Path.find("tcp://") == 0 && parseTcpPath(raw1Path, hosts[1], ports[1])) {
+            numChannels = 2;
+        } else {
+            WARN_ARGS("Raw1 decode: Raw[1] is not an enabled tcp:// destination (%s); decoding Raw[0] only",
+                      raw1Path.c_str());
+        }
+    }
+
+    stopRawDecode();  // join a worker that exited on its own (peer close)
+    prepareRawConsumers();
+    startRawArchive(numChannels);
+    setIntegerParam(ADTimePixRawChannels, numChannels);
+
+    epicsThreadOpts opts = EPICS_THREAD_OPTS_INIT;
+    opts.priority = epicsThreadPriorityMedium;
+    opts.stackSize = epicsThreadGetStackSize(epicsThreadStackMedium);
+    opts.joinable = 1;  // Required: acquireStop uses epicsThreadMustJoin
+
+    epicsThreadSleep(0.2);  // allow Serval to bind the raw TCP port
+
+    epicsMutexLock(rawMutex_);
+    if (!rawRunning_ && !rawWorkerThreadId_) {
+        rawRunning_ = true;
+        rawNumChannels_ = numChannels;
+        for (int c = 0; c < numChannels; ++c) {
+            RawChannel& channel = rawChannels_[c];
+            channel.host = hosts[c];
+            channel.port = ports[c];
+            channel.queue.clear();
+            channel.queuedHits = 0;
+            channel.stalls = 0;
+            channel.stats = Tpx3DecoderStats();
+            channel.active = true;
+            channel.threadId = epicsThreadCreateOpt(c == 0 ? "rawReader0" : "rawReader1",
+                                                    rawReaderThreadC, &channel, &opts);
+            if (!channel.threadId) {
+                ERR_ARGS("Failed to create Raw%d reader thread", c);
+                channel.active = false;
+            }
+        }
+        rawWorkerThreadId_ = epicsThreadCreateOpt("rawWorker", rawWorkerThreadC, this, &opts);
+        if (!rawWorkerThreadId_) {
+            ERR("Failed to create Raw worker thread");
+            rawRunning_ = false;
+        } else {
+            LOG_ARGS("Started Raw TCP decode (%s:%d%s)", hosts[0].c_str(), ports[0],
+                     numChannels > 1 ? ", merged with Raw1" : "");
+        }
+    }
+    epicsMutexUnlock(rawMutex_);
+}
+
+/**
+ * Stop and join the Raw decode readers and worker (acquireStop, shutdown).
+ * From ~ADTimePix (rawTeardown_) the queued batches are dropped and nothing is published.
+ */
+void ADTimePix::stopRawDecode() {
+    if (!rawMutex_) return;
+    epicsMutexLock(rawMutex_);
+    rawRunning_ = false;
+    const bool teardown = rawTeardown_;
+    epicsMutexUnlock(rawMutex_);
+
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        RawChannel& channel = rawChannels_[c];
+        if (channel.spaceEvent) epicsEventSignal(channel.spaceEvent);
+        if (channel.threadId != NULL && channel.threadId != epicsThreadGetIdSelf()) {
+            epicsThreadMustJoin(channel.threadId);
+            channel.threadId = NULL;
+        }
+    }
+    if (rawDataEvent_) epicsEventSignal(rawDataEvent_);
+    if (rawWorkerThreadId_ != NULL && rawWorkerThreadId_ != epicsThreadGetIdSelf()) {
+        epicsThreadMustJoin(rawWorkerThreadId_);
+        rawWorkerThreadId_ = NULL;
+    }
+    for (int c = 0; c < RAW_MAX_CHANNELS; ++c) {
+        rawDisconnect(rawChannels_[c]);
+        epicsMutexLock(rawMutex_);
+        rawChannels_[c].queue.clear();
+        rawChannels_[c].queuedHits = 0;
+        epicsMutexUnlock(rawMutex_);
+    }
+    stopRawArchive();
+    if (!teardown) flushRawConsumers();
+}
@@ -9,6 +9,7 @@
 
 #include "ADTimePix.h"
 #include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
 #include "network_client.h"
 
 #include <NDAttribute.h>
@@ -44,13 +45,10 @@ static int jsonImageThresholdId(const json& j) {
     return 0;
 }
 
+/** T0/T1 have preview addresses; higher thresholds (-1) only feed the pairing queue. */
 static int previewNdarrayAddressForThreshold(int thresholdId, int addrTh0, int addrTh1) {
-    return (thresholdId == 1) ? addrTh1 : addrTh0;
-}
-
-/** Advisory only: Serval frameNumber may match or differ by one between T0/T1. */
-static bool previewThresholdFramesAligned(int t0Frame, int t1Frame) {
-    return t0Frame == t1Frame || t0Frame == t1Frame + 1 || t1Frame == t0Frame + 1;
+    if (thresholdId == 0) return addrTh0;
+    return (thresholdId == 1) ? addrTh1 : -1;
 }
 
 }  // namespace
@@ -62,6 +60,8 @@ struct ADTimePix::PreviewJsonimageStream {
     int ndAddrThreshold1;
     /** NDArray address for T0-T1 band-pass (-1 = disabled). */
     int ndAddrThreshDiff;
+    /** NDArray address for the spectral stack of complete threshold sets. */
+    int ndAddrSpectral;
     int ndMaxAddr;
     int paramFrameNumber;
     int paramThresholdId;
@@ -74,14 +74,9 @@ struct ADTimePix::PreviewJsonimageStream {
     double& lastRateUpdateTime;
     bool& firstFrameReceived;
     int& jsonHeadersRemaining;
-    /** T1 received; next T0 completes the trigger pair (normal T1→T0 order). */
-    bool& t1ReadyForDiff;
-    /** T0 received without preceding T1 (stream start); next T1 completes the pair. */
-    bool& t0OrphanForDiff;
-    /** Last jsonimage frameNumber seen (pairing reset on measurement restart). */
-    int& lastSeenFrameForPair;
-    /** T0 uniqueId of last emitted band-pass (suppress duplicate callbacks). */
-    int& lastDiffT0Frame;
+    /** Threshold frames waiting for the rest of their trigger (band-pass input). */
+    PreviewPairQueue& pairQueue;
+    SpectralAccum& spectral;
     const char* logTag;
 };
 
@@ -158,19 +153,26 @@ bool ADTimePix::processPreviewJsonimageLine(
         dims[2] = 0;
 
         NDArray *pImage = nullptr;
-        if (this->pArrays && ndArrayAddr >= 0 && ndArrayAddr < stream.ndMaxAddr &&
-            this->pArrays[ndArrayAddr]) {
+        const bool published = this->pArrays && ndArrayAddr >= 0 && ndArrayAddr < stream.ndMaxAddr;
+        if (published) {
+            if (this->pArrays[ndArrayAddr]) this->pArrays[ndArrayAddr]->release();
+            this->pArrays[ndArrayAddr] = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
             pImage = this->pArrays[ndArrayAddr];
-            pImage->release();
+        } else {
+            // Threshold 2+ (colour mode): no preview address, pairing queue only
+            pImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
         }
 
-        this->pArrays[ndArrayAddr] = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
-        pImage = this->pArrays[ndArrayAddr];
-
         if (!pImage || !pImage->pData) {
+            if (pImage && !published) pImage->release();
             ERR_ARGS("%s failed to allocate NDArray", stream.logTag);
             return false;
         }
+        // Standalone arrays are released at the end of this frame; the queue takes its own reference
+        struct ReleaseUnpublished {
+            NDArray* pArray;
+            ~ReleaseUnpublished() { if (pArray) pArray->release(); }
+        } releaseUnpublished{published ? nullptr : pImage};
 
         size_t remaining = total_read - (newline_pos - line_buffer + 1);
         size_t binary_read = 0;
@@ -206,19 +208,8 @@ bool ADTimePix::processPreviewJsonimageLine(
             return false;
         }
 
-        if (is_uint32) {
-            uint32_t* pixels = reinterpret_cast<uint32_t*>(pixel_buffer.data());
-            uint32_t* pData = reinterpret_cast<uint32_t*>(pImage->pData);
-            for (size_t i = 0; i < pixel_count; ++i) {
-                pData[i] = __builtin_bswap32(pixels[i]);
-            }
-        } else {
-            uint16_t* pixels = reinterpret_cast<uint16_t*>(pixel_buffer.data());
-            uint16_t* pData = reinterpret_cast<uint16_t*>(pImage->pData);
-            for (size_t i = 0; i < pixel_count; ++i) {
-                pData[i] = __builtin_bswap16(pixels[i]);
-            }
-        }
+        // Network -> host order; TPX3_MASK_OUTPUT masks BPC pixels in the same pass
+        byteSwapFrame(pixel_buffer.data(), pImage->pData, width, height, is_uint32);
 
         const bool updateMetadata = (stream.paramFrameNumber >= 0);
         if (updateMetadata) {
@@ -302,38 +293,12 @@ bool ADTimePix::processPreviewJsonimageLine(
 
         int arrayCallbacks = 0;
         getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-        if (arrayCallbacks && pImage) {
+        if (arrayCallbacks && published) {
             doCallbacksGenericPointer(pImage, NDArrayData, ndArrayAddr);
         }
 
         if (stream.ndAddrThreshDiff >= 0) {
-            if (stream.lastSeenFrameForPair >= 0 &&
-                frame_number + 10 < stream.lastSeenFrameForPair) {
-                stream.t1ReadyForDiff = false;
-                stream.t0OrphanForDiff = false;
-                stream.lastDiffT0Frame = -1;
-            }
-            stream.lastSeenFrameForPair = frame_number;
-
-            if (threshold_id == 1) {
-                if (stream.t0OrphanForDiff) {
-                    emitPreviewThresholdDiff(stream.ndAddrThreshold0, stream.ndAddrThreshold1,
-                                             stream.ndAddrThreshDiff, frame_number, stream.logTag,
-                                             stream.lastDiffT0Frame);
-                    stream.t0OrphanForDiff = false;
-                } else {
-                    stream.t1ReadyForDiff = true;
-                }
-            } else if (threshold_id == 0) {
-                if (stream.t1ReadyForDiff) {
-                    emitPreviewThresholdDiff(stream.ndAddrThreshold0, stream.ndAddrThreshold1,
-                                             stream.ndAddrThreshDiff, frame_number, stream.logTag,
-                                             stream.lastDiffT0Frame);
-                    stream.t1ReadyForDiff = false;
-                } else {
-                    stream.t0OrphanForDiff = true;
-                }
-            }
+            pairPreviewThresholdFrame(stream, pImage, threshold_id, frame_number);
         }
 
         LOG_ARGS("Processed %s frame: width=%d, height=%d, format=%s, frame=%d, thresholdID=%d",
@@ -347,47 +312,82 @@ bool ADTimePix::processPreviewJsonimageLine(
     return true;
 }
 
-// Band-pass is always T0 - T1 (addrs 0-8 / 9-10). Known issue: first integrated
-// diff (Pva6) may still flicker in Signed mode on emulator; leave for later
-// (physical TimePix3 can show a corrupt first frame after calibration load).
-void ADTimePix::emitPreviewThresholdDiff(int addrT0, int addrT1, int addrDiff,
-                                           int frame_number, const char* logTag,
-                                           int& lastDiffT0Frame)
+/** Depth of the threshold pairing queue (triggers in flight per preview stream). */
+static constexpr size_t PREVIEW_PAIR_DEPTH = 16;
+
+/**
+ * File one threshold frame in the stream's pairing queue; emit the band-pass when
+ * it completes a trigger. Pairing is by trigger key (frameNumber, or frameNumber +
+ * thresholdID when Serval numbers every message), so frames may arrive in any order.
+ */
+void ADTimePix::pairPreviewThresholdFrame(const PreviewJsonimageStream& stream, NDArray* pImage,
+                                          int threshold_id, int frame_number)
 {
     int bothCounters = 0;
     getIntegerParam(ADTimePixBothCounters, &bothCounters);
-    if (!bothCounters || addrDiff < 0) {
+    if (!bothCounters) {
         return;
     }
 
+    int mode = 0, thresholds = 0;
+    double timeoutMs = 0.0;
+    getIntegerParam(ADTimePixPrvPairMode, &mode);
+    getIntegerParam(ADTimePixPrvPairThresholds, &thresholds);
+    getDoubleParam(ADTimePixPrvPairTimeoutMs, &timeoutMs);
+    if (mode < 0 || mode > static_cast<int>(ThresholdPairKey::FRAME_PLUS_THRESHOLD)) mode = 0;
+    stream.pairQueue.configure(thresholds, static_cast<ThresholdPairKey>(mode),
+                               timeoutMs / 1000.0, PREVIEW_PAIR_DEPTH);
+
+    std::vector<NDArray*> set;
+    int key = 0;
+    pImage->reserve();
+    if (stream.pairQueue.add(threshold_id, frame_number, pImage, nowSeconds(), set, key)) {
+        emitPreviewThresholdDiff(set[0], set[1], stream.ndAddrThreshDiff, key, stream.logTag);
+        addSpectralSet(stream.spectral, stream.ndAddrSpectral, set, key, stream.logTag);
+        for (NDArray* p : set) {
+            p->release();
+        }
+    }
+
+    publishPreviewPairStats(stream.pairQueue);
+}
+
+/** TPX3_PRV_PAIR_* readbacks; counters are of both preview streams together, in frames. */
+void ADTimePix::publishPreviewPairStats(const PreviewPairQueue& pairQueue)
+{
+    const ThresholdPairStats a = prvImgPairs_.stats();
+    const ThresholdPairStats b = prvImg1Pairs_.stats();
+    setIntegerParam(ADTimePixPrvPairKey, static_cast<int>(pairQueue.key_mode()));
+    setIntegerParam(ADTimePixPrvPairSetSize, pairQueue.thresholds());
+    setIntegerParam(ADTimePixPrvPairPending,
+                    static_cast<int>(prvImgPairs_.pending() + prvImg1Pairs_.pending()));
+    setInteger64Param(ADTimePixPrvPairSets, static_cast<epicsInt64>(a.sets + b.sets));
+    setInteger64Param(ADTimePixPrvPairOrphans,
+                      static_cast<epicsInt64>(a.orphans + a.ignored + b.orphans + b.ignored));
+    setInteger64Param(ADTimePixPrvPairDuplicates, static_cast<epicsInt64>(a.duplicates + b.duplicates));
+    callParamCallbacks();
+}
+
+// Band-pass is always T0 - T1 of one trigger set (addrs 0-8 / 9-10), so higher
+// thresholds only have to be present for the set to complete. Known issue: first
+// integrated diff (Pva6) may still flicker in Signed mode on emulator; leave for
+// later (physical TimePix3 can show a corrupt first frame after calibration load).
+void ADTimePix::emitPreviewThresholdDiff(NDArray* pT0, NDArray* pT1, int addrDiff,
+                                           int key, const char* logTag)
+{
     int clipEnabled = 0;
     getIntegerParam(ADTimePixPrvImgThreshDiffClip, &clipEnabled);
     const bool clipDiff = (clipEnabled != 0);
 
-    if (!pNDArrayPool || !pArrays ||
-        addrT0 < 0 || addrT1 < 0 || addrDiff < 0 ||
-        addrT0 >= NDARRAY_MAX_ADDR || addrT1 >= NDARRAY_MAX_ADDR ||
-        addrDiff >= NDARRAY_MAX_ADDR) {
+    if (!pNDArrayPool || !pArrays || addrDiff < 0 || addrDiff >= NDARRAY_MAX_ADDR) {
         return;
     }
-
-    NDArray* pT0 = pArrays[addrT0];
-    NDArray* pT1 = pArrays[addrT1];
     if (!pT0 || !pT1 || !pT0->pData || !pT1->pData) {
         return;
     }
 
     const int t0Frame = static_cast<int>(pT0->uniqueId);
     const int t1Frame = static_cast<int>(pT1->uniqueId);
-    if (t0Frame == lastDiffT0Frame) {
-        return;
-    }
-    // T1→T0 per trigger on the wire: addrT1 holds the paired T1 when T0 is processed.
-    // Frame numbers can differ (8088 per-message increment vs 8089 same frame); warn only.
-    if (!previewThresholdFramesAligned(t0Frame, t1Frame)) {
-        LOG_ARGS("%s threshold diff: frame ids T0=%d T1=%d (header %d), pairing by order",
-                 logTag, t0Frame, t1Frame, frame_number);
-    }
 
     if (pT0->ndims != 2 || pT1->ndims != 2 ||
         pT0->dims[0].size != pT1->dims[0].size ||
@@ -416,19 +416,13 @@ void ADTimePix::emitPreviewThresholdDiff(int addrT0, int addrT1, int addrDiff,
     int32_t* pDiffData = reinterpret_cast<int32_t*>(pDiff->pData);
 
     if (pT0->dataType == NDUInt32 && pT1->dataType == NDUInt32) {
-        const uint32_t* t0 = reinterpret_cast<const uint32_t*>(pT0->pData);
-        const uint32_t* t1 = reinterpret_cast<const uint32_t*>(pT1->pData);
-        for (size_t i = 0; i < pixel_count; ++i) {
-            const int32_t d = static_cast<int32_t>(t0[i]) - static_cast<int32_t>(t1[i]);
-            pDiffData[i] = clipDiff ? ((d > 0) ? d : 0) : d;
-        }
+        thresholdDiffU32(reinterpret_cast<const uint32_t*>(pT0->pData),
+                         reinterpret_cast<const uint32_t*>(pT1->pData),
+                         pDiffData, pixel_count, clipDiff);
     } else if (pT0->dataType == NDUInt16 && pT1->dataType == NDUInt16) {
-        const uint16_t* t0 = reinterpret_cast<const uint16_t*>(pT0->pData);
-        const uint16_t* t1 = reinterpret_cast<const uint16_t*>(pT1->pData);
-        for (size_t i = 0; i < pixel_count; ++i) {
-            const int32_t d = static_cast<int32_t>(t0[i]) - static_cast<int32_t>(t1[i]);
-            pDiffData[i] = clipDiff ? ((d > 0) ? d : 0) : d;
-        }
+        thresholdDiffU16(reinterpret_cast<const uint16_t*>(pT0->pData),
+                         reinterpret_cast<const uint16_t*>(pT1->pData),
+                         pDiffData, pixel_count, clipDiff);
     } else {
         ERR_ARGS("%s threshold diff skipped: unsupported source types %d / %d",
                  logTag, static_cast<int>(pT0->dataType), static_cast<int>(pT1->dataType));
@@ -454,11 +448,8 @@ void ADTimePix::emitPreviewThresholdDiff(int addrT0, int addrT1, int addrDiff,
         doCallbacksGenericPointer(pDiff, NDArrayData, addrDiff);
     }
 
-    lastDiffT0Frame = t0Frame;
-
-    LOG_ARGS("Processed %s threshold diff: T0=%d T1=%d, addr=%d (%d - %d%s)",
-             logTag, t0Frame, t1Frame, addrDiff, addrT0, addrT1,
-             clipDiff ? ", clipped" : "");
+    LOG_ARGS("Processed %s threshold diff: T0=%d T1=%d (set %d), addr=%d%s",
+             logTag, t0Frame, t1Frame, key, addrDiff, clipDiff ? ", clipped" : "");
 }
 
 void ADTimePix::releasePreviewBandArrays()
@@ -466,7 +457,8 @@ void ADTimePix::releasePreviewBandArrays()
     if (!pArrays) {
         return;
     }
-    for (int addr : {NDARRAY_ADDR_PRVIMG_THRESH_DIFF, NDARRAY_ADDR_PRVIMG1_THRESH_DIFF}) {
+    for (int addr : {NDARRAY_ADDR_PRVIMG_THRESH_DIFF, NDARRAY_ADDR_PRVIMG1_THRESH_DIFF,
+                     NDARRAY_ADDR_PRVIMG_SPECTRAL, NDARRAY_ADDR_PRVIMG1_SPECTRAL}) {
         if (addr >= 0 && addr < NDARRAY_MAX_ADDR && pArrays[addr]) {
             pArrays[addr]->release();
             pArrays[addr] = nullptr;
@@ -487,9 +479,12 @@ void ADTimePix::runPreviewTcpWorker(
     void (ADTimePix::*connectFn)(),
     void (ADTimePix::*disconnectFn)(),
     bool (ADTimePix::*processLineFn)(char*, char*, size_t),
+    PreviewPairQueue& pairQueue,
     const char* logTag)
 {
     constexpr double RECONNECT_DELAY_SEC = 1.0;
+    /** Longest receive wait, so TPX3_PRV_PAIR_TIMEOUT_MS also applies while no frame arrives. */
+    constexpr double IDLE_WAIT_SEC = 0.1;
 
     if (!mutex) {
         ERR_ARGS("%s worker thread: Mutex not initialized", logTag);
@@ -519,6 +514,14 @@ void ADTimePix::runPreviewTcpWorker(
         epicsMutexUnlock(mutex);
 
         if (is_connected && networkClient) {
+            epicsMutexLock(mutex);
+            const bool idle = networkClient->is_connected() && !networkClient->wait_readable(IDLE_WAIT_SEC);
+            epicsMutexUnlock(mutex);
+            if (idle) {
+                // Drop threshold sets whose remaining frames never came
+                if (pairQueue.expire(nowSeconds()) > 0) publishPreviewPairStats(pairQueue);
+                continue;
+            }
             try {
                 epicsMutexLock(mutex);
                 ssize_t bytes_read = networkClient->receive(
@@ -703,7 +706,7 @@ void ADTimePix::prvImgWorkerThread() {
         prvImgMutex_, prvImgRunning_, prvImgConnected_, prvImgHost_, prvImgPort_,
         prvImgNetworkClient_, prvImgLineBuffer_, prvImgTotalRead_,
         &ADTimePix::prvImgConnect, &ADTimePix::prvImgDisconnect,
-        &ADTimePix::processPrvImgDataLine, "PrvImg");
+        &ADTimePix::processPrvImgDataLine, prvImgPairs_, "PrvImg");
 }
 
 void ADTimePix::prvImg1WorkerThreadC(void *pPvt) {
@@ -716,7 +719,7 @@ void ADTimePix::prvImg1WorkerThread() {
         prvImg1Mutex_, prvImg1Running_, prvImg1Connected_, prvImg1Host_, prvImg1Port_,
         prvImg1NetworkClient_, prvImg1LineBuffer_, prvImg1TotalRead_,
         &ADTimePix::prvImg1Connect, &ADTimePix::prvImg1Disconnect,
-        &ADTimePix::processPrvImg1DataLine, "PrvImg1");
+        &ADTimePix::processPrvImg1DataLine, prvImg1Pairs_, "PrvImg1");
 }
 
 void ADTimePix::imgWorkerThreadC(void *pPvt) {
@@ -1022,27 +1025,8 @@ bool ADTimePix::processImgDataLine(char* line_buffer, char* newline_pos, size_t
             return false;
         }
         
-        if (is_uint32) {
-            uint32_t* pixels = reinterpret_cast<uint32_t*>(pixel_buffer.data());
-            uint32_t* pData = reinterpret_cast<uint32_t*>(pImage->pData);
-            if (!pixels || !pData) {
-                ERR("Invalid pixel data pointers");
-                return false;
-            }
-            for (size_t i = 0; i < pixel_count; ++i) {
-                pData[i] = __builtin_bswap32(pixels[i]);
-            }
-        } else {
-            uint16_t* pixels = reinterpret_cast<uint16_t*>(pixel_buffer.data());
-            uint16_t* pData = reinterpret_cast<uint16_t*>(pImage->pData);
-            if (!pixels || !pData) {
-                ERR("Invalid pixel data pointers");
-                return false;
-            }
-            for (size_t i = 0; i < pixel_count; ++i) {
-                pData[i] = __builtin_bswap16(pixels[i]);
-            }
-        }
+        // TPX3_MASK_OUTPUT masks BPC pixels in the same pass
+        byteSwapFrame(pixel_buffer.data(), pImage->pData, width, height, is_uint32);
         
         // Set image parameters (thread-safe via asynPortDriver)
         setIntegerParam(ADSizeX, width);
@@ -1155,7 +1139,14 @@ bool ADTimePix::processImgDataLine(char* line_buffer, char* newline_pos, size_t
             }
             processImgFrame(frame_image);
         }
-        
+
+        // ToF gates: Image[0] runs in "tof" mode; pixel values are ToF in TDC ticks
+        int gateMode = 0;
+        getIntegerParam(ADTimePixGateMode, &gateMode);
+        if (gateMode == TOF_GATE_MODE_IMG && threshold_id != 1) {
+            processTofGateFrame(pImage->pData, is_uint32, width, height);
+        }
+
         // Call parameter callbacks to update EPICS PVs (thread-safe)
         callParamCallbacks();
         
@@ -1784,6 +1775,7 @@ bool ADTimePix::processPrvImgDataLine(char* line_buffer, char* newline_pos, size
         NDARRAY_ADDR_PRVIMG_THRESHOLD0,
         NDARRAY_ADDR_PRVIMG_THRESHOLD1,
         NDARRAY_ADDR_PRVIMG_THRESH_DIFF,
+        NDARRAY_ADDR_PRVIMG_SPECTRAL,
         NDARRAY_MAX_ADDR,
         ADTimePixPrvImgFrameNumber,
         ADTimePixPrvImgThresholdID,
@@ -1796,10 +1788,8 @@ bool ADTimePix::processPrvImgDataLine(char* line_buffer, char* newline_pos, size
         prvImgLastRateUpdateTime_,
         prvImgFirstFrameReceived_,
         prvImgJsonHeadersRemaining_,
-        prvImgT1ReadyForDiff_,
-        prvImgT0OrphanForDiff_,
-        prvImgLastSeenFrameForPair_,
-        prvImgLastDiffT0Frame_,
+        prvImgPairs_,
+        prvImgSpectral_,
         "PrvImg"};
     return processPreviewJsonimageLine(stream, line_buffer, newline_pos, total_read);
 }
@@ -1811,6 +1801,7 @@ bool ADTimePix::processPrvImg1DataLine(char* line_buffer, char* newline_pos, siz
         NDARRAY_ADDR_PRVIMG1_THRESHOLD0,
         NDARRAY_ADDR_PRVIMG1_THRESHOLD1,
         NDARRAY_ADDR_PRVIMG1_THRESH_DIFF,
+        NDARRAY_ADDR_PRVIMG1_SPECTRAL,
         NDARRAY_MAX_ADDR,
         -1,
         -1,
@@ -1823,10 +1814,8 @@ bool ADTimePix::processPrvImg1DataLine(char* line_buffer, char* newline_pos, siz
         prvImg1LastRateUpdateTime_,
         prvImg1FirstFrameReceived_,
         prvImg1JsonHeadersRemaining_,
-        prvImg1T1ReadyForDiff_,
-        prvImg1T0OrphanForDiff_,
-        prvImg1LastSeenFrameForPair_,
-        prvImg1LastDiffT0Frame_,
+        prvImg1Pairs_,
+        prvImg1Spectral_,
         "PrvImg1"};
     return processPreviewJsonimageLine(stream, line_buffer, newline_pos, total_read);
 }
@@ -0,0 +1,231 @@
+/*
+ * ADTimePix3 - Multi-threshold spectral image stack from paired Medipix3 frames
+ *
+ * With BothCounters and TPX3_SPEC_ENABLE=1 every complete threshold set from
+ * the preview pairing queue (threshold_pair.h) is summed into one 3D NDInt32
+ * array {width, height, planes}: the thresholds T0..Tn-1 followed, with
+ * TPX3_SPEC_BANDS=1, by the energy bands T0-T1 .. Tn-2 - Tn-1 (clipped at zero
+ * per set when TPX3_PRVIMG_THRESH_DIFF_CLIP=1). After TPX3_SPEC_FRAMES sets the
+ * stack is published on NDArray address 41 (PrvImg) or 42 (PrvImg1) and the
+ * next sum starts in a fresh array, so one plugin chain sees the whole
+ * spectrum of a trigger (or of N triggers) instead of three separate images.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "spectral_stack.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+
+#include <algorithm>
+
+extern const char* driverName;
+
+namespace {
+
+/** Pixels per pass: the input rows of one block stay in L1 for all planes. */
+constexpr size_t SPECTRAL_BLOCK_PIXELS = 2048;
+/** Largest TPX3_SPEC_FRAMES. */
+constexpr int SPECTRAL_MAX_FRAMES = 100000;
+
+inline void bandDiff(const uint16_t* a, const uint16_t* b, int32_t* out, size_t n, bool clip) {
+    thresholdDiffU16(a, b, out, n, clip);
+}
+inline void bandDiff(const uint32_t* a, const uint32_t* b, int32_t* out, size_t n, bool clip) {
+    thresholdDiffU32(a, b, out, n, clip);
+}
+
+}  // namespace
+
+bool SpectralStack::configure(const SpectralStackConfig& config) {
+    SpectralStackConfig next = config;
+    next.thresholds = std::min(std::max(next.thresholds, 1), THRESHOLD_PAIR_MAX);
+    next.frames = std::min(std::max(next.frames, 1), SPECTRAL_MAX_FRAMES);
+    const bool layout = next.width != config_.width || next.height != config_.height ||
+                        next.thresholds != config_.thresholds || next.bands != config_.bands;
+    // Clipping is applied per set, so changing it mid-sum would mix two definitions
+    if (layout || next.clip != config_.clip) frames_ = 0;
+    config_ = next;
+    return layout;
+}
+
+bool SpectralStack::add(const uint16_t* const* frames, int32_t* stack) {
+    return addSet(frames, stack);
+}
+
+bool SpectralStack::add(const uint32_t* const* frames, int32_t* stack) {
+    return addSet(frames, stack);
+}
+
+template <typename T>
+bool SpectralStack::addSet(const T* const* in, int32_t* stack) {
+    const int n = config_.thresholds;
+    const size_t pixels = plane_pixels();
+    const bool first = frames_ == 0;
+    int32_t band[SPECTRAL_BLOCK_PIXELS];
+
+    for (size_t b = 0; b < pixels; b += SPECTRAL_BLOCK_PIXELS) {
+        const size_t len = std::min(SPECTRAL_BLOCK_PIXELS, pixels - b);
+        for (int t = 0; t < n; ++t) {
+            const T* src = in[t] + b;
+            int32_t* dst = stack + static_cast<size_t>(t) * pixels + b;
+            if (first) {
+                for (size_t i = 0; i < len; ++i) dst[i] = static_cast<int32_t>(src[i]);
+            } else {
+                for (size_t i = 0; i < len; ++i) dst[i] += static_cast<int32_t>(src[i]);
+            }
+        }
+        if (!config_.bands) continue;
+        for (int k = 0; k + 1 < n; ++k) {
+            int32_t* dst = stack + static_cast<size_t>(n + k) * pixels + b;
+            if (first) {
+                bandDiff(in[k] + b, in[k + 1] + b, dst, len, config_.clip);
+            } else {
+                bandDiff(in[k] + b, in[k + 1] + b, band, len, config_.clip);
+                for (size_t i = 0; i < len; ++i) dst[i] += band[i];
+            }
+        }
+    }
+
+    if (++frames_ < config_.frames) return false;
+    frames_ = 0;
+    return true;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: paired preview frames -> SpectralStack -> addrs 41 / 42
+// -----------------------------------------------------------------------
+
+/** Acquisition start / TPX3_SPEC_RESET: drop the partial sums (port thread). */
+void ADTimePix::resetSpectralStacks() {
+    const std::pair<epicsMutexId, SpectralAccum*> streams[] = {
+        {prvImgMutex_, &prvImgSpectral_}, {prvImg1Mutex_, &prvImg1Spectral_}};
+    for (const auto& s : streams) {
+        if (s.first) epicsMutexLock(s.first);
+        s.second->stack.restart();
+        if (s.second->pArray) {
+            s.second->pArray->release();
+            s.second->pArray = nullptr;
+        }
+        s.second->stacks = 0;
+        if (s.first) epicsMutexUnlock(s.first);
+    }
+    setIntegerParam(ADTimePixSpecFramesRbv, 0);
+    setIntegerParam(ADTimePixSpecStacks, 0);
+}
+
+/**
+ * Preview worker (stream mutex held): sum a complete threshold set into the
+ * stream's stack and publish the stack on addr once TPX3_SPEC_FRAMES sets are in.
+ */
+void ADTimePix::addSpectralSet(SpectralAccum& acc, int addr, const std::vector<NDArray*>& set,
+                               int key, const char* logTag)
+{
+    int enable = 0, framesToSum = 1, bands = 1, clip = 0;
+    getIntegerParam(ADTimePixSpecEnable, &enable);
+    if (!enable) {
+        if (acc.pArray) {
+            acc.pArray->release();
+            acc.pArray = nullptr;
+        }
+        acc.stack.restart();
+        return;
+    }
+    getIntegerParam(ADTimePixSpecFrames, &framesToSum);
+    getIntegerParam(ADTimePixSpecBands, &bands);
+    getIntegerParam(ADTimePixPrvImgThreshDiffClip, &clip);
+
+    if (!pNDArrayPool || !pArrays || addr < 0 || addr >= NDARRAY_MAX_ADDR || set.empty()) {
+        return;
+    }
+    const NDArray* pT0 = set[0];
+    for (const NDArray* p : set) {
+        if (!p || !p->pData || p->ndims != 2 || p->dataType != pT0->dataType ||
+            p->dims[0].size != pT0->dims[0].size || p->dims[1].size != pT0->dims[1].size) {
+            ERR_ARGS("%s spectral stack skipped: threshold frames differ in size or type", logTag);
+            return;
+        }
+    }
+    if (pT0->dataType != NDUInt16 && pT0->dataType != NDUInt32) {
+        ERR_ARGS("%s spectral stack skipped: unsupported source type %d",
+                 logTag, static_cast<int>(pT0->dataType));
+        return;
+    }
+
+    SpectralStackConfig config;
+    config.width = pT0->dims[0].size;
+    config.height = pT0->dims[1].size;
+    config.thresholds = static_cast<int>(set.size());
+    config.bands = bands != 0;
+    config.clip = clip != 0;
+    config.frames = framesToSum;
+    if (acc.stack.configure(config) && acc.pArray) {
+        acc.pArray->release();
+        acc.pArray = nullptr;
+    }
+    if (!acc.pArray) {
+        size_t dims[3] = {config.width, config.height, static_cast<size_t>(acc.stack.planes())};
+        acc.pArray = pNDArrayPool->alloc(3, dims, NDInt32, 0, nullptr);
+        if (!acc.pArray || !acc.pArray->pData) {
+            if (acc.pArray) acc.pArray->release();
+            acc.pArray = nullptr;
+            ERR_ARGS("%s failed to allocate spectral stack NDArray", logTag);
+            return;
+        }
+        acc.stack.restart();
+    }
+
+    const int n = acc.stack.config().thresholds;
+    int32_t* stack = reinterpret_cast<int32_t*>(acc.pArray->pData);
+    bool done;
+    if (pT0->dataType == NDUInt16) {
+        const uint16_t* frames[THRESHOLD_PAIR_MAX];
+        for (int t = 0; t < n; ++t) frames[t] = reinterpret_cast<const uint16_t*>(set[t]->pData);
+        done = acc.stack.add(frames, stack);
+    } else {
+        const uint32_t* frames[THRESHOLD_PAIR_MAX];
+        for (int t = 0; t < n; ++t) frames[t] = reinterpret_cast<const uint32_t*>(set[t]->pData);
+        done = acc.stack.add(frames, stack);
+    }
+    setIntegerParam(ADTimePixSpecPlanes, acc.stack.planes());
+    setIntegerParam(ADTimePixSpecFramesRbv, done ? acc.stack.config().frames : acc.stack.frames());
+    if (!done) {
+        return;
+    }
+
+    NDArray* pStack = acc.pArray;
+    acc.pArray = nullptr;
+    pStack->uniqueId = key;
+    pStack->timeStamp = pT0->timeStamp;
+    pStack->epicsTS = pT0->epicsTS;
+    if (pStack->pAttributeList && pT0->pAttributeList) {
+        pT0->pAttributeList->copy(pStack->pAttributeList);
+        int sets = acc.stack.config().frames;
+        int thresholds = n;
+        int bandPlanes = acc.stack.planes() - n;
+        pStack->pAttributeList->add("SpectralThresholds", "Threshold planes (T0..Tn-1)",
+                                    NDAttrInt32, &thresholds);
+        pStack->pAttributeList->add("SpectralBands", "Band planes (Tk - Tk+1) after the thresholds",
+                                    NDAttrInt32, &bandPlanes);
+        pStack->pAttributeList->add("SpectralFrames", "Threshold sets summed",
+                                    NDAttrInt32, &sets);
+    }
+
+    if (pArrays[addr]) {
+        pArrays[addr]->release();
+    }
+    pArrays[addr] = pStack;
+    ++acc.stacks;
+    setIntegerParam(ADTimePixSpecStacks, prvImgSpectral_.stacks + prvImg1Spectral_.stacks);
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (arrayCallbacks) {
+        doCallbacksGenericPointer(pStack, NDArrayData, addr);
+    }
+    LOG_ARGS("Processed %s spectral stack: %d planes, %d sets, addr=%d",
+             logTag, acc.stack.planes(), acc.stack.config().frames, addr);
+}
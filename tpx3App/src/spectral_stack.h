@@ -0,0 +1,71 @@
+/*
+ * ADTimePix3 - Multi-threshold spectral image stack from paired Medipix3 frames
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef SPECTRAL_STACK_H
+#define SPECTRAL_STACK_H
+
+#include "threshold_pair.h"
+
+#include <cstdint>
+#include <cstddef>
+
+/** @brief Stack settings. */
+struct SpectralStackConfig {
+    size_t width = 0;
+    size_t height = 0;
+    int thresholds = 2;                // threshold planes T0..Tn-1 (up to THRESHOLD_PAIR_MAX)
+    bool bands = true;                 // append band planes T0-T1, T1-T2, .., Tn-2 - Tn-1
+    bool clip = true;                  // bands max(0, Tk - Tk+1) per frame before summing
+    int frames = 1;                    // threshold sets summed per published stack
+};
+
+/**
+ * @brief Sum threshold sets into one (plane x height x width) int32 stack
+ *
+ * Planes 0..n-1 are the thresholds, followed (with bands) by the n-1 energy
+ * bands between neighbouring thresholds. add() writes the first set of a sum
+ * and adds the following ones straight into the caller's stack buffer, so a
+ * stack of n thresholds costs one pass over the inputs per set and no
+ * per-plane copies. The pass runs in blocks of pixels, so each block of the
+ * input frames is read from cache for all the planes that use it.
+ *
+ * Counts are summed as int32: 12-bit counters allow more than 500000 sets.
+ */
+class SpectralStack {
+public:
+    /** Apply settings; returns true when the stack layout changed (current sum restarted). */
+    bool configure(const SpectralStackConfig& config);
+    const SpectralStackConfig& config() const { return config_; }
+
+    int planes() const { return config_.thresholds + (config_.bands ? config_.thresholds - 1 : 0); }
+    size_t plane_pixels() const { return config_.width * config_.height; }
+    size_t elements() const { return plane_pixels() * static_cast<size_t>(planes()); }
+    /** Sets in the current sum. */
+    int frames() const { return frames_; }
+
+    /**
+     * Add one threshold set (frames[t], t < thresholds, width x height each)
+     * into stack (elements() int32). Returns true when this completed the sum;
+     * the next add() starts a new one.
+     */
+    bool add(const uint16_t* const* frames, int32_t* stack);
+    bool add(const uint32_t* const* frames, int32_t* stack);
+
+    /** Start a new sum with the next add(). */
+    void restart() { frames_ = 0; }
+
+private:
+    template <typename T>
+    bool addSet(const T* const* frames, int32_t* stack);
+
+    SpectralStackConfig config_;
+    int frames_ = 0;
+};
+
+#endif // SPECTRAL_STACK_H
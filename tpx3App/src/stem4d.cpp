@@ -0,0 +1,374 @@
+/*
+ * ADTimePix3 - Sparse 4D-STEM event store (CSR by probe position, memory mapped)
+ *
+ * With TPX3_STEM4D_ENABLE=1 the virtual STEM imager (stem_image.cpp) also
+ * reports the scan row of every placed hit and the hits are appended here, one
+ * file pair per acquisition: <TPX3_STEM4D_FILE>_NNNN.csr / .idx. A summed
+ * diffraction pattern over a scan ROI is served on TPX3_STEM4D_SUM as an
+ * NDUInt32 on NDArray addr 31, during or after the acquisition.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "stem4d.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern const char* driverName;
+
+static_assert(sizeof(Stem4dHeader) == 64, "Stem4dHeader must stay 64 bytes");
+
+namespace {
+
+/** Initial .csr capacity (events) and .idx capacity (rows); both double on demand. */
+constexpr size_t STEM4D_INITIAL_EVENTS = size_t(16) << 20;
+constexpr size_t STEM4D_INITIAL_ROWS = size_t(1) << 20;
+
+/** Resize fd to bytes and replace the mapping at *map (old size old_bytes). */
+bool remapFile(int fd, void** map, size_t old_bytes, size_t bytes, std::string& err) {
+    if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+        err = std::string("ftruncate: ") + strerror(errno);
+        return false;
+    }
+    if (*map) munmap(*map, old_bytes);
+    *map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        *map = nullptr;
+        err = std::string("mmap: ") + strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+Stem4dStore::~Stem4dStore() {
+    std::string err;
+    close(err);
+    release();
+}
+
+void Stem4dStore::release() {
+    if (events_) munmap(events_, events_cap_ * sizeof(uint32_t));
+    if (idx_map_) munmap(idx_map_, sizeof(Stem4dHeader) + index_cap_ * sizeof(uint64_t));
+    if (csr_fd_ >= 0) ::close(csr_fd_);
+    if (idx_fd_ >= 0) ::close(idx_fd_);
+    events_ = nullptr;
+    idx_map_ = nullptr;
+    offsets_ = nullptr;
+    events_cap_ = 0;
+    index_cap_ = 0;
+    csr_fd_ = -1;
+    idx_fd_ = -1;
+    writing_ = false;
+    failed_ = false;
+    error_.clear();
+    have_row_ = false;
+    current_row_ = 0;
+    stats_ = Stem4dStats();
+}
+
+bool Stem4dStore::open(const std::string& base, int scan_width, int scan_height,
+                       size_t det_width, size_t det_height, double dwell_ns, std::string& err) {
+    release();
+    base_ = base;
+    scan_width_ = static_cast<size_t>(std::max(scan_width, 1));
+    scan_height_ = static_cast<size_t>(std::max(scan_height, 1));
+    det_width_ = det_width;
+    det_height_ = det_height;
+
+    const std::string csrPath = base + ".csr";
+    const std::string idxPath = base + ".idx";
+    csr_fd_ = ::open(csrPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (csr_fd_ < 0) {
+        err = csrPath + ": " + strerror(errno);
+        release();
+        return false;
+    }
+    idx_fd_ = ::open(idxPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (idx_fd_ < 0) {
+        err = idxPath + ": " + strerror(errno);
+        release();
+        return false;
+    }
+    if (!grow_events(STEM4D_INITIAL_EVENTS, err) || !grow_index(STEM4D_INITIAL_ROWS, err)) {
+        release();
+        return false;
+    }
+
+    Stem4dHeader* hdr = static_cast<Stem4dHeader*>(idx_map_);
+    std::memset(hdr, 0, sizeof(*hdr));
+    std::memcpy(hdr->magic, "TPX4DCSR", 8);
+    hdr->version = 1;
+    hdr->header_bytes = sizeof(Stem4dHeader);
+    hdr->scan_width = static_cast<uint32_t>(scan_width_);
+    hdr->scan_height = static_cast<uint32_t>(scan_height_);
+    hdr->det_width = static_cast<uint32_t>(det_width_);
+    hdr->det_height = static_cast<uint32_t>(det_height_);
+    hdr->dwell_ns = dwell_ns;
+    offsets_[0] = 0;
+    writing_ = true;
+    return true;
+}
+
+bool Stem4dStore::grow_events(size_t need, std::string& err) {
+    if (need <= events_cap_) return true;
+    size_t cap = std::max(events_cap_, STEM4D_INITIAL_EVENTS);
+    while (cap < need) cap *= 2;
+    void* map = events_;
+    if (!remapFile(csr_fd_, &map, events_cap_ * sizeof(uint32_t), cap * sizeof(uint32_t), err)) {
+        events_ = nullptr;
+        events_cap_ = 0;
+        return false;
+    }
+    events_ = static_cast<uint32_t*>(map);
+    events_cap_ = cap;
+    return true;
+}
+
+bool Stem4dStore::grow_index(size_t rows_needed, std::string& err) {
+    if (rows_needed <= index_cap_) return true;
+    size_t cap = std::max(index_cap_, STEM4D_INITIAL_ROWS);
+    while (cap < rows_needed) cap *= 2;
+    const size_t oldBytes = idx_map_ ? sizeof(Stem4dHeader) + index_cap_ * sizeof(uint64_t) : 0;
+    if (!remapFile(idx_fd_, &idx_map_, oldBytes, sizeof(Stem4dHeader) + cap * sizeof(uint64_t), err)) {
+        offsets_ = nullptr;
+        index_cap_ = 0;
+        return false;
+    }
+    offsets_ = reinterpret_cast<uint64_t*>(static_cast<char*>(idx_map_) + sizeof(Stem4dHeader));
+    index_cap_ = cap;
+    return true;
+}
+
+/** Close rows [current_row_, row): each gets its end offset. */
+void Stem4dStore::close_rows_until(uint64_t row) {
+    for (uint64_t r = current_row_ + 1; r <= row; ++r) offsets_[r] = stats_.events;
+    current_row_ = row;
+    stats_.rows = row;
+}
+
+void Stem4dStore::append(const Tpx3HitBatch& hits, const std::vector<uint64_t>& rows) {
+    if (!writing_ || failed_) return;
+    const size_t n = std::min(hits.size(), rows.size());
+    std::string err;
+    if (!grow_events(stats_.events + n, err)) {
+        error_ = err;
+        failed_ = true;
+        return;
+    }
+    const size_t pixels = det_width_ * det_height_;
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t row = rows[i];
+        const uint32_t pixel = hits.pixel[i];
+        if (row == STEM_NO_ROW || pixel >= pixels) continue;
+        if (!have_row_) {
+            // First event: rows before it are empty
+            if (!grow_index(row + 2, err)) break;
+            for (uint64_t r = 1; r <= row; ++r) offsets_[r] = 0;
+            current_row_ = row;
+            stats_.rows = row;
+            have_row_ = true;
+        } else if (row < current_row_) {
+            ++stats_.unordered;
+            continue;
+        } else if (row > current_row_) {
+            if (!grow_index(row + 2, err)) break;
+            close_rows_until(row);
+        }
+        events_[stats_.events++] = pixel;
+    }
+    if (!err.empty()) {
+        error_ = err;
+        failed_ = true;
+    }
+    stats_.bytes = stats_.events * sizeof(uint32_t) + (stats_.rows + 1) * sizeof(uint64_t) + sizeof(Stem4dHeader);
+}
+
+bool Stem4dStore::close(std::string& err) {
+    if (!writing_) return true;
+    writing_ = false;
+    const uint64_t rows = have_row_ ? current_row_ + 1 : 0;
+    if (rows > 0) offsets_[rows] = stats_.events;
+    stats_.rows = rows;
+
+    Stem4dHeader* hdr = static_cast<Stem4dHeader*>(idx_map_);
+    hdr->rows = rows;
+    hdr->events = stats_.events;
+
+    // Trim both files to their payload; the mappings stay valid up to the new size
+    const size_t csrBytes = stats_.events * sizeof(uint32_t);
+    const size_t idxBytes = sizeof(Stem4dHeader) + (rows + 1) * sizeof(uint64_t);
+    msync(idx_map_, idxBytes, MS_ASYNC);
+    bool ok = true;
+    if (ftruncate(csr_fd_, static_cast<off_t>(csrBytes)) != 0 ||
+        ftruncate(idx_fd_, static_cast<off_t>(idxBytes)) != 0) {
+        err = std::string("ftruncate: ") + strerror(errno);
+        ok = false;
+    }
+    stats_.bytes = csrBytes + idxBytes;
+    return ok;
+}
+
+uint64_t Stem4dStore::get_frames() const {
+    const uint64_t positions = scan_width_ * scan_height_;
+    return (stats_.rows + positions - 1) / positions;
+}
+
+uint64_t Stem4dStore::sum_diffraction(int x, int y, int width, int height, int frame, uint32_t* out) const {
+    const size_t pixels = det_width_ * det_height_;
+    std::fill(out, out + pixels, 0u);
+    if (!offsets_ || !events_) return 0;
+
+    const size_t x0 = static_cast<size_t>(std::max(x, 0));
+    const size_t y0 = static_cast<size_t>(std::max(y, 0));
+    const size_t x1 = std::min(scan_width_, static_cast<size_t>(std::max(x + width, 0)));
+    const size_t y1 = std::min(scan_height_, static_cast<size_t>(std::max(y + height, 0)));
+    if (x0 >= x1 || y0 >= y1) return 0;
+
+    const uint64_t positions = scan_width_ * scan_height_;
+    const uint64_t closed = stats_.rows;   // offsets_[r + 1] is valid for r < closed
+    const uint64_t frames = get_frames();
+    const uint64_t f0 = frame < 0 ? 0 : static_cast<uint64_t>(frame);
+    const uint64_t f1 = frame < 0 ? frames : std::min<uint64_t>(f0 + 1, frames);
+
+    uint64_t summed = 0;
+    for (uint64_t f = f0; f < f1; ++f) {
+        for (size_t sy = y0; sy < y1; ++sy) {
+            const uint64_t rowBase = f * positions + sy * scan_width_;
+            for (size_t sx = x0; sx < x1; ++sx) {
+                const uint64_t r = rowBase + sx;
+                if (r >= closed) return summed;
+                const uint64_t b = offsets_[r];
+                const uint64_t e = offsets_[r + 1];
+                for (uint64_t k = b; k < e; ++k) ++out[events_[k]];
+                summed += e - b;
+            }
+        }
+    }
+    return summed;
+}
+
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: StemImager rows -> Stem4dStore; ROI sums -> NDArray addr 31
+// -----------------------------------------------------------------------
+
+/**
+ * Open the next <TPX3_STEM4D_FILE>_NNNN pair for the current scan. Caller holds stemMutex_.
+ * A failure sets stem4dOpenFailed_, so the raw worker does not retry on every batch.
+ */
+void ADTimePix::openStem4d(const StemConfig& cfg) {
+    std::string base;
+    int fileNumber = 0;
+    getStringParam(ADTimePixStem4dFile, base);
+    getIntegerParam(ADTimePixStem4dFileNumber, &fileNumber);
+    if (base.empty()) {
+        setStringParam(ADTimePixStem4dStatus, "No 4D-STEM file base");
+        stem4dOpenFailed_ = true;
+        return;
+    }
+    char name[512];
+    epicsSnprintf(name, sizeof(name), "%s_%04d", base.c_str(), fileNumber);
+
+    std::string err;
+    const double dwellNs = cfg.dwell_ticks * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9;
+    if (!stem4dStore_) stem4dStore_.reset(new Stem4dStore());
+    if (!stem4dStore_->open(name, cfg.scan_width, cfg.scan_height, cfg.det_width, cfg.det_height, dwellNs, err)) {
+        ERR_ARGS("4D-STEM store open failed: %s", err.c_str());
+        setStringParam(ADTimePixStem4dStatus, err.c_str());
+        stem4dOpenFailed_ = true;
+        return;
+    }
+    setIntegerParam(ADTimePixStem4dFileNumber, fileNumber + 1);
+    setStringParam(ADTimePixStem4dFullFileName, name);
+    setStringParam(ADTimePixStem4dStatus, "Writing");
+    LOG_ARGS("4D-STEM store writing %s.csr / .idx", name);
+}
+
+/** Finalize the open store; data stays available for ROI sums. Caller holds stemMutex_. */
+void ADTimePix::closeStem4d() {
+    if (!stem4dStore_ || !stem4dStore_->is_writing()) return;
+    std::string err;
+    if (!stem4dStore_->close(err)) {
+        ERR_ARGS("4D-STEM store close failed: %s", err.c_str());
+        setStringParam(ADTimePixStem4dStatus, err.c_str());
+    } else {
+        setStringParam(ADTimePixStem4dStatus, "Closed");
+    }
+    updateStem4dStats();
+}
+
+/** Caller holds stemMutex_. */
+void ADTimePix::updateStem4dStats() {
+    if (!stem4dStore_) return;
+    const Stem4dStats& st = stem4dStore_->stats();
+    setInteger64Param(ADTimePixStem4dEvents, static_cast<epicsInt64>(st.events));
+    setInteger64Param(ADTimePixStem4dRows, static_cast<epicsInt64>(st.rows));
+    setInteger64Param(ADTimePixStem4dUnordered, static_cast<epicsInt64>(st.unordered));
+    setDoubleParam(ADTimePixStem4dMBytes, st.bytes / (1024.0 * 1024.0));
+}
+
+/** TPX3_STEM4D_SUM: publish the diffraction pattern summed over the scan ROI (port thread). */
+asynStatus ADTimePix::sumStem4d() {
+    int x = 0, y = 0, w = 0, h = 0, frame = -1;
+    getIntegerParam(ADTimePixStem4dRoiX, &x);
+    getIntegerParam(ADTimePixStem4dRoiY, &y);
+    getIntegerParam(ADTimePixStem4dRoiWidth, &w);
+    getIntegerParam(ADTimePixStem4dRoiHeight, &h);
+    getIntegerParam(ADTimePixStem4dFrame, &frame);
+
+    epicsMutexLock(stemMutex_);
+    if (!stem4dStore_ || !stem4dStore_->has_data()) {
+        epicsMutexUnlock(stemMutex_);
+        setStringParam(ADTimePixStem4dStatus, "No 4D-STEM data");
+        return asynError;
+    }
+    const size_t width = stem4dStore_->get_det_width();
+    const size_t height = stem4dStore_->get_det_height();
+    std::vector<uint32_t> pattern(width * height);
+    const uint64_t summed = stem4dStore_->sum_diffraction(x, y, w, h, frame, pattern.data());
+    epicsMutexUnlock(stemMutex_);
+
+    setInteger64Param(ADTimePixStem4dSumEvents, static_cast<epicsInt64>(summed));
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return asynSuccess;
+
+    size_t dims[2] = { width, height };
+    NDArray* pArr = pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+    if (!pArr || !pArr->pData) {
+        if (pArr) pArr->release();
+        ERR("Failed to allocate 4D-STEM sum NDArray");
+        return asynError;
+    }
+    std::memcpy(pArr->pData, pattern.data(), pattern.size() * sizeof(uint32_t));
+    epicsInt32 roi[5] = { x, y, w, h, frame };
+    epicsInt64 events = static_cast<epicsInt64>(summed);
+    pArr->uniqueId = 0;
+    epicsTimeGetCurrent(&pArr->epicsTS);
+    pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+    if (pArr->pAttributeList) {
+        getAttributes(pArr->pAttributeList);
+        pArr->pAttributeList->add("ScanRoiX", "Scan ROI x", NDAttrInt32, &roi[0]);
+        pArr->pAttributeList->add("ScanRoiY", "Scan ROI y", NDAttrInt32, &roi[1]);
+        pArr->pAttributeList->add("ScanRoiWidth", "Scan ROI width", NDAttrInt32, &roi[2]);
+        pArr->pAttributeList->add("ScanRoiHeight", "Scan ROI height", NDAttrInt32, &roi[3]);
+        pArr->pAttributeList->add("ScanFrame", "Scan frame (-1 = all)", NDAttrInt32, &roi[4]);
+        pArr->pAttributeList->add("SummedEvents", "Events in the pattern", NDAttrInt64, &events);
+    }
+    doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_STEM4D_SUM);
+    pArr->release();
+    return asynSuccess;
+}
@@ -0,0 +1,124 @@
+/*
+ * ADTimePix3 - Sparse 4D-STEM event store (CSR by probe position, memory mapped)
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef STEM4D_H
+#define STEM4D_H
+
+#include "stem_image.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief Header at the start of the .idx file (little endian, 64 bytes)
+ *
+ * The .idx file is this header followed by rows + 1 uint64 offsets; events of
+ * row r (= frame * scan_width * scan_height + y * scan_width + x) are entries
+ * [offset[r], offset[r + 1]) of the .csr file, one uint32 detector pixel index
+ * (y * det_width + x) per event.
+ */
+struct Stem4dHeader {
+    char magic[8];             // "TPX4DCSR"
+    uint32_t version;          // 1
+    uint32_t header_bytes;     // sizeof(Stem4dHeader)
+    uint32_t scan_width;
+    uint32_t scan_height;
+    uint32_t det_width;
+    uint32_t det_height;
+    uint64_t rows;             // complete rows (0 while writing)
+    uint64_t events;
+    double dwell_ns;
+    uint64_t reserved;
+};
+
+/** @brief Store counters since open(). */
+struct Stem4dStats {
+    uint64_t events = 0;
+    uint64_t rows = 0;         // rows closed so far
+    uint64_t unordered = 0;    // hits for a row before the current one (dropped)
+    uint64_t bytes = 0;        // .csr + .idx payload
+};
+
+/**
+ * @brief Append-only CSR writer and ROI reader for sparse 4D-STEM
+ *
+ * Hits arrive in time order, so rows (probe positions) only move forward:
+ * events are appended to the mapped .csr file and the row offset table is
+ * extended as rows close. Both files grow by doubling (ftruncate + remap).
+ * close() trims them to size, writes the final header and keeps a read-only
+ * mapping so sum_diffraction() keeps working until the next open().
+ */
+class Stem4dStore {
+public:
+    Stem4dStore() = default;
+    ~Stem4dStore();
+    Stem4dStore(const Stem4dStore&) = delete;
+    Stem4dStore& operator=(const Stem4dStore&) = delete;
+
+    /** Create base.csr and base.idx (truncating existing files). */
+    bool open(const std::string& base, int scan_width, int scan_height,
+              size_t det_width, size_t det_height, double dwell_ns, std::string& err);
+
+    /** Append the hits with a row; rows[i] == STEM_NO_ROW skips hit i. */
+    void append(const Tpx3HitBatch& hits, const std::vector<uint64_t>& rows);
+
+    /** Finalize sizes and header; data stays readable. */
+    bool close(std::string& err);
+
+    /** Unmap and close everything. */
+    void release();
+
+    bool is_writing() const { return writing_; }
+    /** A file could not grow; appends are dropped until the next open(). */
+    bool failed() const { return failed_; }
+    const std::string& error() const { return error_; }
+    bool has_data() const { return offsets_ != nullptr; }
+    const Stem4dStats& stats() const { return stats_; }
+    const std::string& base() const { return base_; }
+    size_t get_det_width() const { return det_width_; }
+    size_t get_det_height() const { return det_height_; }
+    /** Frames with at least one closed row. */
+    uint64_t get_frames() const;
+
+    /**
+     * @brief Sum the diffraction patterns of a scan ROI over closed rows
+     * @param frame frame index, or -1 for all frames
+     * @param out det_width * det_height counts (overwritten)
+     * @return events summed
+     */
+    uint64_t sum_diffraction(int x, int y, int width, int height, int frame, uint32_t* out) const;
+
+private:
+    bool grow_events(size_t need, std::string& err);
+    bool grow_index(size_t rows_needed, std::string& err);
+    void close_rows_until(uint64_t row);
+
+    std::string base_;
+    int csr_fd_ = -1;
+    int idx_fd_ = -1;
+    uint32_t* events_ = nullptr;      // mapped .csr
+    size_t events_cap_ = 0;           // entries
+    void* idx_map_ = nullptr;         // mapped .idx (header + offsets)
+    uint64_t* offsets_ = nullptr;
+    size_t index_cap_ = 0;            // offsets entries
+    bool writing_ = false;
+    bool failed_ = false;             // a grow failed; further appends are dropped
+    std::string error_;
+    uint64_t current_row_ = 0;        // row being written; rows below are closed
+    bool have_row_ = false;
+    size_t scan_width_ = 0;
+    size_t scan_height_ = 0;
+    size_t det_width_ = 0;
+    size_t det_height_ = 0;
+    Stem4dStats stats_;
+};
+
+#endif // STEM4D_H
@@ -0,0 +1,517 @@
+/*
+ * ADTimePix3 - Event-based virtual STEM imaging from decoded raw hits
+ *
+ * Fed from the Raw TCP decoder (TPX3_RAW_DECODE=1) when TPX3_VSTEM_ENABLE=1.
+ * Scan geometry comes from Measurement.Config Stem.Scan (Width, Height,
+ * DwellTime); without TPX3_VSTEM_DETECTORS the virtual detectors default to a
+ * bright-field disk of Stem.VirtualDetector.RadiusInner and an annular dark
+ * field from RadiusInner to RadiusOuter. Detector images go to NDArray addrs
+ * 25..28, centre-of-mass X/Y to addrs 29..30.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "stem_image.h"
+#include "stem4d.h"
+#include "histogram_io.h"
+#include "tof_gate.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+extern const char* driverName;
+
+bool parseStemDetectors(const std::string& spec, std::vector<StemDetector>& dets, std::string& err) {
+    dets.clear();
+    err.clear();
+    std::string s;
+    s.reserve(spec.size());
+    for (char c : spec) {
+        if (c != ' ' && c != '\t') s.push_back(c);
+    }
+
+    std::vector<StemDetector> parsed;
+    size_t start = 0;
+    while (start < s.size()) {
+        size_t comma = s.find(',', start);
+        if (comma == std::string::npos) comma = s.size();
+        const std::string item = s.substr(start, comma - start);
+        start = comma + 1;
+        if (item.empty()) continue;
+        const size_t colon = item.find(':');
+        if (colon == std::string::npos) {
+            err = "detector '" + item + "' must be inner:outer (px)";
+            return false;
+        }
+        char* end = nullptr;
+        const std::string a = item.substr(0, colon);
+        const std::string b = item.substr(colon + 1);
+        const double r0 = std::strtod(a.c_str(), &end);
+        if (a.empty() || *end != '\0') {
+            err = "bad inner radius '" + a + "'";
+            return false;
+        }
+        const double r1 = std::strtod(b.c_str(), &end);
+        if (b.empty() || *end != '\0') {
+            err = "bad outer radius '" + b + "'";
+            return false;
+        }
+        if (r0 < 0.0 || r1 <= r0) {
+            err = "detector '" + item + "' needs outer > inner >= 0";
+            return false;
+        }
+        if (static_cast<int>(parsed.size()) >= STEM_MAX_DETECTORS) {
+            err = "too many detectors (max " + std::to_string(STEM_MAX_DETECTORS) + ")";
+            return false;
+        }
+        StemDetector d;
+        d.inner = r0;
+        d.outer = r1;
+        parsed.push_back(d);
+    }
+    dets.swap(parsed);
+    return true;
+}
+
+// StemImager class implementation
+StemImager::StemImager(const StemConfig& config) : config_(config) {
+    if (config_.detectors.size() > static_cast<size_t>(STEM_MAX_DETECTORS)) {
+        config_.detectors.resize(STEM_MAX_DETECTORS);
+    }
+    config_.scan_width = std::max(config_.scan_width, 1);
+    config_.scan_height = std::max(config_.scan_height, 1);
+    config_.dwell_ticks = std::max<uint64_t>(config_.dwell_ticks, 1);
+    positions_ = static_cast<size_t>(config_.scan_width) * config_.scan_height;
+    line_ticks_ = config_.dwell_ticks * config_.scan_width;
+    frame_ticks_ = line_ticks_ * config_.scan_height;
+
+    // Per-pixel detector membership and centre-of-mass offsets
+    const size_t pixels = config_.det_width * config_.det_height;
+    mask_.assign(pixels, 0);
+    dx_.resize(pixels);
+    dy_.resize(pixels);
+    for (size_t y = 0; y < config_.det_height; ++y) {
+        for (size_t x = 0; x < config_.det_width; ++x) {
+            const size_t p = y * config_.det_width + x;
+            const double ox = static_cast<double>(x) - config_.center_x;
+            const double oy = static_cast<double>(y) - config_.center_y;
+            const double r = std::sqrt(ox * ox + oy * oy);
+            uint8_t bits = 0;
+            for (size_t d = 0; d < config_.detectors.size(); ++d) {
+                if (r >= config_.detectors[d].inner && r < config_.detectors[d].outer) bits |= uint8_t(1u << d);
+            }
+            mask_[p] = bits;
+            dx_[p] = static_cast<float>(ox);
+            dy_[p] = static_cast<float>(oy);
+        }
+    }
+
+    images_.assign(config_.detectors.size() * positions_, 0);
+    sum_x_.assign(positions_, 0.0);
+    sum_y_.assign(positions_, 0.0);
+    sum_n_.assign(positions_, 0);
+    com_x_.assign(positions_, 0.0f);
+    com_y_.assign(positions_, 0.0f);
+}
+
+int StemImager::get_line() const {
+    if (!armed_) return -1;
+    if (config_.trigger == STEM_TRIGGER_LINE) return line_;
+    const uint64_t off = last_toa_ > frame_start_ ? last_toa_ - frame_start_ : 0;
+    return static_cast<int>(std::min<uint64_t>(off / line_ticks_, config_.scan_height - 1));
+}
+
+void StemImager::handle_trigger(uint64_t t, const FrameCallback& on_frame) {
+    ++stats_.triggers;
+    switch (config_.trigger) {
+        case STEM_TRIGGER_FRAME:
+            if (armed_) finish_frame(true, on_frame);
+            frame_start_ = t;
+            armed_ = true;
+            triggered_ = true;
+            break;
+        case STEM_TRIGGER_LINE:
+            if (!armed_ || line_ >= config_.scan_height - 1) {
+                if (armed_) finish_frame(true, on_frame);
+                line_ = 0;
+                armed_ = true;
+            } else {
+                ++line_;
+            }
+            line_start_ = t;
+            triggered_ = true;
+            break;
+        case STEM_TRIGGER_FREE:
+        default:
+            break;
+    }
+}
+
+void StemImager::add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs, const FrameCallback& on_frame,
+                     std::vector<uint64_t>* rows) {
+    if (config_.trigger != STEM_TRIGGER_FREE) {
+        for (size_t i = 0; i < tdcs.size(); ++i) {
+            if (tdcs.edge[i] != config_.tdc_edge) continue;
+            const uint64_t t = tdcs.time[i];
+            if (pending_tdc_.empty() || t >= pending_tdc_.back()) {
+                pending_tdc_.push_back(t);
+            } else {
+                pending_tdc_.insert(std::upper_bound(pending_tdc_.begin(), pending_tdc_.end(), t), t);
+            }
+        }
+    }
+
+    const size_t pixels = mask_.size();
+    const size_t ndet = config_.detectors.size();
+    const size_t n = hits.size();
+    if (rows) rows->assign(n, STEM_NO_ROW);
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t t = hits.toa[i];
+        while (!pending_tdc_.empty() && pending_tdc_.front() <= t) {
+            handle_trigger(pending_tdc_.front(), on_frame);
+            pending_tdc_.pop_front();
+        }
+        ++stats_.hits;
+        last_toa_ = std::max(last_toa_, t);
+        const uint32_t pixel = hits.pixel[i];
+        if (pixel >= pixels) {
+            ++stats_.unmapped;
+            continue;
+        }
+
+        size_t pos;
+        if (config_.trigger == STEM_TRIGGER_LINE) {
+            if (!triggered_) {
+                ++stats_.no_trigger;
+                continue;
+            }
+            const uint64_t x = t >= line_start_ ? (t - line_start_) / config_.dwell_ticks : 0;
+            if (!armed_ || x >= static_cast<uint64_t>(config_.scan_width)) {
+                // Flyback; after the last line the frame is done
+                if (armed_ && line_ == config_.scan_height - 1) finish_frame(true, on_frame);
+                ++stats_.outside;
+                continue;
+            }
+            pos = static_cast<size_t>(line_) * config_.scan_width + static_cast<size_t>(x);
+        } else {
+            if (config_.trigger == STEM_TRIGGER_FREE) {
+                if (!triggered_) {
+                    frame_start_ = t;
+                    armed_ = true;
+                    triggered_ = true;
+                } else if (t >= frame_start_ + frame_ticks_) {
+                    if (armed_) finish_frame(true, on_frame);
+                    // Skip whole frames without hits rather than emitting them
+                    frame_start_ += ((t - frame_start_) / frame_ticks_) * frame_ticks_;
+                    armed_ = true;
+                }
+            } else if (!triggered_) {
+                ++stats_.no_trigger;
+                continue;
+            }
+            const uint64_t idx = t >= frame_start_ ? (t - frame_start_) / config_.dwell_ticks : 0;
+            if (!armed_ || idx >= positions_) {
+                if (armed_) finish_frame(true, on_frame);
+                ++stats_.outside;
+                continue;
+            }
+            pos = static_cast<size_t>(idx);
+        }
+
+        const uint8_t bits = mask_[pixel];
+        for (size_t d = 0; d < ndet; ++d) {
+            images_[d * positions_ + pos] += (bits >> d) & 1u;
+        }
+        sum_x_[pos] += dx_[pixel];
+        sum_y_[pos] += dy_[pixel];
+        ++sum_n_[pos];
+        ++frame_events_;
+        ++stats_.placed;
+        if (rows) (*rows)[i] = frame_index_ * positions_ + pos;
+    }
+}
+
+void StemImager::emit(bool complete, const FrameCallback& on_frame) {
+    for (size_t p = 0; p < positions_; ++p) {
+        const uint32_t k = sum_n_[p];
+        com_x_[p] = k ? static_cast<float>(sum_x_[p] / k) : 0.0f;
+        com_y_[p] = k ? static_cast<float>(sum_y_[p] / k) : 0.0f;
+    }
+    StemFrame f;
+    for (int d = 0; d < STEM_MAX_DETECTORS; ++d) {
+        f.images[d] = d < get_detectors() ? images_.data() + static_cast<size_t>(d) * positions_ : nullptr;
+    }
+    f.detectors = get_detectors();
+    f.com_x = com_x_.data();
+    f.com_y = com_y_.data();
+    f.width = static_cast<size_t>(config_.scan_width);
+    f.height = static_cast<size_t>(config_.scan_height);
+    f.index = frame_index_;
+    f.complete = complete;
+    f.events = frame_events_;
+    on_frame(f);
+}
+
+void StemImager::finish_frame(bool complete, const FrameCallback& on_frame) {
+    emit(complete, on_frame);
+    std::fill(images_.begin(), images_.end(), 0u);
+    std::fill(sum_x_.begin(), sum_x_.end(), 0.0);
+    std::fill(sum_y_.begin(), sum_y_.end(), 0.0);
+    std::fill(sum_n_.begin(), sum_n_.end(), 0u);
+    frame_events_ = 0;
+    ++frame_index_;
+    ++stats_.frames;
+    armed_ = false;
+}
+
+void StemImager::snapshot(const FrameCallback& on_frame) {
+    if (armed_ || frame_events_ > 0) emit(false, on_frame);
+}
+
+void StemImager::flush(const FrameCallback& on_frame) {
+    while (!pending_tdc_.empty()) {
+        handle_trigger(pending_tdc_.front(), on_frame);
+        pending_tdc_.pop_front();
+    }
+    if (frame_events_ > 0) finish_frame(false, on_frame);
+}
+
+void StemImager::reset() {
+    std::fill(images_.begin(), images_.end(), 0u);
+    std::fill(sum_x_.begin(), sum_x_.end(), 0.0);
+    std::fill(sum_y_.begin(), sum_y_.end(), 0.0);
+    std::fill(sum_n_.begin(), sum_n_.end(), 0u);
+    triggered_ = false;
+    armed_ = false;
+    frame_start_ = 0;
+    line_start_ = 0;
+    line_ = -1;
+    last_toa_ = 0;
+    pending_tdc_.clear();
+    frame_events_ = 0;
+    frame_index_ = 0;
+    stats_ = StemStats();
+}
+
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: raw batches -> StemImager -> NDArray addrs 25..30
+// -----------------------------------------------------------------------
+
+/** Mark the imager for rebuild from Stem.* / TPX3_VSTEM_* (applied on the Raw worker thread). */
+void ADTimePix::invalidateStemImager() {
+    if (!stemMutex_) return;
+    epicsMutexLock(stemMutex_);
+    stemConfigDirty_ = true;
+    epicsMutexUnlock(stemMutex_);
+}
+
+/** Caller holds stemMutex_. Invalid settings leave no imager and a status message. */
+void ADTimePix::rebuildStemImager() {
+    int scanWidth = 0, scanHeight = 0, radiusInner = 0, radiusOuter = 0;
+    int trigger = STEM_TRIGGER_FRAME, tdcEdge = TPX3_TDC1_RISE;
+    double dwellSec = 0.0, centerX = -1.0, centerY = -1.0;
+    std::string detSpec;
+    getIntegerParam(ADTimePixStemScanWidth, &scanWidth);
+    getIntegerParam(ADTimePixStemScanHeight, &scanHeight);
+    getIntegerParam(ADTimePixStemRadiusInner, &radiusInner);
+    getIntegerParam(ADTimePixStemRadiusOuter, &radiusOuter);
+    getDoubleParam(ADTimePixStemDwellTime, &dwellSec);
+    getIntegerParam(ADTimePixVStemTrigger, &trigger);
+    getIntegerParam(ADTimePixVStemTdcEdge, &tdcEdge);
+    getDoubleParam(ADTimePixVStemCenterX, &centerX);
+    getDoubleParam(ADTimePixVStemCenterY, &centerY);
+    getStringParam(ADTimePixVStemDetectors, detSpec);
+
+    closeStem4d();
+    stemImager_.reset();
+    stemConfigDirty_ = false;
+    stem4dOpenFailed_ = false;
+    stemLastPublishTime_ = 0.0;
+
+    epicsMutexLock(rawMutex_);
+    const int width = rawImageWidth_;
+    const int height = rawImageHeight_;
+    epicsMutexUnlock(rawMutex_);
+
+    StemConfig cfg;
+    cfg.det_width = static_cast<size_t>(std::max(width, 0));
+    cfg.det_height = static_cast<size_t>(std::max(height, 0));
+    cfg.scan_width = scanWidth;
+    cfg.scan_height = scanHeight;
+    cfg.dwell_ticks = tofMsToTicks(dwellSec * 1e3);
+    cfg.trigger = (trigger == STEM_TRIGGER_LINE || trigger == STEM_TRIGGER_FREE)
+                      ? static_cast<StemTriggerMode>(trigger) : STEM_TRIGGER_FRAME;
+    cfg.tdc_edge = static_cast<uint8_t>((tdcEdge >= TPX3_TDC1_RISE && tdcEdge <= TPX3_TDC2_FALL) ? tdcEdge : TPX3_TDC1_RISE);
+    cfg.center_x = centerX >= 0.0 ? centerX : (width - 1) / 2.0;
+    cfg.center_y = centerY >= 0.0 ? centerY : (height - 1) / 2.0;
+
+    std::string err;
+    if (!parseStemDetectors(detSpec, cfg.detectors, err)) {
+        setStringParam(ADTimePixVStemStatus, err.c_str());
+        return;
+    }
+    if (cfg.detectors.empty()) {
+        // Stem.VirtualDetector: BF disk inside RadiusInner, ADF annulus out to RadiusOuter
+        if (radiusInner > 0) cfg.detectors.push_back(StemDetector{ 0.0, static_cast<double>(radiusInner) });
+        if (radiusOuter > radiusInner) {
+            cfg.detectors.push_back(StemDetector{ static_cast<double>(std::max(radiusInner, 0)),
+                                                  static_cast<double>(radiusOuter) });
+        }
+    }
+    setIntegerParam(ADTimePixVStemNumDetectors, static_cast<int>(cfg.detectors.size()));
+    for (int d = 0; d < STEM_MAX_DETECTORS; ++d) {
+        const bool used = d < static_cast<int>(cfg.detectors.size());
+        setDoubleParam(d, ADTimePixVStemInner, used ? cfg.detectors[d].inner : 0.0);
+        setDoubleParam(d, ADTimePixVStemOuter, used ? cfg.detectors[d].outer : 0.0);
+        callParamCallbacks(d);
+    }
+
+    if (cfg.det_width == 0 || cfg.det_height == 0) {
+        setStringParam(ADTimePixVStemStatus, "No detector pixel map");
+        return;
+    }
+    if (scanWidth <= 0 || scanHeight <= 0 ||
+        static_cast<size_t>(scanWidth) * static_cast<size_t>(scanHeight) > STEM_MAX_POSITIONS) {
+        setStringParam(ADTimePixVStemStatus, "Stem.Scan Width/Height out of range");
+        return;
+    }
+    if (cfg.dwell_ticks == 0) {
+        setStringParam(ADTimePixVStemStatus, "Stem.Scan DwellTime must be > 0");
+        return;
+    }
+
+    stemImager_.reset(new StemImager(cfg));
+    char msg[80];
+    epicsSnprintf(msg, sizeof(msg), "OK: %d x %d, %d detectors", scanWidth, scanHeight, stemImager_->get_detectors());
+    setStringParam(ADTimePixVStemStatus, msg);
+}
+
+/** Push one frame: detector d on addr 25 + d (NDUInt32), COM X/Y on 29/30 (NDFloat32). Caller holds stemMutex_. */
+void ADTimePix::publishStemFrame(const StemFrame& frame) {
+    if (frame.complete) setIntegerParam(ADTimePixVStemFrames, static_cast<int>(frame.index + 1));
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return;
+
+    size_t dims[2] = { frame.width, frame.height };
+    const size_t positions = frame.width * frame.height;
+    epicsInt32 frameIndex = static_cast<epicsInt32>(frame.index);
+    epicsInt32 complete = frame.complete ? 1 : 0;
+    epicsInt64 events = static_cast<epicsInt64>(frame.events);
+
+    auto publish = [&](const void* data, NDDataType_t type, size_t elemSize, int addr, double inner, double outer) {
+        NDArray* pArr = pNDArrayPool->alloc(2, dims, type, 0, NULL);
+        if (!pArr || !pArr->pData) {
+            if (pArr) pArr->release();
+            ERR("Failed to allocate virtual STEM NDArray");
+            return;
+        }
+        std::memcpy(pArr->pData, data, positions * elemSize);
+        pArr->uniqueId = frameIndex;
+        epicsTimeGetCurrent(&pArr->epicsTS);
+        pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+        if (pArr->pAttributeList) {
+            getAttributes(pArr->pAttributeList);
+            pArr->pAttributeList->add("StemFrame", "Scan frame index", NDAttrInt32, &frameIndex);
+            pArr->pAttributeList->add("StemComplete", "1: full scan frame, 0: partial", NDAttrInt32, &complete);
+            pArr->pAttributeList->add("StemEvents", "Hits placed in this frame", NDAttrInt64, &events);
+            if (outer > 0.0) {
+                pArr->pAttributeList->add("RadiusInner", "Virtual detector inner radius (px)", NDAttrFloat64, &inner);
+                pArr->pAttributeList->add("RadiusOuter", "Virtual detector outer radius (px)", NDAttrFloat64, &outer);
+            }
+        }
+        doCallbacksGenericPointer(pArr, NDArrayData, addr);
+        pArr->release();
+    };
+
+    const StemConfig& cfg = stemImager_->config();
+    for (int d = 0; d < frame.detectors; ++d) {
+        publish(frame.images[d], NDUInt32, sizeof(uint32_t), NDARRAY_ADDR_VSTEM0 + d,
+                cfg.detectors[d].inner, cfg.detectors[d].outer);
+    }
+    publish(frame.com_x, NDFloat32, sizeof(float), NDARRAY_ADDR_VSTEM_COM_X, 0.0, 0.0);
+    publish(frame.com_y, NDFloat32, sizeof(float), NDARRAY_ADDR_VSTEM_COM_Y, 0.0, 0.0);
+}
+
+/** Raw worker hook: place one decoded batch into the virtual STEM images and the 4D-STEM store. */
+void ADTimePix::processStemBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    int enable = 0;
+    int enable4d = 0;
+    getIntegerParam(ADTimePixVStemEnable, &enable);
+    getIntegerParam(ADTimePixStem4dEnable, &enable4d);
+    if (!enable && !enable4d) return;
+
+    epicsMutexLock(stemMutex_);
+    if (stemConfigDirty_) rebuildStemImager();
+    if (stemImager_) {
+        auto onFrame = [this, enable](const StemFrame& f) {
+            if (enable) publishStemFrame(f);
+        };
+        if (enable4d) {
+            if ((!stem4dStore_ || !stem4dStore_->is_writing()) && !stem4dOpenFailed_) {
+                openStem4d(stemImager_->config());
+            }
+            stemImager_->add(hits, tdcs, onFrame, &stem4dRows_);
+            if (stem4dStore_ && stem4dStore_->is_writing()) {
+                const bool wasFailed = stem4dStore_->failed();
+                stem4dStore_->append(hits, stem4dRows_);
+                if (stem4dStore_->failed() && !wasFailed) {
+                    ERR_ARGS("4D-STEM store %s: %s", stem4dStore_->base().c_str(), stem4dStore_->error().c_str());
+                    setStringParam(ADTimePixStem4dStatus, stem4dStore_->error().c_str());
+                }
+                updateStem4dStats();
+            }
+        } else {
+            stemImager_->add(hits, tdcs, onFrame);
+        }
+
+        double period = 0.0;
+        getDoubleParam(ADTimePixVStemPublishPeriod, &period);
+        const double now = nowSeconds();
+        if (stemLastPublishTime_ == 0.0) stemLastPublishTime_ = now;
+        if (enable && period > 0.0 && now - stemLastPublishTime_ >= std::max(period, 0.05)) {
+            stemImager_->snapshot(onFrame);
+            stemLastPublishTime_ = now;
+        }
+
+        const StemStats& st = stemImager_->stats();
+        setIntegerParam(ADTimePixVStemLine, stemImager_->get_line());
+        setInteger64Param(ADTimePixVStemPlaced, static_cast<epicsInt64>(st.placed));
+        setInteger64Param(ADTimePixVStemNoTrigger, static_cast<epicsInt64>(st.no_trigger));
+        setInteger64Param(ADTimePixVStemOutside, static_cast<epicsInt64>(st.outside));
+    }
+    epicsMutexUnlock(stemMutex_);
+}
+
+/** Publish the frame in progress at end of acquisition; the next acquisition rebuilds. */
+void ADTimePix::flushStem() {
+    if (!stemMutex_) return;
+    epicsMutexLock(stemMutex_);
+    if (stemImager_) {
+        int enable = 0;
+        getIntegerParam(ADTimePixVStemEnable, &enable);
+        stemImager_->flush([this, enable](const StemFrame& f) {
+            if (enable) publishStemFrame(f);
+        });
+        const StemStats& st = stemImager_->stats();
+        setIntegerParam(ADTimePixVStemLine, -1);
+        setInteger64Param(ADTimePixVStemPlaced, static_cast<epicsInt64>(st.placed));
+        setInteger64Param(ADTimePixVStemNoTrigger, static_cast<epicsInt64>(st.no_trigger));
+        setInteger64Param(ADTimePixVStemOutside, static_cast<epicsInt64>(st.outside));
+        stemImager_.reset();
+    }
+    closeStem4d();
+    stemConfigDirty_ = true;
+    epicsMutexUnlock(stemMutex_);
+    callParamCallbacks();
+}
@@ -0,0 +1,164 @@
+/*
+ * ADTimePix3 - Event-based virtual STEM imaging from decoded raw hits
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef STEM_IMAGE_H
+#define STEM_IMAGE_H
+
+#include "tpx3_raw.h"
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** Maximum number of virtual detectors (one NDArray address each). */
+constexpr int STEM_MAX_DETECTORS = 4;
+/** Largest scan (positions) accepted; bounds the per-detector image memory. */
+constexpr size_t STEM_MAX_POSITIONS = 4096 * 4096;
+/** Row reported by StemImager::add for a hit without a scan position. */
+constexpr uint64_t STEM_NO_ROW = UINT64_MAX;
+
+/** TPX3_VSTEM_TRIGGER values: how hits are assigned to scan positions. */
+enum StemTriggerMode {
+    STEM_TRIGGER_FRAME = 0,    // TDC edge starts a frame; position = elapsed / dwell
+    STEM_TRIGGER_LINE = 1,     // TDC edge starts each line; time past width * dwell is flyback
+    STEM_TRIGGER_FREE = 2      // no trigger; frames of width * height * dwell from the first hit
+};
+
+/** @brief Annular virtual detector in diffraction space; radii in detector pixels. */
+struct StemDetector {
+    double inner = 0.0;     // 0 = disk (bright field)
+    double outer = 0.0;
+};
+
+/**
+ * @brief Parse a detector list "inner:outer,inner:outer,..." (detector pixels)
+ *
+ * Whitespace is ignored. Each detector needs outer > inner >= 0. At most
+ * STEM_MAX_DETECTORS.
+ * @return true on success; on failure dets is left empty and err describes the problem
+ */
+bool parseStemDetectors(const std::string& spec, std::vector<StemDetector>& dets, std::string& err);
+
+/** @brief Scan and virtual detector geometry; times in TDC ticks. */
+struct StemConfig {
+    size_t det_width = 0;
+    size_t det_height = 0;
+    int scan_width = 0;
+    int scan_height = 0;
+    uint64_t dwell_ticks = 0;
+    StemTriggerMode trigger = STEM_TRIGGER_FRAME;
+    uint8_t tdc_edge = TPX3_TDC1_RISE;
+    double center_x = 0.0;     // diffraction pattern centre (detector pixels)
+    double center_y = 0.0;
+    std::vector<StemDetector> detectors;
+};
+
+/**
+ * @brief One scan frame; pointers are valid only inside the callback
+ *
+ * images[d] holds the counts of virtual detector d per scan position (row
+ * major, scan_width x scan_height). com_x / com_y are the mean hit offset from
+ * the pattern centre in detector pixels (0 where no hit).
+ */
+struct StemFrame {
+    const uint32_t* images[STEM_MAX_DETECTORS];
+    int detectors;
+    const float* com_x;
+    const float* com_y;
+    size_t width;
+    size_t height;
+    uint64_t index;            // frame number since reset
+    bool complete;             // false: live snapshot or frame cut short at stop
+    uint64_t events;           // hits placed in this frame
+};
+
+/** @brief Running counters (monotonic until reset()). */
+struct StemStats {
+    uint64_t hits = 0;
+    uint64_t placed = 0;       // hits assigned to a scan position
+    uint64_t unmapped = 0;     // no image pixel
+    uint64_t no_trigger = 0;   // before the first frame / line trigger
+    uint64_t outside = 0;      // flyback or after the end of a frame
+    uint64_t triggers = 0;
+    uint64_t frames = 0;
+};
+
+/**
+ * @brief Builds virtual STEM images from time-ordered hits
+ *
+ * Each hit is assigned to a scan position from its ToA, the dwell time and the
+ * last trigger, then added to every virtual detector whose annulus contains its
+ * pixel (precomputed per-pixel bit mask) and to the centre-of-mass sums of that
+ * position. Input should be time ordered (TPX3_RAW_SORT=1); TDC triggers are
+ * applied in time order between hits.
+ */
+class StemImager {
+public:
+    typedef std::function<void(const StemFrame&)> FrameCallback;
+
+    explicit StemImager(const StemConfig& config);
+
+    /**
+     * @brief Add a decoded batch; completed frames are passed to on_frame
+     * @param rows when set, receives per hit frame * positions + position, or STEM_NO_ROW
+     */
+    void add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs, const FrameCallback& on_frame,
+             std::vector<uint64_t>* rows = nullptr);
+
+    /** Pass the frame in progress (complete = false) without clearing it. */
+    void snapshot(const FrameCallback& on_frame);
+
+    /** Apply pending triggers and emit the frame in progress if it holds hits. */
+    void flush(const FrameCallback& on_frame);
+
+    /** Drop frame, trigger state and counters. */
+    void reset();
+
+    const StemConfig& config() const { return config_; }
+    const StemStats& stats() const { return stats_; }
+    int get_detectors() const { return static_cast<int>(config_.detectors.size()); }
+    /** Scan line being filled, -1 between frames. */
+    int get_line() const;
+
+private:
+    void handle_trigger(uint64_t t, const FrameCallback& on_frame);
+    void finish_frame(bool complete, const FrameCallback& on_frame);
+    void emit(bool complete, const FrameCallback& on_frame);
+
+    StemConfig config_;
+    size_t positions_;
+    uint64_t line_ticks_;
+    uint64_t frame_ticks_;
+
+    std::vector<uint8_t> mask_;       // detector pixel -> bit d when inside detector d
+    std::vector<float> dx_;           // detector pixel -> offset from pattern centre
+    std::vector<float> dy_;
+    std::vector<uint32_t> images_;    // detectors x positions
+    std::vector<double> sum_x_;
+    std::vector<double> sum_y_;
+    std::vector<uint32_t> sum_n_;
+    std::vector<float> com_x_;
+    std::vector<float> com_y_;
+
+    bool triggered_ = false;          // at least one trigger (or first hit in FREE mode)
+    bool armed_ = false;              // a frame is being filled
+    uint64_t frame_start_ = 0;
+    uint64_t line_start_ = 0;
+    int line_ = -1;
+    uint64_t last_toa_ = 0;
+    std::deque<uint64_t> pending_tdc_;
+    uint64_t frame_events_ = 0;
+    uint64_t frame_index_ = 0;
+    StemStats stats_;
+};
+
+#endif // STEM_IMAGE_H
@@ -0,0 +1,86 @@
+/*
+ * ADTimePix3 - Threshold band-pass kernels for paired Medipix3 frames
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "threshold_pair.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+inline int32_t diffScalar(int32_t d, bool clip) {
+    return clip ? (d > 0 ? d : 0) : d;
+}
+
+#if defined(__SSE2__)
+/** Signed 32-bit max(d, 0) without SSE4.1. */
+inline __m128i clipZero128(__m128i d) {
+    return _mm_andnot_si128(_mm_srai_epi32(d, 31), d);
+}
+#endif
+
+}  // namespace
+
+void thresholdDiffU16(const uint16_t* t0, const uint16_t* t1, int32_t* out, size_t n, bool clip) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i zero256 = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+        const __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(t0 + i)));
+        const __m256i b = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(t1 + i)));
+        __m256i d = _mm256_sub_epi32(a, b);
+        if (clip) d = _mm256_max_epi32(d, zero256);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), d);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t0 + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t1 + i));
+        __m128i lo = _mm_sub_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(b, zero));
+        __m128i hi = _mm_sub_epi32(_mm_unpackhi_epi16(a, zero), _mm_unpackhi_epi16(b, zero));
+        if (clip) {
+            lo = clipZero128(lo);
+            hi = clipZero128(hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), hi);
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = diffScalar(static_cast<int32_t>(t0[i]) - static_cast<int32_t>(t1[i]), clip);
+    }
+}
+
+void thresholdDiffU32(const uint32_t* t0, const uint32_t* t1, int32_t* out, size_t n, bool clip) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i zero256 = _mm256_setzero_si256();
+    for (; i + 8 <= n; i += 8) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t0 + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(t1 + i));
+        __m256i d = _mm256_sub_epi32(a, b);
+        if (clip) d = _mm256_max_epi32(d, zero256);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), d);
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t0 + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t1 + i));
+        __m128i d = _mm_sub_epi32(a, b);
+        if (clip) d = clipZero128(d);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), d);
+    }
+#endif
+    for (; i < n; ++i) {
+        // Same wrap as the former static_cast<int32_t>(t0) - static_cast<int32_t>(t1)
+        out[i] = diffScalar(static_cast<int32_t>(t0[i] - t1[i]), clip);
+    }
+}
@@ -0,0 +1,273 @@
+/*
+ * ADTimePix3 - Pairing of Medipix3 threshold frames by frame number
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef THRESHOLD_PAIR_H
+#define THRESHOLD_PAIR_H
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** Most thresholds in one set (Medipix3 colour mode has 8 counters per pixel group). */
+constexpr int THRESHOLD_PAIR_MAX = 8;
+
+/**
+ * @brief How a jsonimage frameNumber maps to the trigger it belongs to
+ *
+ * Serval numbers the threshold frames of one trigger either the same
+ * (FRAME) or one per message, highest threshold first on the wire
+ * (T1 = n, T0 = n + 1), so frameNumber + thresholdID is the same for the
+ * whole set (FRAME_PLUS_THRESHOLD). AUTO picks one from the first two
+ * consecutive frames of different thresholds that fit either rule.
+ */
+enum class ThresholdPairKey { AUTO = 0, FRAME = 1, FRAME_PLUS_THRESHOLD = 2 };
+
+/** @brief Counters since reset(). */
+struct ThresholdPairStats {
+    uint64_t sets = 0;                 // complete sets handed out
+    uint64_t orphans = 0;              // frames of incomplete sets dropped (timeout, depth, restart, AUTO learning)
+    uint64_t duplicates = 0;           // a threshold arrived twice for one set; older frame dropped
+    uint64_t ignored = 0;              // frames with thresholdID outside [0, THRESHOLD_PAIR_MAX)
+    uint64_t restarts = 0;             // frame numbers went backwards (new measurement)
+};
+
+/**
+ * @brief Bounded buffer completing threshold frame sets by trigger
+ *
+ * Frames are filed under their trigger key; the set is handed out as soon as
+ * every threshold 0..N-1 is present, whatever the order on the wire, so
+ * pairing no longer depends on T1 arriving just before T0. Sets still
+ * incomplete after timeout_sec, or pushed out by more than depth newer
+ * triggers, are dropped and their frames counted as orphans. N is fixed by configure(), or
+ * with thresholds = 0 follows the highest thresholdID seen (at least 2).
+ *
+ * Handle is a reference-counted frame (NDArray*); add() takes over one
+ * reference and Release()(handle) gives it back when a frame is dropped. All
+ * methods are thread safe (reset() runs on the acquisition-control thread).
+ */
+template <typename Handle, typename Release>
+class ThresholdPairQueue {
+public:
+    ThresholdPairQueue() = default;
+    ~ThresholdPairQueue() { reset(); }
+    ThresholdPairQueue(const ThresholdPairQueue&) = delete;
+    ThresholdPairQueue& operator=(const ThresholdPairQueue&) = delete;
+
+    void configure(int thresholds, ThresholdPairKey mode, double timeout_sec, size_t depth) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fixed_thresholds_ = std::min(std::max(thresholds, 0), THRESHOLD_PAIR_MAX);
+        if (fixed_thresholds_ >= 2) thresholds_ = fixed_thresholds_;
+        if (mode != mode_) {
+            mode_ = mode;
+            key_mode_ = mode;
+        }
+        timeout_sec_ = timeout_sec;
+        depth_ = std::max<size_t>(depth, 1);
+    }
+
+    /**
+     * @brief File one frame at wall time now (seconds)
+     * @param set receives the complete set, indexed by threshold, when this frame completes one
+     * @param key receives the trigger key of the completed set
+     * @return true when set was filled; the caller then owns those references
+     */
+    bool add(int threshold, int frame, Handle handle, double now, std::vector<Handle>& set, int& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireLocked(now);
+        if (threshold < 0 || threshold >= THRESHOLD_PAIR_MAX) {
+            ++stats_.ignored;
+            Release()(handle);
+            return false;
+        }
+        if (fixed_thresholds_ < 2) thresholds_ = std::max(thresholds_, threshold + 1);
+
+        if (key_mode_ == ThresholdPairKey::AUTO) {
+            // Learn the numbering from two consecutive frames of different thresholds
+            if (has_last_ && last_threshold_ != threshold) {
+                if (last_frame_ == frame) {
+                    key_mode_ = ThresholdPairKey::FRAME;
+                } else if (last_frame_ + last_threshold_ == frame + threshold) {
+                    key_mode_ = ThresholdPairKey::FRAME_PLUS_THRESHOLD;
+                }
+            }
+            if (key_mode_ == ThresholdPairKey::AUTO) {
+                if (has_last_) {
+                    ++stats_.orphans;
+                    Release()(last_handle_);
+                }
+                has_last_ = true;
+                last_threshold_ = threshold;
+                last_frame_ = frame;
+                last_handle_ = handle;
+                return false;
+            }
+            if (has_last_) {
+                has_last_ = false;
+                fileLocked(last_threshold_, last_frame_, last_handle_, now);
+            }
+        }
+        const size_t done = fileLocked(threshold, frame, handle, now);
+        if (done == NONE) return false;
+        const Entry& entry = pending_[done];
+        set.assign(entry.frames, entry.frames + thresholds_);
+        key = entry.key;
+        ++stats_.sets;
+        pending_.erase(pending_.begin() + done);
+        return true;
+    }
+
+    /**
+     * Drop sets older than the timeout without filing a frame (the preview
+     * worker calls this while its stream is idle); returns the frames released.
+     */
+    uint64_t expire(double now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const uint64_t before = stats_.orphans;
+        expireLocked(now);
+        return stats_.orphans - before;
+    }
+
+    /** Drop everything pending and relearn the numbering (new acquisition). */
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (Entry& e : pending_) releaseEntry(e);
+        pending_.clear();
+        if (has_last_) Release()(last_handle_);
+        has_last_ = false;
+        key_mode_ = mode_;
+        thresholds_ = fixed_thresholds_ >= 2 ? fixed_thresholds_ : 2;
+        newest_key_valid_ = false;
+        stats_ = ThresholdPairStats();
+    }
+
+    ThresholdPairStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+    /** Numbering in use (AUTO until learned). */
+    ThresholdPairKey key_mode() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return key_mode_;
+    }
+    int thresholds() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return thresholds_;
+    }
+    /** Frames held for sets not complete yet. */
+    size_t pending() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t frames = has_last_ ? 1 : 0;
+        for (const Entry& e : pending_) frames += static_cast<size_t>(__builtin_popcount(e.present));
+        return frames;
+    }
+
+private:
+    /** Frame numbers going back by more than this mean a new measurement. */
+    static constexpr int RESTART_FRAMES = 10;
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+
+    struct Entry {
+        int key = 0;
+        double first = 0.0;
+        unsigned present = 0;
+        Handle frames[THRESHOLD_PAIR_MAX] = {};
+    };
+
+    void releaseEntry(Entry& e) {
+        for (int t = 0; t < THRESHOLD_PAIR_MAX; ++t) {
+            if (e.present & (1u << t)) Release()(e.frames[t]);
+        }
+        e.present = 0;
+    }
+
+    void dropFrontLocked() {
+        stats_.orphans += static_cast<uint64_t>(__builtin_popcount(pending_.front().present));
+        releaseEntry(pending_.front());
+        pending_.pop_front();
+    }
+
+    void expireLocked(double now) {
+        while (!pending_.empty() && timeout_sec_ > 0.0 && now - pending_.front().first > timeout_sec_) {
+            dropFrontLocked();
+        }
+    }
+
+    /** File a frame; returns the index of its entry when that completed the set, else NONE. */
+    size_t fileLocked(int threshold, int frame, Handle handle, double now) {
+        const int key = key_mode_ == ThresholdPairKey::FRAME_PLUS_THRESHOLD ? frame + threshold : frame;
+        if (newest_key_valid_ && key + RESTART_FRAMES < newest_key_) {
+            while (!pending_.empty()) dropFrontLocked();
+            ++stats_.restarts;
+            newest_key_valid_ = false;
+        }
+        if (!newest_key_valid_ || key > newest_key_) newest_key_ = key;
+        newest_key_valid_ = true;
+
+        size_t index = NONE;
+        for (size_t i = 0; i < pending_.size(); ++i) {
+            if (pending_[i].key == key) {
+                index = i;
+                break;
+            }
+        }
+        if (index == NONE) {
+            while (pending_.size() >= depth_) dropFrontLocked();
+            pending_.emplace_back();
+            index = pending_.size() - 1;
+            pending_[index].key = key;
+            pending_[index].first = now;
+        }
+        Entry* entry = &pending_[index];
+        const unsigned bit = 1u << threshold;
+        if (entry->present & bit) {
+            Release()(entry->frames[threshold]);
+            ++stats_.duplicates;
+        }
+        entry->frames[threshold] = handle;
+        entry->present |= bit;
+        const unsigned full = (1u << thresholds_) - 1;
+        if ((entry->present & full) != full) return NONE;
+        // Thresholds above N (N fixed lower than the stream provides) are not part of the set
+        for (int t = thresholds_; t < THRESHOLD_PAIR_MAX; ++t) {
+            if (entry->present & (1u << t)) Release()(entry->frames[t]);
+        }
+        return index;
+    }
+
+    mutable std::mutex mutex_;
+    ThresholdPairKey mode_ = ThresholdPairKey::AUTO;
+    ThresholdPairKey key_mode_ = ThresholdPairKey::AUTO;
+    int fixed_thresholds_ = 0;
+    int thresholds_ = 2;
+    double timeout_sec_ = 1.0;
+    size_t depth_ = 8;
+    std::deque<Entry> pending_;
+    int newest_key_ = 0;
+    bool newest_key_valid_ = false;
+    // AUTO: the previous frame, held until the numbering is known
+    bool has_last_ = false;
+    int last_threshold_ = 0;
+    int last_frame_ = 0;
+    Handle last_handle_ = Handle();
+    ThresholdPairStats stats_;
+};
+
+/**
+ * @brief Band-pass T0 - T1 into int32, optionally clipped at zero
+ *
+ * SSE2 / AVX2 (when the build targets them) widen, subtract and clamp 4 / 8
+ * pixels per instruction; the scalar tail handles the rest.
+ */
+void thresholdDiffU16(const uint16_t* t0, const uint16_t* t1, int32_t* out, size_t n, bool clip);
+void thresholdDiffU32(const uint32_t* t0, const uint32_t* t1, int32_t* out, size_t n, bool clip);
+
+#endif // THRESHOLD_PAIR_H
@@ -0,0 +1,343 @@
+/*
+ * ADTimePix3 - ToA time-walk correction of decoded raw hits
+ *
+ * With TPX3_TIMEWALK_ENABLE=1 the Raw decode worker (raw_stream.cpp) corrects
+ * each decoded batch before the sorter, so every consumer sees corrected ToA.
+ * Tables load on TPX3_TIMEWALK_RELOAD and at acquisition start when none is
+ * loaded. With TPX3_TIMEWALK_VALIDATE=1 uncorrected and corrected ToF spectra
+ * (TPX3_RAWHST_* binning, TDC and edge) are published side by side on
+ * TPX3_TIMEWALK_HIST_RAW / _HIST_CORR and as NDInt64 {bins, 2} on addr 38.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "timewalk.h"
+#include "histogram_io.h"
+#include "tof_gate.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+extern const char* driverName;
+
+namespace {
+
+int64_t nsToTicks(double ns) {
+    return static_cast<int64_t>(std::llround(ns * 1e-9 / TPX3_TDC_CLOCK_PERIOD_SEC));
+}
+
+}  // namespace
+
+bool TimeWalkCorrector::load(const std::string& tot_file, const std::string& pixel_file, int chips, std::string& err) {
+    std::ifstream in(tot_file.c_str());
+    if (!in) {
+        err = "Cannot open " + tot_file;
+        return false;
+    }
+    std::vector<std::pair<double, double>> pts;
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line)) {
+        ++lineNo;
+        const size_t hash = line.find('#');
+        if (hash != std::string::npos) line.erase(hash);
+        std::istringstream ls(line);
+        double tot = 0.0, ns = 0.0;
+        if (!(ls >> tot)) continue;  // blank / comment
+        if (!(ls >> ns) || tot < 0.0 || tot >= TIMEWALK_TOT_ENTRIES) {
+            err = tot_file + ": bad line " + std::to_string(lineNo) + " (tot delay_ns)";
+            return false;
+        }
+        pts.emplace_back(tot, ns);
+    }
+    if (pts.empty()) {
+        err = tot_file + ": no points";
+        return false;
+    }
+    std::stable_sort(pts.begin(), pts.end(),
+                     [](const std::pair<double, double>& a, const std::pair<double, double>& b) { return a.first < b.first; });
+
+    std::vector<int64_t> totTicks(TIMEWALK_TOT_ENTRIES);
+    double maxNs = 0.0;
+    size_t k = 0;
+    for (int tot = 0; tot < TIMEWALK_TOT_ENTRIES; ++tot) {
+        while (k + 1 < pts.size() && pts[k + 1].first <= tot) ++k;
+        double ns;
+        if (tot <= pts.front().first) {
+            ns = pts.front().second;
+        } else if (k + 1 >= pts.size()) {
+            ns = pts.back().second;
+        } else {
+            const double f = (tot - pts[k].first) / (pts[k + 1].first - pts[k].first);
+            ns = pts[k].second + f * (pts[k + 1].second - pts[k].second);
+        }
+        totTicks[tot] = nsToTicks(ns);
+        maxNs = std::max(maxNs, std::fabs(ns));
+    }
+
+    std::vector<int64_t> pixelTicks(1, 0);
+    if (!pixel_file.empty()) {
+        const size_t count = static_cast<size_t>(std::max(chips, 1)) * 65536;
+        std::ifstream pin(pixel_file.c_str());
+        if (!pin) {
+            err = "Cannot open " + pixel_file;
+            return false;
+        }
+        pixelTicks.clear();
+        pixelTicks.reserve(count + 1);
+        double ns = 0.0;
+        while (pixelTicks.size() < count && (pin >> ns)) pixelTicks.push_back(nsToTicks(ns));
+        if (pixelTicks.size() != count || (pin >> ns)) {
+            err = pixel_file + ": expected " + std::to_string(count) + " values";
+            return false;
+        }
+        pixelTicks.push_back(0);
+    }
+
+    tot_ticks_.swap(totTicks);
+    pixel_ticks_.swap(pixelTicks);
+    points_ = static_cast<int>(pts.size());
+    max_ns_ = maxNs;
+    corrected_ = 0;
+    correction_sum_ = 0.0;
+    return true;
+}
+
+void TimeWalkCorrector::gather(const Tpx3HitBatch& hits) {
+    const size_t n = hits.size();
+    corr_.resize(n);
+    const uint32_t pixels = static_cast<uint32_t>(pixel_ticks_.size() - 1);
+    const int64_t* totLut = tot_ticks_.data();
+    const int64_t* pixLut = pixel_ticks_.data();
+    const uint16_t* tot = hits.tot.data();
+    const uint8_t* chip = hits.chip.data();
+    const uint8_t* x = hits.x.data();
+    const uint8_t* y = hits.y.data();
+    for (size_t i = 0; i < n; ++i) {
+        const uint32_t bpc = (static_cast<uint32_t>(chip[i]) << 16) | (static_cast<uint32_t>(y[i]) << 8) | x[i];
+        const uint32_t p = bpc < pixels ? bpc : pixels;
+        corr_[i] = totLut[tot[i] & (TIMEWALK_TOT_ENTRIES - 1)] + pixLut[p];
+    }
+}
+
+void TimeWalkCorrector::apply(Tpx3HitBatch& hits, uint64_t period) {
+    gather(hits);
+    const size_t n = hits.size();
+    const int64_t per = static_cast<int64_t>(period);
+    uint64_t* toa = hits.toa.data();
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t t = static_cast<int64_t>(toa[i]) - corr_[i];
+        t += t < 0 ? per : 0;
+        t -= t >= per ? per : 0;
+        toa[i] = static_cast<uint64_t>(t);
+        sum += corr_[i];
+    }
+    corrected_ += n;
+    correction_sum_ += static_cast<double>(sum);
+}
+
+void TimeWalkCorrector::restore(Tpx3HitBatch& hits) {
+    gather(hits);
+    const size_t n = hits.size();
+    uint64_t* toa = hits.toa.data();
+    for (size_t i = 0; i < n; ++i) toa[i] = static_cast<uint64_t>(static_cast<int64_t>(toa[i]) + corr_[i]);
+}
+
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: decoder batch -> TimeWalkCorrector; validation spectra -> addr 38
+// -----------------------------------------------------------------------
+
+/** TPX3_TIMEWALK_RELOAD / acquisition start: (re)load the tables (port thread). */
+asynStatus ADTimePix::loadTimeWalk() {
+    std::string totFile, pixelFile;
+    int numChips = 1;
+    getStringParam(ADTimePixTimeWalkFile, totFile);
+    getStringParam(ADTimePixTimeWalkPixelFile, pixelFile);
+    getIntegerParam(ADTimePixNumberOfChips, &numChips);
+    if (totFile.empty()) {
+        setStringParam(ADTimePixTimeWalkStatus, "No time-walk file");
+        return asynError;
+    }
+
+    std::unique_ptr<TimeWalkCorrector> tw(new TimeWalkCorrector());
+    std::string err;
+    if (!tw->load(totFile, pixelFile, numChips, err)) {
+        setStringParam(ADTimePixTimeWalkStatus, err.c_str());
+        ERR_ARGS("Time-walk table: %s", err.c_str());
+        return asynError;
+    }
+    setIntegerParam(ADTimePixTimeWalkPoints, tw->get_points());
+    setIntegerParam(ADTimePixTimeWalkPixels, static_cast<int>(tw->get_pixels()));
+    setDoubleParam(ADTimePixTimeWalkMaxNs, tw->get_max_ns());
+    setInteger64Param(ADTimePixTimeWalkCorrected, 0);
+    setDoubleParam(ADTimePixTimeWalkMeanNs, 0.0);
+    char msg[80];
+    epicsSnprintf(msg, sizeof(msg), "Loaded: %d points, %d pixel offsets",
+                  tw->get_points(), static_cast<int>(tw->get_pixels()));
+    setStringParam(ADTimePixTimeWalkStatus, msg);
+    LOG_ARGS("Time-walk table %s: %s", totFile.c_str(), msg);
+
+    epicsMutexLock(timeWalkMutex_);
+    timeWalk_ = std::move(tw);
+    timeWalkConfigDirty_ = true;
+    epicsMutexUnlock(timeWalkMutex_);
+    return asynSuccess;
+}
+
+/** Raw worker, before the sorter: correct the decoder's batch in place. */
+void ADTimePix::applyTimeWalk(Tpx3HitBatch& hits) {
+    int enable = 0;
+    getIntegerParam(ADTimePixTimeWalkEnable, &enable);
+    if (!enable || hits.empty()) return;
+
+    epicsMutexLock(timeWalkMutex_);
+    if (timeWalk_) {
+        timeWalk_->apply(hits, TPX3_PIXEL_TOA_PERIOD_TICKS);
+        const uint64_t n = timeWalk_->get_corrected();
+        setInteger64Param(ADTimePixTimeWalkCorrected, static_cast<epicsInt64>(n));
+        setDoubleParam(ADTimePixTimeWalkMeanNs,
+                       n ? timeWalk_->get_correction_sum() / n * TPX3_TDC_CLOCK_PERIOD_SEC * 1e9 : 0.0);
+    }
+    epicsMutexUnlock(timeWalkMutex_);
+}
+
+/** Rebuild the validation spectra on the next batch (RawHst binning changed, new table). */
+void ADTimePix::invalidateTimeWalkValidation() {
+    if (!timeWalkMutex_) return;
+    epicsMutexLock(timeWalkMutex_);
+    timeWalkConfigDirty_ = true;
+    epicsMutexUnlock(timeWalkMutex_);
+}
+
+/** Caller holds timeWalkMutex_. Two detector-wide histogrammers on the TPX3_RAWHST_* axis. */
+void ADTimePix::rebuildTimeWalkValidation() {
+    int binning = 0, bins = 1000, tdcChannel = 0, edgeSel = 0;
+    double minMs = 0.0, maxMs = 1.0;
+    std::string tdcReference;
+    getIntegerParam(ADTimePixRawHstBinning, &binning);
+    getIntegerParam(ADTimePixRawHstBins, &bins);
+    getIntegerParam(ADTimePixRawHstTdc, &tdcChannel);
+    getIntegerParam(ADTimePixRawHstEdge, &edgeSel);
+    getDoubleParam(ADTimePixRawHstMinMs, &minMs);
+    getDoubleParam(ADTimePixRawHstMaxMs, &maxMs);
+    getStringParam(ADTimePixTofTdcReference, tdcReference);
+
+    timeWalkHistRaw_.reset();
+    timeWalkHistCorr_.reset();
+    timeWalkConfigDirty_ = false;
+    timeWalkLastPublishTime_ = 0.0;
+
+    TofHistConfig cfg;
+    cfg.log_bins = (binning == 1);
+    cfg.min_ticks = tofMsToTicks(minMs);
+    cfg.max_ticks = tofMsToTicks(maxMs);
+    cfg.bins = std::min(std::max(bins, 1), TOF_HIST_MAX_BINS);
+    const uint8_t riseEdge = tdcChannel ? TPX3_TDC2_RISE : TPX3_TDC1_RISE;
+    const uint8_t fallEdge = tdcChannel ? TPX3_TDC2_FALL : TPX3_TDC1_FALL;
+    switch (edgeSel) {
+        case 1: cfg.edge_mask = static_cast<uint8_t>(1u << riseEdge); break;
+        case 2: cfg.edge_mask = static_cast<uint8_t>(1u << fallEdge); break;
+        case 3: cfg.edge_mask = static_cast<uint8_t>((1u << riseEdge) | (1u << fallEdge)); break;
+        default: cfg.edge_mask = tofReferenceEdgeMask(tdcReference, tdcChannel); break;
+    }
+    if (!(maxMs > minMs) || (cfg.log_bins && !(minMs > 0.0))) return;
+
+    timeWalkHistRaw_.reset(new TofHistogrammer(cfg));
+    timeWalkHistCorr_.reset(new TofHistogrammer(cfg));
+    std::vector<double> axis = timeWalkHistCorr_->bin_centers_ms();
+    doCallbacksFloat64Array(axis.data(), axis.size(), ADTimePixTimeWalkTimeMs, 0);
+}
+
+/** Push both validation spectra (waveforms and NDInt64 {bins, 2}: uncorrected, corrected). Caller holds timeWalkMutex_. */
+void ADTimePix::publishTimeWalk() {
+    timeWalkHistRaw_->merge();
+    timeWalkHistCorr_->merge();
+    const int bins = timeWalkHistCorr_->get_bins();
+    const std::vector<uint64_t>& raw = timeWalkHistRaw_->totals();
+    const std::vector<uint64_t>& corr = timeWalkHistCorr_->totals();
+
+    timeWalkPublishBuffer_.resize(static_cast<size_t>(bins) * 2);
+    for (int b = 0; b < bins; ++b) {
+        timeWalkPublishBuffer_[b] = static_cast<epicsInt64>(raw[b]);
+        timeWalkPublishBuffer_[bins + b] = static_cast<epicsInt64>(corr[b]);
+    }
+    doCallbacksInt64Array(timeWalkPublishBuffer_.data(), bins, ADTimePixTimeWalkHistRaw, 0);
+    doCallbacksInt64Array(timeWalkPublishBuffer_.data() + bins, bins, ADTimePixTimeWalkHistCorr, 0);
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return;
+
+    size_t dims[2] = { static_cast<size_t>(bins), 2 };
+    NDArray* pArr = pNDArrayPool->alloc(2, dims, NDInt64, 0, NULL);
+    if (!pArr || !pArr->pData) {
+        if (pArr) pArr->release();
+        ERR("Failed to allocate time-walk validation NDArray");
+        return;
+    }
+    std::memcpy(pArr->pData, timeWalkPublishBuffer_.data(), timeWalkPublishBuffer_.size() * sizeof(epicsInt64));
+    const TofHistConfig& cfg = timeWalkHistCorr_->config();
+    epicsInt32 logBins = cfg.log_bins ? 1 : 0;
+    double minMs = tofTicksToMs(cfg.min_ticks);
+    double maxMs = tofTicksToMs(cfg.max_ticks);
+    epicsTimeGetCurrent(&pArr->epicsTS);
+    pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+    if (pArr->pAttributeList) {
+        getAttributes(pArr->pAttributeList);
+        pArr->pAttributeList->add("LogBins", "1 = logarithmic bins", NDAttrInt32, &logBins);
+        pArr->pAttributeList->add("TofMinMs", "First bin edge (ms)", NDAttrFloat64, &minMs);
+        pArr->pAttributeList->add("TofMaxMs", "Last bin edge (ms)", NDAttrFloat64, &maxMs);
+        pArr->pAttributeList->add("Rows", "0 = uncorrected, 1 = time-walk corrected", NDAttrString,
+                                  const_cast<char*>("uncorrected,corrected"));
+    }
+    doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_TIMEWALK_HIST);
+    pArr->release();
+}
+
+/** Raw worker hook: fill the uncorrected / corrected validation spectra. */
+void ADTimePix::processTimeWalkBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    int enable = 0, validate = 0;
+    getIntegerParam(ADTimePixTimeWalkEnable, &enable);
+    getIntegerParam(ADTimePixTimeWalkValidate, &validate);
+    if (!enable || !validate) return;
+
+    epicsMutexLock(timeWalkMutex_);
+    if (timeWalkConfigDirty_) rebuildTimeWalkValidation();
+    if (timeWalk_ && timeWalkHistCorr_) {
+        timeWalkHistCorr_->add(hits, tdcs);
+        timeWalkRawBatch_ = hits;
+        timeWalk_->restore(timeWalkRawBatch_);
+        timeWalkHistRaw_->add(timeWalkRawBatch_, tdcs);
+
+        double period = 1.0;
+        getDoubleParam(ADTimePixRawHstPublishPeriod, &period);
+        const double now = nowSeconds();
+        if (now - timeWalkLastPublishTime_ >= std::max(period, 0.05)) {
+            timeWalkLastPublishTime_ = now;
+            publishTimeWalk();
+        }
+    }
+    epicsMutexUnlock(timeWalkMutex_);
+}
+
+/** Final publish at end of acquisition; spectra restart with the next one. */
+void ADTimePix::flushTimeWalk() {
+    if (!timeWalkMutex_) return;
+    epicsMutexLock(timeWalkMutex_);
+    if (timeWalkHistCorr_) publishTimeWalk();
+    timeWalkConfigDirty_ = true;
+    epicsMutexUnlock(timeWalkMutex_);
+    callParamCallbacks();
+}
@@ -0,0 +1,71 @@
+/*
+ * ADTimePix3 - ToA time-walk correction of decoded raw hits
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TIMEWALK_H
+#define TIMEWALK_H
+
+#include "tpx3_raw.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** ToT LUT entries: the 10-bit pixel ToT (25 ns units). */
+constexpr int TIMEWALK_TOT_ENTRIES = 1024;
+
+/**
+ * @brief Time-walk correction table: delay(ToT) + optional per-pixel offset
+ *
+ * The ToT file lists "tot delay_ns" pairs (tot in 25 ns units, '#' starts a
+ * comment); the LUT interpolates linearly between points and holds the first /
+ * last delay outside them. The optional pixel file holds one offset in ns per
+ * pixel in chip order, 256 rows of 256 per chip (BPC order), indexed straight
+ * from the hit's chip / x / y.
+ *
+ * apply() subtracts delay + offset from each hit's ToA with a branch-free
+ * lookup (unknown pixels hit a trailing zero entry) and wraps the result into
+ * the pixel ToA period, so it runs before the sorter on the decoder's batch.
+ */
+class TimeWalkCorrector {
+public:
+    /**
+     * @brief Load the ToT table and, when pixel_file is not empty, the pixel offsets
+     * @param chips chips in the detector; the pixel file must hold chips * 65536 values
+     */
+    bool load(const std::string& tot_file, const std::string& pixel_file, int chips, std::string& err);
+
+    /** Correct hits in place; toa stays in [0, period). */
+    void apply(Tpx3HitBatch& hits, uint64_t period);
+
+    /** Undo the correction on unwrapped times (validation histograms). */
+    void restore(Tpx3HitBatch& hits);
+
+    int get_points() const { return points_; }
+    size_t get_pixels() const { return pixel_ticks_.size() - 1; }
+    /** Largest |delay| in the ToT LUT, ns. */
+    double get_max_ns() const { return max_ns_; }
+    /** Hits corrected since load() and the sum of their corrections (ticks). */
+    uint64_t get_corrected() const { return corrected_; }
+    double get_correction_sum() const { return correction_sum_; }
+
+private:
+    /** Correction of every hit of the batch into corr_ (ticks). */
+    void gather(const Tpx3HitBatch& hits);
+
+    std::vector<int64_t> tot_ticks_ = std::vector<int64_t>(TIMEWALK_TOT_ENTRIES, 0);
+    std::vector<int64_t> pixel_ticks_ = std::vector<int64_t>(1, 0);   // + trailing zero entry
+    std::vector<int64_t> corr_;
+    int points_ = 0;
+    double max_ns_ = 0.0;
+    uint64_t corrected_ = 0;
+    double correction_sum_ = 0.0;
+};
+
+#endif // TIMEWALK_H
@@ -0,0 +1,400 @@
+/*
+ * ADTimePix3 - Time-of-flight gated imaging (one accumulated image per ToF gate)
+ *
+ * Gate windows are entered in ms and converted to TDC clock ticks with
+ * TPX3_TDC_CLOCK_PERIOD_SEC, the same conversion the PrvHst time axis uses.
+ * Sources:
+ *   TPX3_GATE_MODE=1: Serval Image[0] in "tof" mode over the Img TCP channel;
+ *     each pixel carries the ToF of its hit in the frame (0 = no hit), in
+ *     units of TPX3_GATE_TOF_UNIT_NS. A 16-bit frame only reaches
+ *     65535 units (about 0.1 ms at 1.5625 ns), so ms gates need 32-bit frames.
+ *   TPX3_GATE_MODE=2: decoded Raw events; ToF is ToA minus the latest
+ *     reference edge (TPX3_TOF_TDC_REFERENCE on TPX3_RAWHST_TDC), as in the
+ *     raw ToF histogram, so gates of any length work.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tof_gate.h"
+#include "histogram_io.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+extern const char* driverName;
+
+uint64_t tofMsToTicks(double ms) {
+    if (!(ms > 0.0)) return 0;
+    return static_cast<uint64_t>(std::llround(ms * 1e-3 / TPX3_TDC_CLOCK_PERIOD_SEC));
+}
+
+double tofTicksToMs(uint64_t ticks) {
+    return static_cast<double>(ticks) * TPX3_TDC_CLOCK_PERIOD_SEC * 1e3;
+}
+
+bool parseTofGates(const std::string& spec, std::vector<TofGate>& gates, std::string& err) {
+    gates.clear();
+    err.clear();
+    std::string s;
+    s.reserve(spec.size());
+    for (char c : spec) {
+        if (c != ' ' && c != '\t') s.push_back(c);
+    }
+    if (s.empty()) return true;  // no gates: feature idle
+
+    std::vector<TofGate> parsed;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t comma = s.find(',', start);
+        std::string item = s.substr(start, (comma == std::string::npos) ? std::string::npos : comma - start);
+        if (!item.empty()) {
+            size_t colon = item.find(':');
+            if (colon == std::string::npos) {
+                err = "gate '" + item + "' must be start:stop (ms)";
+                return false;
+            }
+            char* end = nullptr;
+            const std::string a = item.substr(0, colon);
+            const std::string b = item.substr(colon + 1);
+            double t0 = std::strtod(a.c_str(), &end);
+            if (a.empty() || *end != '\0') {
+                err = "bad gate start '" + a + "'";
+                return false;
+            }
+            double t1 = std::strtod(b.c_str(), &end);
+            if (b.empty() || *end != '\0') {
+                err = "bad gate stop '" + b + "'";
+                return false;
+            }
+            if (t0 < 0.0 || t1 <= t0) {
+                err = "gate '" + item + "' needs stop > start >= 0";
+                return false;
+            }
+            if (static_cast<int>(parsed.size()) >= TOF_GATE_MAX) {
+                err = "too many gates (max " + std::to_string(TOF_GATE_MAX) + ")";
+                return false;
+            }
+            TofGate g;
+            g.start_ms = t0;
+            g.stop_ms = t1;
+            g.start_ticks = tofMsToTicks(t0);
+            g.stop_ticks = tofMsToTicks(t1);
+            if (g.stop_ticks <= g.start_ticks) g.stop_ticks = g.start_ticks + 1;
+            parsed.push_back(g);
+        }
+        if (comma == std::string::npos) break;
+        start = comma + 1;
+    }
+    gates.swap(parsed);
+    return true;
+}
+
+// GatedImageStack class implementation
+GatedImageStack::GatedImageStack(size_t width, size_t height, const std::vector<TofGate>& gates)
+    : width_(width), height_(height), gates_(gates) {
+    images_.assign(gates_.size(), std::vector<uint32_t>(width * height, 0));
+    gate_counts_.assign(gates_.size(), 0);
+    set_frame_unit_ticks(1.0);
+}
+
+void GatedImageStack::set_frame_unit_ticks(double ticks_per_unit) {
+    if (!(ticks_per_unit > 0.0)) ticks_per_unit = 1.0;
+    frame_unit_ticks_ = ticks_per_unit;
+    frame_lo_.resize(gates_.size());
+    frame_hi_.resize(gates_.size());
+    for (size_t g = 0; g < gates_.size(); ++g) {
+        // Keep value v when v * unit lies in [start, stop).
+        // Serval reports ToF 0 for "no hit"; a gate starting at 0 still excludes those pixels.
+        const double lo = std::ceil(gates_[g].start_ticks / ticks_per_unit);
+        const double hi = std::ceil(gates_[g].stop_ticks / ticks_per_unit);
+        frame_lo_[g] = std::max<uint64_t>(static_cast<uint64_t>(lo), 1);
+        frame_hi_[g] = std::max<uint64_t>(static_cast<uint64_t>(hi), frame_lo_[g]);
+    }
+}
+
+template <typename T>
+void GatedImageStack::add_tof_frame(const T* tof, size_t pixel_count) {
+    for (size_t g = 0; g < gates_.size(); ++g) {
+        const uint64_t lo = frame_lo_[g];
+        const uint64_t hi = frame_hi_[g];
+        uint32_t* img = images_[g].data();
+        uint64_t n = 0;
+        for (size_t i = 0; i < pixel_count; ++i) {
+            const uint64_t t = tof[i];
+            const uint32_t in = static_cast<uint32_t>((t >= lo) & (t < hi));
+            img[i] += in;
+            n += in;
+        }
+        gate_counts_[g] += n;
+    }
+    ++frame_count_;
+}
+
+bool GatedImageStack::add_tof_frame_16(const uint16_t* tof, size_t pixel_count) {
+    if (pixel_count != get_pixel_count()) return false;
+    add_tof_frame(tof, pixel_count);
+    return true;
+}
+
+bool GatedImageStack::add_tof_frame_32(const uint32_t* tof, size_t pixel_count) {
+    if (pixel_count != get_pixel_count()) return false;
+    add_tof_frame(tof, pixel_count);
+    return true;
+}
+
+void GatedImageStack::add_events(const Tpx3HitBatch& hits, const TofReferenceEdges& refs,
+                                 uint64_t& no_reference, uint64_t& unmapped) {
+    const size_t npix = get_pixel_count();
+    const size_t nGates = gates_.size();
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const uint32_t pix = hits.pixel[i];
+        if (pix == TPX3_PIXEL_NONE || pix >= npix) {
+            ++unmapped;
+            continue;
+        }
+        uint64_t tof = 0;
+        if (!refs.tof_of(hits.toa[i], tof)) {
+            ++no_reference;
+            continue;
+        }
+        for (size_t g = 0; g < nGates; ++g) {
+            if (tof >= gates_[g].start_ticks && tof < gates_[g].stop_ticks) {
+                ++images_[g][pix];
+                ++gate_counts_[g];
+            }
+        }
+    }
+    ++frame_count_;
+}
+
+void GatedImageStack::reset() {
+    for (auto& img : images_) std::fill(img.begin(), img.end(), 0u);
+    std::fill(gate_counts_.begin(), gate_counts_.end(), 0ull);
+    frame_count_ = 0;
+}
+
+
+/** Parse TPX3_GATE_WINDOWS into tofGates_; clears accumulated gate images. */
+asynStatus ADTimePix::updateTofGates() {
+    std::string spec, err;
+    std::vector<TofGate> gates;
+    getStringParam(ADTimePixGateWindows, spec);
+    const bool ok = parseTofGates(spec, gates, err);
+
+    epicsMutexLock(gateMutex_);
+    tofGates_ = gates;
+    gatedImages_.reset();
+    gateRangeWarned_ = false;
+    epicsMutexUnlock(gateMutex_);
+
+    setIntegerParam(ADTimePixGateCount, static_cast<int>(gates.size()));
+    for (int g = 0; g < TOF_GATE_MAX; ++g) {
+        const bool used = g < static_cast<int>(gates.size());
+        setDoubleParam(g, ADTimePixGateStartMs, used ? gates[g].start_ms : 0.0);
+        setDoubleParam(g, ADTimePixGateStopMs, used ? gates[g].stop_ms : 0.0);
+        setInteger64Param(g, ADTimePixGateTotalCounts, 0);
+        callParamCallbacks(g);
+    }
+    setIntegerParam(ADTimePixGateFrames, 0);
+    if (!ok) {
+        setStringParam(ADTimePixGateStatus, err.c_str());
+        ERR_ARGS("Invalid ToF gate list '%s': %s", spec.c_str(), err.c_str());
+        return asynError;
+    }
+    setStringParam(ADTimePixGateStatus, gates.empty() ? "No gates" : "OK");
+    return asynSuccess;
+}
+
+/** Zero the per-gate images (TPX3_GATE_RESET, acquireStart). Caller must not hold gateMutex_. */
+void ADTimePix::resetTofGateAccumulation() {
+    epicsMutexLock(gateMutex_);
+    if (gatedImages_) gatedImages_->reset();
+    gateNoReference_ = 0;
+    gateUnmapped_ = 0;
+    epicsMutexUnlock(gateMutex_);
+    for (int g = 0; g < TOF_GATE_MAX; ++g) {
+        setInteger64Param(g, ADTimePixGateTotalCounts, 0);
+        callParamCallbacks(g);
+    }
+    setIntegerParam(ADTimePixGateFrames, 0);
+}
+
+/**
+ * Accumulate one Img "tof" frame into every gate and publish per-gate images
+ * every TPX3_GATE_PUBLISH_FRAMES frames. pixels are host-order (already byte-swapped)
+ * and hold ToF in units of TPX3_GATE_TOF_UNIT_NS.
+ */
+void ADTimePix::processTofGateFrame(const void* pixels, bool is_uint32, int width, int height) {
+    int publishEvery = 1;
+    double unitNs = TOF_GATE_FRAME_UNIT_NS;
+    getIntegerParam(ADTimePixGatePublishFrames, &publishEvery);
+    getDoubleParam(ADTimePixGateTofUnitNs, &unitNs);
+    if (publishEvery < 1) publishEvery = 1;
+    if (!(unitNs > 0.0)) unitNs = TOF_GATE_FRAME_UNIT_NS;
+    const double ticksPerUnit = unitNs * 1e-9 / TPX3_TDC_CLOCK_PERIOD_SEC;
+
+    epicsMutexLock(gateMutex_);
+    if (tofGates_.empty()) {
+        epicsMutexUnlock(gateMutex_);
+        return;
+    }
+    if (!gatedImages_ || gatedImages_->get_width() != static_cast<size_t>(width) ||
+        gatedImages_->get_height() != static_cast<size_t>(height)) {
+        gatedImages_.reset(new GatedImageStack(width, height, tofGates_));
+        gatedImages_->set_frame_unit_ticks(ticksPerUnit);
+    } else if (gatedImages_->get_frame_unit_ticks() != ticksPerUnit) {
+        gatedImages_->set_frame_unit_ticks(ticksPerUnit);
+        gateRangeWarned_ = false;
+    }
+    int unreachable = -1;
+    if (!is_uint32 && !gateRangeWarned_) {
+        for (size_t g = 0; g < gatedImages_->get_gate_count(); ++g) {
+            if (gatedImages_->get_frame_gate_start(g) > 0xFFFF) {
+                unreachable = static_cast<int>(g);
+                break;
+            }
+        }
+        gateRangeWarned_ = true;
+    }
+    const size_t n = static_cast<size_t>(width) * static_cast<size_t>(height);
+    if (is_uint32) {
+        gatedImages_->add_tof_frame_32(static_cast<const uint32_t*>(pixels), n);
+    } else {
+        gatedImages_->add_tof_frame_16(static_cast<const uint16_t*>(pixels), n);
+    }
+    const uint64_t frames = gatedImages_->get_frame_count();
+    epicsMutexUnlock(gateMutex_);
+
+    if (unreachable >= 0) {
+        const double reachMs = 0xFFFF * unitNs * 1e-6;
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Gate %d starts past the 16-bit ToF range (%.4g ms)", unreachable, reachMs);
+        setStringParam(ADTimePixGateStatus, msg);
+        WARN_ARGS("%s; use 32-bit Img frames or TPX3_GATE_MODE=2 (raw events)", msg);
+    }
+    setIntegerParam(ADTimePixGateFrames, static_cast<int>(frames));
+    if (frames % static_cast<uint64_t>(publishEvery) == 0) {
+        publishTofGateImages();
+    }
+}
+
+/**
+ * Consumer hook for TPX3_GATE_MODE=2 (worker thread): gate decoded hits by
+ * their ToF against the reference edges and publish every
+ * TPX3_GATE_PUBLISH_PERIOD seconds. Each batch counts as one gate frame.
+ */
+void ADTimePix::processTofGateBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    int mode = TOF_GATE_MODE_OFF;
+    getIntegerParam(ADTimePixGateMode, &mode);
+    if (mode != TOF_GATE_MODE_RAW) return;
+
+    int tdcChannel = 0;
+    double period = 1.0;
+    std::string tdcReference;
+    getIntegerParam(ADTimePixRawHstTdc, &tdcChannel);
+    getDoubleParam(ADTimePixGatePublishPeriod, &period);
+    getStringParam(ADTimePixTofTdcReference, tdcReference);
+
+    epicsMutexLock(rawMutex_);
+    const size_t width = static_cast<size_t>(std::max(rawImageWidth_, 0));
+    const size_t height = static_cast<size_t>(std::max(rawImageHeight_, 0));
+    epicsMutexUnlock(rawMutex_);
+
+    epicsMutexLock(gateMutex_);
+    gateRefs_.set_edge_mask(tofReferenceEdgeMask(tdcReference, tdcChannel));
+    gateRefs_.add(tdcs);
+    if (tofGates_.empty() || width == 0 || height == 0) {
+        epicsMutexUnlock(gateMutex_);
+        return;
+    }
+    if (!gatedImages_ || gatedImages_->get_width() != width || gatedImages_->get_height() != height) {
+        gatedImages_.reset(new GatedImageStack(width, height, tofGates_));
+    }
+    gatedImages_->add_events(hits, gateRefs_, gateNoReference_, gateUnmapped_);
+    const uint64_t frames = gatedImages_->get_frame_count();
+    const uint64_t noReference = gateNoReference_;
+    const uint64_t unmapped = gateUnmapped_;
+    const double now = nowSeconds();
+    const bool publish = now - gateLastPublishTime_ >= std::max(period, 0.05);
+    if (publish) gateLastPublishTime_ = now;
+    epicsMutexUnlock(gateMutex_);
+
+    setIntegerParam(ADTimePixGateFrames, static_cast<int>(frames));
+    if (publish) {
+        char msg[128];
+        if (noReference || unmapped) {
+            snprintf(msg, sizeof(msg), "OK; %llu hits without reference, %llu unmapped",
+                     static_cast<unsigned long long>(noReference), static_cast<unsigned long long>(unmapped));
+        } else {
+            snprintf(msg, sizeof(msg), "OK");
+        }
+        setStringParam(ADTimePixGateStatus, msg);
+        publishTofGateImages();
+    }
+}
+
+/** Drop the reference edges of the previous stream (prepareRawConsumers). */
+void ADTimePix::resetTofGateReferences() {
+    epicsMutexLock(gateMutex_);
+    gateRefs_.clear();
+    gateLastPublishTime_ = 0.0;
+    epicsMutexUnlock(gateMutex_);
+}
+
+/** Push the accumulated image of each gate to NDARRAY_ADDR_GATE0 + g (NDUInt32). */
+void ADTimePix::publishTofGateImages() {
+    if (!pNDArrayPool) return;
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+
+    epicsMutexLock(gateMutex_);
+    if (!gatedImages_) {
+        epicsMutexUnlock(gateMutex_);
+        return;
+    }
+    const size_t nGates = gatedImages_->get_gate_count();
+    size_t dims[3] = { gatedImages_->get_width(), gatedImages_->get_height(), 0 };
+    const size_t npix = gatedImages_->get_pixel_count();
+    epicsInt32 frames = static_cast<epicsInt32>(gatedImages_->get_frame_count());
+
+    for (size_t g = 0; g < nGates && g < static_cast<size_t>(TOF_GATE_MAX); ++g) {
+        const int addr = NDARRAY_ADDR_GATE0 + static_cast<int>(g);
+        setInteger64Param(static_cast<int>(g), ADTimePixGateTotalCounts,
+                          static_cast<epicsInt64>(gatedImages_->get_gate_counts(g)));
+        if (!arrayCallbacks) continue;
+        NDArray* pArr = pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+        if (!pArr || !pArr->pData) {
+            if (pArr) pArr->release();
+            ERR_ARGS("Failed to allocate gate %zu NDArray", g);
+            continue;
+        }
+        std::memcpy(pArr->pData, gatedImages_->get_gate_pixels(g), npix * sizeof(uint32_t));
+        epicsTimeGetCurrent(&pArr->epicsTS);
+        pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+        pArr->uniqueId = frames;
+        if (pArr->pAttributeList) {
+            getAttributes(pArr->pAttributeList);
+            const TofGate& gate = gatedImages_->get_gate(g);
+            epicsInt32 gateIndex = static_cast<epicsInt32>(g);
+            double startMs = gate.start_ms;
+            double stopMs = gate.stop_ms;
+            pArr->pAttributeList->add("GateIndex", "ToF gate index", NDAttrInt32, &gateIndex);
+            pArr->pAttributeList->add("GateStartMs", "ToF gate start (ms)", NDAttrFloat64, &startMs);
+            pArr->pAttributeList->add("GateStopMs", "ToF gate stop (ms)", NDAttrFloat64, &stopMs);
+            pArr->pAttributeList->add("GateFrames", "Frames accumulated", NDAttrInt32, &frames);
+        }
+        doCallbacksGenericPointer(pArr, NDArrayData, addr);
+        pArr->release();
+    }
+    epicsMutexUnlock(gateMutex_);
+
+    for (int g = 0; g < TOF_GATE_MAX; ++g) callParamCallbacks(g);
+}
@@ -0,0 +1,122 @@
+/*
+ * ADTimePix3 - Time-of-flight gated imaging helpers
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TOF_GATE_H
+#define TOF_GATE_H
+
+#include "tof_histogram.h"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/** Maximum number of simultaneous ToF gates (one NDArray address each). */
+constexpr int TOF_GATE_MAX = 4;
+
+/** TPX3_GATE_MODE values. */
+constexpr int TOF_GATE_MODE_OFF = 0;
+constexpr int TOF_GATE_MODE_IMG = 1;  // Serval Image[0] in "tof" mode (Img TCP channel)
+constexpr int TOF_GATE_MODE_RAW = 2;  // decoded Raw events (TPX3_RAW_DECODE)
+
+/** Default Serval tof pixel unit (TPX3_GATE_TOF_UNIT_NS): the pixel ToA LSB. */
+constexpr double TOF_GATE_FRAME_UNIT_NS = 1.5625;
+
+/**
+ * @brief One ToF window [start, stop) in ms and in TDC clock ticks
+ *
+ * Ticks use TPX3_TDC_CLOCK_PERIOD_SEC, the same clock as the PrvHst
+ * BinWidth/Offset and the PrvHst time axis.
+ */
+struct TofGate {
+    double start_ms = 0.0;
+    double stop_ms = 0.0;
+    uint64_t start_ticks = 0;
+    uint64_t stop_ticks = 0;
+};
+
+/**
+ * @brief Parse a gate list "start:stop,start:stop,..." (ms) into TofGate entries
+ *
+ * Whitespace is ignored. Each gate needs stop > start >= 0. At most TOF_GATE_MAX gates.
+ * @return true on success; on failure gates is left empty and err describes the problem
+ */
+bool parseTofGates(const std::string& spec, std::vector<TofGate>& gates, std::string& err);
+
+/** Convert ms to TDC clock ticks (rounded to nearest tick, clamped at 0). */
+uint64_t tofMsToTicks(double ms);
+
+/** Convert TDC clock ticks to ms. */
+double tofTicksToMs(uint64_t ticks);
+
+/**
+ * @brief Per-gate accumulated count images
+ *
+ * One 32-bit count image per gate, all the same size. Gates may overlap; a hit
+ * inside several windows counts in each of them.
+ */
+class GatedImageStack {
+public:
+    GatedImageStack() = default;
+    GatedImageStack(size_t width, size_t height, const std::vector<TofGate>& gates);
+
+    size_t get_width() const { return width_; }
+    size_t get_height() const { return height_; }
+    size_t get_pixel_count() const { return width_ * height_; }
+    size_t get_gate_count() const { return gates_.size(); }
+    const TofGate& get_gate(size_t g) const { return gates_[g]; }
+    uint64_t get_frame_count() const { return frame_count_; }
+    uint64_t get_gate_counts(size_t g) const { return gate_counts_[g]; }
+    const uint32_t* get_gate_pixels(size_t g) const { return images_[g].data(); }
+
+    /**
+     * @brief Set the ToF unit of frame pixel values, in TDC ticks
+     *
+     * Gate bounds are converted once here instead of once per pixel.
+     */
+    void set_frame_unit_ticks(double ticks_per_unit);
+    double get_frame_unit_ticks() const { return frame_unit_ticks_; }
+
+    /** Lowest frame value inside gate g (frame units). */
+    uint64_t get_frame_gate_start(size_t g) const { return frame_lo_[g]; }
+
+    /**
+     * @brief Add one Serval "tof" mode frame (pixel value = ToF in frame units, 0 = no hit)
+     * @return false if pixel_count does not match the stack size
+     */
+    bool add_tof_frame_16(const uint16_t* tof, size_t pixel_count);
+    bool add_tof_frame_32(const uint32_t* tof, size_t pixel_count);
+
+    /**
+     * @brief Add the hits of one decoded batch; ToF is taken against refs
+     *
+     * Hits without a preceding reference edge or outside the image are counted
+     * in no_reference / unmapped. One batch counts as one frame.
+     */
+    void add_events(const Tpx3HitBatch& hits, const TofReferenceEdges& refs,
+                    uint64_t& no_reference, uint64_t& unmapped);
+
+    /** Zero all images and counters; keeps size and gates. */
+    void reset();
+
+private:
+    template <typename T> void add_tof_frame(const T* tof, size_t pixel_count);
+
+    size_t width_ = 0;
+    size_t height_ = 0;
+    std::vector<TofGate> gates_;
+    std::vector<std::vector<uint32_t>> images_;
+    std::vector<uint64_t> gate_counts_;
+    std::vector<uint64_t> frame_lo_;   // gate bounds in frame units
+    std::vector<uint64_t> frame_hi_;
+    double frame_unit_ticks_ = 1.0;
+    uint64_t frame_count_ = 0;
+};
+
+#endif // TOF_GATE_H
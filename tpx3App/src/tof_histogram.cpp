@@ -0,0 +1,450 @@
+/*
+ * ADTimePix3 - TDC-referenced ToF histograms from decoded raw hits
+ *
+ * Fed from the Raw TCP decoder (TPX3_RAW_DECODE=1) when TPX3_RAWHST_ENABLE=1.
+ * Unlike Serval's PrvHst (bin width a multiple of the TDC clock, one global
+ * histogram) bins here are arbitrary linear or log, with one histogram per
+ * detector, chip or ROI. Spectra are published on TPX3_RAWHST_DATA (addr =
+ * group) and as an NDInt64 {bins, groups} array on addr 23, axis on addr 24.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tof_histogram.h"
+#include "histogram_io.h"
+#include "tof_gate.h"
+#include "ADTimePix.h"
+#include "ADTimePixLog.h"
+#include "ADTimePixTime.h"
+#include <NDAttribute.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+extern const char* driverName;
+
+namespace {
+
+/** Below this many hits per thread a batch is histogrammed on the calling thread. */
+constexpr size_t TOF_HIST_MIN_THREAD_HITS = 65536;
+
+}  // namespace
+
+bool parseTofRois(const std::string& spec, std::vector<TofRoi>& rois, std::string& err) {
+    rois.clear();
+    err.clear();
+    std::string s;
+    s.reserve(spec.size());
+    for (char c : spec) {
+        if (c != ' ' && c != '\t') s += c;
+    }
+    size_t start = 0;
+    while (start < s.size()) {
+        size_t end = s.find(';', start);
+        if (end == std::string::npos) end = s.size();
+        const std::string item = s.substr(start, end - start);
+        start = end + 1;
+        if (item.empty()) continue;
+        TofRoi roi;
+        if (std::sscanf(item.c_str(), "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) != 4) {
+            err = "Bad ROI '" + item + "' (x,y,w,h)";
+            rois.clear();
+            return false;
+        }
+        if (roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0) {
+            err = "ROI '" + item + "' needs x,y >= 0 and w,h > 0";
+            rois.clear();
+            return false;
+        }
+        if (static_cast<int>(rois.size()) >= TOF_HIST_MAX_GROUPS) {
+            err = "Too many ROIs (max " + std::to_string(TOF_HIST_MAX_GROUPS) + ")";
+            rois.clear();
+            return false;
+        }
+        rois.push_back(roi);
+    }
+    return true;
+}
+
+uint8_t tofReferenceEdgeMask(const std::string& tdcReference, int tdcChannel) {
+    // Serval lists one entry per chip; all chips share the TDC lines, use the first
+    std::string first = tdcReference.substr(0, tdcReference.find(','));
+    const bool rise = first.find('P') != std::string::npos;
+    const bool fall = first.find('N') != std::string::npos;
+    const uint8_t riseEdge = tdcChannel ? TPX3_TDC2_RISE : TPX3_TDC1_RISE;
+    const uint8_t fallEdge = tdcChannel ? TPX3_TDC2_FALL : TPX3_TDC1_FALL;
+    uint8_t mask = 0;
+    if (rise || !fall) mask |= static_cast<uint8_t>(1u << riseEdge);
+    if (fall) mask |= static_cast<uint8_t>(1u << fallEdge);
+    return mask;
+}
+
+size_t TofReferenceEdges::add(const Tpx3TdcBatch& tdcs) {
+    const size_t oldRefs = refs_.size();
+    for (size_t k = 0; k < tdcs.size(); ++k) {
+        if (edge_mask_ & (1u << tdcs.edge[k])) refs_.push_back(tdcs.time[k]);
+    }
+    const size_t added = refs_.size() - oldRefs;
+    if (added) {
+        std::sort(refs_.begin() + oldRefs, refs_.end());
+        std::inplace_merge(refs_.begin(), refs_.begin() + oldRefs, refs_.end());
+        if (refs_.size() > TOF_REFS_KEEP) {
+            refs_.erase(refs_.begin(), refs_.end() - TOF_REFS_KEEP);
+        }
+    }
+    return added;
+}
+
+// TofHistogrammer class implementation
+TofHistogrammer::TofHistogrammer(const TofHistConfig& config) : config_(config), refs_(config.edge_mask) {
+    config_.bins = std::max(config_.bins, 1);
+    config_.threads = std::min(std::max(config_.threads, 1), TOF_HIST_MAX_THREADS);
+    if (config_.log_bins && config_.min_ticks == 0) config_.min_ticks = 1;
+    if (config_.max_ticks <= config_.min_ticks) config_.max_ticks = config_.min_ticks + 1;
+
+    switch (config_.grouping) {
+        case TOF_HIST_GROUP_CHIP:
+            groups_ = std::min(std::max(config_.groups, 1), TOF_HIST_MAX_GROUPS);
+            break;
+        case TOF_HIST_GROUP_ROI:
+            groups_ = std::max(static_cast<int>(config_.rois.size()), 1);
+            break;
+        default:
+            groups_ = 1;
+            break;
+    }
+
+    if (config_.log_bins) {
+        bin_scale_ = config_.bins / std::log(static_cast<double>(config_.max_ticks) / config_.min_ticks);
+    } else {
+        bin_scale_ = static_cast<double>(config_.bins) / (config_.max_ticks - config_.min_ticks);
+    }
+
+    const size_t n = static_cast<size_t>(groups_) * config_.bins;
+    totals_.assign(n, 0);
+    workers_.resize(config_.threads);
+    for (Worker& w : workers_) w.hist.assign(n, 0);
+}
+
+int TofHistogrammer::bin_of(uint64_t tof) const {
+    if (tof < config_.min_ticks || tof >= config_.max_ticks) return -1;
+    double b;
+    if (config_.log_bins) {
+        b = std::log(static_cast<double>(tof) / config_.min_ticks) * bin_scale_;
+    } else {
+        b = static_cast<double>(tof - config_.min_ticks) * bin_scale_;
+    }
+    return std::min(static_cast<int>(b), config_.bins - 1);
+}
+
+void TofHistogrammer::fill(Worker& w, const Tpx3HitBatch& hits, size_t begin, size_t end) const {
+    const int bins = config_.bins;
+    const uint16_t totMax = config_.tot_max ? config_.tot_max : 0xFFFF;
+    uint64_t* hist = w.hist.data();
+    const size_t width = config_.image_width;
+
+    for (size_t i = begin; i < end; ++i) {
+        ++w.stats.hits;
+        const uint16_t tot = hits.tot[i];
+        if (tot < config_.tot_min || tot > totMax) {
+            ++w.stats.tot_rejected;
+            continue;
+        }
+        uint64_t tof = 0;
+        if (!refs_.tof_of(hits.toa[i], tof)) {
+            ++w.stats.no_reference;
+            continue;
+        }
+        const int bin = bin_of(tof);
+        if (bin < 0) {
+            ++w.stats.out_of_range;
+            continue;
+        }
+
+        if (config_.grouping == TOF_HIST_GROUP_DETECTOR) {
+            ++hist[bin];
+            ++w.stats.binned;
+        } else if (config_.grouping == TOF_HIST_GROUP_CHIP) {
+            const int g = hits.chip[i];
+            if (g >= groups_) {
+                ++w.stats.out_of_range;
+                continue;
+            }
+            ++hist[static_cast<size_t>(g) * bins + bin];
+            ++w.stats.binned;
+        } else {
+            const uint32_t pix = hits.pixel[i];
+            if (pix == TPX3_PIXEL_NONE || width == 0) {
+                ++w.stats.no_roi;
+                continue;
+            }
+            const int x = static_cast<int>(pix % width);
+            const int y = static_cast<int>(pix / width);
+            bool inRoi = false;
+            for (int g = 0; g < static_cast<int>(config_.rois.size()); ++g) {
+                const TofRoi& r = config_.rois[g];
+                if (x >= r.x && x < r.x + r.width && y >= r.y && y < r.y + r.height) {
+                    ++hist[static_cast<size_t>(g) * bins + bin];
+                    ++w.stats.binned;
+                    inRoi = true;
+                }
+            }
+            if (!inRoi) ++w.stats.no_roi;
+        }
+    }
+}
+
+void TofHistogrammer::add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    stats_.references += refs_.add(tdcs);
+
+    const size_t n = hits.size();
+    if (n == 0) return;
+    const size_t nThreads = std::max<size_t>(1, std::min<size_t>(workers_.size(), n / TOF_HIST_MIN_THREAD_HITS));
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads - 1);
+    for (size_t t = 1; t < nThreads; ++t) {
+        threads.emplace_back([this, &hits, t, n, nThreads]() {
+            fill(workers_[t], hits, n * t / nThreads, n * (t + 1) / nThreads);
+        });
+    }
+    fill(workers_[0], hits, 0, n / nThreads);
+    for (auto& th : threads) th.join();
+}
+
+void TofHistogrammer::merge() {
+    for (Worker& w : workers_) {
+        for (size_t i = 0; i < totals_.size(); ++i) totals_[i] += w.hist[i];
+        std::fill(w.hist.begin(), w.hist.end(), 0);
+        stats_.hits += w.stats.hits;
+        stats_.binned += w.stats.binned;
+        stats_.no_reference += w.stats.no_reference;
+        stats_.tot_rejected += w.stats.tot_rejected;
+        stats_.out_of_range += w.stats.out_of_range;
+        stats_.no_roi += w.stats.no_roi;
+        w.stats = TofHistStats();
+    }
+}
+
+void TofHistogrammer::reset() {
+    std::fill(totals_.begin(), totals_.end(), 0);
+    for (Worker& w : workers_) {
+        std::fill(w.hist.begin(), w.hist.end(), 0);
+        w.stats = TofHistStats();
+    }
+    stats_ = TofHistStats();
+}
+
+std::vector<double> TofHistogrammer::bin_centers_ms() const {
+    std::vector<double> centers(config_.bins);
+    const double lo = static_cast<double>(config_.min_ticks);
+    const double hi = static_cast<double>(config_.max_ticks);
+    for (int b = 0; b < config_.bins; ++b) {
+        double t;
+        if (config_.log_bins) {
+            t = lo * std::exp((b + 0.5) * std::log(hi / lo) / config_.bins);
+        } else {
+            t = lo + (b + 0.5) * (hi - lo) / config_.bins;
+        }
+        centers[b] = t * TPX3_TDC_CLOCK_PERIOD_SEC * 1e3;
+    }
+    return centers;
+}
+
+// -----------------------------------------------------------------------
+// ADTimePix glue: raw batches -> TofHistogrammer -> TPX3_RAWHST_* / addrs 23..24
+// -----------------------------------------------------------------------
+
+/** Mark the histogrammer for rebuild from TPX3_RAWHST_* (applied on the Raw worker thread). */
+void ADTimePix::invalidateRawHistogram() {
+    if (!rawHstMutex_) return;
+    epicsMutexLock(rawHstMutex_);
+    rawHstConfigDirty_ = true;
+    epicsMutexUnlock(rawHstMutex_);
+}
+
+/** Caller holds rawHstMutex_. Invalid settings leave no histogrammer and a status message. */
+void ADTimePix::rebuildRawHistogram() {
+    int binning = 0, bins = 1000, grouping = TOF_HIST_GROUP_DETECTOR, totMin = 0, totMax = 0;
+    int tdcChannel = 0, edgeSel = 0, threads = 1, numChips = 1;
+    double minMs = 0.0, maxMs = 1.0;
+    std::string roiSpec, tdcReference;
+    getIntegerParam(ADTimePixRawHstBinning, &binning);
+    getIntegerParam(ADTimePixRawHstBins, &bins);
+    getIntegerParam(ADTimePixRawHstGrouping, &grouping);
+    getIntegerParam(ADTimePixRawHstTotMin, &totMin);
+    getIntegerParam(ADTimePixRawHstTotMax, &totMax);
+    getIntegerParam(ADTimePixRawHstTdc, &tdcChannel);
+    getIntegerParam(ADTimePixRawHstEdge, &edgeSel);
+    getIntegerParam(ADTimePixRawHstThreads, &threads);
+    getIntegerParam(ADTimePixNumberOfChips, &numChips);
+    getDoubleParam(ADTimePixRawHstMinMs, &minMs);
+    getDoubleParam(ADTimePixRawHstMaxMs, &maxMs);
+    getStringParam(ADTimePixRawHstRois, roiSpec);
+    getStringParam(ADTimePixTofTdcReference, tdcReference);
+
+    rawHst_.reset();
+    rawHstConfigDirty_ = false;
+    rawHstLastPublishTime_ = 0.0;
+
+    TofHistConfig cfg;
+    cfg.log_bins = (binning == 1);
+    cfg.min_ticks = tofMsToTicks(minMs);
+    cfg.max_ticks = tofMsToTicks(maxMs);
+    cfg.bins = std::min(std::max(bins, 1), TOF_HIST_MAX_BINS);
+    cfg.grouping = (grouping == TOF_HIST_GROUP_CHIP || grouping == TOF_HIST_GROUP_ROI)
+                       ? static_cast<TofHistGrouping>(grouping) : TOF_HIST_GROUP_DETECTOR;
+    cfg.groups = numChips;
+    cfg.tot_min = static_cast<uint16_t>(std::min(std::max(totMin, 0), 1023));
+    cfg.tot_max = static_cast<uint16_t>(std::min(std::max(totMax, 0), 1023));
+    cfg.threads = threads;
+    const uint8_t riseEdge = tdcChannel ? TPX3_TDC2_RISE : TPX3_TDC1_RISE;
+    const uint8_t fallEdge = tdcChannel ? TPX3_TDC2_FALL : TPX3_TDC1_FALL;
+    switch (edgeSel) {
+        case 1: cfg.edge_mask = static_cast<uint8_t>(1u << riseEdge); break;
+        case 2: cfg.edge_mask = static_cast<uint8_t>(1u << fallEdge); break;
+        case 3: cfg.edge_mask = static_cast<uint8_t>((1u << riseEdge) | (1u << fallEdge)); break;
+        default: cfg.edge_mask = tofReferenceEdgeMask(tdcReference, tdcChannel); break;
+    }
+    epicsMutexLock(rawMutex_);
+    cfg.image_width = static_cast<size_t>(rawImageWidth_);
+    epicsMutexUnlock(rawMutex_);
+
+    if (!(maxMs > minMs) || (cfg.log_bins && !(minMs > 0.0))) {
+        setStringParam(ADTimePixRawHstStatus, cfg.log_bins ? "Log bins need 0 < Min < Max" : "Need Min < Max");
+        return;
+    }
+    if (cfg.grouping == TOF_HIST_GROUP_ROI) {
+        std::string err;
+        if (!parseTofRois(roiSpec, cfg.rois, err) || cfg.rois.empty()) {
+            setStringParam(ADTimePixRawHstStatus, err.empty() ? "No ROIs" : err.c_str());
+            return;
+        }
+    }
+
+    rawHst_.reset(new TofHistogrammer(cfg));
+    char msg[80];
+    epicsSnprintf(msg, sizeof(msg), "OK: %d x %d bins", rawHst_->get_groups(), rawHst_->get_bins());
+    setStringParam(ADTimePixRawHstStatus, msg);
+    setIntegerParam(ADTimePixRawHstGroups, rawHst_->get_groups());
+
+    std::vector<double> axis = rawHst_->bin_centers_ms();
+    doCallbacksFloat64Array(axis.data(), axis.size(), ADTimePixRawHstTimeMs, 0);
+}
+
+/** Merge per-thread histograms and push spectra, counters and NDArrays. Caller holds rawHstMutex_. */
+void ADTimePix::publishRawHistogram() {
+    rawHst_->merge();
+    const int groups = rawHst_->get_groups();
+    const int bins = rawHst_->get_bins();
+    const std::vector<uint64_t>& totals = rawHst_->totals();
+    const TofHistStats& st = rawHst_->stats();
+
+    rawHstPublishBuffer_.resize(totals.size());
+    for (size_t i = 0; i < totals.size(); ++i) rawHstPublishBuffer_[i] = static_cast<epicsInt64>(totals[i]);
+    for (int g = 0; g < groups; ++g) {
+        const epicsInt64* spectrum = rawHstPublishBuffer_.data() + static_cast<size_t>(g) * bins;
+        epicsInt64 sum = 0;
+        for (int b = 0; b < bins; ++b) sum += spectrum[b];
+        setInteger64Param(g, ADTimePixRawHstCounts, sum);
+        doCallbacksInt64Array(const_cast<epicsInt64*>(spectrum), bins, ADTimePixRawHstData, g);
+        callParamCallbacks(g);
+    }
+    setInteger64Param(ADTimePixRawHstHits, static_cast<epicsInt64>(st.hits));
+    setInteger64Param(ADTimePixRawHstNoReference, static_cast<epicsInt64>(st.no_reference));
+    setInteger64Param(ADTimePixRawHstTotRejected, static_cast<epicsInt64>(st.tot_rejected));
+    setInteger64Param(ADTimePixRawHstOutOfRange, static_cast<epicsInt64>(st.out_of_range));
+    setInteger64Param(ADTimePixRawHstNoRoi, static_cast<epicsInt64>(st.no_roi));
+    setInteger64Param(ADTimePixRawHstReferences, static_cast<epicsInt64>(st.references));
+
+    int arrayCallbacks = 0;
+    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+    if (!arrayCallbacks || !pNDArrayPool) return;
+
+    const TofHistConfig& cfg = rawHst_->config();
+    epicsInt32 logBins = cfg.log_bins ? 1 : 0;
+    double minMs = tofTicksToMs(cfg.min_ticks);
+    double maxMs = tofTicksToMs(cfg.max_ticks);
+    epicsInt32 grouping = static_cast<epicsInt32>(cfg.grouping);
+
+    size_t dims[2] = { static_cast<size_t>(bins), static_cast<size_t>(groups) };
+    NDArray* pArr = pNDArrayPool->alloc(2, dims, NDInt64, 0, NULL);
+    if (!pArr || !pArr->pData) {
+        if (pArr) pArr->release();
+        ERR("Failed to allocate Raw ToF histogram NDArray");
+        return;
+    }
+    std::memcpy(pArr->pData, rawHstPublishBuffer_.data(), rawHstPublishBuffer_.size() * sizeof(epicsInt64));
+    epicsTimeGetCurrent(&pArr->epicsTS);
+    pArr->timeStamp = pArr->epicsTS.secPastEpoch + pArr->epicsTS.nsec / 1.e9;
+    if (pArr->pAttributeList) {
+        getAttributes(pArr->pAttributeList);
+        pArr->pAttributeList->add("LogBins", "1 = logarithmic bins", NDAttrInt32, &logBins);
+        pArr->pAttributeList->add("TofMinMs", "First bin edge (ms)", NDAttrFloat64, &minMs);
+        pArr->pAttributeList->add("TofMaxMs", "Last bin edge (ms)", NDAttrFloat64, &maxMs);
+        pArr->pAttributeList->add("Grouping", "0=detector, 1=chip, 2=ROI", NDAttrInt32, &grouping);
+    }
+    doCallbacksGenericPointer(pArr, NDArrayData, NDARRAY_ADDR_RAWHST);
+    pArr->release();
+
+    std::vector<double> axis = rawHst_->bin_centers_ms();
+    size_t axisDims[1] = { axis.size() };
+    NDArray* pAxis = pNDArrayPool->alloc(1, axisDims, NDFloat64, 0, NULL);
+    if (!pAxis || !pAxis->pData) {
+        if (pAxis) pAxis->release();
+        ERR("Failed to allocate Raw ToF axis NDArray");
+        return;
+    }
+    std::memcpy(pAxis->pData, axis.data(), axis.size() * sizeof(double));
+    pAxis->epicsTS = pArr->epicsTS;
+    pAxis->timeStamp = pAxis->epicsTS.secPastEpoch + pAxis->epicsTS.nsec / 1.e9;
+    doCallbacksGenericPointer(pAxis, NDArrayData, NDARRAY_ADDR_RAWHST_AXIS);
+    pAxis->release();
+}
+
+/** Raw worker hook: histogram one decoded batch. */
+void ADTimePix::processRawHistogramBatch(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs) {
+    int enable = 0;
+    getIntegerParam(ADTimePixRawHstEnable, &enable);
+    if (!enable) return;
+
+    epicsMutexLock(rawHstMutex_);
+    if (rawHstConfigDirty_) rebuildRawHistogram();
+    if (rawHst_) {
+        rawHst_->add(hits, tdcs);
+        double period = 1.0;
+        getDoubleParam(ADTimePixRawHstPublishPeriod, &period);
+        const double now = nowSeconds();
+        if (now - rawHstLastPublishTime_ >= std::max(period, 0.05)) {
+            rawHstLastPublishTime_ = now;
+            publishRawHistogram();
+            callParamCallbacks();
+        }
+    }
+    epicsMutexUnlock(rawHstMutex_);
+}
+
+/** TPX3_RAWHST_RESET: zero histograms and counters. */
+void ADTimePix::resetRawHistogram() {
+    if (!rawHstMutex_) return;
+    epicsMutexLock(rawHstMutex_);
+    if (rawHst_) {
+        rawHst_->reset();
+        publishRawHistogram();
+    }
+    epicsMutexUnlock(rawHstMutex_);
+}
+
+/** Final publish at end of acquisition. */
+void ADTimePix::flushRawHistogram() {
+    if (!rawHstMutex_) return;
+    epicsMutexLock(rawHstMutex_);
+    if (rawHst_) publishRawHistogram();
+    epicsMutexUnlock(rawHstMutex_);
+    callParamCallbacks();
+}
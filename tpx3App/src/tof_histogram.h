@@ -0,0 +1,172 @@
+/*
+ * ADTimePix3 - TDC-referenced ToF histograms from decoded raw hits
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TOF_HISTOGRAM_H
+#define TOF_HISTOGRAM_H
+
+#include "tpx3_raw.h"
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/** Maximum histogram groups (chips or ROIs); one asyn address each. */
+constexpr int TOF_HIST_MAX_GROUPS = 8;
+/** Maximum bins per histogram (TPX3_RAWHST_DATA waveform NELM). */
+constexpr int TOF_HIST_MAX_BINS = 100000;
+/** Maximum worker threads with private histograms. */
+constexpr int TOF_HIST_MAX_THREADS = 16;
+
+/** TPX3_RAWHST_GROUPING values. */
+enum TofHistGrouping {
+    TOF_HIST_GROUP_DETECTOR = 0,
+    TOF_HIST_GROUP_CHIP = 1,
+    TOF_HIST_GROUP_ROI = 2
+};
+
+/** Rectangular ROI in image pixels. */
+struct TofRoi {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+/**
+ * @brief Parse an ROI list "x,y,w,h;x,y,w,h;..." (image pixels)
+ *
+ * Whitespace is ignored; w and h must be positive. At most TOF_HIST_MAX_GROUPS.
+ * @return true on success; on failure rois is left empty and err describes the problem
+ */
+bool parseTofRois(const std::string& spec, std::vector<TofRoi>& rois, std::string& err);
+
+/**
+ * @brief Reference edges from a Serval TimeOfFlight.TdcReference entry
+ *
+ * 'P' selects the rising and 'N' the falling edge of the given TDC channel
+ * (0 = TDC1, 1 = TDC2); an entry with neither letter selects the rising edge.
+ * @return bit mask over Tpx3TdcEdge values
+ */
+uint8_t tofReferenceEdgeMask(const std::string& tdcReference, int tdcChannel);
+
+/**
+ * @brief Recent reference TDC edges of a decoded stream
+ *
+ * ToF of a hit is its ToA minus the latest kept edge at or before it. The
+ * last TOF_REFS_KEEP edges are kept, so hits that arrive late relative to the
+ * TDC stream still find their edge.
+ */
+class TofReferenceEdges {
+public:
+    static constexpr size_t TOF_REFS_KEEP = 4096;
+
+    explicit TofReferenceEdges(uint8_t edge_mask = 1u << TPX3_TDC1_RISE) : edge_mask_(edge_mask) {}
+
+    /** Edges other than edge_mask are ignored from the next add() on. */
+    void set_edge_mask(uint8_t edge_mask) { edge_mask_ = edge_mask; }
+    uint8_t edge_mask() const { return edge_mask_; }
+
+    /** Keep the selected edges of a batch; returns how many were added. */
+    size_t add(const Tpx3TdcBatch& tdcs);
+
+    /** ToF of a hit at toa; false when no edge precedes it. */
+    bool tof_of(uint64_t toa, uint64_t& tof) const {
+        const uint64_t* it = std::upper_bound(refs_.data(), refs_.data() + refs_.size(), toa);
+        if (it == refs_.data()) return false;
+        tof = toa - *(it - 1);
+        return true;
+    }
+
+    void clear() { refs_.clear(); }
+
+private:
+    uint8_t edge_mask_;
+    std::vector<uint64_t> refs_;     // sorted
+};
+
+/** @brief Histogram configuration; times in TDC ticks. */
+struct TofHistConfig {
+    bool log_bins = false;
+    uint64_t min_ticks = 0;
+    uint64_t max_ticks = 0;
+    int bins = 1000;
+    TofHistGrouping grouping = TOF_HIST_GROUP_DETECTOR;
+    int groups = 1;                 // chips for TOF_HIST_GROUP_CHIP
+    std::vector<TofRoi> rois;       // TOF_HIST_GROUP_ROI
+    size_t image_width = 0;         // to locate hits in ROIs
+    uint16_t tot_min = 0;
+    uint16_t tot_max = 0;           // 0 = no upper limit
+    uint8_t edge_mask = 1u << TPX3_TDC1_RISE;
+    int threads = 1;
+};
+
+/** @brief Counters since reset(). */
+struct TofHistStats {
+    uint64_t hits = 0;
+    uint64_t binned = 0;            // hit-group entries added to a bin
+    uint64_t no_reference = 0;      // hit before the first reference edge
+    uint64_t tot_rejected = 0;
+    uint64_t out_of_range = 0;      // ToF outside [min, max)
+    uint64_t no_roi = 0;            // ROI grouping: unmapped or outside every ROI
+    uint64_t references = 0;
+};
+
+/**
+ * @brief ToF histogrammer over decoded hit and TDC batches
+ *
+ * ToF of a hit is its ToA minus the latest reference TDC edge at or before it.
+ * Bins are linear or logarithmic between min and max. Hits of a batch are
+ * split across threads; each thread fills a private histogram, and private
+ * histograms are folded into the totals by merge() (publish time), so the hot
+ * loop has no atomics or shared writes.
+ */
+class TofHistogrammer {
+public:
+    explicit TofHistogrammer(const TofHistConfig& config);
+
+    /** Add a batch: reference edges first, then hits. */
+    void add(const Tpx3HitBatch& hits, const Tpx3TdcBatch& tdcs);
+
+    /** Fold private histograms into totals(). */
+    void merge();
+
+    /** Zero histograms and counters; reference edges are kept. */
+    void reset();
+
+    const TofHistConfig& config() const { return config_; }
+    int get_groups() const { return groups_; }
+    int get_bins() const { return config_.bins; }
+    /** Merged histograms, group-major (groups x bins). */
+    const std::vector<uint64_t>& totals() const { return totals_; }
+    /** Merged counters. */
+    const TofHistStats& stats() const { return stats_; }
+    /** Bin centres in ms. */
+    std::vector<double> bin_centers_ms() const;
+
+private:
+    struct Worker {
+        std::vector<uint64_t> hist;
+        TofHistStats stats;
+    };
+
+    void fill(Worker& w, const Tpx3HitBatch& hits, size_t begin, size_t end) const;
+    int bin_of(uint64_t tof) const;
+
+    TofHistConfig config_;
+    int groups_;
+    double bin_scale_;               // bins per tick (linear) or per ln unit (log)
+    TofReferenceEdges refs_;
+    std::vector<Worker> workers_;
+    std::vector<uint64_t> totals_;
+    TofHistStats stats_;
+};
+
+#endif // TOF_HISTOGRAM_H
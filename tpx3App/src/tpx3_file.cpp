@@ -0,0 +1,446 @@
+/*
+ * ADTimePix3 - Memory-mapped .tpx3 file reader with a sidecar time index
+ *
+ * Used by the IOC file replay (raw_replay.cpp, TPX3_REPLAY_*) and by the
+ * standalone tpx3file tool. Has no EPICS dependencies.
+ *
+ * Sidecar layout (<file>.tidx, little endian): a 128-byte header (magic
+ * "TPX3TIDX", version, entry size, indexed file size and mtime, block size,
+ * entry count, Tpx3IndexSummary) followed by the Tpx3IndexEntry array.
+ *
+ * tpx3ArchiveUnpack() reads the .tpx3z archives written by RawArchiver back
+ * into a plain .tpx3 stream (see Tpx3ArchiveFrame).
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tpx3_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+const char INDEX_MAGIC[8] = { 'T', 'P', 'X', '3', 'T', 'I', 'D', 'X' };
+constexpr uint32_t INDEX_VERSION = 1;
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t block_bytes;
+    uint64_t entries;
+    Tpx3IndexSummary summary;
+    uint8_t reserved[128 - 48 - sizeof(Tpx3IndexSummary)];
+};
+static_assert(sizeof(IndexHeader) == 128, "index header layout");
+static_assert(sizeof(Tpx3IndexEntry) == 48, "index entry layout");
+
+inline bool isChunkHeader(const uint8_t* p) {
+    return p[0] == 'T' && p[1] == 'P' && p[2] == 'X' && p[3] == '3';
+}
+
+inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/** TDC packet sub-types the decoder turns into events (rising / falling edge of TDC1 / TDC2). */
+inline bool isTdcEdge(uint64_t pkt) {
+    const unsigned sub = static_cast<unsigned>((pkt >> 56) & 0xF);
+    return sub == 0xF || sub == 0xA || sub == 0xE || sub == 0xB;
+}
+
+/** Pixel ToA and TDC time on one timeline, each extended to the period closest to the newest time. */
+struct Timeline {
+    bool started = false;
+    uint64_t newest = 0;
+    uint64_t pixel_base = 0;
+    uint64_t tdc_base = 0;
+
+    uint64_t extend(uint64_t t, uint64_t period, uint64_t& base) {
+        if (!started) {
+            newest = t;
+            pixel_base = t - t % TPX3_PIXEL_TOA_PERIOD_TICKS;
+            tdc_base = t - t % TPX3_TDC_TIME_PERIOD_TICKS;
+            started = true;
+        }
+        const uint64_t half = period / 2;
+        uint64_t u = base + t;
+        if (u + half < newest) {
+            u += period;
+        } else if (u > newest + half && u >= period) {
+            u -= period;
+        }
+        if (u > newest) {
+            newest = u;
+            while (newest >= pixel_base + TPX3_PIXEL_TOA_PERIOD_TICKS) pixel_base += TPX3_PIXEL_TOA_PERIOD_TICKS;
+            while (newest >= tdc_base + TPX3_TDC_TIME_PERIOD_TICKS) tdc_base += TPX3_TDC_TIME_PERIOD_TICKS;
+        }
+        return u;
+    }
+};
+
+/** Extend a wrapped time to the period instance closest to ref. */
+inline uint64_t extendNear(uint64_t t, uint64_t period, uint64_t ref) {
+    const uint64_t half = period / 2;
+    uint64_t u = ref - ref % period + t;
+    if (u + half < ref) {
+        u += period;
+    } else if (u > ref + half && u >= period) {
+        u -= period;
+    }
+    return u;
+}
+
+}  // namespace
+
+Tpx3FileReader::~Tpx3FileReader() {
+    close();
+}
+
+bool Tpx3FileReader::open(const std::string& path, std::string& err) {
+    close();
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err = "Cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        err = path + ": empty or unreadable";
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        err = "Cannot map " + path + ": " + strerror(errno);
+        return false;
+    }
+    path_ = path;
+    data_ = static_cast<const uint8_t*>(p);
+    size_ = static_cast<uint64_t>(st.st_size);
+    mtime_ = static_cast<int64_t>(st.st_mtime);
+    return true;
+}
+
+void Tpx3FileReader::close() {
+    if (data_) munmap(const_cast<uint8_t*>(data_), static_cast<size_t>(size_));
+    data_ = nullptr;
+    size_ = 0;
+    mtime_ = 0;
+    index_.clear();
+    summary_ = Tpx3IndexSummary();
+}
+
+bool Tpx3FileReader::load_or_build_index(bool rebuild, std::string& err, size_t block_bytes) {
+    from_sidecar_ = false;
+    written_ = false;
+    if (!data_) {
+        err = "No file open";
+        return false;
+    }
+    const std::string sidecar = path_ + TPX3_INDEX_SUFFIX;
+    if (!rebuild && read_sidecar(sidecar)) {
+        from_sidecar_ = true;
+        return true;
+    }
+    build_index(std::max<size_t>(block_bytes, 64 * 1024));
+    if (index_.empty()) {
+        err = path_ + ": no TPX3 chunks";
+        return false;
+    }
+    written_ = write_sidecar(sidecar);
+    return true;
+}
+
+bool Tpx3FileReader::read_sidecar(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+    IndexHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+              std::memcmp(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+              h.version == INDEX_VERSION && h.entry_size == sizeof(Tpx3IndexEntry) &&
+              h.file_size == size_ && h.file_mtime == mtime_ && h.entries > 0 &&
+              h.entries <= size_ / 8;
+    std::vector<Tpx3IndexEntry> entries;
+    if (ok) {
+        entries.resize(static_cast<size_t>(h.entries));
+        ok = fread(entries.data(), sizeof(Tpx3IndexEntry), entries.size(), f) == entries.size();
+    }
+    fclose(f);
+    if (!ok) return false;
+    index_.swap(entries);
+    summary_ = h.summary;
+    return true;
+}
+
+bool Tpx3FileReader::write_sidecar(const std::string& path) const {
+    IndexHeader h = IndexHeader();
+    std::memcpy(h.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    h.version = INDEX_VERSION;
+    h.entry_size = sizeof(Tpx3IndexEntry);
+    h.file_size = size_;
+    h.file_mtime = mtime_;
+    h.block_bytes = index_.empty() ? 0 : index_.front().bytes;
+    h.entries = index_.size();
+    h.summary = summary_;
+    const std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(index_.data(), sizeof(Tpx3IndexEntry), index_.size(), f) == index_.size();
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) remove(tmp.c_str());
+    return ok;
+}
+
+/** One sequential pass: chunk headers give the block boundaries, packet times their range. */
+void Tpx3FileReader::build_index(size_t block_bytes) {
+    index_.clear();
+    summary_ = Tpx3IndexSummary();
+    madvise(const_cast<uint8_t*>(data_), static_cast<size_t>(size_), MADV_SEQUENTIAL);
+
+    Timeline timeline;
+    Tpx3IndexEntry cur = { 0, 0, UINT64_MAX, 0, 0, 0 };
+    uint64_t lastMax = 0;
+    auto closeBlock = [&]() {
+        if (cur.bytes == 0) return;
+        if (cur.t_min == UINT64_MAX) {
+            cur.t_min = lastMax;
+            cur.t_max = lastMax;
+        }
+        lastMax = std::max(lastMax, cur.t_max);
+        index_.push_back(cur);
+    };
+
+    uint64_t pos = 0;
+    while (pos + 8 <= size_) {
+        if (!isChunkHeader(data_ + pos)) {
+            // Lost framing: skip to the next "TPX3"; the skipped bytes stay in the current block
+            const void* next = memmem(data_ + pos + 1, static_cast<size_t>(size_ - pos - 1), "TPX3", 4);
+            const uint64_t to = next ? static_cast<uint64_t>(static_cast<const uint8_t*>(next) - data_) : size_;
+            ++summary_.framing_errors;
+            cur.bytes += to - pos;
+            pos = to;
+            continue;
+        }
+        if (cur.bytes >= block_bytes) {
+            closeBlock();
+            cur = { pos, 0, UINT64_MAX, 0, 0, 0 };
+        }
+        const uint8_t* h = data_ + pos;
+        const uint64_t chunk = (static_cast<uint64_t>(h[6]) | (static_cast<uint64_t>(h[7]) << 8)) & ~uint64_t(7);
+        const uint64_t avail = std::min(chunk, size_ - pos - 8);
+        const uint8_t* w = h + 8;
+        const size_t n = static_cast<size_t>(avail / 8);
+        uint64_t tMin = cur.t_min, tMax = cur.t_max, hits = 0, tdcs = 0;
+        for (size_t i = 0; i < n; ++i) {
+            const uint64_t pkt = load64(w + i * 8);
+            const unsigned type = static_cast<unsigned>(pkt >> 60);
+            uint64_t u;
+            if (type == 0xB) {
+                u = timeline.extend(Tpx3RawDecoder::pixel_toa_ticks(pkt), TPX3_PIXEL_TOA_PERIOD_TICKS, timeline.pixel_base);
+                ++hits;
+            } else if (type == 0x6 && isTdcEdge(pkt)) {
+                u = timeline.extend(Tpx3RawDecoder::tdc_time_ticks(pkt), TPX3_TDC_TIME_PERIOD_TICKS, timeline.tdc_base);
+                ++tdcs;
+            } else {
+                continue;
+            }
+            tMin = std::min(tMin, u);
+            tMax = std::max(tMax, u);
+        }
+        cur.t_min = tMin;
+        cur.t_max = tMax;
+        cur.hits += hits;
+        cur.tdcs += tdcs;
+        cur.bytes += 8 + avail;
+        pos += 8 + avail;
+        ++summary_.chunks;
+    }
+    if (pos < size_) cur.bytes += size_ - pos;
+    closeBlock();
+
+    summary_.t_first = UINT64_MAX;
+    for (const Tpx3IndexEntry& e : index_) {
+        summary_.t_first = std::min(summary_.t_first, e.t_min);
+        summary_.t_last = std::max(summary_.t_last, e.t_max);
+        summary_.hits += e.hits;
+        summary_.tdcs += e.tdcs;
+    }
+    if (index_.empty()) summary_.t_first = 0;
+    madvise(const_cast<uint8_t*>(data_), static_cast<size_t>(size_), MADV_RANDOM);
+}
+
+/** Decode one block and keep the hits / TDCs inside [t0, t1). */
+void Tpx3FileReader::decode_block(const Tpx3IndexEntry& entry, uint64_t t0, uint64_t t1,
+                                  Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs) const {
+    Tpx3RawDecoder decoder;
+    decoder.set_pixel_lut(lut_, lut_entries_);
+    decoder.feed(data_ + entry.offset, static_cast<size_t>(entry.bytes));
+    hits.clear();
+    tdcs.clear();
+    std::swap(hits, decoder.hits());
+    std::swap(tdcs, decoder.tdcs());
+    if (entry.t_min >= t0 && entry.t_max < t1) return;  // whole block inside
+
+    const uint64_t ref = entry.t_min + (entry.t_max - entry.t_min) / 2;
+    size_t out = 0;
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const uint64_t u = extendNear(hits.toa[i], TPX3_PIXEL_TOA_PERIOD_TICKS, ref);
+        if (u < t0 || u >= t1) continue;
+        if (out != i) {
+            hits.pixel[out] = hits.pixel[i];
+            hits.toa[out] = hits.toa[i];
+            hits.tot[out] = hits.tot[i];
+            hits.x[out] = hits.x[i];
+            hits.y[out] = hits.y[i];
+            hits.chip[out] = hits.chip[i];
+        }
+        ++out;
+    }
+    hits.pixel.resize(out);
+    hits.toa.resize(out);
+    hits.tot.resize(out);
+    hits.x.resize(out);
+    hits.y.resize(out);
+    hits.chip.resize(out);
+    out = 0;
+    for (size_t i = 0; i < tdcs.size(); ++i) {
+        const uint64_t u = extendNear(tdcs.time[i], TPX3_TDC_TIME_PERIOD_TICKS, ref);
+        if (u < t0 || u >= t1) continue;
+        if (out != i) {
+            tdcs.time[out] = tdcs.time[i];
+            tdcs.trigger[out] = tdcs.trigger[i];
+            tdcs.edge[out] = tdcs.edge[i];
+            tdcs.chip[out] = tdcs.chip[i];
+        }
+        ++out;
+    }
+    tdcs.time.resize(out);
+    tdcs.trigger.resize(out);
+    tdcs.edge.resize(out);
+    tdcs.chip.resize(out);
+}
+
+Tpx3RangeStats Tpx3FileReader::read_range(uint64_t t0, uint64_t t1, int threads, const BatchCallback& callback) {
+    Tpx3RangeStats stats;
+    if (!data_ || index_.empty()) return stats;
+    if (t1 == 0) t1 = UINT64_MAX;
+
+    std::vector<size_t> blocks;
+    for (size_t k = 0; k < index_.size(); ++k) {
+        const Tpx3IndexEntry& e = index_[k];
+        if (e.t_max >= t0 && e.t_min < t1) blocks.push_back(k);
+    }
+    const size_t nThreads = static_cast<size_t>(std::min(std::max(threads, 1), 64));
+    const size_t wave = nThreads * 2;
+    std::vector<Tpx3HitBatch> hits(wave);
+    std::vector<Tpx3TdcBatch> tdcs(wave);
+
+    for (size_t first = 0; first < blocks.size(); first += wave) {
+        const size_t count = std::min(wave, blocks.size() - first);
+        for (size_t j = 0; j < count; ++j) {
+            const Tpx3IndexEntry& e = index_[blocks[first + j]];
+            madvise(const_cast<uint8_t*>(data_ + (e.offset & ~uint64_t(4095))),
+                    static_cast<size_t>(e.bytes + (e.offset & 4095)), MADV_WILLNEED);
+        }
+        auto work = [&](size_t t) {
+            for (size_t j = t; j < count; j += nThreads) {
+                decode_block(index_[blocks[first + j]], t0, t1, hits[j], tdcs[j]);
+            }
+        };
+        if (nThreads == 1 || count == 1) {
+            work(0);
+        } else {
+            std::vector<std::thread> pool;
+            for (size_t t = 1; t < std::min(nThreads, count); ++t) pool.emplace_back(work, t);
+            work(0);
+            for (std::thread& th : pool) th.join();
+        }
+        for (size_t j = 0; j < count; ++j) {
+            ++stats.blocks;
+            stats.bytes += index_[blocks[first + j]].bytes;
+            stats.hits += hits[j].size();
+            stats.tdcs += tdcs[j].size();
+            if (!callback(hits[j], tdcs[j])) return stats;
+        }
+    }
+    return stats;
+}
+
+bool tpx3ArchiveUnpack(const std::string& path, FILE* out, uint64_t& raw_bytes, std::string& err) {
+    raw_bytes = 0;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        err = "Cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    Tpx3ArchiveHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && std::memcmp(h.magic, "TPX3ZARC", 8) == 0 &&
+              fseek(f, static_cast<long>(TPX3_ARCHIVE_HEADER_BYTES), SEEK_SET) == 0;
+    if (!ok) err = path + ": not a .tpx3z archive";
+
+    std::vector<uint8_t> stored, raw;
+    Tpx3ArchiveFrame fr;
+    while (ok && fread(&fr, sizeof(fr), 1, f) == 1) {
+        if (std::memcmp(fr.magic, "TZFR", 4) != 0) {
+            err = path + ": bad frame header";
+            ok = false;
+            break;
+        }
+        stored.resize(fr.stored_bytes);
+        raw.resize(fr.raw_bytes);
+        if (fread(stored.data(), 1, stored.size(), f) != stored.size()) {
+            err = path + ": truncated frame";
+            ok = false;
+            break;
+        }
+        if (fr.flags & TPX3_ARCHIVE_FRAME_ZLIB) {
+            uLongf len = static_cast<uLongf>(raw.size());
+            if (uncompress(raw.data(), &len, stored.data(), static_cast<uLong>(stored.size())) != Z_OK ||
+                len != raw.size()) {
+                err = path + ": zlib error";
+                ok = false;
+                break;
+            }
+        } else if (stored.size() == raw.size()) {
+            raw.swap(stored);
+        } else {
+            err = path + ": bad stored frame";
+            ok = false;
+            break;
+        }
+        if (crc32(0L, raw.data(), static_cast<uInt>(raw.size())) != fr.crc) {
+            err = path + ": CRC mismatch";
+            ok = false;
+            break;
+        }
+        if (fwrite(raw.data(), 1, raw.size(), out) != raw.size()) {
+            err = std::string("Write error: ") + strerror(errno);
+            ok = false;
+            break;
+        }
+        raw_bytes += raw.size();
+    }
+    fclose(f);
+    return ok;
+}
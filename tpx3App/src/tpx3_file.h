@@ -0,0 +1,186 @@
+/*
+ * ADTimePix3 - Memory-mapped .tpx3 file reader with a sidecar time index
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TPX3_FILE_H
+#define TPX3_FILE_H
+
+#include "tpx3_raw.h"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/** TDC ticks per millisecond (tick = 1.5625 / 6 ns). */
+constexpr double TPX3_TICKS_PER_MS = 1e-3 / (1.5625e-9 / 6.0);
+/** Default index block: chunk-aligned runs of about this many bytes. */
+constexpr size_t TPX3_INDEX_BLOCK_BYTES = 4 * 1024 * 1024;
+/** Sidecar index file suffix (<file>.tpx3 -> <file>.tpx3.tidx). */
+constexpr const char* TPX3_INDEX_SUFFIX = ".tidx";
+
+/**
+ * @brief One index block: a chunk-aligned byte range and the times inside it
+ *
+ * Times are on one extended timeline (pixel ToA and TDC time unwrapped against
+ * the newest time seen, as in Tpx3HitSorter); a block without any timed packet
+ * takes the range of the block before it.
+ */
+struct Tpx3IndexEntry {
+    uint64_t offset;
+    uint64_t bytes;
+    uint64_t t_min;
+    uint64_t t_max;
+    uint64_t hits;
+    uint64_t tdcs;
+};
+
+/** @brief Totals of the indexed file. */
+struct Tpx3IndexSummary {
+    uint64_t t_first = 0;              // earliest extended time
+    uint64_t t_last = 0;
+    uint64_t hits = 0;
+    uint64_t tdcs = 0;
+    uint64_t chunks = 0;
+    uint64_t framing_errors = 0;       // bytes skipped to find the next "TPX3" header
+};
+
+/** @brief Result of one read_range(). */
+struct Tpx3RangeStats {
+    size_t blocks = 0;                 // index blocks decoded
+    uint64_t bytes = 0;
+    uint64_t hits = 0;                 // hits inside the range, passed to the callback
+    uint64_t tdcs = 0;
+};
+
+/**
+ * @brief Read-only mmap of a .tpx3 file with random access by time
+ *
+ * open() maps the file; load_or_build_index() reuses <file>.tidx when its size
+ * and mtime match the file, and otherwise builds the index in one sequential
+ * pass over the chunk headers and packet times (and tries to write the
+ * sidecar). read_range() then touches only the blocks overlapping a time range:
+ * blocks are decoded in waves on up to `threads` threads, each block with its
+ * own Tpx3RawDecoder starting at its chunk boundary, hits and TDCs outside the
+ * range are dropped, and the batches go to the callback in file order. Output
+ * times are the decoder's wrapped times, as from a live stream.
+ */
+class Tpx3FileReader {
+public:
+    Tpx3FileReader() = default;
+    ~Tpx3FileReader();
+    Tpx3FileReader(const Tpx3FileReader&) = delete;
+    Tpx3FileReader& operator=(const Tpx3FileReader&) = delete;
+
+    bool open(const std::string& path, std::string& err);
+    void close();
+
+    /** @param rebuild ignore an existing sidecar */
+    bool load_or_build_index(bool rebuild, std::string& err, size_t block_bytes = TPX3_INDEX_BLOCK_BYTES);
+    /** Index came from the sidecar / a freshly built index was saved to it. */
+    bool index_from_sidecar() const { return from_sidecar_; }
+    bool index_written() const { return written_; }
+
+    /** (chip, y, x) -> image index table for the decoders; must outlive read_range(). */
+    void set_pixel_lut(const uint32_t* lut, size_t entries) { lut_ = lut; lut_entries_ = entries; }
+
+    /**
+     * @brief Callback per decoded block, in file order
+     * @return false to stop reading
+     */
+    typedef std::function<bool(Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs)> BatchCallback;
+
+    /**
+     * @brief Decode [t0, t1) in extended ticks (see summary().t_first)
+     * @param t1 0 = to the end of the file
+     */
+    Tpx3RangeStats read_range(uint64_t t0, uint64_t t1, int threads, const BatchCallback& callback);
+
+    bool is_open() const { return data_ != nullptr; }
+    const std::string& path() const { return path_; }
+    uint64_t size() const { return size_; }
+    const std::vector<Tpx3IndexEntry>& index() const { return index_; }
+    const Tpx3IndexSummary& summary() const { return summary_; }
+
+private:
+    bool read_sidecar(const std::string& path);
+    bool write_sidecar(const std::string& path) const;
+    void build_index(size_t block_bytes);
+    void decode_block(const Tpx3IndexEntry& entry, uint64_t t0, uint64_t t1,
+                      Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs) const;
+
+    std::string path_;
+    const uint8_t* data_ = nullptr;
+    uint64_t size_ = 0;
+    int64_t mtime_ = 0;
+    const uint32_t* lut_ = nullptr;
+    size_t lut_entries_ = 0;
+    bool from_sidecar_ = false;
+    bool written_ = false;
+    std::vector<Tpx3IndexEntry> index_;
+    Tpx3IndexSummary summary_;
+};
+
+/** Compressed raw archive written by RawArchiver (raw_archive.cpp). */
+constexpr const char* TPX3_ARCHIVE_SUFFIX = ".tpx3z";
+/** Archive frame index sidecar (<file>.tpx3z -> <file>.tpx3z.zidx). */
+constexpr const char* TPX3_ARCHIVE_INDEX_SUFFIX = ".zidx";
+/** File header block; frames start at this offset (O_DIRECT alignment). */
+constexpr size_t TPX3_ARCHIVE_HEADER_BYTES = 4096;
+/** Frame payload is zlib-compressed (else stored). */
+constexpr uint32_t TPX3_ARCHIVE_FRAME_ZLIB = 1;
+
+/** @brief .tpx3z file header, at offset 0 and zero-padded to TPX3_ARCHIVE_HEADER_BYTES. */
+struct Tpx3ArchiveHeader {
+    char magic[8];                     // "TPX3ZARC"
+    uint32_t version;
+    uint32_t channel;                  // Raw[channel]
+    uint64_t file_seq;                 // 1.. within one archive run
+    int64_t created_ns;                // Unix time
+    uint64_t frame_bytes;              // nominal raw bytes per frame
+    int32_t level;                     // zlib level, 0 = stored
+    uint32_t reserved;
+};
+
+/**
+ * @brief Header in front of every frame payload
+ *
+ * A frame holds raw_bytes consecutive bytes of the received .tpx3 stream
+ * starting at raw_offset (from the start of the connection); frames are not
+ * aligned to TPX3 chunks. Unpacking all frames in order gives the stream back.
+ */
+struct Tpx3ArchiveFrame {
+    char magic[4];                     // "TZFR"
+    uint32_t flags;                    // TPX3_ARCHIVE_FRAME_ZLIB
+    uint32_t stored_bytes;             // payload bytes following this header
+    uint32_t raw_bytes;
+    uint32_t crc;                      // zlib crc32 of the raw bytes
+    uint32_t reserved;
+    uint64_t raw_offset;
+    int64_t wall_ns;                   // Unix time the frame was filled
+};
+
+/** @brief Entry of the .zidx sidecar (after an 8-byte "TPX3ZIDX" magic and a uint64 count). */
+struct Tpx3ArchiveIndexEntry {
+    uint64_t file_offset;              // of the Tpx3ArchiveFrame header
+    uint32_t stored_bytes;
+    uint32_t raw_bytes;
+    uint64_t raw_offset;
+    int64_t wall_ns;
+};
+
+/**
+ * @brief Append the raw stream bytes of one .tpx3z archive file to out
+ * @param raw_bytes set to the bytes written
+ * @return false on a read, format, CRC or zlib error (err says which)
+ */
+bool tpx3ArchiveUnpack(const std::string& path, FILE* out, uint64_t& raw_bytes, std::string& err);
+
+#endif // TPX3_FILE_H
@@ -0,0 +1,303 @@
+/*
+ * ADTimePix3 - Timepix3 raw (.tpx3) packet framing and decoding
+ *
+ * Packet layouts follow the Timepix3 / SPIDR data-driven readout:
+ *   pixel  0xB: dcol[59:53] spix[52:47] pix[46:44] ToA[43:30] ToT[29:20] FToA[19:16] SPIDR[15:0]
+ *   TDC    0x6: edge[59:56] trigger[55:44] coarse[43:9] (3.125 ns) fine[8:5] (1..12, 260 ps)
+ *   global 0x44/0x45: time LSB[47:16] / MSB[31:16] (25 ns)
+ * Words are little endian on the wire; this file assumes a little-endian host
+ * (x86_64 / aarch64), same as the rest of the driver.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tpx3_raw.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+/** Packets decoded per block; sized so block-local arrays stay in L1. */
+constexpr size_t DECODE_BLOCK = 256;
+
+inline bool isChunkHeader(const uint8_t* p) {
+    return p[0] == 'T' && p[1] == 'P' && p[2] == 'X' && p[3] == '3';
+}
+
+}  // namespace
+
+// Tpx3HitBatch / Tpx3TdcBatch
+void Tpx3HitBatch::clear() {
+    pixel.clear();
+    toa.clear();
+    tot.clear();
+    x.clear();
+    y.clear();
+    chip.clear();
+}
+
+void Tpx3HitBatch::reserve(size_t n) {
+    pixel.reserve(n);
+    toa.reserve(n);
+    tot.reserve(n);
+    x.reserve(n);
+    y.reserve(n);
+    chip.reserve(n);
+}
+
+void Tpx3HitBatch::push_from(const Tpx3HitBatch& src, size_t i) {
+    pixel.push_back(src.pixel[i]);
+    toa.push_back(src.toa[i]);
+    tot.push_back(src.tot[i]);
+    x.push_back(src.x[i]);
+    y.push_back(src.y[i]);
+    chip.push_back(src.chip[i]);
+}
+
+void Tpx3HitBatch::append(const Tpx3HitBatch& src) {
+    pixel.insert(pixel.end(), src.pixel.begin(), src.pixel.end());
+    toa.insert(toa.end(), src.toa.begin(), src.toa.end());
+    tot.insert(tot.end(), src.tot.begin(), src.tot.end());
+    x.insert(x.end(), src.x.begin(), src.x.end());
+    y.insert(y.end(), src.y.begin(), src.y.end());
+    chip.insert(chip.end(), src.chip.begin(), src.chip.end());
+}
+
+void Tpx3TdcBatch::clear() {
+    time.clear();
+    trigger.clear();
+    edge.clear();
+    chip.clear();
+}
+
+void Tpx3TdcBatch::append(const Tpx3TdcBatch& src) {
+    time.insert(time.end(), src.time.begin(), src.time.end());
+    trigger.insert(trigger.end(), src.trigger.begin(), src.trigger.end());
+    edge.insert(edge.end(), src.edge.begin(), src.edge.end());
+    chip.insert(chip.end(), src.chip.begin(), src.chip.end());
+}
+
+// Tpx3RawDecoder class implementation
+Tpx3RawDecoder::Tpx3RawDecoder() {
+    std::memset(carry_, 0, sizeof(carry_));
+}
+
+void Tpx3RawDecoder::set_pixel_lut(const uint32_t* lut, size_t entries) {
+    lut_ = lut;
+    lut_entries_ = lut ? entries : 0;
+}
+
+uint64_t Tpx3RawDecoder::pixel_toa_ticks(uint64_t pkt) {
+    const uint64_t coarse = (((pkt & 0xFFFF) << 14) | ((pkt >> 30) & 0x3FFF)) << 4;
+    const uint64_t ftoa = (pkt >> 16) & 0xF;
+    return (coarse - std::min(ftoa, coarse)) * TPX3_TICKS_PER_FTOA;
+}
+
+uint64_t Tpx3RawDecoder::tdc_time_ticks(uint64_t pkt) {
+    const uint64_t coarse = (pkt >> 9) & 0x7FFFFFFFFull;
+    const uint64_t fine = (pkt >> 5) & 0xF;
+    return coarse * TPX3_TICKS_PER_TDC_COARSE + (fine ? fine - 1 : 0);
+}
+
+void Tpx3RawDecoder::clear_batches() {
+    hits_.clear();
+    tdcs_.clear();
+}
+
+void Tpx3RawDecoder::reset() {
+    clear_batches();
+    carry_len_ = 0;
+    chunk_bytes_left_ = 0;
+    chip_ = 0;
+    global_lsb_ = 0;
+    resync_match_ = 0;
+    resyncing_ = false;
+    stats_ = Tpx3DecoderStats();
+}
+
+void Tpx3RawDecoder::decode_other(uint64_t pkt) {
+    const unsigned type = static_cast<unsigned>(pkt >> 60);
+    const unsigned sub = static_cast<unsigned>((pkt >> 56) & 0xF);
+    if (type == 0x6) {
+        int edge = -1;
+        switch (sub) {
+            case 0xF: edge = TPX3_TDC1_RISE; break;
+            case 0xA: edge = TPX3_TDC1_FALL; break;
+            case 0xE: edge = TPX3_TDC2_RISE; break;
+            case 0xB: edge = TPX3_TDC2_FALL; break;
+            default: break;
+        }
+        if (edge < 0) {
+            ++stats_.other_packets;
+            return;
+        }
+        tdcs_.time.push_back(tdc_time_ticks(pkt));
+        tdcs_.trigger.push_back(static_cast<uint16_t>((pkt >> 44) & 0xFFF));
+        tdcs_.edge.push_back(static_cast<uint8_t>(edge));
+        tdcs_.chip.push_back(chip_);
+        ++stats_.tdc_events;
+    } else if (type == 0x4 && sub == 0x4) {
+        global_lsb_ = (pkt >> 16) & 0xFFFFFFFFull;
+        ++stats_.global_time_packets;
+    } else if (type == 0x4 && sub == 0x5) {
+        const uint64_t msb = (pkt >> 16) & 0xFFFF;
+        stats_.last_global_time = ((msb << 32) | global_lsb_) * TPX3_TICKS_PER_GLOBAL_TIME;
+        ++stats_.global_time_packets;
+    } else {
+        ++stats_.other_packets;
+    }
+}
+
+void Tpx3RawDecoder::decode_words(const uint8_t* bytes, size_t n) {
+    uint64_t w[DECODE_BLOCK];
+    uint64_t toa[DECODE_BLOCK];
+    uint16_t tot[DECODE_BLOCK];
+    uint8_t px[DECODE_BLOCK];
+    uint8_t py[DECODE_BLOCK];
+    uint8_t isPixel[DECODE_BLOCK];
+
+    const uint32_t chipBase = static_cast<uint32_t>(chip_) << 16;
+    while (n > 0) {
+        const size_t m = std::min(n, DECODE_BLOCK);
+        std::memcpy(w, bytes, m * sizeof(uint64_t));
+
+        // Pass 1: branch-free field extraction for every word (vectorizable)
+        size_t nPixel = 0;
+        for (size_t i = 0; i < m; ++i) {
+            const uint64_t pkt = w[i];
+            const uint8_t pix = static_cast<uint8_t>((pkt >> 44) & 0x7);
+            px[i] = static_cast<uint8_t>(((pkt >> 52) & 0xFE) + (pix >> 2));
+            py[i] = static_cast<uint8_t>(((pkt >> 45) & 0xFC) + (pix & 0x3));
+            tot[i] = static_cast<uint16_t>((pkt >> 20) & 0x3FF);
+            const uint64_t coarse = (((pkt & 0xFFFF) << 14) | ((pkt >> 30) & 0x3FFF)) << 4;
+            const uint64_t ftoa = (pkt >> 16) & 0xF;
+            toa[i] = (coarse - std::min(ftoa, coarse)) * TPX3_TICKS_PER_FTOA;
+            isPixel[i] = static_cast<uint8_t>((pkt >> 60) == 0xB);
+            nPixel += isPixel[i];
+        }
+
+        // Pass 2: compact pixel hits into the SoA batch; rare packets go scalar
+        size_t j = hits_.size();
+        const size_t newSize = j + nPixel;
+        hits_.pixel.resize(newSize);
+        hits_.toa.resize(newSize);
+        hits_.tot.resize(newSize);
+        hits_.x.resize(newSize);
+        hits_.y.resize(newSize);
+        hits_.chip.resize(newSize, chip_);  // one chip per chunk
+        uint32_t* outPixel = hits_.pixel.data();
+        uint64_t* outToa = hits_.toa.data();
+        uint16_t* outTot = hits_.tot.data();
+        uint8_t* outX = hits_.x.data();
+        uint8_t* outY = hits_.y.data();
+        for (size_t i = 0; i < m; ++i) {
+            if (isPixel[i]) {
+                const uint32_t bpcIndex = chipBase | (static_cast<uint32_t>(py[i]) << 8) | px[i];
+                outPixel[j] = (bpcIndex < lut_entries_) ? lut_[bpcIndex] : TPX3_PIXEL_NONE;
+                outToa[j] = toa[i];
+                outTot[j] = tot[i];
+                outX[j] = px[i];
+                outY[j] = py[i];
+                ++j;
+            } else {
+                decode_other(w[i]);
+            }
+        }
+
+        stats_.packets += m;
+        stats_.pixel_hits += nPixel;
+        bytes += m * sizeof(uint64_t);
+        n -= m;
+    }
+}
+
+size_t Tpx3RawDecoder::scan_for_header(const uint8_t* p, size_t n) {
+    static const uint8_t kMagic[4] = { 'T', 'P', 'X', '3' };
+    size_t i = 0;
+    while (i < n && resyncing_) {
+        const uint8_t b = p[i++];
+        if (b == kMagic[resync_match_]) {
+            if (++resync_match_ == 4) {
+                std::memcpy(carry_, kMagic, 4);
+                carry_len_ = 4;
+                resyncing_ = false;
+                resync_match_ = 0;
+            }
+        } else {
+            resync_match_ = (b == 'T') ? 1 : 0;
+        }
+    }
+    return i;
+}
+
+void Tpx3RawDecoder::consume_word(const uint8_t* word) {
+    if (chunk_bytes_left_ == 0) {
+        if (isChunkHeader(word)) {
+            chip_ = word[4];
+            chunk_bytes_left_ = (static_cast<size_t>(word[6]) | (static_cast<size_t>(word[7]) << 8)) & ~size_t(7);
+            ++stats_.chunks;
+            return;
+        }
+        // Lost framing: rescan this word (minus its first byte) for the next "TPX3"
+        uint8_t tail[sizeof(uint64_t) - 1];
+        std::memcpy(tail, word + 1, sizeof(tail));
+        ++stats_.framing_errors;
+        resyncing_ = true;
+        resync_match_ = 0;
+        carry_len_ = 0;
+        const size_t used = scan_for_header(tail, sizeof(tail));
+        if (!resyncing_ && used < sizeof(tail)) {
+            std::memcpy(carry_ + carry_len_, tail + used, sizeof(tail) - used);
+            carry_len_ += sizeof(tail) - used;
+        }
+        return;
+    }
+    decode_words(word, 1);
+    chunk_bytes_left_ -= sizeof(uint64_t);
+}
+
+void Tpx3RawDecoder::feed(const uint8_t* data, size_t len) {
+    stats_.bytes += len;
+
+    while (len > 0) {
+        if (resyncing_) {
+            const size_t used = scan_for_header(data, len);
+            data += used;
+            len -= used;
+            continue;
+        }
+
+        if (carry_len_ > 0 || len < sizeof(uint64_t)) {
+            const size_t take = std::min(len, sizeof(uint64_t) - carry_len_);
+            std::memcpy(carry_ + carry_len_, data, take);
+            carry_len_ += take;
+            data += take;
+            len -= take;
+            if (carry_len_ == sizeof(uint64_t)) {
+                uint8_t word[sizeof(uint64_t)];
+                std::memcpy(word, carry_, sizeof(word));
+                carry_len_ = 0;
+                consume_word(word);
+            }
+            continue;
+        }
+
+        if (chunk_bytes_left_ == 0) {
+            consume_word(data);
+            data += sizeof(uint64_t);
+            len -= sizeof(uint64_t);
+            continue;
+        }
+
+        // Bulk path: whole packets of the current chunk straight from the input
+        const size_t words = std::min(len, chunk_bytes_left_) / sizeof(uint64_t);
+        decode_words(data, words);
+        const size_t used = words * sizeof(uint64_t);
+        chunk_bytes_left_ -= used;
+        data += used;
+        len -= used;
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ * ADTimePix3 - Timepix3 raw (.tpx3) packet framing and decoding
+ *
+ * Serval's Raw channel (file or tcp://) carries chunks: an 8-byte header
+ * "TPX3" + chip index + mode + chunk size (bytes, little endian), followed by
+ * 64-bit little-endian packets. Pixel hits (type 0xB), TDC events (0x6) and
+ * global time (0x44/0x45) are decoded into structure-of-arrays batches.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TPX3_RAW_H
+#define TPX3_RAW_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * All decoded times are in TDC clock ticks (TPX3_TDC_CLOCK_PERIOD_SEC = 1.5625/6 ns):
+ * pixel fine ToA (1.5625 ns) = 6 ticks, TDC coarse (3.125 ns) = 12 ticks,
+ * global time LSB (25 ns) = 96 ticks.
+ */
+constexpr uint64_t TPX3_TICKS_PER_FTOA = 6;
+constexpr uint64_t TPX3_TICKS_PER_TDC_COARSE = 12;
+constexpr uint64_t TPX3_TICKS_PER_GLOBAL_TIME = 96;
+/** Pixel ToA range: 16-bit SPIDR time + 14-bit ToA + 4-bit FToA (~26.8 s). */
+constexpr uint64_t TPX3_PIXEL_TOA_PERIOD_TICKS = (uint64_t(1) << 34) * TPX3_TICKS_PER_FTOA;
+/** TDC time range: 35-bit coarse time (~107 s). */
+constexpr uint64_t TPX3_TDC_TIME_PERIOD_TICKS = (uint64_t(1) << 35) * TPX3_TICKS_PER_TDC_COARSE;
+/** Marker for a pixel that has no image position (no LUT or unsupported layout). */
+constexpr uint32_t TPX3_PIXEL_NONE = 0xFFFFFFFFu;
+
+/** TDC edge reported by a 0x6 packet. */
+enum Tpx3TdcEdge : uint8_t {
+    TPX3_TDC1_RISE = 0,
+    TPX3_TDC1_FALL = 1,
+    TPX3_TDC2_RISE = 2,
+    TPX3_TDC2_FALL = 3
+};
+
+/**
+ * @brief Pixel hits as parallel arrays (structure of arrays)
+ *
+ * x/y are chip-local (0..255); pixel is the detector image index from the
+ * decoder pixel LUT (TPX3_PIXEL_NONE without LUT). toa is in TDC ticks, tot in
+ * 25 ns units.
+ */
+struct Tpx3HitBatch {
+    std::vector<uint32_t> pixel;
+    std::vector<uint64_t> toa;
+    std::vector<uint16_t> tot;
+    std::vector<uint8_t> x;
+    std::vector<uint8_t> y;
+    std::vector<uint8_t> chip;
+
+    size_t size() const { return toa.size(); }
+    bool empty() const { return toa.empty(); }
+    void clear();
+    void reserve(size_t n);
+    /** Append hit i of another batch. */
+    void push_from(const Tpx3HitBatch& src, size_t i);
+    /** Append all hits of another batch. */
+    void append(const Tpx3HitBatch& src);
+};
+
+/** @brief TDC events as parallel arrays; time in TDC ticks. */
+struct Tpx3TdcBatch {
+    std::vector<uint64_t> time;
+    std::vector<uint16_t> trigger;
+    std::vector<uint8_t> edge;
+    std::vector<uint8_t> chip;
+
+    size_t size() const { return time.size(); }
+    bool empty() const { return time.empty(); }
+    void clear();
+    void append(const Tpx3TdcBatch& src);
+};
+
+/** @brief Running decoder counters (monotonic until reset()). */
+struct Tpx3DecoderStats {
+    uint64_t bytes = 0;
+    uint64_t chunks = 0;
+    uint64_t packets = 0;
+    uint64_t pixel_hits = 0;
+    uint64_t tdc_events = 0;
+    uint64_t global_time_packets = 0;
+    uint64_t other_packets = 0;      // control / unknown types
+    uint64_t framing_errors = 0;     // resyncs after a missing "TPX3" header
+    uint64_t last_global_time = 0;   // TDC ticks
+};
+
+/**
+ * @brief Streaming decoder for the chunked .tpx3 byte stream
+ *
+ * feed() accepts arbitrary byte fragments (TCP reads, file blocks); partial
+ * packets and chunk state carry over between calls. Packets are decoded in
+ * blocks: fields of every word are extracted branch-free into block-local
+ * arrays (auto-vectorized), pixel hits are then compacted into the output
+ * batch, and the rare non-pixel packets take a scalar path.
+ */
+class Tpx3RawDecoder {
+public:
+    Tpx3RawDecoder();
+
+    /**
+     * @brief Set the (chip, y, x) -> image index table
+     * Index = chip * 65536 + y * 256 + x (BPC order). The table must outlive the
+     * decoder or the next call; nullptr disables mapping.
+     */
+    void set_pixel_lut(const uint32_t* lut, size_t entries);
+
+    /** Decode bytes; output is appended to hits() / tdcs(). */
+    void feed(const uint8_t* data, size_t len);
+
+    Tpx3HitBatch& hits() { return hits_; }
+    Tpx3TdcBatch& tdcs() { return tdcs_; }
+    const Tpx3DecoderStats& stats() const { return stats_; }
+
+    /** Drop decoded batches (keeps framing state). */
+    void clear_batches();
+    /** Forget framing state, batches and counters (new stream). */
+    void reset();
+
+    /** Decode one pixel packet time to TDC ticks. */
+    static uint64_t pixel_toa_ticks(uint64_t pkt);
+    /** Decode one TDC packet time to TDC ticks. */
+    static uint64_t tdc_time_ticks(uint64_t pkt);
+
+private:
+    void decode_words(const uint8_t* bytes, size_t n);
+    void decode_other(uint64_t pkt);
+    void consume_word(const uint8_t* word);
+    size_t scan_for_header(const uint8_t* p, size_t n);
+
+    const uint32_t* lut_ = nullptr;
+    size_t lut_entries_ = 0;
+
+    uint8_t carry_[8];
+    size_t carry_len_ = 0;
+    size_t chunk_bytes_left_ = 0;
+    bool resyncing_ = false;
+    size_t resync_match_ = 0;
+    uint8_t chip_ = 0;
+    uint64_t global_lsb_ = 0;
+
+    Tpx3HitBatch hits_;
+    Tpx3TdcBatch tdcs_;
+    Tpx3DecoderStats stats_;
+};
+
+#endif // TPX3_RAW_H
@@ -0,0 +1,170 @@
+/*
+ * ADTimePix3 - tpx3file: index and slice .tpx3 raw files offline
+ *
+ *   tpx3file index <file.tpx3> [--rebuild] [--block-mb N]
+ *       Build (or verify) the <file>.tidx sidecar and print a summary.
+ *   tpx3file slice <file.tpx3> <start_ms> <stop_ms> [--threads N] [--csv out.csv]
+ *       Decode hits / TDCs in [start, stop) ms from the first time in the file
+ *       (stop 0 = to the end); optionally write hits as CSV
+ *       (chip,x,y,toa_ns,tot_ns) and TDCs as CSV lines starting with "tdc".
+ *   tpx3file unpack <out.tpx3> <archive.tpx3z>...
+ *       Decompress IOC Raw archives (TPX3_RAW_ARCHIVE_*) back into .tpx3, in
+ *       the order given.
+ *
+ * Same reader as the IOC replay (Tpx3FileReader); no EPICS dependencies.
+ *
+ * Copyright (c) 2022 Brookhaven Science Associates, Brookhaven National Laboratory
+ * Copyright (c) 2022-2026 UT-Battelle, LLC, Oak Ridge National Laboratory
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tpx3_file.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+namespace {
+
+double secondsSince(const std::chrono::steady_clock::time_point& t) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int usage() {
+    fprintf(stderr,
+            "usage: tpx3file index <file.tpx3> [--rebuild] [--block-mb N]\n"
+            "       tpx3file slice <file.tpx3> <start_ms> <stop_ms> [--threads N] [--csv out.csv]\n"
+            "       tpx3file unpack <out.tpx3> <archive.tpx3z>...\n");
+    return 2;
+}
+
+bool openIndexed(Tpx3FileReader& reader, const char* path, bool rebuild, size_t blockBytes) {
+    std::string err;
+    if (!reader.open(path, err)) {
+        fprintf(stderr, "tpx3file: %s\n", err.c_str());
+        return false;
+    }
+    const auto t = std::chrono::steady_clock::now();
+    if (!reader.load_or_build_index(rebuild, err, blockBytes)) {
+        fprintf(stderr, "tpx3file: %s\n", err.c_str());
+        return false;
+    }
+    const Tpx3IndexSummary& s = reader.summary();
+    printf("%s: %.1f MB, %zu blocks, %llu chunks, %.3f s span, %llu hits, %llu TDCs, %llu framing errors\n",
+           path, reader.size() / (1024.0 * 1024.0), reader.index().size(),
+           static_cast<unsigned long long>(s.chunks), (s.t_last - s.t_first) / TPX3_TICKS_PER_MS / 1e3,
+           static_cast<unsigned long long>(s.hits), static_cast<unsigned long long>(s.tdcs),
+           static_cast<unsigned long long>(s.framing_errors));
+    printf("index: %s in %.2f s%s\n", reader.index_from_sidecar() ? "loaded" : "built", secondsSince(t),
+           reader.index_from_sidecar() ? "" : (reader.index_written() ? ", sidecar written" : ", sidecar not writable"));
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) return usage();
+    const std::string cmd = argv[1];
+    const char* path = argv[2];
+
+    if (cmd == "index") {
+        bool rebuild = false;
+        size_t blockBytes = TPX3_INDEX_BLOCK_BYTES;
+        for (int i = 3; i < argc; ++i) {
+            if (!strcmp(argv[i], "--rebuild")) {
+                rebuild = true;
+            } else if (!strcmp(argv[i], "--block-mb") && i + 1 < argc) {
+                blockBytes = static_cast<size_t>(atof(argv[++i]) * 1024 * 1024);
+            } else {
+                return usage();
+            }
+        }
+        Tpx3FileReader reader;
+        return openIndexed(reader, path, rebuild, blockBytes) ? 0 : 1;
+    }
+
+    if (cmd == "slice") {
+        if (argc < 5) return usage();
+        const double startMs = atof(argv[3]);
+        const double stopMs = atof(argv[4]);
+        int threads = static_cast<int>(std::thread::hardware_concurrency());
+        const char* csvPath = nullptr;
+        for (int i = 5; i < argc; ++i) {
+            if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            } else if (!strcmp(argv[i], "--csv") && i + 1 < argc) {
+                csvPath = argv[++i];
+            } else {
+                return usage();
+            }
+        }
+        Tpx3FileReader reader;
+        if (!openIndexed(reader, path, false, TPX3_INDEX_BLOCK_BYTES)) return 1;
+
+        FILE* csv = nullptr;
+        if (csvPath) {
+            csv = fopen(csvPath, "w");
+            if (!csv) {
+                fprintf(stderr, "tpx3file: cannot write %s\n", csvPath);
+                return 1;
+            }
+            fprintf(csv, "chip,x,y,toa_ns,tot_ns\n");
+        }
+        const double nsPerTick = 1e6 / TPX3_TICKS_PER_MS;
+        const uint64_t first = reader.summary().t_first;
+        const uint64_t t0 = first + static_cast<uint64_t>(std::max(startMs, 0.0) * TPX3_TICKS_PER_MS);
+        const uint64_t t1 = stopMs > 0.0 ? first + static_cast<uint64_t>(stopMs * TPX3_TICKS_PER_MS) : 0;
+        const auto t = std::chrono::steady_clock::now();
+        const Tpx3RangeStats st = reader.read_range(t0, t1, threads, [&](Tpx3HitBatch& hits, Tpx3TdcBatch& tdcs) {
+            if (!csv) return true;
+            for (size_t i = 0; i < hits.size(); ++i) {
+                fprintf(csv, "%u,%u,%u,%.4f,%u\n", hits.chip[i], hits.x[i], hits.y[i],
+                        hits.toa[i] * nsPerTick, hits.tot[i] * 25u);
+            }
+            for (size_t i = 0; i < tdcs.size(); ++i) {
+                fprintf(csv, "tdc,%u,%u,%.4f,%u\n", tdcs.chip[i], tdcs.edge[i], tdcs.time[i] * nsPerTick, tdcs.trigger[i]);
+            }
+            return true;
+        });
+        const double sec = secondsSince(t);
+        if (csv) fclose(csv);
+        printf("slice [%.3f, %.3f) ms: %zu blocks, %.1f MB, %llu hits, %llu TDCs in %.3f s (%.0f MB/s, %d threads)\n",
+               startMs, stopMs, st.blocks, st.bytes / (1024.0 * 1024.0),
+               static_cast<unsigned long long>(st.hits), static_cast<unsigned long long>(st.tdcs), sec,
+               sec > 0.0 ? st.bytes / (1024.0 * 1024.0) / sec : 0.0, threads);
+        return 0;
+    }
+
+    if (cmd == "unpack") {
+        FILE* out = fopen(path, "wb");
+        if (!out) {
+            fprintf(stderr, "tpx3file: cannot write %s\n", path);
+            return 1;
+        }
+        uint64_t total = 0;
+        for (int i = 3; i < argc; ++i) {
+            uint64_t bytes = 0;
+            std::string err;
+            const bool ok = tpx3ArchiveUnpack(argv[i], out, bytes, err);
+            total += bytes;
+            printf("%s: %.1f MB\n", argv[i], bytes / (1024.0 * 1024.0));
+            if (!ok) {
+                fprintf(stderr, "tpx3file: %s\n", err.c_str());
+                fclose(out);
+                return 1;
+            }
+        }
+        if (fclose(out) != 0) {
+            fprintf(stderr, "tpx3file: write error on %s\n", path);
+            return 1;
+        }
+        printf("%s: %.1f MB\n", path, total / (1024.0 * 1024.0));
+        return 0;
+    }
+
+    return usage();
+}